@@ -19,6 +19,9 @@
 
 DEFINE_LOG_CATEGORY(LogKamoModule);
 
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("GCCount"), STAT_GCCount, STATGROUP_Kamo);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("GCPauseMs"), STAT_GCPauseMs, STATGROUP_Kamo);
+
 
 FKamoModule::FKamoModule() :
 	is_initialized(false)
@@ -357,11 +360,22 @@ FString FKamoModule::GetKamoTenantName() const
 void FKamoModule::OnPreGarbageCollection()
 {
 	bIsCollectingGarbage = true;
+	gc_start_seconds = FPlatformTime::Seconds();
 }
 
 void FKamoModule::OnPostGarbageCollection()
 {
 	bIsCollectingGarbage = false;
+
+	const float pause_ms = (FPlatformTime::Seconds() - gc_start_seconds) * 1000.0;
+	gc_stats.num_collections++;
+	gc_stats.last_pause_ms = pause_ms;
+	gc_stats.max_pause_ms = FMath::Max(gc_stats.max_pause_ms, pause_ms);
+	gc_stats.num_uobjects = GUObjectArray.GetObjectArrayNumMinusAvailable();
+
+	INC_DWORD_STAT(STAT_GCCount);
+	SET_FLOAT_STAT(STAT_GCPauseMs, pause_ms);
+	UE_LOG(LogKamoModule, Verbose, TEXT("Garbage collection took %.2f ms, %i objects alive."), pause_ms, gc_stats.num_uobjects);
 }
 
 void FKamoModule::OnPostEngineInit()
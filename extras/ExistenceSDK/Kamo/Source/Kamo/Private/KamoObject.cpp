@@ -7,6 +7,8 @@
 #include "KamoPersistable.h"
 #include "KamoRt.h"
 #include "KamoRuntime.h" // just for log category, plz fix
+#include "KamoSchema.h"
+#include "KamoPool.h"
 #include "IKamoComponentReflection.h"
 
 
@@ -241,15 +243,18 @@ bool UKamoObject::IsReadyForFinishDestroy()
 }
 
 
+bool UKamoObject::IsFlaggedDirty() const
+{
+	return KamoDirtyProp && object && KamoDirtyProp->GetPropertyValue_InContainer(object);
+}
+
+
 void UKamoObject::MarkForUpdate()
 {
-	if (KamoDirtyProp && object)
+	if (IsFlaggedDirty())
 	{
-		if (KamoDirtyProp->GetPropertyValue_InContainer(object))
-		{
-			dirty = true;
-			KamoDirtyProp->SetPropertyValue_InContainer(object, false);
-		}
+		dirty = true;
+		KamoDirtyProp->SetPropertyValue_InContainer(object, false);
 	}
 	
 	if (dirty)
@@ -276,6 +281,10 @@ void UKamoObject::UpdateKamoStateFromActor_Implementation()
 	auto current_time = FDateTime::UtcNow().ToIso8601();
 	state->SetString("timestamp", current_time);
 	state->SetBool("actor_deleted", actor_deleted);
+	if (kamo_class_entry.schema_version > 0)
+	{
+		FKamoSchemaRegistry::StampStateVersion(state, kamo_class_entry.schema_version);
+	}
 	if (IsValid(object) && IsValid(state))
 	{
 		if (object->GetClass()->ImplementsInterface(UKamoObjectInterface::StaticClass()))
@@ -286,7 +295,7 @@ void UKamoObject::UpdateKamoStateFromActor_Implementation()
 
 
 	// Write out all Kamo object references
-	UKamoState* subs = NewObject<UKamoState>();
+	UKamoState* subs = FKamoObjectPool::Get().AcquireState();
 	for (auto it = kamo_subobjects.CreateIterator(); it; ++it)
 	{
 		subs->SetString(it.Key(), it.Value()->id->GetID());
@@ -654,7 +663,7 @@ void UKamoActor::ApplyKamoStateToActor_Implementation(EKamoStateStage stage_stag
 			{
 				TArray<FString> Properties = IKamoPersistable::Execute_GetKamoPersistedProperties(Component);
 				GetSaveGameProperties(Component, Properties);
-				UKamoState* ComponentState = UKamoState::CreateKamoState();
+				UKamoState* ComponentState = FKamoObjectPool::Get().AcquireState();
 				ComponentState->PopulateFromField(state, Component->GetName());
 				ComponentState->SetPropertiesFromState(Component, Properties);
 				IKamoPersistable::Execute_KamoAfterLoad(Component);
@@ -693,7 +702,7 @@ void UKamoActor::UpdateKamoStateFromActor_Implementation() {
 				IKamoPersistable::Execute_KamoBeforeSave(Component);
 				TArray<FString> Properties = IKamoPersistable::Execute_GetKamoPersistedProperties(Component);
 				GetSaveGameProperties(Component, Properties);
-				UKamoState* ComponentState = UKamoState::CreateKamoState();
+				UKamoState* ComponentState = FKamoObjectPool::Get().AcquireState();
 				ComponentState->SetStateFromProperties(Component, Properties);
 				state->SetObjectField(Component->GetName(), ComponentState);
 			}
@@ -706,7 +715,7 @@ void UKamoActor::UpdateKamoStateFromActor_Implementation() {
 	for (auto kv : embedded_objects)
 	{
 		auto embeded = kv.Value;
-		UKamoState* tmp = NewObject<UKamoState>();
+		UKamoState* tmp = FKamoObjectPool::Get().AcquireState();
 		tmp->SetState(embeded.json_state);
 		tmp->SetString("_category", embeded.category);
 		tmp->SetString("_id", embeded.kamo_id);
@@ -0,0 +1,81 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoPool.h"
+#include "KamoState.h"
+
+
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("PooledObjects"), STAT_PooledObjects, STATGROUP_Kamo);
+DECLARE_DWORD_COUNTER_STAT(TEXT("PoolHits"), STAT_PoolHits, STATGROUP_Kamo);
+DECLARE_DWORD_COUNTER_STAT(TEXT("PoolMisses"), STAT_PoolMisses, STATGROUP_Kamo);
+
+
+FKamoObjectPool& FKamoObjectPool::Get()
+{
+	static FKamoObjectPool pool;
+	return pool;
+}
+
+
+FKamoObjectPool::FScope::FScope()
+{
+	auto& pool = FKamoObjectPool::Get();
+	if (IsInGameThread())
+	{
+		pool.scope_depth++;
+	}
+	states_mark = pool.states_used;
+}
+
+
+FKamoObjectPool::FScope::~FScope()
+{
+	auto& pool = FKamoObjectPool::Get();
+	if (IsInGameThread())
+	{
+		pool.scope_depth--;
+		pool.states_used = states_mark;
+	}
+}
+
+
+bool FKamoObjectPool::CanPool() const
+{
+	return scope_depth > 0 && IsInGameThread() && !IsGarbageCollecting();
+}
+
+
+UKamoState* FKamoObjectPool::AcquireState()
+{
+	if (!CanPool())
+	{
+		return NewObject<UKamoState>();
+	}
+
+	if (states_used < states.Num())
+	{
+		INC_DWORD_STAT(STAT_PoolHits);
+		num_hits++;
+		auto state = states[states_used++];
+		state->ResetState();
+		return state;
+	}
+
+	INC_DWORD_STAT(STAT_PoolMisses);
+	num_misses++;
+	auto state = NewObject<UKamoState>();
+
+	if (states.Num() < max_pooled_objects)
+	{
+		states.Add(state);
+		states_used++;
+		SET_DWORD_STAT(STAT_PooledObjects, GetNumPooled());
+	}
+
+	return state;
+}
+
+
+void FKamoObjectPool::AddReferencedObjects(FReferenceCollector& Collector)
+{
+	Collector.AddReferencedObjects(states);
+}
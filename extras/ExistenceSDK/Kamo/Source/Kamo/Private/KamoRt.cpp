@@ -9,9 +9,14 @@
 #include "KamoSettings.h"
 #include "KamoModule.h"
 #include "KamoVolume.h"
+#include "KamoSchema.h"
+#include "KamoPool.h"
+#include "KamoSnapshot.h"
+#include "KamoTrace.h"
 
 // Unreal Engine
 #include "KamoPersistable.h"
+#include "KamoCommandCodec.h"
 #include "Misc/CoreMisc.h"
 #include "Misc/SecureHash.h"
 #include "GenericPlatform/GenericPlatformProcess.h"
@@ -41,6 +46,7 @@ DECLARE_CYCLE_STAT(TEXT("OnActorSpawned"), STAT_OnActorSpawned, STATGROUP_Kamo);
 DECLARE_CYCLE_STAT(TEXT("UpdateKamoStateFromActor"), STAT_UpdateKamoStateFromActor, STATGROUP_Kamo);
 DECLARE_CYCLE_STAT(TEXT("FlushToDB"), STAT_FlushToDB, STATGROUP_Kamo);
 DECLARE_CYCLE_STAT(TEXT("DeleteFromDB"), STAT_DeleteFromDB, STATGROUP_Kamo);
+DECLARE_CYCLE_STAT(TEXT("SchemaUpgrade"), STAT_SchemaUpgrade, STATGROUP_Kamo);
 
 DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("TotalObjects"), STAT_TotalObjects, STATGROUP_Kamo);
 DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("DirtyObject"), STAT_DirtyObjects, STATGROUP_Kamo);
@@ -52,7 +58,6 @@ UKamoRuntime::UKamoRuntime() :
 	power_save_seconds(0.0f),
 	is_initialized(false),
 	poll_message_queue(true),
-	mark_and_sync_elapsed(0.0f),
 	message_queue_flush_elapsed(0.0f)
 {
 }
@@ -193,6 +198,9 @@ void UKamoRuntime::Tick(float DeltaTime)
 		return;
 	}
 
+	// Transient states and messages acquired during this tick are recycled when it ends
+	FKamoObjectPool::FScope pool_scope;
+
 	auto settings = UKamoProjectSettings::Get();
 	AGameModeBase* gamemode = UGameplayStatics::GetGameMode(GetWorld());
 
@@ -277,12 +285,13 @@ void UKamoRuntime::Tick(float DeltaTime)
 	internal_state.Shrink();	
 
 	// Mark and sync processing
-	mark_and_sync_elapsed += DeltaTime;
-	if (mark_and_sync_elapsed >= settings->mark_and_sync_rate)
+	if (MarkForUpdateBySyncTier(DeltaTime))
 	{
-		MarkForUpdate();
 		SerializeObjects();
-		mark_and_sync_elapsed = 0.0f;
+	}
+	else if (sync_pending_objects.Num() > 0)
+	{
+		SerializePendingObjects();
 	}
 
 	// Message queue processing
@@ -327,6 +336,22 @@ void UKamoRuntime::GatherStats(const TSharedPtr < FJsonObject >& stats) const
 	stats->SetNumberField("time_unpaused_time_seconds", UGameplayStatics::GetUnpausedTimeSeconds(GetWorld())); // Returns time in seconds since world was brought up for play, adjusted by time dilationand IS NOT stopped when game pauses
 
 	stats->SetNumberField("num_kamo_objects", internal_state.Num());
+
+	// Garbage collection pressure
+	const auto& gc_stats = FKamoModule::Get().GetGCStats();
+	stats->SetNumberField("gc_num_collections", gc_stats.num_collections);
+	stats->SetNumberField("gc_last_pause_ms", gc_stats.last_pause_ms);
+	stats->SetNumberField("gc_max_pause_ms", gc_stats.max_pause_ms);
+	stats->SetNumberField("gc_num_uobjects", gc_stats.num_uobjects);
+	stats->SetNumberField("pool_num_objects", FKamoObjectPool::Get().GetNumPooled());
+	stats->SetNumberField("pool_hits", FKamoObjectPool::Get().GetNumHits());
+	stats->SetNumberField("pool_misses", FKamoObjectPool::Get().GetNumMisses());
+
+	// Driver stats, if any
+	if (database)
+	{
+		database->GatherStats(stats);
+	}
 	stats->SetStringField("region_instance_id", region_instance_id);
 	stats->SetStringField("map_name", GetWorld()->GetMapName());
 	TArray <TSharedPtr<FJsonValue> > regions;
@@ -448,11 +473,17 @@ bool UKamoRuntime::Init()
 		return false;
 	}
 
+	KamoDriverConfig db_config = KamoUtil::get_db_config();
+	db_config.instance_name = server_id();
+	database->SetConfig(db_config);
+
 	if (!database->CreateSession(KamoUtil::get_tenant_name()))
 	{
 		return false;
 	}
 
+	database->SetSerializationPolicy(GetSerializationPolicy());
+
 	actor_spawned_delegate = FOnActorSpawned::FDelegate::CreateUObject(
 		this, &UKamoRuntime::OnActorSpawned);
 	World->AddOnActorSpawnedHandler(actor_spawned_delegate);
@@ -510,11 +541,11 @@ bool UKamoRuntime::Init()
 
 	// Send me a message to myself just to verify message queue
 	{
-		TArray<UKamoState*> commands;
-		auto command = CreateMessageCommand(KamoID(), KamoID(), "log", "{\"message\": \"Message queue check.\"}");
-		commands.Add(command);
-		message_queue->SendMessage("", "command", CreateCommandMessagePayload(commands)->GetStateAsString());
-		message_queue->SendMessage(handler.inbox_address, "command", CreateCommandMessagePayload(commands)->GetStateAsString());
+		TArray<KamoCommand> commands;
+		commands.Add({ "log", KamoID(), KamoID(), "{\"message\": \"Message queue check.\"}" });
+		FString payload = CreateCommandMessagePayload(commands);
+		message_queue->SendMessage("", "command", payload);
+		message_queue->SendMessage(handler.inbox_address, "command", payload);
 	}
 
 	// Initialize region instance id if specified.
@@ -579,6 +610,15 @@ bool UKamoRuntime::Init()
 		}
 	}
 
+	if (UKamoProjectSettings::Get()->use_runtime_snapshot)
+	{
+		snapshot = MakeShared<FKamoSnapshot>();
+		if (!snapshot->Load(FKamoSnapshot::GetSnapshotPath(server_id()), GetSnapshotContext()))
+		{
+			snapshot.Reset();
+		}
+	}
+
 	// Register regions
 	for (auto region_id : regions)
 	{
@@ -614,6 +654,13 @@ bool UKamoRuntime::Init()
 		}
 	}
 
+	if (snapshot)
+	{
+		// The snapshot is consumed, a fresh one is written on shutdown
+		snapshot.Reset();
+		IFileManager::Get().Delete(*FKamoSnapshot::GetSnapshotPath(server_id()));
+	}
+
 	InitBeaconHost();
 	InitializeKamoLevelActors();
 
@@ -798,7 +845,14 @@ void UKamoRuntime::ShutdownRuntime()
 {
 	if (is_initialized)
 	{
+		MarkForUpdate(); // Include slow and on demand tiers
 		SerializeObjects(true); // Flush and commit everything to DB
+
+		if (UKamoProjectSettings::Get()->use_runtime_snapshot)
+		{
+			WriteSnapshot();
+		}
+
 		runtime_event.Broadcast(nullptr);
 
 		// Unregister this server
@@ -809,6 +863,12 @@ void UKamoRuntime::ShutdownRuntime()
 
 		// Clear out the internal state.
 		internal_state.Empty();
+		for (auto& sweep : sync_tier_sweeps)
+		{
+			sweep.Reset();
+		}
+		on_demand_objects.Empty();
+		sync_pending_objects.Empty();
 
 		is_initialized = false;
 
@@ -836,19 +896,44 @@ void UKamoRuntime::ShutdownRuntime()
 bool UKamoRuntime::LoadAndPossessRegion(const KamoID& root_id)
 {
 	SCOPE_LOG_TIME_IN_SECONDS(TEXT("Kamo::LoadAndPossessRegion (sec)"), nullptr);
+	KAMO_TRACE_SCOPE("LoadAndPossessRegion", root_id);
 
 	if (!SetHandler(root_id, server_id))
 	{
 		return false;
 	}
 
-	TArray<KamoChildObject> objects = database->FindObjects(root_id, "");
-	for (auto object : objects)
+	TArray<FString> loaded_ids;
+	auto register_objects = [this, &root_id, &loaded_ids](TArray<KamoChildObject>& objects)
 	{
-		auto state = NewObject<UKamoState>();
-		state->SetState(object.state);
-		RegisterKamoObject(object.id, root_id, state, nullptr, false, false);
-    }
+		for (auto& object : objects)
+		{
+			auto state = NewObject<UKamoState>();
+			state->SetState(object.state);
+			RegisterKamoObject(object.id, root_id, state, nullptr, false, false);
+			loaded_ids.Add(object.id());
+		}
+		return true;
+	};
+
+	// Objects are registered chunk by chunk while the rest of the region is still coming in
+	TArray<KamoChildObject> objects;
+	if (LoadRegionFromSnapshot(root_id, objects))
+	{
+		register_objects(objects);
+	}
+	else if (!database->FindObjectsStreamed(root_id, "", register_objects))
+	{
+		// A partially loaded region would be written back with objects missing, give it up
+		UE_LOG(LogKamoRt, Error, TEXT("UKamoRuntime::LoadAndPossessRegion: Failed to load region %s, releasing it."), *root_id());
+		for (const FString& id : loaded_ids)
+		{
+			internal_state.Remove(id);
+		}
+		SetHandler(root_id, KamoID());
+		return false;
+	}
+	int32 num_objects = loaded_ids.Num();
 
 	// TODO: FIX OVERKILL: We call ResolveSubobjects again on all objects to give them proper chance
 	// of resolving the object references.
@@ -859,7 +944,7 @@ bool UKamoRuntime::LoadAndPossessRegion(const KamoID& root_id)
 	}
 
 
-	UE_LOG(LogKamoRt, Display, TEXT("UKamoRuntime::LoadAndPossessRegion: Loaded %i objects for region: %s"), objects.Num(), *root_id());
+	UE_LOG(LogKamoRt, Display, TEXT("UKamoRuntime::LoadAndPossessRegion: Loaded %i objects for region: %s"), num_objects, *root_id());
 
 	// Register meta info if this is the main level volume.
 	if (root_id() == FormatCurrentRegionName())
@@ -873,6 +958,97 @@ bool UKamoRuntime::LoadAndPossessRegion(const KamoID& root_id)
 }
 
 
+FString UKamoRuntime::GetSnapshotContext() const
+{
+	return FString::Printf(TEXT("%s|%s|%s"), *KamoUtil::get_tenant_name(), *KamoUtil::get_driver_name(), *GetWorld()->URL.Map);
+}
+
+
+void UKamoRuntime::WriteSnapshot()
+{
+	SCOPE_LOG_TIME_IN_SECONDS(TEXT("Kamo::WriteSnapshot (sec)"), nullptr);
+
+	TArray<FKamoSnapshotObject> objects;
+
+	for (auto region_id : registered_regions)
+	{
+		TMap<FString, int64> versions;
+		if (!database->GetObjectVersions(region_id, versions))
+		{
+			UE_LOG(LogKamoRt, Warning, TEXT("WriteSnapshot: DB driver doesn't support version stamps, no snapshot written."));
+			return;
+		}
+
+		for (auto& elem : internal_state)
+		{
+			auto child_object = Cast<UKamoChildObject>(elem.Value);
+			if (!child_object || child_object->is_proxy || child_object->deleted || !child_object->root_id || child_object->root_id->GetID() != region_id())
+			{
+				continue;
+			}
+
+			// Objects without a version stamp are fetched from the DB on next start anyways
+			auto version = versions.Find(elem.Key);
+			if (version && *version > 0)
+			{
+				objects.Add({ elem.Key, region_id(), *version, child_object->state->GetStateAsString() });
+			}
+		}
+	}
+
+	FString path = FKamoSnapshot::GetSnapshotPath(server_id());
+	if (!FKamoSnapshot::Write(path, GetSnapshotContext(), objects))
+	{
+		// Make sure an older snapshot isn't picked up instead
+		IFileManager::Get().Delete(*path);
+	}
+}
+
+
+bool UKamoRuntime::LoadRegionFromSnapshot(const KamoID& root_id, TArray<KamoChildObject>& objects)
+{
+	auto snapshot_objects = snapshot ? snapshot->FindRegion(root_id()) : nullptr;
+	if (!snapshot_objects)
+	{
+		return false;
+	}
+
+	TMap<FString, int64> versions;
+	if (!database->GetObjectVersions(root_id, versions))
+	{
+		return false;
+	}
+
+	// Use the snapshot state of objects that haven't been written to since, fetch the rest
+	for (const auto& snapshot_object : *snapshot_objects)
+	{
+		int64 version;
+		if (versions.RemoveAndCopyValue(snapshot_object.id, version) && version == snapshot_object.version)
+		{
+			KamoChildObject object;
+			object.id = KamoID(snapshot_object.id);
+			object.root_id = root_id;
+			object.state = snapshot_object.state;
+			objects.Add(object);
+		}
+	}
+
+	const int32 from_snapshot = objects.Num();
+
+	TArray<KamoID> changed_ids;
+	for (const auto& elem : versions)
+	{
+		changed_ids.Add(KamoID(elem.Key));
+	}
+	objects.Append(database->GetObjects(root_id, changed_ids));
+
+	UE_LOG(LogKamoRt, Display, TEXT("LoadRegionFromSnapshot: %i objects from snapshot, %i fetched from DB for region: %s"), 
+		from_snapshot, objects.Num() - from_snapshot, *root_id());
+
+	return true;
+}
+
+
 TArray<KamoID> UKamoRuntime::GetServerRegions() const
 {
 	return registered_regions;
@@ -1020,11 +1196,18 @@ UKamoObject* UKamoRuntime::CreateObject(const FString& class_name, const KamoID&
 	state->SetString(TEXT("mmo_actor_class"), class_name);
 	state->SetString(TEXT("ue4_class"), object->GetClass()->GetPathName());
 
-	auto uobject = RegisterKamoObject(id, root_id, state, object, false, true);
-	uobject->ResolveSubobjects(this);
+	// New objects start out at the current schema version, there's nothing to upgrade
+	FString context_str;
+	FKamoClassMap* kamo_class_entry = kamo_table ? kamo_table->FindRow<FKamoClassMap>(FName(*class_name), context_str, false) : nullptr;
+	if (kamo_class_entry && kamo_class_entry->schema_version > 0)
+	{
+		FKamoSchemaRegistry::StampStateVersion(state, kamo_class_entry->schema_version);
+	}
 
+	auto uobject = RegisterKamoObject(id, root_id, state, object, false, true);
 
 	if (uobject) {
+		uobject->ResolveSubobjects(this);
 		uobject->isNew = true;
 	}
 
@@ -1034,6 +1217,7 @@ UKamoObject* UKamoRuntime::CreateObject(const FString& class_name, const KamoID&
 bool UKamoRuntime::MoveObject(const KamoID& id, const KamoID& root_id, const FString& spawn_target)
 {
 	SCOPE_CYCLE_COUNTER(STAT_MoveObject);
+	KAMO_TRACE_SCOPE("MoveObject", id);
 
 	UE_LOG(LogKamoRt, Display, TEXT("MoveObject %s to %s"), *id(), *root_id());
 	if (!id.IsValid() || !root_id.IsValid())
@@ -1080,14 +1264,14 @@ bool UKamoRuntime::MoveObject(const KamoID& id, const KamoID& root_id, const FSt
 		}
 	}
 
-	// Move
+	// Move the object and its subobjects in one go
+	if (!database->MoveObjects(MoveIDList, root_id)) {
+		UE_LOG(LogKamoRt, Error, TEXT("FAILED TO MOVE OBJECT IN DATABASE"));
+		return false;
+	}
+
 	for (const KamoID& PendingId : MoveIDList)
 	{
-		if (!database->MoveObject(PendingId, root_id)) {
-			UE_LOG(LogKamoRt, Error, TEXT("FAILED TO MOVE OBJECT IN DATABASE"));
-			return false;
-		}
-
 		// Remove
 		if (internal_state.Remove(PendingId()) != 1) {
 			UE_LOG(LogKamoRt, Error, TEXT("FAILED TO REMOVE OBJECT FROM INTERNAL STATE"));
@@ -1105,13 +1289,9 @@ bool UKamoRuntime::MoveObject(const KamoID& id, const KamoID& root_id, const FSt
         return true;
     }
 
-	TArray<UKamoState*> commands;
-    auto command = CreateMessageCommand(id, root_id, "load_childobject_from_db", "");
-
-    // Insert the move command at top
-	commands.Insert(command, 0);
-	auto payload = CreateCommandMessagePayload(commands);
-    auto message_sent = SendMessage(root_object.handler_id, "command", payload->GetStateAsString());
+	TArray<KamoCommand> commands;
+	commands.Add({ "load_childobject_from_db", id, root_id, FString() });
+    auto message_sent = SendMessage(root_object.handler_id, "command", CreateCommandMessagePayload(commands));
     if (!message_sent) 
 	{
         UE_LOG(LogKamoRt, Warning, TEXT("FAILED TO SEND MESSAGE TO NEW HANDLER"));
@@ -1146,13 +1326,11 @@ bool UKamoRuntime::MoveObjectSafely(const KamoID& id, const KamoID& root_id, con
 		return SendCommandToObject(id, "move_object", parameters);
 	}
 
-	// Do a straight DB move, take care of subobjects and finally notify the target handler if applicable
-	if (!database->MoveObject(id, root_id))
-	{
-		return false;
-	}
+	// Do a straight DB move of the object and its subobjects and finally notify the target handler if applicable
+	TArray<KamoID> MoveIDList;
+	MoveIDList.Add(id);
 
-	// Move all the subobjects
+	TArray<KamoID> SubobjectIDs;
 	UKamoState* ObjectState = NewObject<UKamoState>();
 	if (ObjectState->SetState(object.state))
 	{
@@ -1163,14 +1341,36 @@ bool UKamoRuntime::MoveObjectSafely(const KamoID& id, const KamoID& root_id, con
 			{
 				FString kamo_id_str;
 				subobjects->GetString(key, kamo_id_str);
-				if (!database->MoveObject(KamoID(kamo_id_str), root_id))
-				{
-					UE_LOG(LogKamoRt, Warning, TEXT("MoveObjectSafely: Failed to move subobject %s of  %s to %s."), *kamo_id_str, *id(), *root_id());
-				}
+				SubobjectIDs.Add(KamoID(kamo_id_str));
 			}
 		}
 	}
 
+	// The move fails as a whole if any object is missing, so leave out subobjects that are gone. They
+	// are normally in the same region as their owner.
+	TSet<FString> FoundIDs;
+	for (const KamoChildObject& subobject : database->GetObjects(object.root_id, SubobjectIDs))
+	{
+		FoundIDs.Add(subobject.id());
+	}
+	for (const KamoID& SubobjectID : SubobjectIDs)
+	{
+		if (FoundIDs.Contains(SubobjectID()) || !database->GetObject(SubobjectID, true).IsEmpty())
+		{
+			MoveIDList.Add(SubobjectID);
+		}
+		else
+		{
+			UE_LOG(LogKamoRt, Warning, TEXT("MoveObjectSafely: Subobject %s of %s doesn't exist, not moving it."), *SubobjectID(), *id());
+		}
+	}
+
+	if (!database->MoveObjects(MoveIDList, root_id))
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("MoveObjectSafely: Failed to move %s and its %i subobjects to %s."), *id(), MoveIDList.Num() - 1, *root_id());
+		return false;
+	}
+
 	// Notify the target handler
 	if (!SendCommandToObject(id, "load_childobject_from_db", "{}"))
 	{
@@ -1298,74 +1498,255 @@ void UKamoRuntime::MarkForUpdate()
     }
 }
 
+
+void FKamoSyncTierSweep::Advance(float DeltaTime, float rate)
+{
+	from = progress;
+	to = rate > 0.0f ? progress + DeltaTime / rate : progress + 1.0f;
+	progress = FMath::Fractional(to);
+}
+
+
+bool FKamoSyncTierSweep::IsDue(float phase) const
+{
+	if (to - from >= 1.0f)
+	{
+		return true; // Whole interval passed
+	}
+
+	// The sweep may wrap around the end of the interval
+	return (phase >= from && phase < to) || (to > 1.0f && phase < to - 1.0f);
+}
+
+
+void FKamoSyncTierSweep::GetPassedBuckets(int32& first, int32& num) const
+{
+	// The sweep may wrap around the end of the interval
+	first = FMath::FloorToInt(from * NumBuckets);
+	num = FMath::Min(FMath::CeilToInt(to * NumBuckets) - first, NumBuckets);
+}
+
+
+void FKamoSyncTierSweep::Add(const FString& id, float phase)
+{
+	buckets[FMath::Clamp(int32(phase * NumBuckets), 0, NumBuckets - 1)].Add(id);
+}
+
+
+void FKamoSyncTierSweep::Reset()
+{
+	for (auto& bucket : buckets)
+	{
+		bucket.Empty();
+	}
+}
+
+
+void UKamoRuntime::AddToSyncTier(UKamoObject* object)
+{
+	auto tier = object->kamo_class_entry.sync_tier;
+	if (tier == EKamoSyncTier::KST_OnDemand)
+	{
+		on_demand_objects.Add(object->id->GetID());
+	}
+	else
+	{
+		sync_tier_sweeps[(int32)tier].Add(object->id->GetID(), object->sync_phase);
+	}
+}
+
+
+void UKamoRuntime::MarkSyncTierForUpdate(FKamoSyncTierSweep& sweep)
+{
+	int32 first, num_buckets;
+	sweep.GetPassedBuckets(first, num_buckets);
+
+	for (int32 i = 0; i < num_buckets; i++)
+	{
+		auto& bucket = sweep.buckets[(first + i) % FKamoSyncTierSweep::NumBuckets];
+		for (auto it = bucket.CreateIterator(); it; ++it)
+		{
+			auto object = internal_state.FindRef(*it);
+			if (!object)
+			{
+				it.RemoveCurrent();
+				continue;
+			}
+
+			if (sweep.IsDue(object->sync_phase))
+			{
+				object->MarkForUpdate();
+			}
+
+			if (object->NeedsSerializing())
+			{
+				sync_pending_objects.Add(object);
+			}
+		}
+	}
+}
+
+
+bool UKamoRuntime::MarkForUpdateBySyncTier(float DeltaTime)
+{
+	SCOPE_CYCLE_COUNTER(STAT_MarkForUpdate);
+	KAMO_TRACE_SCOPE("MarkForUpdate");
+
+	auto settings = UKamoProjectSettings::Get();
+	sync_tier_sweeps[(int32)EKamoSyncTier::KST_Normal].Advance(DeltaTime, settings->mark_and_sync_rate);
+	sync_tier_sweeps[(int32)EKamoSyncTier::KST_Fast].Advance(DeltaTime, settings->fast_sync_rate);
+	sync_tier_sweeps[(int32)EKamoSyncTier::KST_Slow].Advance(DeltaTime, settings->slow_sync_rate);
+
+	sync_pending_objects.Reset();
+
+	for (auto& sweep : sync_tier_sweeps)
+	{
+		MarkSyncTierForUpdate(sweep);
+	}
+
+	// On demand objects are only picked up when flagged dirty or changed through the runtime
+	for (auto it = on_demand_objects.CreateIterator(); it; ++it)
+	{
+		auto object = internal_state.FindRef(*it);
+		if (!object)
+		{
+			it.RemoveCurrent();
+			continue;
+		}
+
+		if (object->IsFlaggedDirty())
+		{
+			object->MarkForUpdate();
+		}
+
+		if (object->NeedsSerializing())
+		{
+			sync_pending_objects.Add(object);
+		}
+	}
+
+	SET_DWORD_STAT(STAT_DirtyObjects, sync_pending_objects.Num());
+
+	// Objects flagged outside of the sweeps are written at least once per mark and sync interval
+	return sync_tier_sweeps[(int32)EKamoSyncTier::KST_Normal].IsIntervalDone();
+}
+
+
 void UKamoRuntime::SerializeObjects(bool commit_to_db)
 {
 	SCOPE_CYCLE_COUNTER(STAT_SerializeObjects);
+	KAMO_TRACE_SCOPE("SerializeObjects");
 
 	TArray<KamoID> deleted_ids;
 
 	for (auto& elem : internal_state)
 	{
-		auto object = elem.Value;
-
-		if (!object) {
-			continue;
+		if (elem.Value)
+		{
+			SerializeObject(elem.Value, deleted_ids);
 		}
+	}
+
+	DeleteObjects(deleted_ids);
+	sync_pending_objects.Reset();  // Covered by the full pass
+
+	while (commit_to_db && database->IsSerializationPending(KamoID()))
+	{
+		FPlatformProcess::Sleep(0.0f);
+	}
+}
+
 
-		if (object->deleted)
+void UKamoRuntime::SerializePendingObjects()
+{
+	SCOPE_CYCLE_COUNTER(STAT_SerializeObjects);
+	KAMO_TRACE_SCOPE("SerializeObjects");
+
+	TArray<KamoID> deleted_ids;
+
+	for (auto object : sync_pending_objects)
+	{
+		SerializeObject(object, deleted_ids);
+	}
+	sync_pending_objects.Reset();
+
+	DeleteObjects(deleted_ids);
+}
+
+
+void UKamoRuntime::SerializeObject(UKamoObject* object, TArray<KamoID>& deleted_ids)
+{
+	if (object->deleted)
+	{
+		deleted_ids.Add(object->id->GetPrimitive());
+		auto uactor_object = Cast<UKamoActor>(object);
+		if (uactor_object && uactor_object->object_ref_mode == EObjectRefMode::RM_SpawnObject && uactor_object->GetActor())
 		{
-			deleted_ids.Add(object->id->GetPrimitive());
-			auto uactor_object = Cast<UKamoActor>(object);
-			if (uactor_object && uactor_object->object_ref_mode == EObjectRefMode::RM_SpawnObject && uactor_object->GetActor())
+			uactor_object->GetActor()->Destroy();
+		}
+	}
+	else if (object->dirty || object->isNew)
+	{
+		{
+			// Update Kamo state from actor
+			SCOPE_CYCLE_COUNTER(STAT_UpdateKamoStateFromActor);
+			KAMO_TRACE_SCOPE("UpdateKamoStateFromActor", object->id->GetPrimitive());
+			if (object->GetObject())
 			{
-				uactor_object->GetActor()->Destroy();
+				object->UpdateKamoStateFromActor();
 			}
 		}
-		else if (object->dirty || object->isNew)
+
+		// Queued for writing, actorless objects as well so they aren't written again every tick
+		object->dirty = false;
+		object->isNew = false;
+
 		{
+			// Flush to DB
+			SCOPE_CYCLE_COUNTER(STAT_FlushToDB);
+			FKamoTraceScope trace(TEXT("FlushToDB"));
+			if (trace.IsActive())
 			{
-				// Update Kamo state from actor
-				SCOPE_CYCLE_COUNTER(STAT_UpdateKamoStateFromActor);
-				if (object->GetObject())
-				{
-					object->UpdateKamoStateFromActor();
-					object->dirty = false;
-					object->isNew = false;
-				}
+				trace.SetArgs(object->id->GetPrimitive());
 			}
+			auto child_ptr = Cast<UKamoChildObject>(object);
+			auto root_ptr = Cast<UKamoRootObject>(object);
+			auto handler_ptr = Cast<UKamoHandlerObject>(object);
 
+			if (child_ptr)
 			{
-				// Flush to DB
-				SCOPE_CYCLE_COUNTER(STAT_FlushToDB);
-				auto child_ptr = Cast<UKamoChildObject>(object);
-				auto root_ptr = Cast<UKamoRootObject>(object);
-				auto handler_ptr = Cast<UKamoHandlerObject>(object);
-
-				if (child_ptr)
-				{
-					database->Set(child_ptr->GetPrimitive());
-				}
-				else if (root_ptr)
-				{
-					database->Set(root_ptr->GetPrimitive());
-				}
-				else if (handler_ptr)
-				{
-					database->Set(handler_ptr->GetPrimitive());
-				}
-				else
-				{
-					UE_LOG(LogKamoRt, Error, TEXT("SerializeObjects: Failed to serialize, unknown kamo object type: %s"), *object->id->GetPrimitive()());
-					continue;
-				}
+				auto primitive = child_ptr->GetPrimitive();
+				trace.SetBytes(primitive.state.Len());
+				database->Set(primitive);
+			}
+			else if (root_ptr)
+			{
+				auto primitive = root_ptr->GetPrimitive();
+				trace.SetBytes(primitive.state.Len());
+				database->Set(primitive);
+			}
+			else if (handler_ptr)
+			{
+				auto primitive = handler_ptr->GetPrimitive();
+				trace.SetBytes(primitive.state.Len());
+				database->Set(primitive);
+			}
+			else
+			{
+				UE_LOG(LogKamoRt, Error, TEXT("SerializeObjects: Failed to serialize, unknown kamo object type: %s"), *object->id->GetPrimitive()());
+				return;
 			}
 		}
 	}
+}
 
-    // Delete objects
+
+void UKamoRuntime::DeleteObjects(const TArray<KamoID>& deleted_ids)
+{
 	for (auto deleted_id : deleted_ids)
 	{
 		SCOPE_CYCLE_COUNTER(STAT_DeleteFromDB);
+		KAMO_TRACE_SCOPE("DeleteFromDB", deleted_id);
 
 		UKamoObject* ob = nullptr;	
 
@@ -1401,11 +1782,6 @@ void UKamoRuntime::SerializeObjects(bool commit_to_db)
 			}
 		}
     }
-
-	while (commit_to_db && database->IsSerializationPending(KamoID()))
-	{
-		FPlatformProcess::Sleep(0.0f);
-	}
 }
 
 
@@ -1487,6 +1863,13 @@ bool UKamoRuntime::RegisterUE4Handler(UE4ServerHandler& ue4handler)
 	message_queue = IKamoMQ::CreateDriver(KamoUtil::get_driver_name());
 	if (message_queue)
 	{
+		auto settings = UKamoProjectSettings::Get();
+		KamoDriverConfig driver_config;
+		driver_config.message_batch_size = settings->mq_read_batch_size;
+		driver_config.message_stream_max_length = settings->mq_max_stream_length;
+		driver_config.io_uring = settings->file_io_uring;
+		message_queue->SetConfig(driver_config);
+
 		message_queue->CreateSession(KamoUtil::get_tenant_name(), ue4handler.id());
 		message_queue->CreateMessageQueue();
 		ue4handler.inbox_address = message_queue->GetSessionURL();
@@ -1599,10 +1982,16 @@ void UKamoRuntime::ProcessMessageQueue()
 	}
 	else
 	{
-		KamoMessage message;
-		while (message_queue->ReceiveMessage(message))
+		// Drain in batches, in the order the messages arrived
+		TArray<KamoMessage> messages;
+		while (message_queue->ReceiveMessages(messages, 256) > 0)
 		{
-			ProcessMessage(message);
+			for (const KamoMessage& message : messages)
+			{
+				ProcessMessage(message);
+				message_queue->AcknowledgeMessage(message);
+			}
+			messages.Reset();
 		}
 	}
 }
@@ -1617,35 +2006,39 @@ bool UKamoRuntime::SendMessage(const KamoID& handler_id, const FString& message_
 
 void UKamoRuntime::ProcessMessage(const KamoMessage& message) 
 {
+	KAMO_TRACE_SCOPE("ProcessMessage", message.sender, message.payload.Len());
 	if (message.message_type != "command")
 	{
 		// Never happens actually
 		return;
 	}
 
-    TArray<UKamoState*> command_states;
-
-	UKamoMessage* umessage = NewObject<UKamoMessage>();
-	umessage->Init(message);
-    if (!umessage->payload->GetKamoStateArray("commands", command_states))
+	// Commands are decoded into plain structs, only the parameters of commands that have them go into a
+	// state object. Those are handed to OnCommandReceived which may keep them, so they are never pooled.
+	TArray<KamoCommand> commands;
+	if (!FKamoCommandCodec::Decode(message.payload, commands))
 	{
-        UE_LOG(LogKamoRt, Warning, TEXT("'commands' NOT FOUND"));
-        return;
-    }
+		UE_LOG(LogKamoRt, Warning, TEXT("Malformed command message from %s"), *message.sender());
+		return;
+	}
 
-    for (auto command_state : command_states)
+    for (const KamoCommand& command_entry : commands)
 	{
-        FString command;
-        FString kamo_id;
-		FString region_id;
-		UKamoState* parameters;
+		const FString& command = command_entry.command;
+		const FString kamo_id = command_entry.kamo_id();
+		const FString region_id = command_entry.region_id();
+		const bool kamo_id_valid = !command_entry.kamo_id.IsEmpty();
+		const bool region_id_valid = !command_entry.region_id.IsEmpty();
+		const bool parameters_valid = !command_entry.parameters.IsEmpty();
 
-        const auto command_valid = command_state->GetString("command", command);
-        const auto kamo_id_valid = command_state->GetString("kamo_id", kamo_id);
-        const auto region_id_valid = command_state->GetString("region_id", region_id);
-		const auto parameters_valid = command_state->GetKamoState("parameters", parameters);
+		UKamoState* parameters = nullptr;
+		if (parameters_valid)
+		{
+			parameters = NewObject<UKamoState>();
+			parameters->SetState(command_entry.parameters);
+		}
 
-        if (!command_valid)
+        if (command.IsEmpty())
 		{
             UE_LOG(LogKamoRt, Warning, TEXT("'command' NOT FOUND"));
             continue;
@@ -1774,6 +2167,7 @@ void UKamoRuntime::ProcessMessage(const KamoMessage& message)
 		}
 		else if (command == "flush_to_db")
 		{
+			MarkForUpdate();
 			SerializeObjects();
 		}
 		else if (command == "exit_process")
@@ -1787,7 +2181,7 @@ void UKamoRuntime::ProcessMessage(const KamoMessage& message)
 			{
 				parameters->GetString("message", msg);
 			}
-			UE_LOG(LogKamoRt, Display, TEXT("Log message from %s: %s"), *umessage->sender->GetID(), *msg);
+			UE_LOG(LogKamoRt, Display, TEXT("Log message from %s: %s"), *message.sender(), *msg);
 		}
 		else
 		{
@@ -1802,6 +2196,7 @@ void UKamoRuntime::ProcessMessage(const KamoMessage& message)
 
 UKamoObject* UKamoRuntime::RegisterKamoObject(const KamoID& id, const KamoID& root_id, UKamoState* state, UObject* object, bool is_proxy, bool skip_apply_state)
 {
+	KAMO_TRACE_SCOPE("RegisterKamoObject", id);
 
 	auto skip_refresh = false;
     auto should_spawn = true;
@@ -1835,6 +2230,19 @@ UKamoObject* UKamoRuntime::RegisterKamoObject(const KamoID& id, const KamoID& ro
 		return nullptr;
 	}
 
+	// Lazily bring records written with an older schema up to date. Proxies are read-only views
+	// of objects owned by other servers so they are left alone.
+	bool schema_upgraded = false;
+	if (!is_proxy && kamo_class_entry->schema_version > 0)
+	{
+		SCOPE_CYCLE_COUNTER(STAT_SchemaUpgrade);
+		if (!FKamoSchemaRegistry::Get().UpgradeState(id.class_name, state, kamo_class_entry->schema_version, schema_upgraded))
+		{
+			UE_LOG(LogKamoRt, Error, TEXT("Failed to upgrade schema of kamo entry: \"%s.%s\""), *id.class_name, *id.unique_id);
+			return nullptr;
+		}
+	}
+
 	auto actor = Cast<AActor>(object);
 
     FString actor_class;
@@ -1859,7 +2267,14 @@ UKamoObject* UKamoRuntime::RegisterKamoObject(const KamoID& id, const KamoID& ro
 	// uobject->OnObjectAttached(object);
 	uobject->check_if_dirty = kamo_class_entry->check_if_dirty; // TODO: Use CDO instead
 	uobject->kamo_class_entry = *kamo_class_entry;
+	uobject->sync_phase = float(GetTypeHash(id()) % 1024) / 1024.0f;
 
+	if (schema_upgraded)
+	{
+		// Write the upgraded record back on next sync
+		uobject->dirty = true;
+		UE_LOG(LogKamoRt, Display, TEXT("Upgraded schema of \"%s\" to version %i"), *id(), kamo_class_entry->schema_version);
+	}
 
 	auto uchild_object = Cast<UKamoChildObject>(uobject);
 
@@ -1874,6 +2289,7 @@ UKamoObject* UKamoRuntime::RegisterKamoObject(const KamoID& id, const KamoID& ro
 	if (is_proxy)
 	{
 		internal_state.Add(id(), uobject);
+		AddToSyncTier(uobject);
 		uobject->ResolveSubobjects(this);
 		return uobject;
 	}
@@ -1908,6 +2324,7 @@ UKamoObject* UKamoRuntime::RegisterKamoObject(const KamoID& id, const KamoID& ro
     }
 
     internal_state.Add(id(), uobject);
+	AddToSyncTier(uobject);
 
 	// Applies the state from the kamo object to the created object
     if (!skip_refresh)
@@ -2093,6 +2510,26 @@ UDataTable* UKamoRuntime::GetKamoTable()
 }
 
 
+KamoSerializationPolicy UKamoRuntime::GetSerializationPolicy() const
+{
+	auto settings = UKamoProjectSettings::Get();
+	KamoSerializationPolicy policy;
+	policy.aging_rate = settings->serialization_aging_rate;
+	policy.deadline = settings->serialization_deadline;
+
+	static const FString context(TEXT("KamoRuntime"));
+	for (auto row_name : kamo_table->GetRowNames())
+	{
+		auto entry = kamo_table->FindRow<FKamoClassMap>(row_name, context);
+		if (entry && entry->serialization_priority != 0)
+		{
+			policy.class_priority.Add(row_name.ToString().ToLower(), entry->serialization_priority);
+		}
+	}
+
+	return policy;
+}
+
 TKamoClassMapEntry UKamoRuntime::GetDefaultKamoClassMapEntry() const
 {
 	static FKamoClassMap KamoClassMap;
@@ -2173,9 +2610,9 @@ FKamoClassMap UKamoRuntime::GetKamoClass(const FString& class_name) const {
 	return *entry;
 }
 
-UKamoState* UKamoRuntime::CreateMessageCommand(const KamoID& kamo_id, const KamoID& root_id, const FString& command, const FString& parameters) {
-	auto command_object = NewObject<UKamoState>();
-	auto params = NewObject<UKamoState>();
+UKamoState* UKamoRuntime::CreateMessageCommand(const KamoID& kamo_id, const KamoID& root_id, const FString& command, const FString& parameters, bool pooled) {
+	auto command_object = pooled ? FKamoObjectPool::Get().AcquireState() : NewObject<UKamoState>();
+	auto params = pooled ? FKamoObjectPool::Get().AcquireState() : NewObject<UKamoState>();
 
 	params->SetState(parameters);
 
@@ -2193,14 +2630,42 @@ UKamoState* UKamoRuntime::CreateMessageCommand(const KamoID& kamo_id, const Kamo
 	return command_object;
 }
 
-UKamoState* UKamoRuntime::CreateCommandMessagePayload(TArray<UKamoState*> commands) {
-	auto payload = NewObject<UKamoState>();
+UKamoState* UKamoRuntime::CreateCommandMessagePayload(TArray<UKamoState*> commands, bool pooled) {
+	auto payload = pooled ? FKamoObjectPool::Get().AcquireState() : NewObject<UKamoState>();
 
 	payload->SetKamoStateArray("commands", commands);
 
 	return payload;
 }
 
+FString UKamoRuntime::CreateCommandMessagePayload(const TArray<KamoCommand>& commands) {
+	return FKamoCommandCodec::Encode(commands, UKamoProjectSettings::Get()->mq_json_commands);
+}
+
+bool UKamoRuntime::GetCommandFromState(UKamoState* command_state, KamoCommand& command) {
+	if (!command_state || !command_state->GetString("command", command.command))
+	{
+		return false;
+	}
+
+	FString id;
+	if (command_state->GetString("kamo_id", id))
+	{
+		command.kamo_id = KamoID(id);
+	}
+	if (command_state->GetString("region_id", id))
+	{
+		command.region_id = KamoID(id);
+	}
+
+	UKamoState* parameters;
+	if (command_state->GetKamoState("parameters", parameters) && parameters)
+	{
+		command.parameters = parameters->GetStateAsString();
+	}
+	return true;
+}
+
 bool UKamoRuntime::SendCommandToObject(const KamoID& id, const FString& command, const FString& parameters) {
 	KamoID root_id = id;
 	KamoID message_root_id;
@@ -2218,14 +2683,10 @@ bool UKamoRuntime::SendCommandToObject(const KamoID& id, const FString& command,
 		return false;
 	}
 
-	auto command_object = CreateMessageCommand(id, message_root_id, command, parameters);
-
-	TArray<UKamoState*> commands;
-	commands.Add(command_object);
-
-	auto payload = CreateCommandMessagePayload(commands);
+	TArray<KamoCommand> commands;
+	commands.Add({ command, id, message_root_id, parameters });
 
-	return SendMessage(root_object.handler_id, "command", payload->GetStateAsString());
+	return SendMessage(root_object.handler_id, "command", CreateCommandMessagePayload(commands));
 }
 
 bool UKamoRuntime::SendCommandsToObject(const KamoID& id, TArray<UKamoState*> commands) {
@@ -2243,9 +2704,17 @@ bool UKamoRuntime::SendCommandsToObject(const KamoID& id, TArray<UKamoState*> co
 		return false;
 	}
 
-	auto payload = CreateCommandMessagePayload(commands);
+	TArray<KamoCommand> encoded_commands;
+	for (auto command_state : commands)
+	{
+		if (!GetCommandFromState(command_state, encoded_commands.AddDefaulted_GetRef()))
+		{
+			UE_LOG(LogKamoRt, Warning, TEXT("SendCommandsToObject: 'command' NOT FOUND"));
+			encoded_commands.Pop();
+		}
+	}
 
-	return SendMessage(root_object.handler_id, "command", payload->GetStateAsString());
+	return SendMessage(root_object.handler_id, "command", CreateCommandMessagePayload(encoded_commands));
 }
 
 
@@ -0,0 +1,101 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoSchema.h"
+#include "KamoRuntime.h"
+#include "KamoState.h"
+
+
+const TCHAR* FKamoSchemaRegistry::VersionField = TEXT("schema_version");
+
+
+FKamoSchemaRegistry& FKamoSchemaRegistry::Get()
+{
+	static FKamoSchemaRegistry registry;
+	return registry;
+}
+
+
+void FKamoSchemaRegistry::RegisterUpgrade(const FString& class_name, int32 from_version, FKamoSchemaUpgradeFunc upgrade_func)
+{
+	FScopeLock lock(&mutex);
+	auto& steps = upgrades.FindOrAdd(class_name);
+	if (steps.Contains(from_version))
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("Schema upgrade for '%s' from version %i registered twice. Replacing the previous one."), *class_name, from_version);
+	}
+	steps.Add(from_version, MoveTemp(upgrade_func));
+}
+
+
+void FKamoSchemaRegistry::UnregisterUpgrades(const FString& class_name)
+{
+	FScopeLock lock(&mutex);
+	upgrades.Remove(class_name);
+}
+
+
+int32 FKamoSchemaRegistry::GetStateVersion(UKamoState* state)
+{
+	int version = 0;
+	if (state)
+	{
+		state->GetInt(VersionField, version);
+	}
+	return version;
+}
+
+
+void FKamoSchemaRegistry::StampStateVersion(UKamoState* state, int32 version)
+{
+	if (state)
+	{
+		state->SetInt(VersionField, version);
+	}
+}
+
+
+bool FKamoSchemaRegistry::UpgradeState(const FString& class_name, UKamoState* state, int32 target_version, bool& upgraded) const
+{
+	upgraded = false;
+
+	if (!state)
+	{
+		return false;
+	}
+
+	int32 version = GetStateVersion(state);
+	if (version >= target_version)
+	{
+		if (version > target_version)
+		{
+			// Written by a newer build. Load it as is, it's up to the game to cope with unknown fields.
+			UE_LOG(LogKamoRt, Warning, TEXT("Record of class '%s' has schema version %i but current version is %i."), *class_name, version, target_version);
+		}
+		return true;
+	}
+
+	FScopeLock lock(&mutex);
+	auto steps = upgrades.Find(class_name);
+
+	while (version < target_version)
+	{
+		auto upgrade_func = steps ? steps->Find(version) : nullptr;
+		if (!upgrade_func)
+		{
+			UE_LOG(LogKamoRt, Error, TEXT("No schema upgrade registered for '%s' from version %i."), *class_name, version);
+			return false;
+		}
+
+		if (!(*upgrade_func)(state))
+		{
+			UE_LOG(LogKamoRt, Error, TEXT("Schema upgrade for '%s' from version %i failed."), *class_name, version);
+			return false;
+		}
+
+		version++;
+		StampStateVersion(state, version);
+		upgraded = true;
+	}
+
+	return true;
+}
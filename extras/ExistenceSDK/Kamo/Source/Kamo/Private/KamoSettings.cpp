@@ -68,6 +68,25 @@ FString KamoUtil::get_driver_name()
 }
 
 
+KamoDriverConfig KamoUtil::get_db_config()
+{
+	auto settings = UKamoProjectSettings::Get();
+	KamoDriverConfig driver_config;
+	driver_config.connection_pool_size = settings->db_connection_pool_size;
+	driver_config.num_writers = settings->db_writer_threads;
+	driver_config.write_batch_size = settings->db_write_batch_size;
+	driver_config.write_batch_bytes = settings->db_write_batch_bytes;
+	driver_config.read_cache_mb = settings->db_read_cache_mb;
+	driver_config.region_lock_refresh_interval = settings->db_region_lock_refresh_interval;
+	driver_config.region_lock_timeout = settings->db_region_lock_timeout;
+	driver_config.journal_directory = settings->db_journal_directory;
+	driver_config.journal_sync_interval_ms = settings->db_journal_sync_interval_ms;
+	driver_config.loose_objects = settings->file_db_loose_objects;
+	driver_config.io_uring = settings->file_io_uring;
+	return driver_config;
+}
+
+
 FString KamoUtil::GetCommandLineSwitch(const FString& switch_name)
 {
 	TArray<FString> tokens;
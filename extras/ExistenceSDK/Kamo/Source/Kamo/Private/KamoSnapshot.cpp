@@ -0,0 +1,130 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoSnapshot.h"
+#include "KamoRuntime.h"
+
+#include "HAL/PlatformFileManager.h"
+#include "Async/MappedFileHandle.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+
+static const uint32 snapshot_magic = 0x4B534E50; // 'KSNP'
+static const int32 snapshot_format_version = 1;
+
+
+static FArchive& operator<<(FArchive& Ar, FKamoSnapshotObject& object)
+{
+	Ar << object.id;
+	Ar << object.root_id;
+	Ar << object.version;
+	Ar << object.state;
+	return Ar;
+}
+
+
+FString FKamoSnapshot::GetSnapshotPath(const FString& server_id)
+{
+	return FPaths::Combine(FPaths::ProjectSavedDir(), TEXT("Kamo"), FString::Printf(TEXT("snapshot-%s.bin"), *server_id));
+}
+
+
+bool FKamoSnapshot::Write(const FString& path, const FString& context, const TArray<FKamoSnapshotObject>& objects)
+{
+	TArray<uint8> data;
+	FMemoryWriter writer(data);
+
+	uint32 magic = snapshot_magic;
+	int32 format_version = snapshot_format_version;
+	FString context_str = context;
+	int32 num_objects = objects.Num();
+
+	writer << magic;
+	writer << format_version;
+	writer << context_str;
+	writer << num_objects;
+	for (auto object : objects)
+	{
+		writer << object;
+	}
+	writer << magic; // End marker, catches truncated files
+
+	// Write to a temp file first so a crash during shutdown doesn't leave a half written snapshot behind
+	FString temp_path = path + TEXT(".tmp");
+	if (!FFileHelper::SaveArrayToFile(data, *temp_path))
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("Failed to write runtime snapshot: %s"), *temp_path);
+		return false;
+	}
+
+	if (!IFileManager::Get().Move(*path, *temp_path, true))
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("Failed to move runtime snapshot into place: %s"), *path);
+		return false;
+	}
+
+	UE_LOG(LogKamoRt, Display, TEXT("Wrote runtime snapshot with %i objects (%i bytes): %s"), objects.Num(), data.Num(), *path);
+	return true;
+}
+
+
+bool FKamoSnapshot::Load(const FString& path, const FString& context)
+{
+	regions.Empty();
+
+	TUniquePtr<IMappedFileHandle> handle(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*path));
+	if (!handle)
+	{
+		return false;
+	}
+
+	TUniquePtr<IMappedFileRegion> region(handle->MapRegion(0, handle->GetFileSize()));
+	if (!region)
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("Failed to map runtime snapshot: %s"), *path);
+		return false;
+	}
+
+	FMemoryReaderView reader(MakeArrayView(region->GetMappedPtr(), region->GetMappedSize()));
+
+	uint32 magic = 0;
+	int32 format_version = 0;
+	FString snapshot_context;
+	int32 num_objects = 0;
+
+	reader << magic;
+	reader << format_version;
+	if (reader.IsError() || magic != snapshot_magic || format_version != snapshot_format_version)
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("Runtime snapshot has unknown format, ignoring it: %s"), *path);
+		return false;
+	}
+
+	reader << snapshot_context;
+	if (snapshot_context != context)
+	{
+		UE_LOG(LogKamoRt, Display, TEXT("Runtime snapshot was written for '%s', ignoring it."), *snapshot_context);
+		return false;
+	}
+
+	reader << num_objects;
+	for (int32 i = 0; i < num_objects && !reader.IsError(); i++)
+	{
+		FKamoSnapshotObject object;
+		reader << object;
+		regions.FindOrAdd(object.root_id).Add(MoveTemp(object));
+	}
+
+	reader << magic;
+	if (reader.IsError() || magic != snapshot_magic)
+	{
+		UE_LOG(LogKamoRt, Warning, TEXT("Runtime snapshot is truncated, ignoring it: %s"), *path);
+		regions.Empty();
+		return false;
+	}
+
+	UE_LOG(LogKamoRt, Display, TEXT("Loaded runtime snapshot with %i objects in %i regions."), num_objects, regions.Num());
+	return true;
+}
@@ -0,0 +1,38 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+
+/**
+ * Local checkpoint of the objects a runtime had loaded when it shut down.
+ *
+ * Each object is stored with the DB version stamp it had when the snapshot was written. On the
+ * next start the runtime compares those against the current stamps in the DB and only fetches
+ * the objects that changed in the meantime. The file is memory mapped when read.
+ */
+struct FKamoSnapshotObject
+{
+	FString id;
+	FString root_id;
+	int64 version;
+	FString state;
+};
+
+
+class FKamoSnapshot
+{
+public:
+	// 'context' identifies the tenant, driver and map. A snapshot written in another context is ignored.
+	static FString GetSnapshotPath(const FString& server_id);
+	static bool Write(const FString& path, const FString& context, const TArray<FKamoSnapshotObject>& objects);
+
+	bool Load(const FString& path, const FString& context);
+
+	// Returns the snapshot objects of region 'root_id' or null if the region isn't in the snapshot.
+	const TArray<FKamoSnapshotObject>* FindRegion(const FString& root_id) const { return regions.Find(root_id); }
+
+private:
+	TMap<FString, TArray<FKamoSnapshotObject>> regions;
+};
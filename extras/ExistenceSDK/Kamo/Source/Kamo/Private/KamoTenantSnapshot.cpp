@@ -0,0 +1,489 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoTenantSnapshot.h"
+#include "Kamo.h"
+#include "KamoDB.h"
+
+#include "Async/Async.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformMisc.h"
+#include "HAL/PlatformProcess.h"
+#include "Misc/Compression.h"
+#include "Misc/Crc.h"
+#include "Misc/DateTime.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+
+static const uint32 tenant_snapshot_magic = 0x4B54534E; // 'KTSN'
+static const int32 tenant_snapshot_format_version = 2;  // 2: Chunk CRCs cover the object count and raw size
+
+// Smallest serialized object, three empty strings
+static const int32 tenant_snapshot_min_object_bytes = 3 * sizeof(int32);
+
+// Most zlib can expand a byte to
+static const int64 tenant_snapshot_max_compression_ratio = 1032;
+
+// Seconds between progress reports
+static const double tenant_snapshot_report_interval = 5.0;
+
+
+struct FKamoTenantObject
+{
+	FString id;
+	FString root_id;  // Empty for root objects
+	FString state;
+};
+
+
+static FArchive& operator<<(FArchive& Ar, FKamoTenantObject& object)
+{
+	Ar << object.id;
+	Ar << object.root_id;
+	Ar << object.state;
+	return Ar;
+}
+
+
+namespace
+{
+	struct FEncodedChunk
+	{
+		int32 num_objects = 0;
+		int32 raw_size = 0;
+		uint32 crc = 0;
+		TArray<uint8> data;
+		bool ok = false;
+	};
+
+	struct FDecodedChunk
+	{
+		TArray<FKamoTenantObject> objects;
+		int32 compressed_size = 0;
+		bool ok = false;
+	};
+
+	uint32 ChunkCrc(int32 num_objects, int32 raw_size, const TArray<uint8>& data)
+	{
+		uint32 crc = FCrc::MemCrc32(&num_objects, sizeof(num_objects));
+		crc = FCrc::MemCrc32(&raw_size, sizeof(raw_size), crc);
+		return FCrc::MemCrc32(data.GetData(), data.Num(), crc);
+	}
+
+	FEncodedChunk EncodeChunk(TArray<FKamoTenantObject>& objects)
+	{
+		TArray<uint8> raw;
+		FMemoryWriter writer(raw);
+		for (auto& object : objects)
+		{
+			writer << object;
+		}
+
+		FEncodedChunk chunk;
+		chunk.num_objects = objects.Num();
+		chunk.raw_size = raw.Num();
+		int32 compressed_size = FCompression::CompressMemoryBound(NAME_Zlib, raw.Num());
+		chunk.data.SetNumUninitialized(compressed_size);
+		chunk.ok = FCompression::CompressMemory(NAME_Zlib, chunk.data.GetData(), compressed_size, raw.GetData(), raw.Num());
+		chunk.data.SetNum(compressed_size);
+		chunk.crc = ChunkCrc(chunk.num_objects, chunk.raw_size, chunk.data);
+		return chunk;
+	}
+
+	FDecodedChunk DecodeChunk(int32 num_objects, int32 raw_size, uint32 crc, const TArray<uint8>& data)
+	{
+		FDecodedChunk chunk;
+		chunk.compressed_size = data.Num();
+		if (ChunkCrc(num_objects, raw_size, data) != crc)
+		{
+			return chunk;
+		}
+
+		// Checked by the CRC already, but a bad header would cost huge allocations so don't trust it alone
+		if (raw_size > data.Num() * tenant_snapshot_max_compression_ratio || num_objects > raw_size / tenant_snapshot_min_object_bytes)
+		{
+			return chunk;
+		}
+
+		TArray<uint8> raw;
+		raw.SetNumUninitialized(raw_size);
+		if (!FCompression::UncompressMemory(NAME_Zlib, raw.GetData(), raw.Num(), data.GetData(), data.Num()))
+		{
+			return chunk;
+		}
+
+		FMemoryReader reader(raw);
+		chunk.objects.SetNum(num_objects);
+		for (auto& object : chunk.objects)
+		{
+			reader << object;
+		}
+		chunk.ok = !reader.IsError();
+		return chunk;
+	}
+
+	int32 MaxPendingChunks(const FKamoTenantSnapshotOptions& options)
+	{
+		int32 num_threads = options.num_threads > 0 ? options.num_threads : FPlatformMisc::NumberOfCoresIncludingHyperthreads();
+		return FMath::Max(num_threads, 1) * 2;
+	}
+
+	struct FProgress
+	{
+		const TCHAR* verb;
+		double start_time = FPlatformTime::Seconds();
+		double last_report_time = FPlatformTime::Seconds();
+		int64 num_objects = 0;
+		int64 num_bytes = 0;
+
+		FProgress(const TCHAR* _verb) : verb(_verb) {}
+
+		void Add(int32 objects, int32 bytes)
+		{
+			num_objects += objects;
+			num_bytes += bytes;
+			Report(false);
+		}
+
+		void Report(bool done)
+		{
+			double now = FPlatformTime::Seconds();
+			if (!done && now - last_report_time < tenant_snapshot_report_interval)
+			{
+				return;
+			}
+
+			last_report_time = now;
+			double seconds = FMath::Max(now - start_time, 0.001);
+			UE_LOG(LogKamo, Display, TEXT("KamoTenantSnapshot: %s %lld objects, %.1f MB compressed in %.1f s (%.0f objects/s)%s"),
+				verb, num_objects, num_bytes / (1024.0 * 1024.0), seconds, num_objects / seconds, done ? TEXT(", done.") : TEXT(""));
+		}
+	};
+
+	void WaitForWrites(IKamoDB& db, FProgress& progress)
+	{
+		while (db.IsSerializationPending(KamoID(), false))
+		{
+			FPlatformProcess::Sleep(0.01f);
+			progress.Report(false);
+		}
+	}
+}
+
+
+bool FKamoTenantSnapshot::Export(IKamoDB& db, const FString& path, const FKamoTenantSnapshotOptions& options)
+{
+	// Write to a temp file first so a failed export doesn't leave a snapshot that looks whole
+	FString temp_path = path + TEXT(".tmp");
+	TUniquePtr<FArchive> file(IFileManager::Get().CreateFileWriter(*temp_path));
+	if (!file)
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Can't create %s"), *temp_path);
+		return false;
+	}
+
+	uint32 magic = tenant_snapshot_magic;
+	int32 format_version = tenant_snapshot_format_version;
+	FString source = db.GetSessionURL();
+	int64 created = FDateTime::UtcNow().GetTicks();
+	*file << magic;
+	*file << format_version;
+	*file << source;
+	*file << created;
+
+	const int32 chunk_size = FMath::Max(options.chunk_size, 1);
+	const int32 max_pending = MaxPendingChunks(options);
+	TArray<TFuture<FEncodedChunk>> pending;
+	TArray<FKamoTenantObject> objects;
+	FProgress progress(TEXT("Exported"));
+	int64 total_objects = 0;
+	bool ok = true;
+
+	// Chunks are compressed on the thread pool and written in order
+	auto write_chunks = [&](bool all)
+	{
+		if (objects.Num())
+		{
+			pending.Add(Async(EAsyncExecution::ThreadPool, [chunk_objects = MoveTemp(objects)]() mutable { return EncodeChunk(chunk_objects); }));
+			objects.Reset();
+		}
+
+		while (pending.Num() && (all || pending.Num() >= max_pending))
+		{
+			const FEncodedChunk& chunk = pending[0].Get();
+			if (!chunk.ok)
+			{
+				UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Failed to compress a chunk of %i objects"), chunk.num_objects);
+				ok = false;
+			}
+
+			int32 num_objects = chunk.num_objects;
+			int32 raw_size = chunk.raw_size;
+			int32 compressed_size = chunk.data.Num();
+			uint32 crc = chunk.crc;
+			*file << num_objects;
+			*file << raw_size;
+			*file << compressed_size;
+			*file << crc;
+			file->Serialize(const_cast<uint8*>(chunk.data.GetData()), compressed_size);
+			progress.Add(num_objects, compressed_size);
+			total_objects += num_objects;
+			pending.RemoveAt(0);
+		}
+	};
+
+	TArray<KamoRootObject> roots = db.FindRootObjects("");
+	UE_LOG(LogKamo, Display, TEXT("KamoTenantSnapshot: Exporting %i regions from %s to %s"), roots.Num(), *source, *path);
+
+	// Roots first, their objects need them on import
+	for (const auto& root : roots)
+	{
+		objects.Add({ root.id(), FString(), root.state });
+		if (objects.Num() >= chunk_size)
+		{
+			write_chunks(false);
+		}
+	}
+
+	for (const auto& root : roots)
+	{
+		bool streamed = db.FindObjectsStreamed(root.id, "", [&](TArray<KamoChildObject>& children)
+		{
+			for (auto& child : children)
+			{
+				objects.Add({ child.id(), root.id(), MoveTemp(child.state) });
+				if (objects.Num() >= chunk_size)
+				{
+					write_chunks(false);
+				}
+			}
+			return ok;
+		}, chunk_size);
+
+		if (!streamed || !ok)
+		{
+			UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Failed to read the objects of %s"), *root.id());
+			ok = false;
+			break;
+		}
+	}
+
+	write_chunks(true);
+
+	// End marker, catches truncated files
+	int32 end_of_chunks = 0;
+	*file << end_of_chunks;
+	*file << total_objects;
+	*file << magic;
+
+	ok = !file->IsError() && file->Close() && ok;
+	file.Reset();
+
+	if (!ok)
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Export to %s failed"), *path);
+		IFileManager::Get().Delete(*temp_path);
+		return false;
+	}
+
+	if (!IFileManager::Get().Move(*path, *temp_path, true))
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Failed to move snapshot into place: %s"), *path);
+		return false;
+	}
+
+	progress.Report(true);
+	return true;
+}
+
+
+bool FKamoTenantSnapshot::Import(IKamoDB& db, const FString& path, const FKamoTenantSnapshotOptions& options)
+{
+	TUniquePtr<FArchive> file(IFileManager::Get().CreateFileReader(*path));
+	if (!file)
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Can't open %s"), *path);
+		return false;
+	}
+
+	uint32 magic = 0;
+	int32 format_version = 0;
+	FString source;
+	int64 created = 0;
+	*file << magic;
+	*file << format_version;
+	if (file->IsError() || magic != tenant_snapshot_magic || format_version != tenant_snapshot_format_version)
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: %s isn't a tenant snapshot or has an unknown format"), *path);
+		return false;
+	}
+
+	*file << source;
+	*file << created;
+
+	// Objects of both would be mixed up with no way to tell them apart afterwards
+	int32 num_existing = db.FindRootObjects("").Num();
+	if (num_existing > 0 && !options.merge)
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: %s already has %i root objects, not importing. Use -merge to import into it anyways."),
+			*db.GetSessionURL(), num_existing);
+		return false;
+	}
+
+	UE_LOG(LogKamo, Display, TEXT("KamoTenantSnapshot: Importing %s, exported from %s at %s, into %s"),
+		*path, *source, *FDateTime(created).ToString(), *db.GetSessionURL());
+
+	const int32 max_pending = MaxPendingChunks(options);
+	TArray<TFuture<FDecodedChunk>> pending;
+	FProgress progress(TEXT("Imported"));
+	int64 num_read = 0;
+	int64 num_failed = 0;
+	int64 num_skipped = 0;
+	int64 num_queued = 0;
+	TMap<FString, int64> region_objects;  // Child objects queued per region, checked at the end
+	bool ok = true;
+
+	auto import_root = [&](FKamoTenantObject& object)
+	{
+		if (options.clear_handlers)
+		{
+			TSharedPtr<FJsonObject> json_object;
+			TSharedRef<TJsonReader<>> json_reader = TJsonReaderFactory<>::Create(object.state);
+			if (FJsonSerializer::Deserialize(json_reader, json_object) && json_object.IsValid())
+			{
+				if (json_object->HasField("inbox_address"))
+				{
+					num_skipped++;
+					return;
+				}
+
+				json_object->SetField("handler", MakeShared<FJsonValueNull>());
+				object.state.Reset();
+				TSharedRef<TJsonWriter<>> json_writer = TJsonWriterFactory<>::Create(&object.state);
+				FJsonSerializer::Serialize(json_object.ToSharedRef(), json_writer);
+			}
+		}
+
+		KamoID id(object.id);
+		if (!db.AddRootObject(id, object.state, true) && !db.UpdateRootObject(id, object.state))
+		{
+			num_failed++;
+		}
+	};
+
+	// Chunks are decompressed on the thread pool and imported in order. Child objects are queued so
+	// the driver batches them, the queue is drained every so often to keep memory in check.
+	auto import_chunks = [&](bool all)
+	{
+		while (pending.Num() && (all || pending.Num() >= max_pending))
+		{
+			FDecodedChunk chunk = pending[0].Get();
+			pending.RemoveAt(0);
+			if (!chunk.ok)
+			{
+				UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Corrupt chunk in %s"), *path);
+				ok = false;
+				continue;
+			}
+
+			for (auto& object : chunk.objects)
+			{
+				if (object.root_id.IsEmpty())
+				{
+					import_root(object);
+					continue;
+				}
+
+				KamoChildObject child;
+				child.id = KamoID(object.id);
+				child.root_id = KamoID(object.root_id);
+				child.state = MoveTemp(object.state);
+				if (!db.Set(child))
+				{
+					num_failed++;
+					continue;
+				}
+				region_objects.FindOrAdd(object.root_id)++;
+				num_queued++;
+			}
+
+			progress.Add(chunk.objects.Num(), chunk.compressed_size);
+			if (num_queued >= (int64)options.chunk_size * max_pending)
+			{
+				WaitForWrites(db, progress);
+				num_queued = 0;
+			}
+		}
+	};
+
+	for (;;)
+	{
+		int32 num_objects = -1;
+		*file << num_objects;
+		if (file->IsError() || num_objects < 0)
+		{
+			ok = false;
+			break;
+		}
+
+		if (num_objects == 0)
+		{
+			int64 total_objects = -1;
+			uint32 end_magic = 0;
+			*file << total_objects;
+			*file << end_magic;
+			ok = ok && !file->IsError() && end_magic == tenant_snapshot_magic && total_objects == num_read;
+			break;
+		}
+
+		int32 raw_size = 0;
+		int32 compressed_size = 0;
+		uint32 crc = 0;
+		*file << raw_size;
+		*file << compressed_size;
+		*file << crc;
+		if (file->IsError() || raw_size < 0 || compressed_size < 0 || compressed_size > file->TotalSize() - file->Tell())
+		{
+			ok = false;
+			break;
+		}
+
+		TArray<uint8> data;
+		data.SetNumUninitialized(compressed_size);
+		file->Serialize(data.GetData(), compressed_size);
+		num_read += num_objects;
+
+		pending.Add(Async(EAsyncExecution::ThreadPool, [num_objects, raw_size, crc, data = MoveTemp(data)]() { return DecodeChunk(num_objects, raw_size, crc, data); }));
+		import_chunks(false);
+	}
+
+	import_chunks(true);
+	WaitForWrites(db, progress);
+
+	// Queued writes fail on their own, count what made it. A merge may add to regions that already had objects.
+	int32 num_mismatched = 0;
+	for (const auto& region : region_objects)
+	{
+		int64 num_found = 0;
+		bool counted = db.FindObjectsStreamed(KamoID(region.Key), "", [&num_found](TArray<KamoChildObject>& children)
+		{
+			num_found += children.Num();
+			return true;
+		}, options.chunk_size);
+
+		if (!counted || num_found < region.Value || (!options.merge && num_found != region.Value))
+		{
+			UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Region %s has %lld objects after the import, expected %lld"), *region.Key, num_found, region.Value);
+			num_mismatched++;
+		}
+	}
+
+	UE_CLOG(!ok, LogKamo, Error, TEXT("KamoTenantSnapshot: %s is truncated or corrupt, imported what could be read"), *path);
+	UE_CLOG(num_skipped, LogKamo, Display, TEXT("KamoTenantSnapshot: Left out %lld handler objects"), num_skipped);
+	UE_CLOG(num_failed, LogKamo, Error, TEXT("KamoTenantSnapshot: Failed to write %lld objects"), num_failed);
+	UE_CLOG(num_mismatched, LogKamo, Error, TEXT("KamoTenantSnapshot: Object counts of %i of %i regions don't match"), num_mismatched, region_objects.Num());
+	progress.Report(true);
+	return ok && num_failed == 0 && num_mismatched == 0;
+}
@@ -0,0 +1,37 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class IKamoDB;
+
+
+struct FKamoTenantSnapshotOptions
+{
+	int32 chunk_size = 5000;  // Objects per chunk
+	int32 num_threads = 0;  // Chunks compressed or decompressed at once, 0 is one per core
+	bool clear_handlers = false;  // Import: leave out handler objects and the handler references of regions
+	bool merge = false;  // Import: allow importing into a tenant that already has objects, existing objects are overwritten
+};
+
+
+/**
+ * Dump of all objects of a tenant, roots (handlers included) and their child objects, for moving a
+ * tenant between environments or seeding test worlds. Works with any DB driver.
+ *
+ * The file is a header followed by zlib compressed chunks of objects, each with its object count, sizes
+ * and a CRC over those and the data, and an end marker with the total object count. All roots come before any child objects so
+ * the regions exist by the time their objects are imported.
+ *
+ * Chunks are compressed and decompressed on the thread pool while the DB is read or written on the calling
+ * thread. Root objects are written as they come, child objects go through the driver's serialization queue
+ * to get its batched and pipelined writes. As those writes can fail after being queued, the object count of
+ * each region is checked once everything is written.
+ */
+class FKamoTenantSnapshot
+{
+public:
+	static bool Export(IKamoDB& db, const FString& path, const FKamoTenantSnapshotOptions& options);
+	static bool Import(IKamoDB& db, const FString& path, const FKamoTenantSnapshotOptions& options);
+};
@@ -0,0 +1,69 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoTenantSnapshotCommandlet.h"
+#include "KamoTenantSnapshot.h"
+#include "KamoSettings.h"
+#include "Kamo.h"
+#include "KamoDB.h"
+
+#include "Misc/Paths.h"
+
+
+UKamoTenantSnapshotCommandlet::UKamoTenantSnapshotCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+
+	HelpDescription = TEXT("Export a Kamo tenant to a snapshot file or import one.");
+	HelpUsage = TEXT("-run=KamoTenantSnapshot -export=<file> | -import=<file> [-chunk=<objects>] [-threads=<n>] [-clearhandlers] [-merge] [-kamodriver=<driver>] [-kamotenant=<tenant>]");
+}
+
+
+int32 UKamoTenantSnapshotCommandlet::Main(const FString& Params)
+{
+	FString export_path;
+	FString import_path;
+	FParse::Value(*Params, TEXT("export="), export_path);
+	FParse::Value(*Params, TEXT("import="), import_path);
+	if (export_path.IsEmpty() == import_path.IsEmpty())
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Usage: %s"), *HelpUsage);
+		return 1;
+	}
+
+	FKamoTenantSnapshotOptions options;
+	FParse::Value(*Params, TEXT("chunk="), options.chunk_size);
+	FParse::Value(*Params, TEXT("threads="), options.num_threads);
+	options.clear_handlers = FParse::Param(*Params, TEXT("clearhandlers"));
+	options.merge = FParse::Param(*Params, TEXT("merge"));
+
+	FString driver = KamoUtil::get_driver_name();
+	TUniquePtr<IKamoDB> database = IKamoDB::CreateDriver(driver);
+	if (!database)
+	{
+		return 1;
+	}
+
+	database->SetConfig(KamoUtil::get_db_config());
+	if (!database->CreateSession(KamoUtil::get_tenant_name()))
+	{
+		UE_LOG(LogKamo, Error, TEXT("KamoTenantSnapshot: Can't open the '%s' DB of tenant '%s'"), *driver, *KamoUtil::get_tenant_name());
+		return 1;
+	}
+
+	// Relative paths are relative to where the commandlet was started from
+	bool ok;
+	if (!export_path.IsEmpty())
+	{
+		ok = FKamoTenantSnapshot::Export(*database, FPaths::ConvertRelativePathToFull(FPaths::LaunchDir(), export_path), options);
+	}
+	else
+	{
+		ok = FKamoTenantSnapshot::Import(*database, FPaths::ConvertRelativePathToFull(FPaths::LaunchDir(), import_path), options);
+	}
+
+	database->CloseSession();
+	return ok ? 0 : 1;
+}
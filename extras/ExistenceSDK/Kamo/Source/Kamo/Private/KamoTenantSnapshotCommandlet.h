@@ -0,0 +1,25 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "KamoTenantSnapshotCommandlet.generated.h"
+
+/**
+ * Exports a whole tenant to a snapshot file or imports one, see FKamoTenantSnapshot.
+ *
+ * -run=KamoTenantSnapshot -export=<file> | -import=<file> [-chunk=<objects>] [-threads=<n>] [-clearhandlers]
+ *
+ * The DB is picked like for the runtime, with -kamodriver= and -kamotenant= or the project settings.
+ */
+UCLASS()
+class UKamoTenantSnapshotCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UKamoTenantSnapshotCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
@@ -0,0 +1,95 @@
+#include "KamoRt.h"
+#include "Misc/AutomationTest.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace
+{
+	// Sweep 'num_steps' times by 'step' of an interval and check every phase is due exactly once per interval
+	// passed, and always in a bucket the sweep passed.
+	bool TestSweep(FAutomationTestBase& Test, float step, int32 num_steps, int32 num_intervals)
+	{
+		const int32 num_phases = 256;
+		TArray<int32> due_count;
+		due_count.SetNumZeroed(num_phases);
+
+		FKamoSyncTierSweep sweep;
+		int32 num_interval_done = 0;
+		for (int32 n = 0; n < num_steps; n++)
+		{
+			sweep.Advance(step, 1.0f);
+			num_interval_done += sweep.IsIntervalDone() ? 1 : 0;
+
+			int32 first, num;
+			sweep.GetPassedBuckets(first, num);
+
+			for (int32 i = 0; i < num_phases; i++)
+			{
+				float phase = float(i) / num_phases;
+				if (!sweep.IsDue(phase))
+				{
+					continue;
+				}
+
+				due_count[i]++;
+				int32 bucket = FMath::Clamp(int32(phase * FKamoSyncTierSweep::NumBuckets), 0, FKamoSyncTierSweep::NumBuckets - 1);
+				if ((bucket - first + FKamoSyncTierSweep::NumBuckets) % FKamoSyncTierSweep::NumBuckets >= num)
+				{
+					Test.AddError(FString::Printf(TEXT("Step %f: phase %f is due but bucket %i isn't in the %i buckets from %i"), step, phase, bucket, num, first));
+					return false;
+				}
+			}
+		}
+
+		for (int32 i = 0; i < num_phases; i++)
+		{
+			if (due_count[i] != num_intervals)
+			{
+				Test.AddError(FString::Printf(TEXT("Step %f: phase %f was due %i times, expected %i"), step, float(i) / num_phases, due_count[i], num_intervals));
+				return false;
+			}
+		}
+
+		return Test.TestEqual(*FString::Printf(TEXT("Step %f: intervals done"), step), num_interval_done, num_intervals);
+	}
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoSyncTierSweep, "Kamo.SyncTier.Sweep",
+	EAutomationTestFlags::EditorContext | EAutomationTestFlags::ClientContext | EAutomationTestFlags::EngineFilter)
+
+bool FTestKamoSyncTierSweep::RunTest(const FString& Parameters)
+{
+	// Steps that end exactly on the interval and steps that wrap around it
+	TestSweep(*this, 0.125f, 80, 10);
+	TestSweep(*this, 0.1875f, 64, 12);
+	TestSweep(*this, 0.75f, 8, 6);
+
+	// The sweep wraps from 0.875 to 1.125, both ends of the interval are due
+	FKamoSyncTierSweep sweep;
+	sweep.Advance(0.875f, 1.0f);
+	sweep.Advance(0.25f, 1.0f);
+	TestTrue(TEXT("Wrapped: end of interval"), sweep.IsDue(0.9f));
+	TestTrue(TEXT("Wrapped: start of interval"), sweep.IsDue(0.0f) && sweep.IsDue(0.1f));
+	TestFalse(TEXT("Wrapped: past the sweep"), sweep.IsDue(0.125f) || sweep.IsDue(0.5f) || sweep.IsDue(0.8f));
+	TestTrue(TEXT("Wrapped: interval done"), sweep.IsIntervalDone());
+	TestEqual(TEXT("Wrapped: progress"), sweep.progress, 0.125f);
+
+	int32 first, num;
+	sweep.GetPassedBuckets(first, num);
+	TestEqual(TEXT("Wrapped: first bucket"), first, 56);
+	TestEqual(TEXT("Wrapped: buckets"), num, 16);
+
+	// More than a whole interval, or no rate, passes everything
+	sweep.Advance(2.5f, 1.0f);
+	TestTrue(TEXT("Long tick"), sweep.IsDue(0.0f) && sweep.IsDue(0.5f) && sweep.IsDue(0.99f));
+	sweep.GetPassedBuckets(first, num);
+	TestEqual(TEXT("Long tick: buckets"), num, FKamoSyncTierSweep::NumBuckets);
+
+	sweep.Advance(0.01f, 0.0f);
+	TestTrue(TEXT("No rate"), sweep.IsDue(0.3f) && sweep.IsIntervalDone());
+
+	return true;
+}
+
+#endif
@@ -39,6 +39,17 @@ public:
 
 	UKamoRuntime* GetKamoRuntime(UWorld* world);
 
+	// Garbage collection pressure
+	struct FGCStats
+	{
+		int32 num_collections = 0;
+		float last_pause_ms = 0.0f;
+		float max_pause_ms = 0.0f;
+		int32 num_uobjects = 0; // Live UObjects after last collection
+	};
+
+	const FGCStats& GetGCStats() const { return gc_stats; }
+
 private:
 	bool is_initialized;
 	TMap<UWorld*, UKamoRuntime*> runtime_map;
@@ -88,4 +99,6 @@ private:
 #endif
 
 	bool bIsCollectingGarbage = false;
+	double gc_start_seconds = 0.0;
+	FGCStats gc_stats;
 };
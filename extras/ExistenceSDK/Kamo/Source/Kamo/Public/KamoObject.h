@@ -61,6 +61,16 @@ public:
 
 
 
+UENUM(BlueprintType)
+enum class EKamoSyncTier : uint8
+{
+	KST_Normal UMETA(DisplayName = "Normal (mark and sync rate)"),
+	KST_Fast UMETA(DisplayName = "Fast"),
+	KST_Slow UMETA(DisplayName = "Slow"),
+	KST_OnDemand UMETA(DisplayName = "On demand only")
+};
+
+
 USTRUCT(BlueprintType)
 struct FKamoClassMap : public FTableRowBase
 {
@@ -77,6 +87,19 @@ public:
     UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "KamoClassMap")
     bool check_if_dirty;
 
+    /** Current schema version of this class. Older records are upgraded on load, see FKamoSchemaRegistry. */
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "KamoClassMap", meta = (ClampMin = 0))
+    int32 schema_version = 0;
+
+    /** How often objects of this class are checked for changes and written to DB. On demand objects are only
+        written when flagged dirty explicitly or when the runtime flushes everything. */
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "KamoClassMap")
+    EKamoSyncTier sync_tier = EKamoSyncTier::KST_Normal;
+
+    /** Base priority of objects of this class in the DB write queue. Higher is written sooner. */
+    UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "KamoClassMap")
+    int32 serialization_priority = 0;
+
 };
 
 typedef TMap<FString, UKamoObject*> TMapInternalState;
@@ -152,6 +175,9 @@ public:
     UPROPERTY(BlueprintReadOnly)
     FKamoClassMap kamo_class_entry;
 
+    // Offset into the sync tier interval, [0, 1). Spreads mark and sync work evenly over time.
+    float sync_phase = 0.0f;
+
 
 	UObject* GetObject() const { return object; }
 	void SetObject(UObject* InObject);
@@ -169,6 +195,12 @@ public:
 
     void MarkForUpdate();
 
+    // True if the object's KamoDirty property is set, see MarkForUpdate().
+    bool IsFlaggedDirty() const;
+
+    // True if the object needs to be written to or deleted from DB.
+    bool NeedsSerializing() const { return dirty || isNew || deleted; }
+
     KamoObject GetPrimitive() {
         KamoObject obj;
         
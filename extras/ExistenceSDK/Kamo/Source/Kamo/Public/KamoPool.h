@@ -0,0 +1,58 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/GCObject.h"
+
+class UKamoState;
+
+
+/**
+ * Pool for short lived Kamo states.
+ *
+ * Objects are handed out from the pool while a FScope is open and are all returned when the
+ * outermost scope closes. The runtime opens a scope for the duration of its tick so anything
+ * acquired during mark and sync is recycled on the next tick instead of
+ * being left for the garbage collector.
+ *
+ * Acquired objects must not be kept beyond the scope they were acquired in. When no scope is
+ * open, or when called off the game thread, a regular new object is returned.
+ */
+class KAMO_API FKamoObjectPool : public FGCObject
+{
+public:
+	static FKamoObjectPool& Get();
+
+	struct KAMO_API FScope
+	{
+		FScope();
+		~FScope();
+
+	private:
+		int32 states_mark;
+	};
+
+	UKamoState* AcquireState();
+
+	// Stats
+	int32 GetNumPooled() const { return states.Num(); }
+	uint64 GetNumHits() const { return num_hits; }
+	uint64 GetNumMisses() const { return num_misses; }
+
+	// FGCObject
+	virtual void AddReferencedObjects(FReferenceCollector& Collector) override;
+	virtual FString GetReferencerName() const override { return TEXT("FKamoObjectPool"); }
+
+private:
+	static const int32 max_pooled_objects = 4096;
+
+	TArray<UKamoState*> states;
+	int32 states_used = 0;
+	int32 scope_depth = 0;
+
+	uint64 num_hits = 0;
+	uint64 num_misses = 0;
+
+	bool CanPool() const;
+};
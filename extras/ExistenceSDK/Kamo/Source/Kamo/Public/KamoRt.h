@@ -40,6 +40,29 @@ struct FIdentityActor
 };
 
 
+// Each sync tier sweeps through its interval and objects are marked for update when the sweep
+// passes their 'sync_phase'.
+struct FKamoSyncTierSweep
+{
+	float progress = 0.0f; // Fraction of the interval, [0, 1)
+	float from = 0.0f;
+	float to = 0.0f;
+
+	// Ids of the objects in the tier, bucketed by sync phase so a tick only visits the buckets the sweep passed.
+	// Entries of objects that are gone are dropped when visited.
+	static const int32 NumBuckets = 64;
+	TSet<FString> buckets[NumBuckets];
+
+	void Advance(float DeltaTime, float rate);
+	bool IsDue(float phase) const;
+	bool IsIntervalDone() const { return to >= 1.0f; }
+	// Buckets passed by the last Advance(), 'num' buckets from 'first' modulo NumBuckets.
+	void GetPassedBuckets(int32& first, int32& num) const;
+	void Add(const FString& id, float phase);
+	void Reset();
+};
+
+
 /**
  * 
  */
@@ -93,6 +116,12 @@ public:
 	/** Load in a region from DB, registers a handler for it and load all child objects */
     bool LoadAndPossessRegion(const KamoID& root_id);
 
+	// Runtime snapshot for fast restarts, see FKamoSnapshot.
+	FString GetSnapshotContext() const;
+	void WriteSnapshot();
+	bool LoadRegionFromSnapshot(const KamoID& root_id, TArray<KamoChildObject>& objects);
+	TSharedPtr<class FKamoSnapshot> snapshot; // Only valid during Init
+
 	// Runtime processing
 	void TickRuntime();
     
@@ -127,7 +156,9 @@ public:
     
     // DB synch
     void MarkForUpdate();
+    bool MarkForUpdateBySyncTier(float DeltaTime); // Collects objects in 'sync_pending_objects', returns true if a full pass is due.
     void SerializeObjects(bool commit_to_db=false);  // If 'commit_to_db' then the calling thread blocks until all is flushed to DB.
+    void SerializePendingObjects();  // Only the objects in 'sync_pending_objects'.
 
 	// Stuff
 	void FlushStateToActors();
@@ -168,8 +199,12 @@ public:
 	static FString GetCommandLineArgument(const FString& argument, const FString& default_value = FString());
 	TArray<KamoID> GetUE4ServerRegions() const;
 	static UKamoID* GetKamoIDFromString(const FString& kamo_id);	
-	static UKamoState* CreateMessageCommand(const KamoID& kamo_id, const KamoID& root_id, const FString& command, const FString& parameters);
-	static UKamoState* CreateCommandMessagePayload(TArray<UKamoState*> commands);
+	// If 'pooled' the returned state is transient and must not be kept beyond the current tick, see FKamoObjectPool.
+	static UKamoState* CreateMessageCommand(const KamoID& kamo_id, const KamoID& root_id, const FString& command, const FString& parameters, bool pooled=false);
+	static UKamoState* CreateCommandMessagePayload(TArray<UKamoState*> commands, bool pooled=false);
+	// Encoded payload of a "command" message, binary unless 'mq_json_commands' is set. See FKamoCommandCodec.
+	static FString CreateCommandMessagePayload(const TArray<KamoCommand>& commands);
+	static bool GetCommandFromState(UKamoState* command_state, KamoCommand& command);
 	bool SendCommandToObject(const KamoID& id, const FString& command, const FString& parameters);
 	bool SendCommandsToObject(const KamoID& id, TArray<UKamoState*> commands);
 
@@ -180,6 +215,7 @@ public:
 
 	static UDataTable* GetKamoTable();
 	TKamoClassMapEntry GetDefaultKamoClassMapEntry() const;
+	KamoSerializationPolicy GetSerializationPolicy() const;
 	TKamoClassMapEntry GetKamoClassEntryFromActor(AActor* actor) const;
 	FKamoClassMap GetKamoClass(const FString& class_name) const;
 
@@ -255,6 +291,20 @@ public:
 
 
 	// Track how long since certain elements were processed
-	float mark_and_sync_elapsed;
 	float message_queue_flush_elapsed;
+
+	FKamoSyncTierSweep sync_tier_sweeps[3]; // Indexed by EKamoSyncTier, on demand tier has no sweep.
+	TSet<FString> on_demand_objects; // Ids of on demand tier objects, only checked for explicit dirty flags.
+	TSet<UKamoObject*> sync_pending_objects; // Objects that need serializing, collected during a tick.
+
+	// Adds the object to its sync tier, call when it's added to 'internal_state'.
+	void AddToSyncTier(UKamoObject* object);
+
+	// Marks the tier's objects which are due and adds those that need serializing to 'sync_pending_objects'.
+	// Drops entries of objects that are gone.
+	void MarkSyncTierForUpdate(FKamoSyncTierSweep& sweep);
+
+	// Writes 'object' to DB if it's dirty or new, adds it to 'deleted_ids' if it's deleted.
+	void SerializeObject(UKamoObject* object, TArray<KamoID>& deleted_ids);
+	void DeleteObjects(const TArray<KamoID>& deleted_ids);
 };
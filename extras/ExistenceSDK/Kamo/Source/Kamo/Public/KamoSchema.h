@@ -0,0 +1,53 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+class UKamoState;
+
+
+/**
+ * Lazy schema migration for Kamo records.
+ *
+ * Each class entry in the Kamo table declares its current 'schema_version'. The version is stamped
+ * into every record written to the DB. When an older record is loaded, the runtime runs the
+ * registered upgrade steps in order, from the stored version up to the current one, and marks the
+ * object dirty so the upgraded state is written back through the regular serializer.
+ *
+ * Upgrade steps are registered from game code, typically in a module's StartupModule:
+ *
+ *   FKamoSchemaRegistry::Get().RegisterUpgrade(TEXT("ship"), 1, [](UKamoState* state)
+ *   {
+ *       // Version 1 -> 2: 'hp' was renamed to 'health'
+ *       ...
+ *       return true;
+ *   });
+ */
+typedef TFunction<bool(UKamoState* state)> FKamoSchemaUpgradeFunc;
+
+
+class KAMO_API FKamoSchemaRegistry
+{
+public:
+	static FKamoSchemaRegistry& Get();
+
+	// Name of the field in the record which holds the schema version.
+	static const TCHAR* VersionField;
+
+	// Register a step which upgrades a record of 'class_name' from 'from_version' to 'from_version' + 1.
+	void RegisterUpgrade(const FString& class_name, int32 from_version, FKamoSchemaUpgradeFunc upgrade_func);
+	void UnregisterUpgrades(const FString& class_name);
+
+	// Returns the version stamped in 'state'. Records written before versioning was introduced are version 0.
+	static int32 GetStateVersion(UKamoState* state);
+	static void StampStateVersion(UKamoState* state, int32 version);
+
+	// Bring 'state' up to 'target_version'. Returns false if a step is missing or fails, in which
+	// case 'state' may be partially upgraded and must not be used. 'upgraded' is set if any step ran.
+	bool UpgradeState(const FString& class_name, UKamoState* state, int32 target_version, bool& upgraded) const;
+
+private:
+	mutable FCriticalSection mutex;
+	TMap<FString, TMap<int32, FKamoSchemaUpgradeFunc>> upgrades;
+};
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "Engine/DeveloperSettings.h"
+#include "KamoDriver.h"
 
 #include "KamoSettings.generated.h"
 
@@ -12,6 +13,8 @@ class KAMO_API KamoUtil
 public:
 	static FString get_tenant_name();
 	static FString get_driver_name();
+	// DB driver tuning from the project settings
+	static KamoDriverConfig get_db_config();
 	static FString GetCommandLineSwitch(const FString& switch_name);
 };
 
@@ -32,7 +35,7 @@ public:
 	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, meta = (DisplayName = "Kamo Tenant"), Category = "KamoSettings")
 		FString kamo_tenant = "";
 
-	/* If left empty it will default to the -kamodriver value passed in through the command line or if that is not available it defaults to "file" driver.*/
+	/* If left empty it will default to the -kamodriver value passed in through the command line or if that is not available it defaults to "file" driver. Other drivers are "log" and "redis".*/
 	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, meta = (DisplayName = "Kamo Driver"), Category = "KamoSettings")
 	FString kamo_driver = "";
 
@@ -61,6 +64,87 @@ public:
 	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
 		float mark_and_sync_rate = 1.0;
 
+	/** Mark and sync rate of classes in the 'fast' sync tier. The default rate above is used for the 'normal' tier. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		float fast_sync_rate = 0.25;
+
+	/** Mark and sync rate of classes in the 'slow' sync tier */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		float slow_sync_rate = 10.0;
+
+	/** Priority points an object gains per second while waiting in the DB write queue */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		float serialization_aging_rate = 100.0;
+
+	/** Max secs an object waits in the DB write queue before it's written ahead of everything else. 0 disables. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		float serialization_deadline = 30.0;
+
+	/** Max number of connections per DB driver. 0 uses the driver default which depends on the writer count. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 0))
+		int32 db_connection_pool_size = 0;
+
+	/** Number of DB writer threads. Objects are spread over them by region. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 1))
+		int32 db_writer_threads = 4;
+
+	/** Max number of objects a DB writer sends in one round trip, or the file DB writes in one synced batch */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 1))
+		int32 db_write_batch_size = 500;
+
+	/** Max number of bytes a DB writer sends in one round trip, or the file DB writes in one synced batch */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 1))
+		int32 db_write_batch_bytes = 4194304;
+
+	/** Size of the DB driver's client side read cache in MB. 0 disables it. The Redis driver needs keyspace
+	    notifications enabled on the server (notify-keyspace-events 'KA') for the cache to work. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 0))
+		int32 db_read_cache_mb = 0;
+
+	/** Seconds between region lock refreshes. Must be well below the lock timeout. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 0.1))
+		float db_region_lock_refresh_interval = 4.4f;
+
+	/** Seconds until a region lock expires if the server holding it stops refreshing it */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 1))
+		int32 db_region_lock_timeout = 20;
+
+	/** Directory of the local DB write journal. Queued writes are journaled to disk and replayed on the next
+	    start if the server dies before they reach the DB. Empty disables the journal. Journals are named after
+	    the tenant and the server id, see -kamojournalname= to override. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		FString db_journal_directory;
+
+	/** Max milliseconds between journal flushes to disk. Writes are flushed in groups. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 1))
+		int32 db_journal_sync_interval_ms = 10;
+
+	/** Store the objects of the file DB as one JSON file each instead of a packed file per region. Slow, for
+	    debugging. Also enabled with -kamofileloose. Without it, loose object files of a region are moved into
+	    its packed file when the region is opened. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		bool file_db_loose_objects = false;
+
+	/** Let the file DB and message queue batch their file I/O through io_uring on Linux, with many reads and
+	    writes in flight at once. Falls back to blocking I/O if the kernel doesn't allow it. Also enabled
+	    with -kamoiouring. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		bool file_io_uring = false;
+
+	/** Max messages the message queue reads from its inbox at a time. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 1))
+		int32 mq_read_batch_size = 100;
+
+	/** Approximate max number of messages kept in an inbox stream. Older messages are trimmed when a server
+	    doesn't keep up or is gone for good. 0 means no limit. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings", meta = (ClampMin = 0))
+		int32 mq_max_stream_length = 10000;
+
+	/** Send commands between servers as JSON instead of the compact binary envelope. For debugging, servers
+	    understand both. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+		bool mq_json_commands = false;
+
 	/** Message queue flush rate - Will be repurposed once tick groups are in.*/
 	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
 		float message_queue_flush_rate = 0.250;
@@ -77,6 +161,11 @@ public:
 	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
 	bool power_save_only_on_linux = true;
 
+	/** Write a local snapshot of loaded regions on shutdown and use it to speed up the next start.
+	    Only objects that changed in the DB in the meantime are fetched. Requires a DB driver with version stamps. */
+	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
+	bool use_runtime_snapshot = false;
+
 	/** Server heartbeat interval in secs */
 	UPROPERTY(BlueprintReadWrite, Config, EditAnywhere, Category = "KamoSettings")
 	float server_heartbeat_interval = 20.0;
@@ -197,6 +197,10 @@ public:
 
 	void PopulateFromField(UKamoState* Other, const FString& FieldName);
 
+	// Detach from the current json object and start from an empty one. Used when recycling pooled states,
+	// the old json object may still be referenced by states it was embedded into.
+	void ResetState() { localState = MakeShareable(new FJsonObject); }
+
 private:
 	TSharedRef<FJsonObject> localState = MakeShareable(new FJsonObject);
 
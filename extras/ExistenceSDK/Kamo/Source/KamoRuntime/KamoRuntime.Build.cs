@@ -64,5 +64,15 @@ public class KamoRuntime : ModuleRules
         {
 			PublicDefinitions.Add("WITH_REDIS_CLIENT=0");
 		}
+
+		// Optional io_uring backend of the file drivers, falls back to blocking I/O if the kernel doesn't have it.
+		if (Target.Platform == UnrealTargetPlatform.Linux)
+		{
+			PublicDefinitions.Add("WITH_KAMO_IO_URING=1");
+		}
+		else
+		{
+			PublicDefinitions.Add("WITH_KAMO_IO_URING=0");
+		}
 	}
 }
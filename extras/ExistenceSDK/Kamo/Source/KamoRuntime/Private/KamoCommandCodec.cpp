@@ -0,0 +1,365 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoCommandCodec.h"
+#include "KamoTrace.h"
+
+#include "Dom/JsonObject.h"
+#include "Misc/Base64.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Policies/CondensedJsonPrintPolicy.h"
+
+
+static const uint8 envelope_magic[2] = { 'K', 'C' };
+static const uint8 envelope_version = 1;
+
+// Interned command ids, the index + 1 is sent. Only ever append to this list. An envelope only uses the
+// ids known to its version, see num_interned_commands, so receivers of that version can decode it.
+// Commands appended later are sent by name until the envelope version is bumped, which is only safe
+// once every receiver understands the new version.
+static const TCHAR* interned_commands[] = {
+    TEXT("log"),
+    TEXT("load_childobject_from_db"),
+    TEXT("move_object"),
+    TEXT("apply_state"),
+    TEXT("flash"),
+    TEXT("delete_object"),
+    TEXT("flush_to_db"),
+    TEXT("exit_process"),
+};
+
+// Number of interned commands each envelope version knows, indexed by version
+static constexpr int32 num_interned_commands[] = { 0, 8 };
+static_assert(UE_ARRAY_COUNT(num_interned_commands) == envelope_version + 1, "Add the interned command count of the new envelope version");
+static_assert(num_interned_commands[envelope_version] <= UE_ARRAY_COUNT(interned_commands), "Interned command count past the table");
+
+// Command id for commands not in the table, the name follows
+static const uint8 custom_command = 0;
+
+enum ECommandFlags : uint8
+{
+    HasKamoID = 1,
+    HasRegionID = 2,
+    HasParameters = 4,
+};
+
+// Parameter blob types
+enum class EParameterType : uint8
+{
+    Json = 1,
+};
+
+
+namespace
+{
+    void WriteVarint(TArray<uint8>& data, uint32 value)
+    {
+        while (value >= 0x80)
+        {
+            data.Add((uint8)(value | 0x80));
+            value >>= 7;
+        }
+        data.Add((uint8)value);
+    }
+
+    void WriteString(TArray<uint8>& data, const FString& value)
+    {
+        FTCHARToUTF8 utf8(*value);
+        WriteVarint(data, utf8.Length());
+        data.Append((const uint8*)utf8.Get(), utf8.Length());
+    }
+
+    void WriteID(TArray<uint8>& data, const KamoID& id)
+    {
+        WriteString(data, id.class_name);
+        WriteString(data, id.unique_id);
+    }
+
+    struct FEnvelopeReader
+    {
+        const TArray<uint8>& data;
+        int32 offset;
+        bool ok;
+
+        FEnvelopeReader(const TArray<uint8>& _data) : data(_data), offset(0), ok(true) {}
+
+        uint8 ReadByte()
+        {
+            if (offset >= data.Num())
+            {
+                ok = false;
+                return 0;
+            }
+            return data[offset++];
+        }
+
+        uint32 ReadVarint()
+        {
+            uint32 value = 0;
+            for (int32 shift = 0; shift < 35 && ok; shift += 7)
+            {
+                uint8 byte = ReadByte();
+                value |= (uint32)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    return value;
+                }
+            }
+            ok = false;
+            return 0;
+        }
+
+        FString ReadString()
+        {
+            uint32 length = ReadVarint();
+            if (!ok || length > (uint32)(data.Num() - offset))
+            {
+                ok = false;
+                return FString();
+            }
+            FUTF8ToTCHAR tchar((const ANSICHAR*)data.GetData() + offset, length);
+            offset += length;
+            return FString(tchar.Length(), tchar.Get());
+        }
+
+        KamoID ReadID()
+        {
+            KamoID id;
+            id.class_name = ReadString();
+            id.unique_id = ReadString();
+            return id;
+        }
+    };
+}
+
+
+FString FKamoCommandCodec::Encode(const TArray<KamoCommand>& commands, bool json)
+{
+    if (json)
+    {
+        return EncodeJson(commands);
+    }
+
+    TArray<uint8> data;
+    EncodeBinary(commands, data);
+    return FBase64::Encode(data);
+}
+
+
+bool FKamoCommandCodec::Decode(const FString& payload, TArray<KamoCommand>& commands)
+{
+    int32 start = 0;
+    while (start < payload.Len() && FChar::IsWhitespace(payload[start]))
+    {
+        start++;
+    }
+
+    if (start < payload.Len() && payload[start] == TEXT('{'))
+    {
+        return DecodeJson(payload, commands);
+    }
+
+    TArray<uint8> data;
+    if (!FBase64::Decode(payload, data))
+    {
+        return false;
+    }
+    return DecodeBinary(data, commands);
+}
+
+
+void FKamoCommandCodec::EncodeBinary(const TArray<KamoCommand>& commands, TArray<uint8>& data)
+{
+    KAMO_TRACE_SCOPE("CommandCodec.Encode");
+    data.Append(envelope_magic, UE_ARRAY_COUNT(envelope_magic));
+    data.Add(envelope_version);
+    WriteVarint(data, commands.Num());
+
+    for (const KamoCommand& command : commands)
+    {
+        uint8 flags = 0;
+        flags |= command.kamo_id.IsEmpty() ? 0 : HasKamoID;
+        flags |= command.region_id.IsEmpty() ? 0 : HasRegionID;
+        flags |= command.parameters.IsEmpty() ? 0 : HasParameters;
+        data.Add(flags);
+
+        uint8 command_id = custom_command;
+        for (int32 i = 0; i < num_interned_commands[envelope_version]; i++)
+        {
+            if (command.command == interned_commands[i])
+            {
+                command_id = i + 1;
+                break;
+            }
+        }
+        data.Add(command_id);
+        if (command_id == custom_command)
+        {
+            WriteString(data, command.command);
+        }
+
+        if (flags & HasKamoID)
+        {
+            WriteID(data, command.kamo_id);
+        }
+        if (flags & HasRegionID)
+        {
+            WriteID(data, command.region_id);
+        }
+        if (flags & HasParameters)
+        {
+            data.Add((uint8)EParameterType::Json);
+            WriteString(data, command.parameters);
+        }
+    }
+}
+
+
+bool FKamoCommandCodec::DecodeBinary(const TArray<uint8>& data, TArray<KamoCommand>& commands)
+{
+    KAMO_TRACE_SCOPE("CommandCodec.Decode", KamoID(), data.Num());
+    if (data.Num() < 3 || data[0] != envelope_magic[0] || data[1] != envelope_magic[1])
+    {
+        return false;
+    }
+
+    if (data[2] > envelope_version)
+    {
+        UE_LOG(LogKamoStruct, Error, TEXT("FKamoCommandCodec: Command envelope version %i is newer than %i."), data[2], envelope_version);
+        return false;
+    }
+
+    FEnvelopeReader reader(data);
+    reader.offset = 3;
+    uint32 num_commands = reader.ReadVarint();
+    if (!reader.ok || num_commands > (uint32)data.Num())
+    {
+        return false;
+    }
+
+    commands.Reserve(commands.Num() + num_commands);
+    for (uint32 i = 0; i < num_commands && reader.ok; i++)
+    {
+        KamoCommand& command = commands.AddDefaulted_GetRef();
+        uint8 flags = reader.ReadByte();
+        uint8 command_id = reader.ReadByte();
+        if (command_id == custom_command)
+        {
+            command.command = reader.ReadString();
+        }
+        else if (command_id <= num_interned_commands[data[2]])
+        {
+            command.command = interned_commands[command_id - 1];
+        }
+        else
+        {
+            UE_LOG(LogKamoStruct, Error, TEXT("FKamoCommandCodec: Unknown command id %i in a version %i envelope."), command_id, data[2]);
+            return false;
+        }
+
+        if (flags & HasKamoID)
+        {
+            command.kamo_id = reader.ReadID();
+        }
+        if (flags & HasRegionID)
+        {
+            command.region_id = reader.ReadID();
+        }
+        if (flags & HasParameters)
+        {
+            uint8 type = reader.ReadByte();
+            if (type != (uint8)EParameterType::Json)
+            {
+                UE_LOG(LogKamoStruct, Error, TEXT("FKamoCommandCodec: Unknown parameter type %i in command '%s'."), type, *command.command);
+                return false;
+            }
+            command.parameters = reader.ReadString();
+        }
+    }
+
+    return reader.ok;
+}
+
+
+FString FKamoCommandCodec::EncodeJson(const TArray<KamoCommand>& commands)
+{
+    TArray<TSharedPtr<FJsonValue>> command_values;
+    for (const KamoCommand& command : commands)
+    {
+        TSharedPtr<FJsonObject> command_object = MakeShared<FJsonObject>();
+        command_object->SetStringField(TEXT("command"), command.command);
+        if (!command.kamo_id.IsEmpty())
+        {
+            command_object->SetStringField(TEXT("kamo_id"), command.kamo_id());
+        }
+        if (!command.region_id.IsEmpty())
+        {
+            command_object->SetStringField(TEXT("region_id"), command.region_id());
+        }
+
+        TSharedPtr<FJsonObject> parameters;
+        TSharedRef<TJsonReader<>> reader = TJsonReaderFactory<>::Create(command.parameters);
+        if (command.parameters.IsEmpty() || !FJsonSerializer::Deserialize(reader, parameters) || !parameters.IsValid())
+        {
+            parameters = MakeShared<FJsonObject>();
+        }
+        command_object->SetObjectField(TEXT("parameters"), parameters);
+        command_values.Add(MakeShared<FJsonValueObject>(command_object));
+    }
+
+    TSharedPtr<FJsonObject> payload = MakeShared<FJsonObject>();
+    payload->SetArrayField(TEXT("commands"), command_values);
+
+    FString json;
+    TSharedRef<TJsonWriter<>> writer = TJsonWriterFactory<>::Create(&json);
+    FJsonSerializer::Serialize(payload.ToSharedRef(), writer);
+    return json;
+}
+
+
+bool FKamoCommandCodec::DecodeJson(const FString& payload, TArray<KamoCommand>& commands)
+{
+    TSharedPtr<FJsonObject> json;
+    TSharedRef<TJsonReader<>> reader = TJsonReaderFactory<>::Create(payload);
+    if (!FJsonSerializer::Deserialize(reader, json) || !json.IsValid())
+    {
+        return false;
+    }
+
+    const TArray<TSharedPtr<FJsonValue>>* command_values;
+    if (!json->TryGetArrayField(TEXT("commands"), command_values))
+    {
+        return false;
+    }
+
+    for (const TSharedPtr<FJsonValue>& value : *command_values)
+    {
+        const TSharedPtr<FJsonObject>* command_object;
+        if (!value->TryGetObject(command_object))
+        {
+            continue;
+        }
+
+        KamoCommand& command = commands.AddDefaulted_GetRef();
+        (*command_object)->TryGetStringField(TEXT("command"), command.command);
+
+        FString id;
+        if ((*command_object)->TryGetStringField(TEXT("kamo_id"), id))
+        {
+            command.kamo_id = KamoID(id);
+        }
+        if ((*command_object)->TryGetStringField(TEXT("region_id"), id))
+        {
+            command.region_id = KamoID(id);
+        }
+
+        const TSharedPtr<FJsonObject>* parameters;
+        if ((*command_object)->TryGetObjectField(TEXT("parameters"), parameters))
+        {
+            TSharedRef<TJsonWriter<TCHAR, TCondensedJsonPrintPolicy<TCHAR>>> writer = TJsonWriterFactory<TCHAR, TCondensedJsonPrintPolicy<TCHAR>>::Create(&command.parameters);
+            FJsonSerializer::Serialize(parameters->ToSharedRef(), writer);
+        }
+    }
+
+    return true;
+}
@@ -2,6 +2,7 @@
 
 #include "KamoFileDB.h"
 #include "KamoFileMQ.h"
+#include "KamoLogDB.h"
 #include "KamoRedisDB.h"
 #include "KamoRedisMQ.h"
 
@@ -49,6 +50,10 @@ TUniquePtr<IKamoDB> IKamoDB::CreateDriver(const FString& name)
 	{
 		return CreateAndInitialize<KamoFileDB>(name, is_url);
 	}
+	else if (driver_name == "log")
+	{
+		return CreateAndInitialize<KamoLogDB>(name, is_url);
+	}
 #if WITH_REDIS_CLIENT
 	else if (driver_name == "redis")
 	{
@@ -69,7 +74,8 @@ TUniquePtr<IKamoMQ> IKamoMQ::CreateDriver(const FString& name)
 	bool is_url;
 	FString driver_name = GetDriverName(name, is_url);
 
-	if (driver_name == "file")
+	// The log DB has no MQ of its own, it goes with the file MQ
+	if (driver_name == "file" || driver_name == "log")
 	{
 		mq = CreateAndInitialize<KamoFileMQ>(name, is_url);
 	}
@@ -4,14 +4,31 @@
 #include "KamoFileDB.h"
 #include "KamoRuntimeModule.h"
 #include "KamoFileHelper.h"
+#include "KamoTrace.h"
 
 #include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+#if PLATFORM_LINUX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
 
 
 DECLARE_CYCLE_STAT(TEXT("SaveToFile"), STAT_SaveToFile, STATGROUP_Kamo);
 
+static const int32 default_write_batch_size = 500;
+static const int32 default_write_batch_bytes = 4 * 1024 * 1024;
+
 
-KamoFileDB::KamoFileDB()
+KamoFileDB::KamoFileDB() :
+    loose_objects(false),
+    inotify_fd(-1),
+    write_batch_size(default_write_batch_size),
+    write_batch_bytes(default_write_batch_bytes),
+    sync_writes(true)
 {
     serializer.GetTask().file_db = this;
 }
@@ -19,6 +36,33 @@ KamoFileDB::KamoFileDB()
 KamoFileDB::~KamoFileDB()
 {
     serializer.EnsureCompletion(true);
+    StopWatch();
+}
+
+
+bool KamoFileDB::OnSessionCreated()
+{
+    if (!KamoFileDriver::OnSessionCreated())
+    {
+        return false;
+    }
+
+    loose_objects = config.loose_objects || FParse::Param(FCommandLine::Get(), TEXT("kamofileloose"));
+    UE_CLOG(loose_objects, LogKamoRuntime, Display, TEXT("KamoFileDB: Storing objects as loose files."));
+
+    // Can be overridden with -kamofilebatch=, -kamofilebatchbytes= and -kamofilenosync
+    write_batch_size = config.write_batch_size > 0 ? config.write_batch_size : default_write_batch_size;
+    write_batch_bytes = config.write_batch_bytes > 0 ? config.write_batch_bytes : default_write_batch_bytes;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamofilebatch="), write_batch_size);
+    FParse::Value(FCommandLine::Get(), TEXT("-kamofilebatchbytes="), write_batch_bytes);
+    write_batch_size = FMath::Max(write_batch_size, 1);
+    sync_writes = !FParse::Param(FCommandLine::Get(), TEXT("kamofilenosync"));
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoFileDB: Writing in batches of %i objects or %i bytes%s."), write_batch_size, write_batch_bytes,
+        sync_writes ? TEXT(", synced") : TEXT(""));
+    io_uring = CreateIoUring();
+
+    BuildIndex();
+    return true;
 }
 
 
@@ -33,6 +77,8 @@ void KamoFileDB::CloseSession()
     {
         SetHandler(KamoID(Region), KamoID());
     }
+
+    StopWatch();
 }
 
 // Root objects
@@ -55,6 +101,11 @@ bool KamoFileDB::AddRootObject(const KamoID& id, const FString& state, bool igno
         UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB::AddRootObject. CreateDirectory failed for: %s"), *root_path);
         return false;
     }
+
+    {
+        FScopeLock lock(&packs_mutex);
+        IndexRegion(id());
+    }
     
     return FKamoFileHelper::AtomicSaveStringToFile(*state, *file_path);
 }
@@ -67,6 +118,13 @@ bool KamoFileDB::DeleteRootObject(const KamoID& id) {
 	if (!PlatformFile.DirectoryExists(*root_path)) {
 		return false;
 	}
+
+    {
+        // Let go of the mapping before the file goes
+        FScopeLock lock(&packs_mutex);
+        packs.Remove(id());
+        UnindexRegion(id());
+    }
     
     return PlatformFile.DeleteDirectoryRecursively(*root_path);
 }
@@ -232,13 +290,40 @@ bool KamoFileDB::AddObject(const KamoID& root_id, const KamoID& id, const FStrin
 		UE_LOG(LogKamoRuntime, Error, TEXT("FAILED TO ADD CHILD OBJECT - ROOT DIRECTORY NOT FOUND: '%s'"), *root_path);
         return false;
     }
-    
-    return FKamoFileHelper::AtomicSaveStringToFile(*state, *file_path);
+
+    if (!loose_objects)
+    {
+        return WritePacked(root_id, id, state);
+    }
+
+    if (!FKamoFileHelper::AtomicSaveStringToFile(*state, *file_path))
+    {
+        return false;
+    }
+
+    FScopeLock lock(&packs_mutex);
+    IndexObject(id(), root_id());
+    return true;
 }
 
 bool KamoFileDB::DeleteObject(const KamoID& id){
     IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
     IFileManager& FileManager = IFileManager::Get();
+
+    if (!loose_objects)
+    {
+        KamoID root_id;
+        {
+            FScopeLock lock(&packs_mutex);
+            FindPack(id, root_id);
+        }
+        if (root_id.IsEmpty())
+        {
+            UE_LOG(LogKamoRuntime, Error, TEXT("FAILED TO DELETE CHILD OBJECT - NOT FOUND"));
+            return false;
+        }
+        return WritePacked(root_id, id, TOptional<FString>());
+    }
     
     auto file_path = GetObjectPath(id);
     
@@ -246,7 +331,9 @@ bool KamoFileDB::DeleteObject(const KamoID& id){
 		UE_LOG(LogKamoRuntime, Error, TEXT("FAILED TO DELETE CHILD OBJECT - NOT FOUND"));
         return false;
     }
-    
+
+    FScopeLock lock(&packs_mutex);
+    UnindexObject(id(), FPaths::GetCleanFilename(FPaths::GetPath(file_path)));
     return PlatformFile.DeleteFile(*file_path);
 }
 
@@ -254,6 +341,22 @@ bool KamoFileDB::DeleteObject(const KamoID& id){
 bool KamoFileDB::UpdateObject(const KamoID& id, const FString& state) 
 {
 	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+
+	if (!loose_objects)
+	{
+		KamoID root_id;
+		{
+			FScopeLock lock(&packs_mutex);
+			FindPack(id, root_id);
+		}
+		if (root_id.IsEmpty())
+		{
+			UE_LOG(LogKamoRuntime, Error, TEXT("FAILED TO UPDATE CHILD OBJECT - NOT FOUND"));
+			return false;
+		}
+		return WritePacked(root_id, id, state);
+	}
+
 	auto file_path = GetObjectPath(id);
 
 	if (file_path == "")
@@ -270,6 +373,21 @@ KamoChildObject KamoFileDB::GetObject(const KamoID& id, bool fail_silently)  con
 	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
     
     KamoChildObject object;
+
+    if (!loose_objects)
+    {
+        FScopeLock lock(&packs_mutex);
+        KamoID root_id;
+        FKamoRegionPack* pack = FindPack(id, root_id);
+        if (!pack || !pack->Get(id(), object.state))
+        {
+            UE_CLOG(!fail_silently, LogKamoRuntime, Error, TEXT("KamoFileDB::GetObject: Not found: %s"), *id());
+            return object;
+        }
+        object.id = id;
+        object.root_id = root_id;
+        return object;
+    }
     
     auto file_path = GetObjectPath(id);
     
@@ -295,9 +413,63 @@ KamoChildObject KamoFileDB::GetObject(const KamoID& id, bool fail_silently)  con
 
 TArray<KamoChildObject> KamoFileDB::FindObjects(const KamoID& root_id, const FString& class_name) const
 {
+    KAMO_TRACE_SCOPE("FileDB.FindObjects", root_id);
     IFileManager& FileManager = IFileManager::Get();
     
     TArray<KamoChildObject> objects;
+
+    if (!loose_objects)
+    {
+        FScopeLock lock(&packs_mutex);
+        if (!root_id.IsEmpty())
+        {
+            FKamoRegionPack* pack = GetPack(root_id);
+            TArray<FString> ids;
+            if (pack)
+            {
+                pack->GetIDs(ids);
+            }
+
+            objects.Reserve(ids.Num());
+            for (const FString& id : ids)
+            {
+                KamoChildObject& object = objects.AddDefaulted_GetRef();
+                object.id = KamoID(id);
+                object.root_id = root_id;
+                if (!pack->Get(id, object.state))
+                {
+                    // Callers can't tell a partial result from a complete one
+                    UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB::FindObjects: Can't read %s in %s, returning none."), *id, *root_id());
+                    objects.Reset();
+                    return objects;
+                }
+            }
+        }
+        else if (class_name != "")
+        {
+            if (!UpdateIndex())
+            {
+                RescanIndex();
+            }
+
+            const TSet<FString>* ids = class_objects.Find(class_name);
+            TArray<FString> class_ids = ids ? ids->Array() : TArray<FString>();
+            objects.Reserve(class_ids.Num());
+            for (const FString& id : class_ids)
+            {
+                const FString* root_name = object_roots.Find(id);
+                FKamoRegionPack* pack = root_name ? GetPack(KamoID(*root_name)) : nullptr;
+                KamoChildObject object;
+                if (pack && pack->Get(id, object.state))
+                {
+                    object.id = KamoID(id);
+                    object.root_id = KamoID(*root_name);
+                    objects.Add(MoveTemp(object));
+                }
+            }
+        }
+        return objects;
+    }
     
     FString ext = ".json";
     
@@ -307,40 +479,47 @@ TArray<KamoChildObject> KamoFileDB::FindObjects(const KamoID& root_id, const FSt
 
 		FileManager.FindFiles(object_names, *path, *ext);
         
-        for (auto object_name : object_names) {
-			if (object_name == "_this.json") {
-				continue;
-			}
-
-			auto id = KamoID(object_name.Replace(TEXT(".json"), TEXT("")));
-            
-            auto object = GetObject(id);
+        object_names.Remove(TEXT("_this.json"));
+        
+        TArray<FString> file_paths;
+        for (const FString& object_name : object_names) {
+            file_paths.Add(path / object_name);
+        }
+        
+        TArray<FString> states;
+        TArray<bool> loaded;
+        LoadFiles(file_paths, states, loaded);
+        
+        for (int32 i = 0; i < object_names.Num(); i++) {
+            if (!loaded[i]) {
+                continue;
+            }
             
+            KamoChildObject object;
+            object.id = KamoID(FPaths::GetBaseFilename(object_names[i]));
+            object.root_id = root_id;
+            object.state = MoveTemp(states[i]);
             objects.Add(object);
         }
     }
     else if (class_name != "") {
-		auto path = session_path + "/*";
-
-        TArray<FString> root_names;
-        FileManager.FindFiles(root_names, *path, false, true);
+        TArray<FString> class_ids;
+        {
+            FScopeLock lock(&packs_mutex);
+            if (!UpdateIndex())
+            {
+                RescanIndex();
+            }
+            if (const TSet<FString>* ids = class_objects.Find(class_name))
+            {
+                class_ids = ids->Array();
+            }
+        }
         
-        for (auto root_name : root_names) {
-            TArray<FString> object_names;
-            
-            path = session_path + "/" + root_name;
+        for (const FString& id : class_ids) {
+            auto object = GetObject(KamoID(id), true);
             
-			FileManager.FindFiles(object_names, *path, *ext);
-            
-            for (auto object_name : object_names) {
-                auto id = KamoID(object_name);
-                
-                if (id.class_name != class_name) {
-                    continue;
-                }
-                
-                auto object = GetObject(id);
-                
+            if (!object.id.IsEmpty()) {
                 objects.Add(object);
             }
         }
@@ -351,10 +530,22 @@ TArray<KamoChildObject> KamoFileDB::FindObjects(const KamoID& root_id, const FSt
 
 bool KamoFileDB::MoveObject(const KamoID& id, const KamoID& root_id) {
     IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+
+    KamoID current_root_id;
+    FString state;
+    if (!loose_objects)
+    {
+        FScopeLock lock(&packs_mutex);
+        FKamoRegionPack* pack = FindPack(id, current_root_id);
+        if (!pack || !pack->Get(id(), state))
+        {
+            return false;
+        }
+    }
     
-    auto current_path = GetObjectPath(id);
+    auto current_path = loose_objects ? GetObjectPath(id) : FString();
     
-    if (current_path == "") {
+    if (loose_objects && current_path == "") {
         return false;
     }
     
@@ -367,9 +558,23 @@ bool KamoFileDB::MoveObject(const KamoID& id, const KamoID& root_id) {
             return false;
         }
     }
+
+    if (!loose_objects)
+    {
+        // Add to the target first so a failure halfway leaves a copy rather than nothing
+        return current_root_id == root_id || (WritePacked(root_id, id, state) && WritePacked(current_root_id, id, TOptional<FString>()));
+    }
+
     auto new_path = GetFilePath(root_id, id);
     
-    return PlatformFile.MoveFile(*new_path, *current_path);
+    if (!PlatformFile.MoveFile(*new_path, *current_path))
+    {
+        return false;
+    }
+
+    FScopeLock lock(&packs_mutex);
+    IndexObject(id(), root_id());
+    return true;
 }
 
 // Handler
@@ -473,68 +678,189 @@ bool KamoFileDB::Set(const KamoRootObject& object) {
 
 void KamoFileDB::DoWork()
 {
-    // While there are objects to be serialized, pop one from the map that has the highest priority
+    // While there are objects to be serialized, take a batch of the ones with the highest priority
+    // and write them out together.
+    TArray<FKamoSerializationQueue::Record> batch;
     for (;;)
     {
-        SerializationRecord object;
-        object.priority = -1;
+        batch.Reset();
         {
             FScopeLock lock(&mutex);
-            if (objects_for_serialization.Num() == 0)
+            objects_for_serialization.PopBatch(write_batch_size, write_batch_bytes, batch);
+        }
+
+        if (batch.Num() == 0)
+        {
+            return;
+        }
+
+        WriteBatch(batch);
+
+        // Always consider the objects written even though they failed to write out because we might
+        // be in an unrecoverable state with the file writing and thus erroring infinitely.
+        {
+            FScopeLock lock(&mutex);
+            for (const auto& object : batch)
+            {
+                objects_for_serialization.Complete(object);
+            }
+        }
+    }
+}
+
+
+void KamoFileDB::WriteBatch(const TArray<FKamoSerializationQueue::Record>& batch)
+{
+    KAMO_TRACE_SCOPE("FileDB.WriteBatch", KamoID(), batch.Num());
+
+    TMap<FString, TArray<int32>> regions;
+    for (int32 i = 0; i < batch.Num(); i++)
+    {
+        regions.FindOrAdd(batch[i].root_id()).Add(i);
+    }
+
+    // Synced together at the end
+    TArray<FString> sync_paths;
+
+    for (const auto& region : regions)
+    {
+        KamoID root_id(region.Key);
+        if (!RootExists(root_id))
+        {
+            UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB::SerializerWorker - Root object not found: '%s'"), *GetRootFilePath(root_id));
+            continue;
+        }
+
+        auto root_path = session_path + "/" + region.Key;
+        if (!loose_objects)
+        {
+            // One append for the region. The pack is synced outside the lock, lookups don't wait for the disk.
+            TArray<FKamoRegionPack::FWrite> writes;
+            writes.Reserve(region.Value.Num());
+            for (int32 i : region.Value)
             {
-                return;
+                writes.Add({ batch[i].id(), batch[i].state });
             }
 
-            for (auto it = objects_for_serialization.CreateIterator(); it; ++it)
             {
-                if (it.Value().priority >= object.priority)
+                FScopeLock lock(&packs_mutex);
+                FKamoRegionPack* pack = GetPack(root_id);
+                if (!pack || !pack->Append(writes))
                 {
-                    object = it.Value();
+                    UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB:SerializerWorker - Failed to write %i objects to '%s'"), writes.Num(), *root_path);
+                    continue;
+                }
+
+                for (const FKamoRegionPack::FWrite& write : writes)
+                {
+                    IndexObject(write.id, region.Key);
                 }
             }
-        }
 
-        // write out 'next'
-        IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
-        auto root_file_path = GetRootFilePath(object.root_id);
-        if (!PlatformFile.FileExists(*root_file_path))
-        {
-            UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB::SerializerWorker - Root object not found: '%s'"), *root_file_path);
+            sync_paths.Add(FKamoRegionPack::PackFilename(root_path));
         }
         else
         {
-            auto file_path = GetFilePath(object.root_id, object.id);
-            if (!FKamoFileHelper::AtomicSaveStringToFile(*object.state, *file_path))
+            // All files of the region at once if there's io_uring, what it fails goes through the helper
+            TArray<FString> file_paths;
+            TArray<FString> states;
+            for (int32 i : region.Value)
             {
-                UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB:SerializerWorker - Failed to write file: '%s'"), *file_path);
+                file_paths.Add(GetFilePath(batch[i].root_id, batch[i].id));
+                states.Add(batch[i].state);
+            }
+
+            TArray<bool> written;
+            if (io_uring)
+            {
+                io_uring->WriteFiles(file_paths, states, sync_writes, written);
+            }
+            else
+            {
+                written.Init(false, file_paths.Num());
+            }
+
+            for (int32 j = 0; j < region.Value.Num(); j++)
+            {
+                const FKamoSerializationQueue::Record& object = batch[region.Value[j]];
+                if (!written[j] && !FKamoFileHelper::AtomicSaveStringToFile(*object.state, *file_paths[j], sync_writes))
+                {
+                    UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB:SerializerWorker - Failed to write file: '%s'"), *file_paths[j]);
+                }
+                else
+                {
+                    FScopeLock lock(&packs_mutex);
+                    IndexObject(object.id(), object.root_id());
+                }
             }
         }
 
-        // Always remove the object from the queue even though it failed to write out because we might
-        // be in an unrecoverable state with the file writing and thus erroring infinitely.
+        // New files and renames are only durable once the directory is
+        sync_paths.Add(root_path);
+    }
+
+    if (sync_writes && sync_paths.Num() && !(io_uring && io_uring->SyncFiles(sync_paths)))
+    {
+        for (const FString& path : sync_paths)
         {
-            FScopeLock lock(&mutex);
-            objects_for_serialization.Remove(object.id());
+            FKamoFileHelper::Sync(*path);
         }
     }
 }
 
 
-bool KamoFileDB::Set(const KamoChildObject& object)
+void KamoFileDB::LoadFiles(const TArray<FString>& paths, TArray<FString>& contents, TArray<bool>& ok) const
 {
-    SerializationRecord rec = { object.id, object.root_id, object.state, 0 };
-    
+    contents.SetNum(paths.Num());
+    ok.Init(false, paths.Num());
+
+    TArray<TArray<uint8>> data;
+    if (io_uring)
     {
-        FScopeLock lock(&mutex);
-        if (objects_for_serialization.Contains(object.id()))
+        io_uring->ReadFiles(paths, data, ok);
+    }
+
+    for (int32 i = 0; i < paths.Num(); i++)
+    {
+        if (ok[i])
+        {
+            FFileHelper::BufferToString(contents[i], data[i].GetData(), data[i].Num());
+        }
+        else
         {
-            // Bump priority by one.
-            // TODO: Have class based priority jumps, i.e. important stuff gets bumped by 10 while
-            // insignificant stuff gets bumped by less.
-            // TODO: Add max. age priority as well to prevent starvation.
-            rec.priority = objects_for_serialization[object.id()].priority + 1;
+            // Locked by a writer, or no io_uring
+            ok[i] = FKamoFileHelper::AtomicLoadFileToString(contents[i], *paths[i]);
         }
-        objects_for_serialization.Add(object.id(), rec);
+    }
+}
+
+
+bool KamoFileDB::RootExists(const KamoID& root_id) const
+{
+    {
+        FScopeLock lock(&packs_mutex);
+        if (existing_roots.Contains(root_id()))
+        {
+            return true;
+        }
+    }
+
+    if (!FPlatformFileManager::Get().GetPlatformFile().FileExists(*GetRootFilePath(root_id)))
+    {
+        return false;
+    }
+
+    FScopeLock lock(&packs_mutex);
+    existing_roots.Add(root_id());
+    return true;
+}
+
+
+bool KamoFileDB::Set(const KamoChildObject& object)
+{
+    {
+        FScopeLock lock(&mutex);
+        objects_for_serialization.Push(object.id, object.root_id, object.state);
     }
 
     if (serializer.IsDone())
@@ -562,8 +888,17 @@ bool KamoFileDB::Delete(const KamoID& id) {
 
 bool KamoFileDB::DeleteChildObject(const KamoID& root_id, const KamoID& id)
 {
+    if (!loose_objects)
+    {
+        return WritePacked(root_id, id, TOptional<FString>());
+    }
+
     auto file_path = GetFilePath(root_id, id);
     IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+    {
+        FScopeLock lock(&packs_mutex);
+        UnindexObject(id(), root_id());
+    }
     return PlatformFile.DeleteFile(*file_path);
 }
 
@@ -616,18 +951,13 @@ bool KamoFileDB::IsSerializationPending(const KamoID& id, bool bump_priority)
     if (id.IsEmpty())
     {
         // See if any object is pending serialization
-        return objects_for_serialization.Num() > 0;
+        return !objects_for_serialization.IsEmpty();
     }
     else if (objects_for_serialization.Contains(id()))
     {
         if (bump_priority)
         {
-            SerializationRecord& rec = objects_for_serialization[id()];
-            if (rec.priority < 1000000000)
-            {
-                // TODO: Class based bumpness
-                rec.priority += 1000;
-            }
+            objects_for_serialization.Bump(id());
         }
         return true;
     }
@@ -638,7 +968,14 @@ bool KamoFileDB::IsSerializationPending(const KamoID& id, bool bump_priority)
 bool KamoFileDB::CancelIfPending(const KamoID& id)
 {
     FScopeLock lock(&mutex);
-    return objects_for_serialization.Remove(id()) > 0;
+    return objects_for_serialization.Remove(id());
+}
+
+
+void KamoFileDB::SetSerializationPolicy(const KamoSerializationPolicy& policy)
+{
+    FScopeLock lock(&mutex);
+    objects_for_serialization.SetPolicy(policy);
 }
 
 
@@ -651,26 +988,518 @@ FString KamoFileDB::GetFilePath(const KamoID& root_id, const KamoID& kamo_id) co
 }
 
 FString KamoFileDB::GetObjectPath(const KamoID& id) const {
+    FScopeLock lock(&packs_mutex);
+    FString root_name;
+    
+    if (!LookupRoot(id, root_name)) {
+        return "";
+    }
+    
+    return GetFilePath(KamoID(root_name), id);
+}
+
+FKamoRegionPack* KamoFileDB::GetPack(const KamoID& root_id) const
+{
+    auto root_path = session_path + "/" + root_id();
+    TUniquePtr<FKamoRegionPack>* existing = packs.Find(root_id());
+    if (existing)
+    {
+        if ((*existing)->Refresh())
+        {
+            return existing->Get();
+        }
+
+        // Region deleted by someone else
+        packs.Remove(root_id());
+        return nullptr;
+    }
+
     IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+    if (!PlatformFile.DirectoryExists(*root_path))
+    {
+        return nullptr;
+    }
+
+    TUniquePtr<FKamoRegionPack> pack = MakeUnique<FKamoRegionPack>(root_path);
+    if (!pack->Refresh())
+    {
+        return nullptr;
+    }
+    if (!ImportLooseObjects(*pack, root_path))
+    {
+        return nullptr;
+    }
+    return packs.Add(root_id(), MoveTemp(pack)).Get();
+}
+
+FKamoRegionPack* KamoFileDB::FindPack(const KamoID& id, KamoID& root_id) const
+{
+    FString root_name;
+    if (!LookupRoot(id, root_name))
+    {
+        return nullptr;
+    }
+
+    root_id = KamoID(root_name);
+    return GetPack(root_id);
+}
+
+bool KamoFileDB::ImportLooseObjects(FKamoRegionPack& pack, const FString& root_path) const
+{
+    // Objects written with -kamofileloose, or by a version without packs. Ignoring them would hide the
+    // objects and later writes would fork from them, so they're moved into the pack when the region is
+    // first opened. The pack is synced before the files are deleted, a region the move fails for is
+    // refused rather than served without them.
     IFileManager& FileManager = IFileManager::Get();
+    TArray<FString> object_names;
+    FileManager.FindFiles(object_names, *root_path, TEXT(".json"));
+    object_names.Remove(TEXT("_this.json"));
+    if (object_names.Num() == 0)
+    {
+        return true;
+    }
 
-	auto path = session_path + "/*";
-    
-    TArray<FString> output;
-    
-    FileManager.FindFiles(output, *path, false, true);
-    
-    for (auto root_object : output) {
-        auto root_id = KamoID(root_object);
-        
-        auto file_path = GetFilePath(root_id, id);
-        
-        if (PlatformFile.FileExists(*file_path)) {
-            return file_path;
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoFileDB: Moving %i loose object files in %s into the region pack. Run with -kamofileloose to keep using them as they are."),
+        object_names.Num(), *root_path);
+
+    TArray<FString> file_paths;
+    for (const FString& object_name : object_names)
+    {
+        file_paths.Add(root_path / object_name);
+    }
+
+    TArray<FString> states;
+    TArray<bool> loaded;
+    LoadFiles(file_paths, states, loaded);
+
+    TArray<FKamoRegionPack::FWrite> writes;
+    for (int32 i = 0; i < object_names.Num(); i++)
+    {
+        if (loaded[i])
+        {
+            writes.Add({ FPaths::GetBaseFilename(object_names[i]), MoveTemp(states[i]) });
         }
     }
-    
-    return "";
+
+    // Synced so the objects can't be lost with the files
+    if (!pack.Append(writes, true))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB: Failed to pack the loose objects in %s"), *root_path);
+        return false;
+    }
+
+    for (int32 i = 0; i < object_names.Num(); i++)
+    {
+        if (loaded[i])
+        {
+            FileManager.Delete(*(root_path / object_names[i]));
+        }
+    }
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoFileDB: Packed %i loose objects in %s"), writes.Num(), *root_path);
+    UE_CLOG(writes.Num() < object_names.Num(), LogKamoRuntime, Error, TEXT("KamoFileDB: %i loose object files in %s can't be read, the region is refused until they're fixed or removed."),
+        object_names.Num() - writes.Num(), *root_path);
+    return writes.Num() == object_names.Num();
+}
+
+bool KamoFileDB::WritePacked(const KamoID& root_id, const KamoID& id, const TOptional<FString>& state)
+{
+    FScopeLock lock(&packs_mutex);
+    FKamoRegionPack* pack = GetPack(root_id);
+    if (!pack)
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoFileDB: Region not found: '%s'"), *root_id());
+        return false;
+    }
+
+    if (!state.IsSet() && !pack->Contains(id()))
+    {
+        return false;
+    }
+
+    if (!pack->Append({ { id(), state } }))
+    {
+        return false;
+    }
+
+    if (state.IsSet())
+    {
+        IndexObject(id(), root_id());
+    }
+    else
+    {
+        UnindexObject(id(), root_id());
+    }
+    return true;
+}
+
+// Object index
+
+void KamoFileDB::BuildIndex()
+{
+    KAMO_TRACE_SCOPE("FileDB.BuildIndex");
+    FScopeLock lock(&packs_mutex);
+
+    // Watch first so nothing that changes during the scan is missed
+    StartWatch();
+
+    object_roots.Reset();
+    region_objects.Reset();
+    existing_roots.Reset();
+    class_objects.Reset();
+    indexed_packs.Reset();
+    dirty_regions.Reset();
+    RescanIndex();
+
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoFileDB: Indexed %i objects in %i regions%s."), object_roots.Num(), region_objects.Num(),
+        inotify_fd >= 0 ? TEXT(", watching for changes") : TEXT(""));
+}
+
+void KamoFileDB::IndexObject(const FString& id, const FString& root_name) const
+{
+    if (!region_objects.Contains(root_name))
+    {
+        IndexRegion(root_name);
+    }
+
+    if (FString* previous = object_roots.Find(id))
+    {
+        if (*previous == root_name)
+        {
+            return;
+        }
+
+        // Moved
+        if (TSet<FString>* objects = region_objects.Find(*previous))
+        {
+            objects->Remove(id);
+        }
+        *previous = root_name;
+    }
+    else
+    {
+        FString class_name;
+        id.Split(TEXT("."), &class_name, nullptr);
+        class_objects.FindOrAdd(class_name).Add(id);
+        object_roots.Add(id, root_name);
+    }
+
+    region_objects.FindOrAdd(root_name).Add(id);
+}
+
+void KamoFileDB::UnindexObject(const FString& id, const FString& root_name) const
+{
+    const FString* current = object_roots.Find(id);
+    if (!current || *current != root_name)
+    {
+        // Moved somewhere else since
+        return;
+    }
+
+    object_roots.Remove(id);
+    if (TSet<FString>* objects = region_objects.Find(root_name))
+    {
+        objects->Remove(id);
+    }
+
+    FString class_name;
+    id.Split(TEXT("."), &class_name, nullptr);
+    if (TSet<FString>* objects = class_objects.Find(class_name))
+    {
+        objects->Remove(id);
+        if (objects->Num() == 0)
+        {
+            class_objects.Remove(class_name);
+        }
+    }
+}
+
+void KamoFileDB::IndexRegion(const FString& root_name) const
+{
+    KamoID root_id(root_name);
+    TSet<FString> ids;
+    if (!loose_objects)
+    {
+        FKamoRegionPack* pack = GetPack(root_id);
+        if (!pack)
+        {
+            UnindexRegion(root_name);
+            return;
+        }
+
+        // Only our own writes since it was last indexed, and those are in the index already
+        const uint64* indexed_change_count = indexed_packs.Find(root_name);
+        if (indexed_change_count && *indexed_change_count == pack->GetChangeCount())
+        {
+            return;
+        }
+
+        TArray<FString> pack_ids;
+        pack->GetIDs(pack_ids);
+        ids.Append(MoveTemp(pack_ids));
+        indexed_packs.Add(root_name, pack->GetChangeCount());
+    }
+    else
+    {
+        auto root_path = session_path + "/" + root_name;
+        if (!FPlatformFileManager::Get().GetPlatformFile().DirectoryExists(*root_path))
+        {
+            UnindexRegion(root_name);
+            return;
+        }
+
+        TArray<FString> object_names;
+        IFileManager::Get().FindFiles(object_names, *root_path, TEXT(".json"));
+        for (const FString& object_name : object_names)
+        {
+            if (object_name != "_this.json")
+            {
+                ids.Add(FPaths::GetBaseFilename(object_name));
+            }
+        }
+    }
+
+    if (!region_objects.Contains(root_name))
+    {
+        WatchRegion(root_name);
+        region_objects.Add(root_name);
+    }
+
+    for (const FString& id : region_objects[root_name].Array())
+    {
+        if (!ids.Contains(id))
+        {
+            UnindexObject(id, root_name);
+        }
+    }
+    for (const FString& id : ids)
+    {
+        IndexObject(id, root_name);
+    }
+}
+
+void KamoFileDB::UnindexRegion(const FString& root_name) const
+{
+    if (const TSet<FString>* objects = region_objects.Find(root_name))
+    {
+        for (const FString& id : objects->Array())
+        {
+            UnindexObject(id, root_name);
+        }
+    }
+
+    region_objects.Remove(root_name);
+    indexed_packs.Remove(root_name);
+    existing_roots.Remove(root_name);
+    if (const int32* found = watched_regions.FindKey(root_name))
+    {
+        int32 watch = *found;
+#if PLATFORM_LINUX
+        inotify_rm_watch(inotify_fd, watch);
+#endif
+        watched_regions.Remove(watch);
+    }
+}
+
+void KamoFileDB::RescanIndex() const
+{
+    KAMO_TRACE_SCOPE("FileDB.RescanIndex");
+    TArray<FString> root_names;
+    IFileManager::Get().FindFiles(root_names, *(session_path + "/*"), false, true);
+
+    TSet<FString> existing(root_names);
+    TArray<FString> indexed;
+    region_objects.GetKeys(indexed);
+    for (const FString& root_name : indexed)
+    {
+        if (!existing.Contains(root_name))
+        {
+            UnindexRegion(root_name);
+        }
+    }
+
+    for (const FString& root_name : root_names)
+    {
+        IndexRegion(root_name);
+    }
+    dirty_regions.Reset();
+}
+
+bool KamoFileDB::UpdateIndex() const
+{
+#if PLATFORM_LINUX
+    if (inotify_fd < 0)
+    {
+        return false;
+    }
+
+    bool rescan = FKamoFileHelper::ReadWatchEvents(inotify_fd, [this](int32 wd, uint32 mask, const FString& file_name)
+    {
+        const FString* watched = watched_regions.Find(wd);
+        if (!watched)
+        {
+            return;
+        }
+
+        FString root_name = *watched;
+        if (mask & IN_IGNORED)
+        {
+            // The region directory is gone, or we stopped watching it
+            watched_regions.Remove(wd);
+            if (!root_name.IsEmpty())
+            {
+                dirty_regions.Add(root_name);
+            }
+        }
+        else if (root_name.IsEmpty())
+        {
+            // Region created or deleted
+            if ((mask & IN_ISDIR) && !file_name.IsEmpty())
+            {
+                dirty_regions.Add(file_name);
+            }
+        }
+        else if (!loose_objects)
+        {
+            if (file_name == TEXT("_objects.pack") || (mask & IN_DELETE_SELF))
+            {
+                dirty_regions.Add(root_name);
+            }
+        }
+        else if (file_name.EndsWith(TEXT(".json")) && file_name != TEXT("_this.json"))
+        {
+            // Loose objects are tracked file by file
+            FString id = FPaths::GetBaseFilename(file_name);
+            if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            {
+                IndexObject(id, root_name);
+            }
+            else
+            {
+                UnindexObject(id, root_name);
+            }
+        }
+    });
+
+    if (rescan)
+    {
+        UE_LOG(LogKamoRuntime, Warning, TEXT("KamoFileDB: inotify queue overflow, rescanning %s"), *session_path);
+        RescanIndex();
+    }
+    else if (dirty_regions.Num() > 0)
+    {
+        KAMO_TRACE_SCOPE("FileDB.UpdateIndex", KamoID(), dirty_regions.Num());
+        for (const FString& root_name : dirty_regions.Array())
+        {
+            IndexRegion(root_name);
+        }
+        dirty_regions.Reset();
+    }
+
+    // The watch may have been dropped while indexing
+    return inotify_fd >= 0;
+#else
+    return false;
+#endif
+}
+
+bool KamoFileDB::LookupRoot(const KamoID& id, FString& root_name) const
+{
+    bool tracking = UpdateIndex();
+    for (int32 attempt = 0; attempt < 2; attempt++)
+    {
+        if (const FString* root = object_roots.Find(id()))
+        {
+            // The index can lag behind other processes for a moment, check that the region still has it
+            root_name = *root;
+            if (loose_objects)
+            {
+                if (FPlatformFileManager::Get().GetPlatformFile().FileExists(*GetFilePath(KamoID(root_name), id)))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                IndexRegion(root_name);
+                const FString* current = object_roots.Find(id());
+                if (current && *current == root_name)
+                {
+                    return true;
+                }
+            }
+        }
+        else if (tracking)
+        {
+            // Nothing has it
+            break;
+        }
+
+        if (attempt == 0)
+        {
+            RescanIndex();
+        }
+    }
+
+    root_name.Empty();
+    return false;
+}
+
+void KamoFileDB::StartWatch()
+{
+#if PLATFORM_LINUX
+    StopWatch();
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        UE_LOG(LogKamoRuntime, Warning, TEXT("KamoFileDB: inotify_init1 failed, errno %i. Lookups rescan the regions instead."), errno);
+        return;
+    }
+
+    int32 watch = inotify_add_watch(inotify_fd, TCHAR_TO_UTF8(*session_path), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR);
+    if (watch < 0)
+    {
+        UE_LOG(LogKamoRuntime, Warning, TEXT("KamoFileDB: Can't watch %s, errno %i. Lookups rescan the regions instead."), *session_path, errno);
+        StopWatch();
+        return;
+    }
+    watched_regions.Add(watch, FString());
+#endif
+}
+
+void KamoFileDB::StopWatch() const
+{
+#if PLATFORM_LINUX
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+#endif
+    watched_regions.Reset();
+}
+
+void KamoFileDB::WatchRegion(const FString& root_name) const
+{
+#if PLATFORM_LINUX
+    if (inotify_fd < 0)
+    {
+        return;
+    }
+
+    auto root_path = session_path + "/" + root_name;
+    int32 watch = inotify_add_watch(inotify_fd, TCHAR_TO_UTF8(*root_path), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_ONLYDIR);
+    if (watch < 0)
+    {
+        if (errno != ENOENT)
+        {
+            // Most likely out of watches (fs.inotify.max_user_watches), can't tell what changes anymore
+            UE_LOG(LogKamoRuntime, Warning, TEXT("KamoFileDB: Can't watch %s, errno %i. Lookups rescan the regions instead."), *root_path, errno);
+            StopWatch();
+        }
+        return;
+    }
+    watched_regions.Add(watch, root_name);
+#endif
 }
 
 KamoID KamoFileDB::GetObjectIDFromPath(const FString& path) const {
@@ -6,7 +6,10 @@
 #include "KamoDB.h"
 #include "KamoFileDriver.h"
 #include "KamoStructs.h"
+#include "KamoSerializationQueue.h"
 #include "KamoFileHelper.h"
+#include "KamoRegionPack.h"
+#include "KamoIoUring.h"
 
 #include "CoreMinimal.h"
 #include "Json.h"
@@ -33,17 +36,44 @@ class KAMORUNTIME_API KamoFileDB : public IKamoDB, public KamoFileDriver
     // File locks
     TMap<FString, IKamoFileHandle*> file_locks;
 
-    // Serialization job management
-    struct SerializationRecord
-    {
-        KamoID id;
-        KamoID root_id;
-        FString state;
-        int priority;
-    };
+    // Child objects are stored in a packed file per region unless 'loose_objects' is set, then it's
+    // a file per object. The packs are shared with the serializer worker.
+    bool loose_objects;
+    mutable FCriticalSection packs_mutex;
+    mutable TMap<FString, TUniquePtr<FKamoRegionPack>> packs;
+
+    // Call with 'packs_mutex' held. Null if the region doesn't exist.
+    FKamoRegionPack* GetPack(const KamoID& root_id) const;
+    FKamoRegionPack* FindPack(const KamoID& id, KamoID& root_id) const;
+    bool ImportLooseObjects(FKamoRegionPack& pack, const FString& root_path) const;
+    bool WritePacked(const KamoID& root_id, const KamoID& id, const TOptional<FString>& state);
+
+    // Object lookup index, built when the session is created and kept up to date on writes. Changes made
+    // by other processes are picked up through an inotify watch on Linux, elsewhere a lookup that misses
+    // rescans the regions. Guarded by 'packs_mutex' as well.
+    mutable TMap<FString, FString> object_roots;  // Object id -> root id
+    mutable TMap<FString, TSet<FString>> region_objects;  // Root id -> object ids
+    mutable TMap<FString, TSet<FString>> class_objects;  // Class name -> object ids
+    mutable TMap<FString, uint64> indexed_packs;  // Root id -> pack change count when indexed
+    mutable TSet<FString> dirty_regions;  // Changed by someone else, reindexed before the next lookup
+    mutable TMap<int32, FString> watched_regions;  // Watch descriptor -> root id, empty for the session directory
+    mutable int32 inotify_fd;
+
+    void BuildIndex();
+    void IndexObject(const FString& id, const FString& root_name) const;
+    void UnindexObject(const FString& id, const FString& root_name) const;
+    void IndexRegion(const FString& root_name) const;
+    void UnindexRegion(const FString& root_name) const;
+    bool UpdateIndex() const;  // Returns false if changes by others can't be tracked
+    void RescanIndex() const;
+    bool LookupRoot(const KamoID& id, FString& root_name) const;
+    void StartWatch();
+    void StopWatch() const;
+    void WatchRegion(const FString& root_name) const;
 
+    // Serialization job management
     FCriticalSection mutex;
-    TMap<FString, SerializationRecord> objects_for_serialization;
+    FKamoSerializationQueue objects_for_serialization;
 
     // Serializer worker
     class FDBSerializerWorker : public FNonAbandonableTask
@@ -63,6 +93,20 @@ class KAMORUNTIME_API KamoFileDB : public IKamoDB, public KamoFileDriver
     FAsyncTask<FDBSerializerWorker> serializer;
     void DoWork();
 
+    // What's queued is written in batches, region by region, with one sync per region for the batch
+    int32 write_batch_size;
+    int32 write_batch_bytes;
+    bool sync_writes;
+    void WriteBatch(const TArray<FKamoSerializationQueue::Record>& batch);
+
+    // Batched reads, writes and syncs if enabled, shared by the game thread and the serializer
+    TUniquePtr<FKamoIoUring> io_uring;
+    void LoadFiles(const TArray<FString>& paths, TArray<FString>& contents, TArray<bool>& ok) const;
+
+    // Regions whose root object is known to exist. Guarded by 'packs_mutex', dropped when unindexed.
+    mutable TSet<FString> existing_roots;
+    bool RootExists(const KamoID& root_id) const;
+
     
 public:
 	KamoFileDB();
@@ -70,6 +114,7 @@ public:
 
 	// IKamoDriver
 	FString GetDriverType() const override { return "db"; }
+    bool OnSessionCreated() override;
     void CloseSession() override;
 
 	// IKamoDB
@@ -87,6 +132,7 @@ public:
     
     // Remove object from serialization queue if it's there. Returns true if removed.
     virtual bool CancelIfPending(const KamoID& id) override;
+    virtual void SetSerializationPolicy(const KamoSerializationPolicy& policy) override;
     
     // Root object API
     virtual bool AddRootObject(const KamoID& id, const FString& state, bool ignore_if_exists=false);
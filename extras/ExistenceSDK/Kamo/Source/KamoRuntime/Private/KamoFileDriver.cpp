@@ -3,6 +3,7 @@
 
 #include "KamoFileDriver.h"
 #include "KamoRuntimeModule.h"
+#include "KamoIoUring.h"
 
 #include "GenericPlatform/GenericPlatformFile.h"
 #include "HAL/PlatformFileManager.h"
@@ -61,3 +62,11 @@ bool KamoFileDriver::OnSessionCreated()
 }
 
 
+TUniquePtr<FKamoIoUring> KamoFileDriver::CreateIoUring() const
+{
+	if (!config.io_uring && !FParse::Param(FCommandLine::Get(), TEXT("kamoiouring")))
+	{
+		return nullptr;
+	}
+	return FKamoIoUring::Create();
+}
@@ -22,6 +22,10 @@ public:
     // Utility function for file based drivers, returns a path to ~/.kamo/<tenant>/<driver>
     FString GetHomePath() const;
 
+    // io_uring for batched file I/O if enabled by the 'io_uring' config or -kamoiouring and the platform
+    // has it, null otherwise.
+    TUniquePtr<class FKamoIoUring> CreateIoUring() const;
+
 protected:
     FString session_path;
 
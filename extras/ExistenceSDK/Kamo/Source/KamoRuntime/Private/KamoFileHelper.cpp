@@ -46,7 +46,7 @@
 
 
 // Atomic retry methods.
-bool FKamoFileHelper::AtomicSaveStringToFile(const FString& String, const TCHAR* Filename)
+bool FKamoFileHelper::AtomicSaveStringToFile(const FString& String, const TCHAR* Filename, bool bSync)
 {
 	bool result;
 	for (int i = 0; i < 3; i++) {
@@ -55,7 +55,7 @@ bool FKamoFileHelper::AtomicSaveStringToFile(const FString& String, const TCHAR*
 			// short sleep before retrying
 			Nap();
 		}
-		result = SaveStringToLockedFile(String, Filename);
+		result = SaveStringToLockedFile(String, Filename, bSync);
 		if (!result) {
 			if (!WasSharingViolation())
 			{
@@ -97,9 +97,10 @@ bool FKamoFileHelper::AtomicLoadFileToString(FString& Result, const TCHAR* Filen
 
 #if LOCK_MODE == MODE_PASSTHROUGH
 
-bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR* Filename)
+bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR* Filename, bool bSync)
 {
-	return FFileHelper::SaveStringToFile(String, Filename, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM);
+	return FFileHelper::SaveStringToFile(String, Filename, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM)
+		&& (!bSync || Sync(Filename));
 }
 bool FKamoFileHelper::LoadLockedFileToString(FString& Result, const TCHAR* Filename)
 {
@@ -114,7 +115,7 @@ bool FKamoFileHelper::LoadLockedFileToString(FString& Result, const TCHAR* Filen
 // using fcntl() locking, which does work on unix.
 // On Windows, the file handle uses the windows UE implementation underneath.
 
-bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR* Filename)
+bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR* Filename, bool bSync)
 {
 	TUniquePtr<IKamoFileHandle> WriteHandle(OpenWrite(Filename, false, false));
 	if (!WriteHandle)
@@ -127,7 +128,8 @@ bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR*
 
 	// Support only utf8
 	FTCHARToUTF8 UTF8String(*String, String.Len());
-	return WriteHandle->Write((UTF8CHAR*)UTF8String.Get(), UTF8String.Length() * sizeof(UTF8CHAR));
+	return WriteHandle->Write((UTF8CHAR*)UTF8String.Get(), UTF8String.Length() * sizeof(UTF8CHAR))
+		&& (!bSync || Sync(Filename));
 }
 
 // Unfortunately, the linux platform functions for OpenRead _do not_ in fact use flock.
@@ -176,10 +178,12 @@ bool FKamoFileHelper::LoadLockedFileToString(FString& Result, const TCHAR* Filen
 }
 
 
-bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR* Filename)
+bool FKamoFileHelper::SaveStringToLockedFile(const FString& String, const TCHAR* Filename, bool bSync)
 {
 	FString tmp = GetTempFileName(Filename);
 	bool ok = FFileHelper::SaveStringToFile(String, *tmp, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM);
+	// Otherwise the rename can reach the disk before the data, and a crash leaves an empty file behind
+	ok = ok && (!bSync || Sync(*tmp));
 	const bool overwrite = true;
 	if (ok) {
 		if (overwrite)
@@ -411,6 +415,25 @@ bool FKamoFileHelper::ReplaceAtomic(const TCHAR *To, const TCHAR *From)
 	return MoveFileExW(*NormalizeFilename(From), *NormalizeFilename(To), MOVEFILE_REPLACE_EXISTING);
 }
 
+// Directory entries can't be flushed on their own on windows, renames are flushed with the file system journal.
+bool FKamoFileHelper::Sync(const TCHAR* Path)
+{
+	auto& pf = FPlatformFileManager::Get().GetPlatformFile();
+	if (pf.DirectoryExists(Path))
+	{
+		return true;
+	}
+
+	HANDLE Handle = CreateFileW(*NormalizeFilename(Path), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (Handle == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	bool Result = FlushFileBuffers(Handle) != 0;
+	CloseHandle(Handle);
+	return Result;
+}
+
 
 #elif PLATFORM_LINUX
 
@@ -418,6 +441,7 @@ bool FKamoFileHelper::ReplaceAtomic(const TCHAR *To, const TCHAR *From)
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/inotify.h>
 
 /** simple file handle for reading
  * allows us to try this both for windows and linux
@@ -661,6 +685,46 @@ bool FKamoFileHelper::ReplaceAtomic(const TCHAR *To, const TCHAR *From)
 	return pf.MoveFile(To, From);
 }
 
+// fsync() flushes the file, not the descriptor, so a fresh read only one will do. Works for directories too.
+bool FKamoFileHelper::Sync(const TCHAR* Path)
+{
+	int Handle = open(TCHAR_TO_UTF8(*NormalizeFilename(Path)), O_RDONLY | O_CLOEXEC);
+	if (Handle == -1)
+	{
+		return false;
+	}
+	bool Result = fsync(Handle) == 0;
+	close(Handle);
+	return Result;
+}
+
+bool FKamoFileHelper::ReadWatchEvents(int32 Fd, TFunctionRef<void(int32 Wd, uint32 Mask, const FString& Name)> Callback)
+{
+	alignas(struct inotify_event) char Buffer[16 * 1024];
+	bool Overflow = false;
+	for (;;)
+	{
+		ssize_t Length = read(Fd, Buffer, sizeof(Buffer));
+		if (Length <= 0)
+		{
+			// EAGAIN, nothing more for now
+			break;
+		}
+
+		for (char* Ptr = Buffer; Ptr < Buffer + Length; Ptr += sizeof(struct inotify_event) + ((struct inotify_event*)Ptr)->len)
+		{
+			const struct inotify_event* Event = (const struct inotify_event*)Ptr;
+			if (Event->mask & IN_Q_OVERFLOW)
+			{
+				Overflow = true;
+				continue;
+			}
+			Callback(Event->wd, Event->mask, Event->len > 0 ? FString(UTF8_TO_TCHAR(Event->name)) : FString());
+		}
+	}
+	return Overflow;
+}
+
 bool FKamoFileHelper::WasSharingViolation()
 {
 	return EAGAIN == errno || EWOULDBLOCK == errno;
@@ -709,4 +773,16 @@ bool FKamoFileHelper::ReplaceAtomic(const TCHAR* To, const TCHAR* From)
 	return pf.MoveFile(To, From);
 }
 
+bool FKamoFileHelper::Sync(const TCHAR* Path)
+{
+	auto& pf = FPlatformFileManager::Get().GetPlatformFile();
+	if (pf.DirectoryExists(Path))
+	{
+		return true;
+	}
+
+	TUniquePtr<IFileHandle> fh(pf.OpenWrite(Path, true, true));
+	return fh && fh->Flush(true);
+}
+
 #endif
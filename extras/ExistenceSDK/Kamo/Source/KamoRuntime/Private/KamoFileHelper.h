@@ -22,8 +22,9 @@ public:
 
 struct FKamoFileHelper
 {
-	// atomic save and load of string to/from file.
-	static bool AtomicSaveStringToFile(const FString& String, const TCHAR* Filename);
+	// atomic save and load of string to/from file. With 'bSync' the contents are flushed to disk before
+	// the file replaces the old one, a crash then leaves either version rather than an empty file.
+	static bool AtomicSaveStringToFile(const FString& String, const TCHAR* Filename, bool bSync = false);
 	static bool AtomicLoadFileToString(FString& Result, const TCHAR* Filename);
 
 	// platform dependent files
@@ -31,11 +32,22 @@ struct FKamoFileHelper
 	static IKamoFileHandle* OpenRead(const TCHAR* Filename, bool bAllowWrite);
 	// Open an exclusively locked file.
 	static IKamoFileHandle* OpenWrite(const TCHAR* Filename, bool bAppend, bool bAllowRead);
+	// Rename 'From' over 'To', replacing it if it exists.
+	static bool ReplaceAtomic(const TCHAR *To, const TCHAR *From);
+	// Flush a file, or the entries of a directory, to disk. Written through any handle, not just ours.
+	static bool Sync(const TCHAR* Path);
+
+#if PLATFORM_LINUX
+	// Reads all queued events of a non-blocking inotify descriptor, calling 'Callback' with the watch
+	// descriptor, event mask and file name (empty for events on the watched directory itself).
+	// Returns true if the kernel queue overflowed and events were lost, the caller must rescan.
+	static bool ReadWatchEvents(int32 Fd, TFunctionRef<void(int32 Wd, uint32 Mask, const FString& Name)> Callback);
+#endif
 
 private:
 	// Functions with different implementation based on the MODE that we operate in
 	// read and write functions without retry on sharing collision
-	static bool SaveStringToLockedFile(const FString& String, const TCHAR* Filename);
+	static bool SaveStringToLockedFile(const FString& String, const TCHAR* Filename, bool bSync);
 	static bool LoadLockedFileToString(FString& Result, const TCHAR* Filename);
 	static FString GetTempFileName(const TCHAR* Filename);
 	static bool KamoLoadFileToString(FString& Result, const TCHAR* Filename);
@@ -46,5 +58,4 @@ private:
 	static void Nap();
 	
 	static bool MoveAtomic(const TCHAR *To, const TCHAR *From);
-	static bool ReplaceAtomic(const TCHAR *To, const TCHAR *From);
 };
\ No newline at end of file
@@ -2,26 +2,46 @@
 
 #include "KamoFileMQ.h"
 #include "KamoFileHelper.h"
+#include "KamoTrace.h"
 
-#include "KamoFileMQ.h"
+#include "Algo/BinarySearch.h"
 #include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+#include <atomic>
+
+#if PLATFORM_LINUX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
 
 
-KamoFileMQ::KamoFileMQ()
+KamoFileMQ::KamoFileMQ() :
+    inotify_fd(-1)
 {
 }
 
 
 KamoFileMQ::~KamoFileMQ()
 {
+    StopWatch();
 }
 
 
 void KamoFileMQ::CloseSession()
 {
+	StopWatch();
 	KamoFileDriver::CloseSession();
 }
 
+
+FString KamoFileMQ::InboxPath() const
+{
+    return session_path + "/" + session_info;
+}
+
 bool KamoFileMQ::CreateMessageQueue() 
 {   
 	if (!DeleteMessageQueue())
@@ -38,13 +58,18 @@ bool KamoFileMQ::CreateMessageQueue()
 		UE_LOG(LogKamoDriver, Error, TEXT("Cannot create directory: %s"), *path);
 		return false;
 	}
-    
+
+	StartWatch();
+	io_uring = CreateIoUring();
     return true;
 }
 
 
 bool KamoFileMQ::DeleteMessageQueue()
 {
+    StopWatch();
+    pending.Reset();
+
     auto path = session_path;
     path /= session_info;
 
@@ -78,6 +103,7 @@ bool KamoFileMQ::DeleteMessageQueue()
 
 bool KamoFileMQ::SendMessage(const FString& inbox_address, const FString& message_type, const FString& payload)
 {
+    KAMO_TRACE_SCOPE("FileMQ.Send", KamoID(), payload.Len());
     FString key;
     if (inbox_address.IsEmpty())
     {
@@ -102,10 +128,13 @@ bool KamoFileMQ::SendMessage(const FString& inbox_address, const FString& messag
             return false;
         }
         
+        // Receivers go by file name so it starts with the time, then a counter to keep messages sent
+        // within the same millisecond in order.
+        static std::atomic<uint32> message_counter(0);
         auto guid = FGuid::NewGuid().ToString();
-        auto current_time = FDateTime::UtcNow().ToIso8601().Replace(TEXT(":"), TEXT("-"));;
+        auto current_time = FDateTime::UtcNow().ToIso8601().Replace(TEXT(":"), TEXT("-"));
         
-        auto file_name = current_time + "_" + guid.Left(8) + ".json";
+        auto file_name = FString::Printf(TEXT("%s_%08x_%s.json"), *current_time, message_counter++, *guid.Left(8));
         
         auto file_path = inbox_path + "/" + file_name;
         
@@ -117,27 +146,164 @@ bool KamoFileMQ::SendMessage(const FString& inbox_address, const FString& messag
 
 bool KamoFileMQ::ReceiveMessage(KamoMessage& message)
 {
+    TArray<KamoMessage> messages;
+    if (ReceiveMessages(messages, 1) == 0)
+    {
+        return false;
+    }
+
+    message = MoveTemp(messages[0]);
+    return true;
+}
+
+
+int32 KamoFileMQ::ReceiveMessages(TArray<KamoMessage>& messages, int32 max_messages)
+{
+    KAMO_TRACE_SCOPE("FileMQ.Receive");
+    UpdatePending();
+    if (pending.Num() == 0)
+    {
+        return 0;
+    }
+
+    // Oldest first
+    int32 num_files = FMath::Clamp(max_messages, 0, pending.Num());
+    TArray<FString> file_names(pending.GetData(), num_files);
+    pending.RemoveAt(0, num_files, false);
+
     IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    FString inbox_path = InboxPath();
     TArray<FString> file_paths;
-    FString ext = ".json";
-    FString inbox_path = session_path + "/" + session_info;
-    
-    pf.FindFiles(file_paths, *inbox_path, *ext);
+    for (const FString& file_name : file_names)
+    {
+        file_paths.Add(inbox_path / file_name);
+    }
 
-    if (file_paths.Num() == 0) 
+    // The whole batch at once with io_uring. Files it can't read, e.g. locked by a sender that's still
+    // writing, go through the helper which waits for the lock.
+    TArray<TArray<uint8>> file_data;
+    TArray<bool> read;
+    if (io_uring)
     {
-        return false;
+        io_uring->ReadFiles(file_paths, file_data, read);
     }
-    
-    auto file_path = file_paths[0];
-    
-    FString data;
-    FKamoFileHelper::AtomicLoadFileToString(data, *file_path);
-    
-    message.message_type = "command";
-    message.payload = data;
-    
-    pf.DeleteFile(*file_path);
-    
-    return true;
+    else
+    {
+        read.Init(false, file_paths.Num());
+    }
+
+    int32 num_received = 0;
+    for (int32 i = 0; i < file_paths.Num(); i++)
+    {
+        FString data;
+        if (read[i])
+        {
+            FFileHelper::BufferToString(data, file_data[i].GetData(), file_data[i].Num());
+        }
+        else if (!FKamoFileHelper::AtomicLoadFileToString(data, *file_paths[i]))
+        {
+            // Stale entry if the file is gone. Otherwise try again on the next poll, the watch
+            // won't report it again.
+            if (pf.FileExists(*file_paths[i]))
+            {
+                UE_LOG(LogKamoDriver, Warning, TEXT("KamoFileMQ: Can't read %s, retrying later."), *file_paths[i]);
+                AddPending(file_names[i]);
+            }
+            continue;
+        }
+
+        KamoMessage& message = messages.AddDefaulted_GetRef();
+        message.message_type = "command";
+        message.payload = MoveTemp(data);
+        num_received++;
+
+        pf.DeleteFile(*file_paths[i]);
+    }
+
+    return num_received;
+}
+
+
+void KamoFileMQ::ScanInbox()
+{
+    KAMO_TRACE_SCOPE("FileMQ.ScanInbox");
+    TArray<FString> file_paths;
+    FPlatformFileManager::Get().GetPlatformFile().FindFiles(file_paths, *InboxPath(), TEXT(".json"));
+    for (const FString& file_path : file_paths)
+    {
+        AddPending(FPaths::GetCleanFilename(file_path));
+    }
+}
+
+
+void KamoFileMQ::AddPending(const FString& file_name)
+{
+    int32 index = Algo::LowerBound(pending, file_name);
+    if (index == pending.Num() || pending[index] != file_name)
+    {
+        pending.Insert(file_name, index);
+    }
+}
+
+
+void KamoFileMQ::StartWatch()
+{
+#if PLATFORM_LINUX
+    StopWatch();
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        UE_LOG(LogKamoDriver, Warning, TEXT("KamoFileMQ: inotify_init1 failed, errno %i. Polling the inbox instead."), errno);
+        return;
+    }
+
+    // Messages are written to a temporary file and renamed, other tools may write them in place
+    if (inotify_add_watch(inotify_fd, TCHAR_TO_UTF8(*InboxPath()), IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+    {
+        UE_LOG(LogKamoDriver, Warning, TEXT("KamoFileMQ: Can't watch %s, errno %i. Polling the inbox instead."), *InboxPath(), errno);
+        StopWatch();
+        return;
+    }
+#endif
+
+    // Pick up whatever arrived before the watch was in place
+    ScanInbox();
+}
+
+
+void KamoFileMQ::StopWatch()
+{
+#if PLATFORM_LINUX
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+#endif
+}
+
+
+void KamoFileMQ::UpdatePending()
+{
+#if PLATFORM_LINUX
+    if (inotify_fd >= 0)
+    {
+        bool rescan = FKamoFileHelper::ReadWatchEvents(inotify_fd, [this](int32 wd, uint32 mask, const FString& file_name)
+        {
+            if (file_name.EndsWith(TEXT(".json")))
+            {
+                AddPending(file_name);
+            }
+        });
+
+        if (rescan)
+        {
+            UE_LOG(LogKamoDriver, Warning, TEXT("KamoFileMQ: inotify queue overflow, rescanning %s"), *InboxPath());
+            ScanInbox();
+        }
+        return;
+    }
+#endif
+
+    ScanInbox();
 }
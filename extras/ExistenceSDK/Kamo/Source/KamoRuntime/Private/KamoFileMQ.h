@@ -7,6 +7,7 @@
 #include "KamoStructs.h"
 #include "HAL/PlatformFileManager.h"
 #include "KamoFileDriver.h"
+#include "KamoIoUring.h"
 
 class KAMORUNTIME_API KamoFileMQ : public IKamoMQ, public KamoFileDriver {
     
@@ -25,5 +26,22 @@ public:
 	virtual bool DeleteMessageQueue() override;
     virtual bool SendMessage(const FString& inbox_address, const FString& message_type, const FString& payload) override;
     virtual bool ReceiveMessage(KamoMessage& message) override;
+    virtual int32 ReceiveMessages(TArray<KamoMessage>& messages, int32 max_messages) override;
 
+private:
+    FString InboxPath() const;
+
+    // Index of the message files in the inbox. On Linux it's kept up to date by an inotify watch, so
+    // polling an empty inbox is a single read() and the directory is only listed when the watch is set
+    // up or its event queue overflows. Elsewhere the inbox is listed on each poll.
+    TArray<FString> pending;  // File names of unread messages, sorted. Names start with the time they were sent.
+    void AddPending(const FString& file_name);
+    void UpdatePending();
+    void ScanInbox();
+    void StartWatch();
+    void StopWatch();
+    int32 inotify_fd;
+
+    // Batched reads of the message files if enabled
+    TUniquePtr<FKamoIoUring> io_uring;
 };
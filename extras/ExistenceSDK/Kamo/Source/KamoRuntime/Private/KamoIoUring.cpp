@@ -0,0 +1,634 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoIoUring.h"
+#include "KamoRuntimeModule.h"
+#include "KamoTrace.h"
+
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+
+// The toolchain's kernel headers may predate io_uring
+#if WITH_KAMO_IO_URING && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KAMO_IO_URING 1
+#endif
+#endif
+
+#ifndef KAMO_IO_URING
+#define KAMO_IO_URING 0
+#endif
+
+
+struct FKamoIoUring::FTransfer
+{
+    enum class EType : uint8
+    {
+        Read,
+        Write,
+        Sync,
+    };
+
+    EType type = EType::Read;
+    int32 fd = -1;
+    uint8* data = nullptr;
+    int64 size = 0;
+    int64 submitted = 0;  // Bytes handed to requests, or 1 once a sync is
+    int64 done = 0;
+    bool failed = false;
+
+    bool Succeeded() const { return fd >= 0 && !failed && done == size; }
+};
+
+
+#if KAMO_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Same on all architectures, but missing from older libc headers
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#define __NR_io_uring_register 427
+#endif
+
+static const uint32 ring_entries = 64;
+
+// Staging buffers registered with the kernel. Requests in flight are bounded by the number of these.
+static const int32 num_staging_buffers = 32;
+static const int32 staging_buffer_size = 256 * 1024;
+
+
+namespace
+{
+    int32 SysSetup(uint32 entries, io_uring_params* params)
+    {
+        return (int32)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int32 SysEnter(int32 fd, uint32 to_submit, uint32 min_complete, uint32 flags)
+    {
+        return (int32)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    int32 SysRegister(int32 fd, uint32 opcode, const void* arg, uint32 num_args)
+    {
+        return (int32)syscall(__NR_io_uring_register, fd, opcode, arg, num_args);
+    }
+
+    uint32 LoadAcquire(const uint32* value)
+    {
+        return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+    }
+
+    void StoreRelease(uint32* value, uint32 new_value)
+    {
+        __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+    }
+
+    // Shared lock like FKamoFileHelper::OpenRead takes, so files being written in place aren't read half done
+    bool LockShared(int32 fd)
+    {
+        struct flock lock = {};
+        lock.l_type = F_RDLCK;
+        lock.l_whence = SEEK_SET;
+        return fcntl(fd, F_SETLK, &lock) == 0;
+    }
+}
+
+
+FKamoIoUring::FKamoIoUring() :
+    ring_fd(-1),
+    sq_entries(0),
+    cq_entries(0),
+    sq_ring(nullptr),
+    sq_ring_size(0),
+    cq_ring(nullptr),
+    cq_ring_size(0),
+    sqes(nullptr),
+    sqes_size(0),
+    sq_head(nullptr),
+    sq_tail(nullptr),
+    sq_mask(nullptr),
+    sq_array(nullptr),
+    cq_head(nullptr),
+    cq_tail(nullptr),
+    cq_mask(nullptr),
+    cqes(nullptr),
+    buffer_size(staging_buffer_size),
+    fixed_buffers(false),
+    broken(false)
+{
+}
+
+
+FKamoIoUring::~FKamoIoUring()
+{
+    if (sqes)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0)
+    {
+        // Unregisters the buffers too
+        close(ring_fd);
+    }
+    for (uint8* buffer : buffers)
+    {
+        FMemory::Free(buffer);
+    }
+}
+
+
+TUniquePtr<FKamoIoUring> FKamoIoUring::Create()
+{
+    TUniquePtr<FKamoIoUring> io_uring(new FKamoIoUring());
+    if (!io_uring->Setup())
+    {
+        return nullptr;
+    }
+    return io_uring;
+}
+
+
+bool FKamoIoUring::Setup()
+{
+    io_uring_params params;
+    FMemory::Memzero(params);
+    ring_fd = SysSetup(ring_entries, &params);
+    if (ring_fd < 0)
+    {
+        UE_LOG(LogKamoDriver, Display, TEXT("FKamoIoUring: io_uring not available, errno %i. Using blocking file I/O."), errno);
+        return false;
+    }
+
+    sq_entries = params.sq_entries;
+    cq_entries = params.cq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+    {
+        sq_ring_size = cq_ring_size = FMath::Max(sq_ring_size, cq_ring_size);
+    }
+#endif
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        UE_LOG(LogKamoDriver, Warning, TEXT("FKamoIoUring: Can't map the submission ring, errno %i. Using blocking file I/O."), errno);
+        return false;
+    }
+
+    cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+    {
+        cq_ring = nullptr;
+        UE_LOG(LogKamoDriver, Warning, TEXT("FKamoIoUring: Can't map the completion ring, errno %i. Using blocking file I/O."), errno);
+        return false;
+    }
+
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        sqes = nullptr;
+        UE_LOG(LogKamoDriver, Warning, TEXT("FKamoIoUring: Can't map the submission entries, errno %i. Using blocking file I/O."), errno);
+        return false;
+    }
+
+    uint8* sq = (uint8*)sq_ring;
+    sq_head = (uint32*)(sq + params.sq_off.head);
+    sq_tail = (uint32*)(sq + params.sq_off.tail);
+    sq_mask = (uint32*)(sq + params.sq_off.ring_mask);
+    sq_array = (uint32*)(sq + params.sq_off.array);
+
+    uint8* cq = (uint8*)cq_ring;
+    cq_head = (uint32*)(cq + params.cq_off.head);
+    cq_tail = (uint32*)(cq + params.cq_off.tail);
+    cq_mask = (uint32*)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    // Registered buffers are pinned and count against RLIMIT_MEMLOCK on older kernels. Without them the
+    // requests point straight at the caller's memory.
+    TArray<iovec> iovecs;
+    for (int32 i = 0; i < num_staging_buffers; i++)
+    {
+        uint8* buffer = (uint8*)FMemory::Malloc(buffer_size, 4096);
+        buffers.Add(buffer);
+        iovecs.Add({ buffer, (size_t)buffer_size });
+    }
+
+    fixed_buffers = SysRegister(ring_fd, IORING_REGISTER_BUFFERS, iovecs.GetData(), iovecs.Num()) == 0;
+    if (!fixed_buffers)
+    {
+        UE_LOG(LogKamoDriver, Log, TEXT("FKamoIoUring: Can't register buffers, errno %i. Using unregistered requests."), errno);
+        for (uint8* buffer : buffers)
+        {
+            FMemory::Free(buffer);
+        }
+        buffers.Reset();
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("FKamoIoUring: Using io_uring with %i entries%s."), sq_entries,
+        fixed_buffers ? TEXT(" and registered buffers") : TEXT(""));
+    return true;
+}
+
+
+bool FKamoIoUring::Run(TArray<FTransfer>& transfers)
+{
+    if (broken)
+    {
+        return false;
+    }
+
+    // A request in flight. With registered buffers each slot has a buffer of its own.
+    struct FSlot
+    {
+        int32 transfer;
+        int64 offset;
+        int32 length;
+        iovec iov;
+    };
+
+    int32 num_slots = fixed_buffers ? buffers.Num() : (int32)sq_entries;
+    TArray<FSlot> slots;
+    slots.SetNumZeroed(num_slots);
+    TArray<int32> free_slots;
+    for (int32 i = num_slots - 1; i >= 0; i--)
+    {
+        free_slots.Add(i);
+    }
+
+    // Leftovers of short reads and writes
+    TArray<FSlot> retries;
+    int32 next_transfer = 0;
+
+    auto next_request = [&](FSlot& slot) -> bool
+    {
+        while (retries.Num())
+        {
+            slot = retries.Pop(false);
+            if (!transfers[slot.transfer].failed)
+            {
+                return true;
+            }
+        }
+
+        for (; next_transfer < transfers.Num(); next_transfer++)
+        {
+            FTransfer& transfer = transfers[next_transfer];
+            if (transfer.fd < 0 || transfer.failed)
+            {
+                continue;
+            }
+
+            if (transfer.type == FTransfer::EType::Sync)
+            {
+                if (transfer.submitted == 0)
+                {
+                    transfer.submitted = 1;
+                    slot = { next_transfer, 0, 0, {} };
+                    return true;
+                }
+                continue;
+            }
+
+            if (transfer.submitted < transfer.size)
+            {
+                int32 length = (int32)FMath::Min<int64>(transfer.size - transfer.submitted, fixed_buffers ? buffer_size : MAX_int32);
+                slot = { next_transfer, transfer.submitted, length, {} };
+                transfer.submitted += length;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    int32 in_flight = 0;
+    uint32 unsubmitted = 0;
+    for (;;)
+    {
+        // Queue up as many requests as there are free slots
+        uint32 tail = *sq_tail;
+        while (free_slots.Num())
+        {
+            FSlot request;
+            if (!next_request(request))
+            {
+                break;
+            }
+
+            int32 slot_index = free_slots.Pop(false);
+            FSlot& slot = slots[slot_index];
+            slot = request;
+            FTransfer& transfer = transfers[slot.transfer];
+
+            uint32 sqe_index = tail & *sq_mask;
+            io_uring_sqe* sqe = (io_uring_sqe*)sqes + sqe_index;
+            FMemory::Memzero(*sqe);
+            sqe->fd = transfer.fd;
+            sqe->user_data = slot_index;
+
+            if (transfer.type == FTransfer::EType::Sync)
+            {
+                sqe->opcode = IORING_OP_FSYNC;
+            }
+            else if (fixed_buffers)
+            {
+                uint8* buffer = buffers[slot_index];
+                if (transfer.type == FTransfer::EType::Write)
+                {
+                    FMemory::Memcpy(buffer, transfer.data + slot.offset, slot.length);
+                }
+                sqe->opcode = transfer.type == FTransfer::EType::Read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe->addr = (uint64)(UPTRINT)buffer;
+                sqe->len = slot.length;
+                sqe->off = slot.offset;
+                sqe->buf_index = slot_index;
+            }
+            else
+            {
+                slot.iov.iov_base = transfer.data + slot.offset;
+                slot.iov.iov_len = slot.length;
+                sqe->opcode = transfer.type == FTransfer::EType::Read ? IORING_OP_READV : IORING_OP_WRITEV;
+                sqe->addr = (uint64)(UPTRINT)&slot.iov;
+                sqe->len = 1;
+                sqe->off = slot.offset;
+            }
+
+            sq_array[sqe_index] = sqe_index;
+            tail++;
+            unsubmitted++;
+            in_flight++;
+        }
+        StoreRelease(sq_tail, tail);
+
+        if (in_flight == 0)
+        {
+            return true;
+        }
+
+        // Submit and wait for at least one to complete
+        int32 result = SysEnter(ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (result < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                continue;
+            }
+
+            // Requests may still be in the ring pointing at memory we're about to let go of. Never touch the
+            // ring again, the drivers fall back to blocking I/O.
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoIoUring: io_uring_enter failed, errno %i. Using blocking file I/O from now on."), errno);
+            broken = true;
+            return false;
+        }
+        unsubmitted -= FMath::Min((uint32)result, unsubmitted);
+
+        // Reap what's done
+        uint32 head = *cq_head;
+        uint32 completed_tail = LoadAcquire(cq_tail);
+        for (; head != completed_tail; head++)
+        {
+            const io_uring_cqe* cqe = (const io_uring_cqe*)cqes + (head & *cq_mask);
+            int32 slot_index = (int32)cqe->user_data;
+            int32 res = cqe->res;
+            FSlot slot = slots[slot_index];
+            FTransfer& transfer = transfers[slot.transfer];
+            free_slots.Add(slot_index);
+            in_flight--;
+
+            if (transfer.type == FTransfer::EType::Sync)
+            {
+                transfer.failed |= res < 0;
+            }
+            else if (res == -EAGAIN || res == -EINTR)
+            {
+                retries.Add(slot);
+            }
+            else if (res <= 0)
+            {
+                // An error, or the file is shorter than when it was opened
+                transfer.failed = true;
+            }
+            else
+            {
+                if (fixed_buffers && transfer.type == FTransfer::EType::Read)
+                {
+                    FMemory::Memcpy(transfer.data + slot.offset, buffers[slot_index], res);
+                }
+                transfer.done += res;
+                if (res < slot.length)
+                {
+                    retries.Add({ slot.transfer, slot.offset + res, slot.length - res, {} });
+                }
+            }
+        }
+        StoreRelease(cq_head, head);
+    }
+}
+
+
+void FKamoIoUring::ReadFiles(const TArray<FString>& paths, TArray<TArray<uint8>>& contents, TArray<bool>& ok)
+{
+    KAMO_TRACE_SCOPE("IoUring.ReadFiles", KamoID(), paths.Num());
+    FScopeLock lock(&mutex);
+    contents.SetNum(paths.Num());
+    ok.Init(false, paths.Num());
+
+    TArray<FTransfer> transfers;
+    transfers.SetNum(paths.Num());
+    for (int32 i = 0; i < paths.Num(); i++)
+    {
+        FTransfer& transfer = transfers[i];
+        transfer.type = FTransfer::EType::Read;
+        transfer.fd = open(TCHAR_TO_UTF8(*paths[i]), O_RDONLY | O_CLOEXEC);
+        if (transfer.fd < 0)
+        {
+            continue;
+        }
+
+        struct stat file_stat;
+        if (!LockShared(transfer.fd) || fstat(transfer.fd, &file_stat) != 0)
+        {
+            transfer.failed = true;
+            continue;
+        }
+
+        contents[i].SetNumUninitialized(file_stat.st_size);
+        transfer.data = contents[i].GetData();
+        transfer.size = file_stat.st_size;
+    }
+
+    bool ran = Run(transfers);
+    for (int32 i = 0; i < transfers.Num(); i++)
+    {
+        if (transfers[i].fd >= 0)
+        {
+            close(transfers[i].fd);
+        }
+        ok[i] = ran && transfers[i].Succeeded();
+    }
+}
+
+
+bool FKamoIoUring::WriteFiles(const TArray<FString>& paths, const TArray<FString>& contents, bool sync, TArray<bool>& ok)
+{
+    KAMO_TRACE_SCOPE("IoUring.WriteFiles", KamoID(), paths.Num());
+    FScopeLock lock(&mutex);
+    ok.Init(false, paths.Num());
+
+    TArray<FString> temp_paths;
+    TArray<TArray<uint8>> data;
+    TArray<FTransfer> transfers;
+    temp_paths.SetNum(paths.Num());
+    data.SetNum(paths.Num());
+    transfers.SetNum(paths.Num());
+    for (int32 i = 0; i < paths.Num(); i++)
+    {
+        FTCHARToUTF8 utf8(*contents[i]);
+        data[i].Append((const uint8*)utf8.Get(), utf8.Length());
+
+        temp_paths[i] = FPaths::CreateTempFilename(*FPaths::GetPath(paths[i]), *FPaths::GetCleanFilename(paths[i]));
+        FTransfer& transfer = transfers[i];
+        transfer.type = FTransfer::EType::Write;
+        transfer.fd = open(TCHAR_TO_UTF8(*temp_paths[i]), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        transfer.data = data[i].GetData();
+        transfer.size = data[i].Num();
+    }
+
+    bool ran = Run(transfers);
+    if (ran && sync)
+    {
+        // Only once all the data is written
+        for (FTransfer& transfer : transfers)
+        {
+            transfer.type = FTransfer::EType::Sync;
+            transfer.submitted = 0;
+        }
+        ran = Run(transfers);
+    }
+
+    bool all_ok = true;
+    for (int32 i = 0; i < transfers.Num(); i++)
+    {
+        FTransfer& transfer = transfers[i];
+        if (transfer.fd < 0)
+        {
+            all_ok = false;
+            continue;
+        }
+        close(transfer.fd);
+
+        ok[i] = ran && transfer.Succeeded() && rename(TCHAR_TO_UTF8(*temp_paths[i]), TCHAR_TO_UTF8(*paths[i])) == 0;
+        if (!ok[i])
+        {
+            unlink(TCHAR_TO_UTF8(*temp_paths[i]));
+            all_ok = false;
+        }
+    }
+    return all_ok;
+}
+
+
+bool FKamoIoUring::SyncFiles(const TArray<FString>& paths)
+{
+    KAMO_TRACE_SCOPE("IoUring.SyncFiles", KamoID(), paths.Num());
+    FScopeLock lock(&mutex);
+
+    TArray<FTransfer> transfers;
+    transfers.SetNum(paths.Num());
+    for (int32 i = 0; i < paths.Num(); i++)
+    {
+        transfers[i].type = FTransfer::EType::Sync;
+        transfers[i].fd = open(TCHAR_TO_UTF8(*paths[i]), O_RDONLY | O_CLOEXEC);
+    }
+
+    bool all_ok = Run(transfers);
+    for (const FTransfer& transfer : transfers)
+    {
+        all_ok &= transfer.Succeeded();
+        if (transfer.fd >= 0)
+        {
+            close(transfer.fd);
+        }
+    }
+    return all_ok;
+}
+
+
+#else // KAMO_IO_URING
+
+
+FKamoIoUring::FKamoIoUring() :
+    ring_fd(-1),
+    buffer_size(0),
+    fixed_buffers(false),
+    broken(true)
+{
+}
+
+
+FKamoIoUring::~FKamoIoUring()
+{
+}
+
+
+TUniquePtr<FKamoIoUring> FKamoIoUring::Create()
+{
+    return nullptr;
+}
+
+
+bool FKamoIoUring::Setup()
+{
+    return false;
+}
+
+
+bool FKamoIoUring::Run(TArray<FTransfer>& transfers)
+{
+    return false;
+}
+
+
+void FKamoIoUring::ReadFiles(const TArray<FString>& paths, TArray<TArray<uint8>>& contents, TArray<bool>& ok)
+{
+    contents.SetNum(paths.Num());
+    ok.Init(false, paths.Num());
+}
+
+
+bool FKamoIoUring::WriteFiles(const TArray<FString>& paths, const TArray<FString>& contents, bool sync, TArray<bool>& ok)
+{
+    ok.Init(false, paths.Num());
+    return false;
+}
+
+
+bool FKamoIoUring::SyncFiles(const TArray<FString>& paths)
+{
+    return false;
+}
+
+#endif // KAMO_IO_URING
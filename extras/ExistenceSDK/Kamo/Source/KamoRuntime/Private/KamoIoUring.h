@@ -0,0 +1,74 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+
+
+/**
+ * Batched file I/O for the file drivers through io_uring on Linux.
+ *
+ * Whole files are read, written and synced with many requests in flight at once. Data goes through a
+ * fixed set of staging buffers registered with the kernel, or straight to and from the caller's memory
+ * if registering them isn't allowed (memlock limits). Opening, renaming and closing stay synchronous,
+ * io_uring only got those in recent kernels.
+ *
+ * Create() returns null where io_uring isn't available: other platforms, kernels before 5.1 or containers
+ * that block the syscalls. The drivers then use FKamoFileHelper as before.
+ *
+ * Thread safe, calls are serialized.
+ */
+class FKamoIoUring
+{
+public:
+    static TUniquePtr<FKamoIoUring> Create();
+    ~FKamoIoUring();
+
+    // Read whole files. 'ok' tells which ones were read, a missing file doesn't fail the others.
+    void ReadFiles(const TArray<FString>& paths, TArray<TArray<uint8>>& contents, TArray<bool>& ok);
+
+    // Write whole files as UTF-8. Each goes to a temp file that's renamed over the target once written,
+    // and synced before that if 'sync' is set. Returns false if any of them failed, 'ok' tells which.
+    bool WriteFiles(const TArray<FString>& paths, const TArray<FString>& contents, bool sync, TArray<bool>& ok);
+
+    // fsync files and directories, all at once
+    bool SyncFiles(const TArray<FString>& paths);
+
+private:
+    FKamoIoUring();
+    bool Setup();
+
+    // One read, write or fsync of a whole file, split into buffer sized requests
+    struct FTransfer;
+    bool Run(TArray<FTransfer>& transfers);
+
+    FCriticalSection mutex;
+
+    // Ring state, see io_uring_setup(2)
+    int32 ring_fd;
+    uint32 sq_entries;
+    uint32 cq_entries;
+    void* sq_ring;
+    SIZE_T sq_ring_size;
+    void* cq_ring;
+    SIZE_T cq_ring_size;
+    void* sqes;
+    SIZE_T sqes_size;
+    uint32* sq_head;
+    uint32* sq_tail;
+    uint32* sq_mask;
+    uint32* sq_array;
+    uint32* cq_head;
+    uint32* cq_tail;
+    uint32* cq_mask;
+    void* cqes;
+
+    // Staging buffers, registered with the kernel if 'fixed_buffers' is set
+    TArray<uint8*> buffers;
+    int32 buffer_size;
+    bool fixed_buffers;
+
+    // Set if the ring is in an unknown state after an error, nothing is submitted after that
+    bool broken;
+};
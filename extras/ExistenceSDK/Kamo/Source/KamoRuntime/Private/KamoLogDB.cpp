@@ -0,0 +1,648 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+
+#include "KamoLogDB.h"
+#include "KamoRuntimeModule.h"
+#include "KamoTrace.h"
+
+#include "Misc/CommandLine.h"
+#include "Misc/DateTime.h"
+#include "Misc/Paths.h"
+
+
+static const int32 default_log_write_batch_size = 500;
+static const int32 default_log_write_batch_bytes = 4 * 1024 * 1024;
+static const int32 default_log_segment_mb = 64;
+
+
+KamoLogDB::KamoLogDB() :
+    write_batch_size(default_log_write_batch_size),
+    write_batch_bytes(default_log_write_batch_bytes),
+    sync_writes(true)
+{
+    serializer.GetTask().log_db = this;
+}
+
+KamoLogDB::~KamoLogDB()
+{
+    serializer.EnsureCompletion(true);
+}
+
+
+bool KamoLogDB::OnSessionCreated()
+{
+    // ~/.kamo/<tenant>/logdb, next to the directories of the file drivers
+    FString home_path = GetHomePath();
+    if (home_path.IsEmpty())
+    {
+        return false;
+    }
+    session_path = FPaths::GetPath(home_path) / TEXT("logdb");
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoLogDB: Session path is: %s"), *session_path);
+
+    // Can be overridden with -kamologbatch=, -kamologbatchbytes=, -kamologsegmentmb= and -kamolognosync
+    write_batch_size = config.write_batch_size > 0 ? config.write_batch_size : default_log_write_batch_size;
+    write_batch_bytes = config.write_batch_bytes > 0 ? config.write_batch_bytes : default_log_write_batch_bytes;
+    int32 segment_mb = default_log_segment_mb;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamologbatch="), write_batch_size);
+    FParse::Value(FCommandLine::Get(), TEXT("-kamologbatchbytes="), write_batch_bytes);
+    FParse::Value(FCommandLine::Get(), TEXT("-kamologsegmentmb="), segment_mb);
+    write_batch_size = FMath::Max(write_batch_size, 1);
+    segment_mb = FMath::Max(segment_mb, 1);
+    sync_writes = !FParse::Param(FCommandLine::Get(), TEXT("kamolognosync"));
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoLogDB: Writing in batches of %i objects or %i bytes%s, %i MB segments."), write_batch_size, write_batch_bytes,
+        sync_writes ? TEXT(", synced") : TEXT(""), segment_mb);
+
+    if (!store.Open(session_path, (int64)segment_mb * 1024 * 1024))
+    {
+        return false;
+    }
+
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoLogDB: URL: %s"), *GetSessionURL());
+    return true;
+}
+
+
+void KamoLogDB::CloseSession()
+{
+    KamoFileDriver::CloseSession();
+
+    // Release all remaining handlers just in case
+    for (const FString& region : handled_roots.Array())
+    {
+        SetHandler(KamoID(region), KamoID());
+    }
+
+    serializer.EnsureCompletion(true);
+    store.Close();
+}
+
+
+bool KamoLogDB::Write(const FString& id, const FString& root_id, const TOptional<FString>& state)
+{
+    TArray<FKamoLogStore::FWrite> writes;
+    writes.Add({ id, root_id, state });
+    return store.Append(writes, sync_writes);
+}
+
+// Root objects
+
+bool KamoLogDB::AddRootObject(const KamoID& id, const FString& state, bool ignore_if_exists)
+{
+    UE_LOG(LogKamoRuntime, Display, TEXT("KamoLogDB::AddRootObject: %s"), *id());
+
+    if (store.Contains(id()))
+    {
+        UE_CLOG(!ignore_if_exists, LogKamoRuntime, Display, TEXT("KamoLogDB::AddRootObject. Already exists: %s"), *id());
+        return false;
+    }
+
+    return Write(id(), FString(), state);
+}
+
+bool KamoLogDB::DeleteRootObject(const KamoID& id)
+{
+    if (!store.IsRoot(id()))
+    {
+        return false;
+    }
+
+    // The children and the root in one append
+    TArray<FString> children;
+    store.GetChildren(id(), children);
+
+    TArray<FKamoLogStore::FWrite> writes;
+    for (const FString& child : children)
+    {
+        writes.Add({ child, id(), TOptional<FString>() });
+    }
+    writes.Add({ id(), FString(), TOptional<FString>() });
+
+    return store.Append(writes, sync_writes);
+}
+
+bool KamoLogDB::UpdateRootObject(const KamoID& id, const FString& state)
+{
+    if (!store.IsRoot(id()))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::UpdateRootObject. Not found: %s"), *id());
+        return false;
+    }
+
+    return Write(id(), FString(), state);
+}
+
+KamoRootObject KamoLogDB::GetRootObject(const KamoID& id) const
+{
+    KamoRootObject root_object;
+
+    FString data;
+    FString root_id;
+    if (!store.Get(id(), data, &root_id) || !root_id.IsEmpty())
+    {
+        // Fail silently as the caller will log out a warning if applicable.
+        return root_object;
+    }
+
+    auto json_object = GetJsonObject(data);
+
+    if (!json_object.IsValid())
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::GetRootObject. Invalid json: %s"), *id());
+        return root_object;
+    }
+
+    root_object.id = id;
+    root_object.state = data;
+
+    // Handler objecs don't have handlers themselves
+    FString handler;
+    if (json_object->TryGetStringField("handler", handler))
+    {
+        root_object.handler_id = KamoID(handler);
+    }
+
+    return root_object;
+}
+
+TArray<KamoRootObject> KamoLogDB::FindRootObjects(const FString& class_name) const
+{
+    TArray<FString> ids;
+    store.GetRoots(ids);
+
+    TArray<KamoRootObject> root_objects;
+    for (const FString& id : ids)
+    {
+        auto root_id = KamoID(id);
+        if (class_name != "" && root_id.class_name != class_name)
+        {
+            continue;
+        }
+
+        auto root_object = GetRootObject(root_id);
+        if (!root_object.IsEmpty())
+        {
+            root_objects.Add(root_object);
+        }
+    }
+
+    return root_objects;
+}
+
+bool KamoLogDB::SetHandler(const KamoID& id, const KamoID& handler_id)
+{
+    UE_LOG(LogKamoRuntime, Log, TEXT("KamoLogDB::SetHandler: '%s' to '%s'"), *id(), *handler_id());
+
+    if (handler_id.IsEmpty())
+    {
+        if (!handled_roots.Contains(id()))
+        {
+            UE_LOG(LogKamoRuntime, Warning, TEXT("SetHandler(null): This instance is not registered for %s."), *id());
+        }
+        else
+        {
+            // Reset handler reference
+            KamoRootObject ob = GetRootObject(id);
+            ob.handler_id = KamoID();
+            Set(ob);
+            handled_roots.Remove(id());
+        }
+        return true;
+    }
+
+    auto root_object = GetRootObject(id);
+    if (root_object.IsEmpty())
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::SetHandler. Root not found: %s"), *id());
+        return false;
+    }
+
+    auto json_object = GetJsonObject(root_object.state);
+    json_object->SetStringField("handler", handler_id());
+
+    if (!UpdateRootObject(id, GetJsonString(json_object)))
+    {
+        return false;
+    }
+
+    handled_roots.Add(id());
+    return true;
+}
+
+// Objects
+
+bool KamoLogDB::AddObject(const KamoID& root_id, const KamoID& id, const FString& state)
+{
+    if (!store.IsRoot(root_id()))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::AddObject. Root not found: '%s'"), *root_id());
+        return false;
+    }
+
+    return Write(id(), root_id(), state);
+}
+
+bool KamoLogDB::DeleteObject(const KamoID& id)
+{
+    FString root_id;
+    if (!store.GetRoot(id(), root_id))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::DeleteObject. Not found: %s"), *id());
+        return false;
+    }
+
+    return Write(id(), root_id, TOptional<FString>());
+}
+
+bool KamoLogDB::DeleteChildObject(const KamoID& root_id, const KamoID& id)
+{
+    return Write(id(), root_id(), TOptional<FString>());
+}
+
+bool KamoLogDB::UpdateObject(const KamoID& id, const FString& state)
+{
+    FString root_id;
+    if (!store.GetRoot(id(), root_id))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::UpdateObject. Not found: %s"), *id());
+        return false;
+    }
+
+    return Write(id(), root_id, state);
+}
+
+KamoChildObject KamoLogDB::GetObject(const KamoID& id, bool fail_silently) const
+{
+    KamoChildObject object;
+
+    FString root_id;
+    if (!store.Get(id(), object.state, &root_id) || root_id.IsEmpty())
+    {
+        UE_CLOG(!fail_silently, LogKamoRuntime, Error, TEXT("KamoLogDB::GetObject: Not found: %s"), *id());
+        object.state.Reset();
+        return object;
+    }
+
+    object.id = id;
+    object.root_id = KamoID(root_id);
+    return object;
+}
+
+TArray<KamoChildObject> KamoLogDB::FindObjects(const KamoID& root_id, const FString& class_name) const
+{
+    KAMO_TRACE_SCOPE("LogDB.FindObjects", root_id);
+
+    TArray<FString> ids;
+    if (!root_id.IsEmpty())
+    {
+        store.GetChildren(root_id(), ids);
+    }
+    else if (class_name != "")
+    {
+        store.GetChildrenOfClass(class_name, ids);
+    }
+
+    TArray<KamoChildObject> objects;
+    objects.Reserve(ids.Num());
+    for (const FString& id : ids)
+    {
+        // Deleted since the ids were taken
+        auto object = GetObject(KamoID(id), true);
+        if (!object.IsEmpty())
+        {
+            objects.Add(MoveTemp(object));
+        }
+    }
+
+    return objects;
+}
+
+bool KamoLogDB::MoveObject(const KamoID& id, const KamoID& root_id)
+{
+    return MoveObjects({ id }, root_id);
+}
+
+bool KamoLogDB::MoveObjects(const TArray<KamoID>& ids, const KamoID& root_id)
+{
+    TArray<FKamoLogStore::FWrite> writes;
+    for (const KamoID& id : ids)
+    {
+        FKamoLogStore::FWrite& write = writes.AddDefaulted_GetRef();
+        FString state;
+        FString current_root_id;
+        if (!store.Get(id(), state, &current_root_id) || current_root_id.IsEmpty())
+        {
+            UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::MoveObjects. Not found: %s"), *id());
+            return false;
+        }
+
+        write.id = id();
+        write.root_id = root_id();
+        write.state = MoveTemp(state);
+    }
+
+    // See if destination root object exists, and if not just create it
+    if (!store.IsRoot(root_id()) && !AddRootObject(root_id, "{}"))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::MoveObjects. Target region doesn't exist and an attempt to create one failed: %s"), *root_id());
+        return false;
+    }
+
+    // A record carries the root id, rewriting the objects under the new root is the move
+    return store.Append(writes, sync_writes);
+}
+
+bool KamoLogDB::GetObjectVersions(const KamoID& root_id, TMap<FString, int64>& versions) const
+{
+    TArray<FString> ids;
+    store.GetChildren(root_id(), ids);
+    for (const FString& id : ids)
+    {
+        versions.Add(id, (int64)store.GetSequence(id));
+    }
+    return true;
+}
+
+void KamoLogDB::GatherStats(const TSharedPtr<FJsonObject>& stats) const
+{
+    store.GatherStats(stats);
+}
+
+// Handler
+
+bool KamoLogDB::AddHandlerObject(const KamoHandlerObject& handler)
+{
+    auto json_object = GetJsonObject(handler.state);
+    if (!json_object)
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::AddHandlerObject. Malformed json: %s"), *handler.state);
+        return false;
+    }
+
+    auto current_time = FDateTime::UtcNow().ToIso8601();
+
+    json_object->SetStringField("inbox_address", handler.inbox_address);
+    json_object->SetStringField("start_time", current_time);
+    json_object->SetStringField("last_refresh", current_time);
+
+    return AddRootObject(handler.id, GetJsonString(json_object));
+}
+
+bool KamoLogDB::DeleteHandlerObject(const KamoID& handler_id)
+{
+    // Reset all root objects that are referencing this handler
+    for (auto ob : FindRootObjects(""))
+    {
+        if (ob.handler_id == handler_id)
+        {
+            ob.handler_id = KamoID();
+            Set(ob);
+        }
+    }
+
+    return DeleteRootObject(handler_id);
+}
+
+bool KamoLogDB::RefreshHandler(const KamoID& handler_id, const TSharedPtr < FJsonObject >& stats)
+{
+    auto root_object = GetRootObject(handler_id);
+
+    if (root_object.IsEmpty())
+    {
+        return false;
+    }
+
+    auto json_object = GetJsonObject(root_object.state);
+
+    json_object->SetStringField("last_refresh", FDateTime::UtcNow().ToIso8601());
+    json_object->SetObjectField("stats", stats);
+
+    return UpdateRootObject(handler_id, GetJsonString(json_object));
+}
+
+KamoHandlerObject KamoLogDB::GetHandlerInfo(const KamoID& handler_id) const
+{
+    KamoHandlerObject handler_object;
+
+    auto root_object = GetRootObject(handler_id);
+
+    if (root_object.IsEmpty())
+    {
+        return handler_object;
+    }
+
+    auto json_object = GetJsonObject(root_object.state);
+
+    handler_object.id = root_object.id;
+    handler_object.state = root_object.state;
+    handler_object.inbox_address = json_object->GetStringField("inbox_address");
+
+    return handler_object;
+}
+
+// Unified
+
+bool KamoLogDB::Set(const KamoRootObject& object)
+{
+    auto json_object = GetJsonObject(object.state);
+
+    if (!object.IsEmpty())
+    {
+        if (object.handler_id.IsEmpty())
+        {
+            json_object->SetField("handler", MakeShared<FJsonValueNull>());
+        }
+        else
+        {
+            json_object->SetStringField("handler", object.handler_id());
+        }
+    }
+
+    auto new_state = GetJsonString(json_object);
+
+    return AddRootObject(object.id, new_state, true) || UpdateRootObject(object.id, new_state);
+}
+
+bool KamoLogDB::Set(const KamoChildObject& object)
+{
+    {
+        FScopeLock lock(&mutex);
+        objects_for_serialization.Push(object.id, object.root_id, object.state);
+    }
+
+    if (serializer.IsDone())
+    {
+        serializer.StartBackgroundTask();
+    }
+
+    return true;
+}
+
+bool KamoLogDB::Set(const KamoHandlerObject& object)
+{
+    auto json_object = GetJsonObject(object.state);
+
+    json_object->SetStringField("inbox_address", object.inbox_address);
+
+    auto new_state = GetJsonString(json_object);
+
+    return AddHandlerObject(object) || UpdateRootObject(object.id, new_state);
+}
+
+bool KamoLogDB::Delete(const KamoID& id)
+{
+    return DeleteRootObject(id) || DeleteObject(id);
+}
+
+TSharedPtr<KamoObject> KamoLogDB::Get(const KamoID& id) const
+{
+    TSharedPtr<KamoObject> object_ptr;
+
+    auto handler_object = GetHandlerInfo(id);
+
+    if (!handler_object.IsEmpty())
+    {
+        object_ptr = MakeShareable(new KamoObject);
+        object_ptr->id = handler_object.id;
+        object_ptr->state = handler_object.state;
+        return object_ptr;
+    }
+
+    auto root_object = GetRootObject(id);
+
+    if (!root_object.IsEmpty())
+    {
+        object_ptr = MakeShareable(new KamoObject);
+        object_ptr->id = root_object.id;
+        object_ptr->state = root_object.state;
+        return object_ptr;
+    }
+
+    auto object = GetObject(id);
+
+    if (!object.id.IsEmpty())
+    {
+        object_ptr = MakeShareable(new KamoObject);
+        object_ptr->id = object.id;
+        object_ptr->state = object.state;
+        return object_ptr;
+    }
+
+    return object_ptr;
+}
+
+
+void KamoLogDB::DoWork()
+{
+    // While there are objects to be serialized, take a batch of the ones with the highest priority
+    // and append them together.
+    TArray<FKamoSerializationQueue::Record> batch;
+    for (;;)
+    {
+        batch.Reset();
+        {
+            FScopeLock lock(&mutex);
+            objects_for_serialization.PopBatch(write_batch_size, write_batch_bytes, batch);
+        }
+
+        if (batch.Num() == 0)
+        {
+            return;
+        }
+
+        WriteBatch(batch);
+
+        // Failed writes are dropped like in KamoFileDB, retrying could keep the worker busy forever
+        {
+            FScopeLock lock(&mutex);
+            for (const auto& object : batch)
+            {
+                objects_for_serialization.Complete(object);
+            }
+        }
+    }
+}
+
+
+void KamoLogDB::WriteBatch(const TArray<FKamoSerializationQueue::Record>& batch)
+{
+    KAMO_TRACE_SCOPE("LogDB.WriteBatch", KamoID(), batch.Num());
+
+    TArray<FKamoLogStore::FWrite> writes;
+    writes.Reserve(batch.Num());
+    TMap<FString, bool> root_exists;
+    for (const auto& object : batch)
+    {
+        bool* exists = root_exists.Find(object.root_id());
+        if (!exists)
+        {
+            exists = &root_exists.Add(object.root_id(), store.IsRoot(object.root_id()));
+            UE_CLOG(!*exists, LogKamoRuntime, Error, TEXT("KamoLogDB::SerializerWorker - Root object not found: '%s'"), *object.root_id());
+        }
+
+        if (*exists)
+        {
+            writes.Add({ object.id(), object.root_id(), object.state });
+        }
+    }
+
+    if (writes.Num() && !store.Append(writes, sync_writes))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("KamoLogDB::SerializerWorker - Failed to write %i objects"), writes.Num());
+    }
+}
+
+// Helpers
+
+bool KamoLogDB::IsSerializationPending(const KamoID& id, bool bump_priority)
+{
+    FScopeLock lock(&mutex);
+    if (id.IsEmpty())
+    {
+        // See if any object is pending serialization
+        return !objects_for_serialization.IsEmpty();
+    }
+    else if (objects_for_serialization.Contains(id()))
+    {
+        if (bump_priority)
+        {
+            objects_for_serialization.Bump(id());
+        }
+        return true;
+    }
+    return false;
+}
+
+
+bool KamoLogDB::CancelIfPending(const KamoID& id)
+{
+    FScopeLock lock(&mutex);
+    return objects_for_serialization.Remove(id());
+}
+
+
+void KamoLogDB::SetSerializationPolicy(const KamoSerializationPolicy& policy)
+{
+    FScopeLock lock(&mutex);
+    objects_for_serialization.SetPolicy(policy);
+}
+
+
+TSharedPtr<FJsonObject> KamoLogDB::GetJsonObject(const FString& data) const
+{
+    TSharedPtr<FJsonObject> json_object;
+    TSharedRef< TJsonReader<> > json_reader = TJsonReaderFactory<>::Create(*data);
+
+    FJsonSerializer::Deserialize(json_reader, json_object);
+
+    return json_object;
+}
+
+FString KamoLogDB::GetJsonString(const TSharedPtr<FJsonObject>& json_object) const
+{
+    FString json_string;
+    TSharedRef< TJsonWriter<> > json_writer = TJsonWriterFactory<>::Create(&json_string);
+    FJsonSerializer::Serialize(json_object.ToSharedRef(), json_writer);
+
+    return json_string;
+}
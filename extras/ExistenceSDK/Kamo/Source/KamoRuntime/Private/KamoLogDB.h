@@ -0,0 +1,121 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "KamoDB.h"
+#include "KamoFileDriver.h"
+#include "KamoStructs.h"
+#include "KamoSerializationQueue.h"
+#include "KamoLogStore.h"
+
+#include "Json.h"
+#include "Async/AsyncWork.h"
+#include "Misc/ScopeLock.h"
+
+
+/**
+ * Log structured DB driver, "log" scheme. All objects of the tenant go to a single FKamoLogStore in
+ * ~/.kamo/<tenant>/logdb, an update is an append rather than a file rewrite.
+ *
+ * For single box and offline deployments, the store is owned by one process at a time. Handler locks
+ * are kept in memory for the same reason.
+ */
+class KAMORUNTIME_API KamoLogDB : public IKamoDB, public KamoFileDriver
+{
+    TSharedPtr<FJsonObject> GetJsonObject(const FString& data) const;
+    FString GetJsonString(const TSharedPtr<FJsonObject>& json_object) const;
+
+    FKamoLogStore store;
+
+    // Regions this instance is the handler of
+    TSet<FString> handled_roots;
+
+    // Serialization job management
+    FCriticalSection mutex;
+    FKamoSerializationQueue objects_for_serialization;
+
+    // Serializer worker
+    class FDBSerializerWorker : public FNonAbandonableTask
+    {
+    public:
+        KamoLogDB* log_db;
+        friend class FAsyncTask<FDBSerializerWorker>;
+
+        FORCEINLINE TStatId GetStatId() const
+        {
+            RETURN_QUICK_DECLARE_CYCLE_STAT(FDBSerializerWorker, STATGROUP_KamoAsync);
+        }
+
+        void DoWork() { log_db->DoWork(); }
+    };
+
+    FAsyncTask<FDBSerializerWorker> serializer;
+    void DoWork();
+
+    // What's queued is appended in batches with one sync per batch
+    int32 write_batch_size;
+    int32 write_batch_bytes;
+    bool sync_writes;
+    void WriteBatch(const TArray<FKamoSerializationQueue::Record>& batch);
+
+    // Appends a single write, synced if 'sync_writes' is set
+    bool Write(const FString& id, const FString& root_id, const TOptional<FString>& state);
+
+public:
+    KamoLogDB();
+    virtual ~KamoLogDB() override;
+
+    // IKamoDriver
+    FString GetDriverType() const override { return "db"; }
+    FString GetScheme() const override { return "log"; }
+    bool OnSessionCreated() override;
+    void CloseSession() override;
+
+    // IKamoDB
+    class IKamoDriver* GetDriver() override { return nullptr; }
+
+    // Unified object API
+    virtual bool Set(const KamoRootObject& object);
+    virtual bool Set(const KamoChildObject& object);
+    virtual bool Set(const KamoHandlerObject& object);
+    virtual bool Delete(const KamoID& id);
+    virtual TSharedPtr<KamoObject> Get(const KamoID& id) const;
+
+    // Check if object is pending serialization to DB and bump priority if needed
+    virtual bool IsSerializationPending(const KamoID& id, bool bump_priority = true);
+
+    // Remove object from serialization queue if it's there. Returns true if removed.
+    virtual bool CancelIfPending(const KamoID& id) override;
+    virtual void SetSerializationPolicy(const KamoSerializationPolicy& policy) override;
+
+    // Root object API
+    virtual bool AddRootObject(const KamoID& id, const FString& state, bool ignore_if_exists=false);
+    virtual bool DeleteRootObject(const KamoID& id);
+    virtual bool UpdateRootObject(const KamoID& id, const FString& state);
+    virtual KamoRootObject GetRootObject(const KamoID& id) const;
+    // 'class_name' is optional
+    virtual TArray<KamoRootObject> FindRootObjects(const FString& class_name) const;
+    virtual bool SetHandler(const KamoID& id, const KamoID& handler_id);
+
+    // Object API
+    virtual bool AddObject(const KamoID& root_id, const KamoID& id, const FString& state);
+    virtual bool DeleteObject(const KamoID& id);
+    virtual bool DeleteChildObject(const KamoID& root_id, const KamoID& id) override;
+    virtual bool UpdateObject(const KamoID& id, const FString& state);
+    virtual KamoChildObject GetObject(const KamoID& id, bool fail_silently = false) const override;
+    // Specify either 'root_id', 'class_name'
+    virtual TArray<KamoChildObject> FindObjects(const KamoID& root_id, const FString& class_name) const;
+    virtual bool MoveObject(const KamoID& id, const KamoID& root_id);
+    // The whole set is moved in one append
+    virtual bool MoveObjects(const TArray<KamoID>& ids, const KamoID& root_id) override;
+    // The sequence number of the last write is the version
+    virtual bool GetObjectVersions(const KamoID& root_id, TMap<FString, int64>& versions) const override;
+    virtual void GatherStats(const TSharedPtr<FJsonObject>& stats) const override;
+
+    // Handler API
+    virtual bool AddHandlerObject(const KamoHandlerObject& handler);
+    virtual bool DeleteHandlerObject(const KamoID& handler_id);
+    virtual bool RefreshHandler(const KamoID& handler_id, const TSharedPtr < FJsonObject >& stats);
+    virtual KamoHandlerObject GetHandlerInfo(const KamoID& handler_id) const;
+};
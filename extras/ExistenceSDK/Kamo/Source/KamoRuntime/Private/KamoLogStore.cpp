@@ -0,0 +1,825 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoLogStore.h"
+#include "KamoDriver.h"
+#include "KamoFileHelper.h"
+#include "KamoTrace.h"
+
+#include "Dom/JsonObject.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/Crc.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+
+
+static const uint32 log_magic = 0x474F4C4B; // 'KLOG'
+static const uint32 log_format_version = 1;
+
+// Segment header: magic, version
+static const int32 log_header_bytes = 4 + 4;
+
+// Size and CRC
+static const int32 log_record_header_bytes = 8;
+
+// Payload: sequence, type, id length, id, root id length, root id, state
+static const int32 log_min_payload_bytes = 8 + 1 + 2 + 2;
+
+enum class ELogRecordType : uint8
+{
+    Root,
+    Child,
+    Delete,
+};
+
+
+namespace KamoLog
+{
+    template <typename T>
+    void Write(TArray<uint8>& data, T value)
+    {
+        data.Append((const uint8*)&value, sizeof(T));
+    }
+
+    template <typename T>
+    T Read(const uint8* data)
+    {
+        T value;
+        FMemory::Memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    void WriteUTF8(TArray<uint8>& data, const FString& value, bool with_length)
+    {
+        FTCHARToUTF8 utf8(*value);
+        if (with_length)
+        {
+            Write<uint16>(data, (uint16)utf8.Length());
+        }
+        data.Append((const uint8*)utf8.Get(), utf8.Length());
+    }
+
+    FString ReadUTF8(const uint8* data, int32 length)
+    {
+        FUTF8ToTCHAR tchar((const ANSICHAR*)data, length);
+        return FString(tchar.Length(), tchar.Get());
+    }
+
+    FString ClassName(const FString& id)
+    {
+        FString class_name;
+        id.Split(TEXT("."), &class_name, nullptr);
+        return class_name;
+    }
+}
+
+
+FKamoLogStore::FKamoLogStore() :
+    segment_bytes(0),
+    active_segment(0),
+    next_segment(1),
+    next_sequence(1),
+    num_compactions(0),
+    compacted_bytes(0)
+{
+    compactor.GetTask().store = this;
+}
+
+
+FKamoLogStore::~FKamoLogStore()
+{
+    Close();
+}
+
+
+FString FKamoLogStore::SegmentPath(uint32 segment) const
+{
+    return directory / FString::Printf(TEXT("segment_%08u.log"), segment);
+}
+
+
+bool FKamoLogStore::Open(const FString& _directory, int64 _segment_bytes)
+{
+    KAMO_TRACE_SCOPE("LogStore.Open");
+    FScopeLock lock(&mutex);
+    directory = _directory;
+    segment_bytes = _segment_bytes;
+
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    if (!pf.DirectoryExists(*directory) && !pf.CreateDirectoryTree(*directory))
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Cannot create directory: %s"), *directory);
+        return false;
+    }
+
+    // Held until closed, the key directory can't follow writes of other processes
+    directory_lock.Reset(FKamoFileHelper::OpenWrite(*(directory / TEXT("_store.lock")), false, false));
+    if (!directory_lock)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: %s is in use by another process."), *directory);
+        return false;
+    }
+
+    if (!Recover() || !StartSegment())
+    {
+        directory_lock.Reset();
+        return false;
+    }
+
+    if (NeedsCompaction())
+    {
+        compactor.StartBackgroundTask();
+    }
+    return true;
+}
+
+
+void FKamoLogStore::Close()
+{
+    compactor.EnsureCompletion();
+
+    FScopeLock lock(&mutex);
+    writer.Reset();
+    segments.Reset();
+    keydir.Reset();
+    roots.Reset();
+    root_children.Reset();
+    class_children.Reset();
+    directory_lock.Reset();
+}
+
+
+void FKamoLogStore::EncodeHeader(TArray<uint8>& data)
+{
+    KamoLog::Write<uint32>(data, log_magic);
+    KamoLog::Write<uint32>(data, log_format_version);
+}
+
+
+int32 FKamoLogStore::EncodeRecord(TArray<uint8>& data, uint64 sequence, const FWrite& write)
+{
+    int32 start = data.Num();
+    data.AddZeroed(log_record_header_bytes);
+    KamoLog::Write<uint64>(data, sequence);
+    ELogRecordType type = !write.state.IsSet() ? ELogRecordType::Delete : write.root_id.IsEmpty() ? ELogRecordType::Root : ELogRecordType::Child;
+    data.Add((uint8)type);
+    KamoLog::WriteUTF8(data, write.id, true);
+    KamoLog::WriteUTF8(data, write.root_id, true);
+
+    int32 state_offset = data.Num() - start;
+    if (write.state.IsSet())
+    {
+        KamoLog::WriteUTF8(data, write.state.GetValue(), false);
+    }
+
+    uint32 payload_size = data.Num() - start - log_record_header_bytes;
+    uint32 crc = FCrc::MemCrc32(&data[start + log_record_header_bytes], payload_size);
+    FMemory::Memcpy(&data[start], &payload_size, sizeof(payload_size));
+    FMemory::Memcpy(&data[start + 4], &crc, sizeof(crc));
+    return state_offset;
+}
+
+
+bool FKamoLogStore::ScanSegment(const TArray<uint8>& data, TArray<FRecord>& records, int64& scanned_bytes)
+{
+    scanned_bytes = 0;
+    if (data.Num() < log_header_bytes || KamoLog::Read<uint32>(&data[0]) != log_magic || KamoLog::Read<uint32>(&data[4]) != log_format_version)
+    {
+        return false;
+    }
+
+    int64 pos = log_header_bytes;
+    while (pos + log_record_header_bytes + log_min_payload_bytes <= data.Num())
+    {
+        uint32 payload_size = KamoLog::Read<uint32>(&data[pos]);
+        uint32 crc = KamoLog::Read<uint32>(&data[pos + 4]);
+        int64 payload = pos + log_record_header_bytes;
+        if (payload_size < (uint32)log_min_payload_bytes || payload + payload_size > data.Num() || FCrc::MemCrc32(&data[payload], payload_size) != crc)
+        {
+            break;
+        }
+
+        const uint8* p = &data[payload];
+        const uint8* end = p + payload_size;
+        FRecord& record = records.AddDefaulted_GetRef();
+        record.offset = pos;
+        record.sequence = KamoLog::Read<uint64>(p);
+        record.type = p[8];
+        p += 9;
+
+        uint16 id_len = KamoLog::Read<uint16>(p);
+        p += 2;
+        if (p + id_len + 2 > end)
+        {
+            records.Pop();
+            break;
+        }
+        record.id = KamoLog::ReadUTF8(p, id_len);
+        p += id_len;
+
+        uint16 root_len = KamoLog::Read<uint16>(p);
+        p += 2;
+        if (p + root_len > end || record.type > (uint8)ELogRecordType::Delete)
+        {
+            records.Pop();
+            break;
+        }
+        record.root_id = KamoLog::ReadUTF8(p, root_len);
+        p += root_len;
+
+        record.state_offset = pos + (p - &data[pos]);
+        record.state_length = (int32)(end - p);
+        record.record_bytes = log_record_header_bytes + payload_size;
+        pos += record.record_bytes;
+    }
+
+    scanned_bytes = pos;
+    return true;
+}
+
+
+bool FKamoLogStore::Recover()
+{
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+
+    // Leftovers of a compaction that didn't finish
+    TArray<FString> names;
+    IFileManager::Get().FindFiles(names, *(directory / TEXT("*.tmp")), true, false);
+    for (const FString& name : names)
+    {
+        pf.DeleteFile(*(directory / name));
+    }
+
+    names.Reset();
+    IFileManager::Get().FindFiles(names, *(directory / TEXT("segment_*.log")), true, false);
+    TArray<uint32> numbers;
+    for (const FString& name : names)
+    {
+        numbers.Add((uint32)FCString::Atoi64(*FPaths::GetBaseFilename(name).RightChop(8)));
+    }
+    numbers.Sort();
+
+    // Latest record of every key, deletes included until all segments have been seen
+    TMap<FString, FEntry> latest;
+    TSet<FString> deleted;
+    int64 total_bytes = 0;
+
+    for (uint32 number : numbers)
+    {
+        FString path = SegmentPath(number);
+        TArray<uint8> data;
+        if (!FFileHelper::LoadFileToArray(data, *path))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Can't read %s"), *path);
+            return false;
+        }
+
+        TArray<FRecord> records;
+        int64 scanned_bytes;
+        if (!ScanSegment(data, records, scanned_bytes))
+        {
+            // Crashed before the header made it to disk, nothing else can be in it
+            UE_LOG(LogKamoDriver, Warning, TEXT("FKamoLogStore: Removing %s, it has no valid header."), *path);
+            pf.DeleteFile(*path);
+            continue;
+        }
+
+        if (records.Num() == 0 && scanned_bytes == data.Num())
+        {
+            // Active segment of a session that didn't write anything
+            pf.DeleteFile(*path);
+            continue;
+        }
+
+        UE_CLOG(scanned_bytes < data.Num(), LogKamoDriver, Warning, TEXT("FKamoLogStore: Ignoring %lld bytes of torn records at the end of %s"),
+            data.Num() - scanned_bytes, *path);
+
+        FSegment& segment = segments.Add(number);
+        segment.path = path;
+        segment.size = data.Num();
+        segment.live_bytes = 0;
+        segment.max_sequence = 0;
+        total_bytes += data.Num();
+
+        for (const FRecord& record : records)
+        {
+            segment.max_sequence = FMath::Max(segment.max_sequence, record.sequence);
+            next_sequence = FMath::Max(next_sequence, record.sequence + 1);
+
+            FEntry* existing = latest.Find(record.id);
+            if (existing && existing->sequence > record.sequence)
+            {
+                continue;
+            }
+
+            FEntry& entry = existing ? *existing : latest.Add(record.id);
+            entry.segment = number;
+            entry.offset = record.state_offset;
+            entry.length = record.state_length;
+            entry.record_bytes = record.record_bytes;
+            entry.sequence = record.sequence;
+            entry.root_id = record.root_id;
+            if (record.type == (uint8)ELogRecordType::Delete)
+            {
+                deleted.Add(record.id);
+            }
+            else
+            {
+                deleted.Remove(record.id);
+            }
+        }
+
+        next_segment = number + 1;
+    }
+
+    for (const auto& it : latest)
+    {
+        if (!deleted.Contains(it.Key))
+        {
+            Apply(it.Key, &it.Value);
+        }
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("FKamoLogStore: Recovered %i objects from %i segments, %lld bytes in %s"),
+        keydir.Num(), segments.Num(), total_bytes, *directory);
+    return true;
+}
+
+
+bool FKamoLogStore::StartSegment()
+{
+    // Call with 'mutex' held. Recovered segments are never appended to, a torn record would hide what follows.
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    uint32 number = next_segment++;
+    FString path = SegmentPath(number);
+
+    writer.Reset(pf.OpenWrite(*path, false, true));
+    TArray<uint8> data;
+    EncodeHeader(data);
+    if (!writer || !writer->Write(data.GetData(), data.Num()))
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Can't create segment %s"), *path);
+        writer.Reset();
+        return false;
+    }
+
+    FSegment& segment = segments.Add(number);
+    segment.path = path;
+    segment.size = data.Num();
+    segment.live_bytes = 0;
+    segment.max_sequence = 0;
+    active_segment = number;
+
+    // So the segment is found after a crash
+    FKamoFileHelper::Sync(*directory);
+    return true;
+}
+
+
+void FKamoLogStore::Apply(const FString& id, const FEntry* entry)
+{
+    if (FEntry* old = keydir.Find(id))
+    {
+        if (FSegment* segment = segments.Find(old->segment))
+        {
+            segment->live_bytes -= old->record_bytes;
+        }
+
+        if (old->root_id.IsEmpty())
+        {
+            roots.Remove(id);
+        }
+        else if (!entry || entry->root_id != old->root_id)
+        {
+            TSet<FString>* children = root_children.Find(old->root_id);
+            if (children && children->Remove(id) && children->Num() == 0)
+            {
+                root_children.Remove(old->root_id);
+            }
+
+            // Deleted, or turned into a root object
+            if (!entry || entry->root_id.IsEmpty())
+            {
+                FString class_name = KamoLog::ClassName(id);
+                TSet<FString>* objects = class_children.Find(class_name);
+                if (objects && objects->Remove(id) && objects->Num() == 0)
+                {
+                    class_children.Remove(class_name);
+                }
+            }
+        }
+    }
+
+    if (!entry)
+    {
+        keydir.Remove(id);
+        return;
+    }
+
+    keydir.Add(id, *entry);
+    if (FSegment* segment = segments.Find(entry->segment))
+    {
+        segment->live_bytes += entry->record_bytes;
+    }
+
+    if (entry->root_id.IsEmpty())
+    {
+        roots.Add(id);
+    }
+    else
+    {
+        root_children.FindOrAdd(entry->root_id).Add(id);
+        class_children.FindOrAdd(KamoLog::ClassName(id)).Add(id);
+    }
+}
+
+
+bool FKamoLogStore::Append(const TArray<FWrite>& writes, bool sync)
+{
+    KAMO_TRACE_SCOPE("LogStore.Append", KamoID(), writes.Num());
+    FString sync_path;
+    {
+        FScopeLock lock(&mutex);
+        if (!writer)
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Append to a store that isn't open: %s"), *directory);
+            return false;
+        }
+
+        FSegment& segment = segments.FindChecked(active_segment);
+        TArray<uint8> data;
+        TArray<FEntry> entries;
+        entries.Reserve(writes.Num());
+        for (const FWrite& write : writes)
+        {
+            int32 start = data.Num();
+            FEntry& entry = entries.AddDefaulted_GetRef();
+            entry.sequence = next_sequence++;
+            entry.segment = active_segment;
+            entry.offset = segment.size + start + EncodeRecord(data, entry.sequence, write);
+            entry.record_bytes = data.Num() - start;
+            entry.length = segment.size + data.Num() - entry.offset;
+            entry.root_id = write.root_id;
+        }
+
+        if (!writer->Write(data.GetData(), data.Num()) || !writer->Flush())
+        {
+            // What made it is past the last good record, carry on in a new segment
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Failed to write %i bytes to %s"), data.Num(), *segment.path);
+            segment.size = writer->Size();
+            StartSegment();
+            return false;
+        }
+
+        segment.size += data.Num();
+        segment.max_sequence = next_sequence - 1;
+        for (int32 i = 0; i < writes.Num(); i++)
+        {
+            Apply(writes[i].id, writes[i].state.IsSet() ? &entries[i] : nullptr);
+        }
+        sync_path = segment.path;
+
+        if (segment.size >= segment_bytes)
+        {
+            // Sealed, synced below if asked to be
+            StartSegment();
+            if (NeedsCompaction() && compactor.IsDone())
+            {
+                compactor.StartBackgroundTask();
+            }
+        }
+    }
+
+    // Readers don't wait for the disk
+    return !sync || FKamoFileHelper::Sync(*sync_path);
+}
+
+
+IFileHandle* FKamoLogStore::GetReader(uint32 number) const
+{
+    FSegment* segment = segments.Find(number);
+    if (!segment)
+    {
+        return nullptr;
+    }
+
+    if (!segment->reader)
+    {
+        segment->reader.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*segment->path, true));
+    }
+    return segment->reader.Get();
+}
+
+
+bool FKamoLogStore::ReadState(const FEntry& entry, FString& state) const
+{
+    IFileHandle* reader = GetReader(entry.segment);
+    TArray<uint8> data;
+    data.SetNumUninitialized(entry.length);
+    if (!reader || !reader->Seek(entry.offset) || !reader->Read(data.GetData(), data.Num()))
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Failed to read %i bytes at %lld of segment %u in %s"), entry.length, entry.offset, entry.segment, *directory);
+        return false;
+    }
+
+    state = KamoLog::ReadUTF8(data.GetData(), data.Num());
+    return true;
+}
+
+
+bool FKamoLogStore::Contains(const FString& id) const
+{
+    FScopeLock lock(&mutex);
+    return keydir.Contains(id);
+}
+
+
+bool FKamoLogStore::IsRoot(const FString& id) const
+{
+    FScopeLock lock(&mutex);
+    const FEntry* entry = keydir.Find(id);
+    return entry && entry->root_id.IsEmpty();
+}
+
+
+bool FKamoLogStore::Get(const FString& id, FString& state, FString* root_id) const
+{
+    FScopeLock lock(&mutex);
+    const FEntry* entry = keydir.Find(id);
+    if (!entry || !ReadState(*entry, state))
+    {
+        return false;
+    }
+
+    if (root_id)
+    {
+        *root_id = entry->root_id;
+    }
+    return true;
+}
+
+
+bool FKamoLogStore::GetRoot(const FString& id, FString& root_id) const
+{
+    FScopeLock lock(&mutex);
+    const FEntry* entry = keydir.Find(id);
+    if (!entry || entry->root_id.IsEmpty())
+    {
+        return false;
+    }
+
+    root_id = entry->root_id;
+    return true;
+}
+
+
+uint64 FKamoLogStore::GetSequence(const FString& id) const
+{
+    FScopeLock lock(&mutex);
+    const FEntry* entry = keydir.Find(id);
+    return entry ? entry->sequence : 0;
+}
+
+
+void FKamoLogStore::GetRoots(TArray<FString>& ids) const
+{
+    FScopeLock lock(&mutex);
+    ids = roots.Array();
+}
+
+
+void FKamoLogStore::GetChildren(const FString& root_id, TArray<FString>& ids) const
+{
+    FScopeLock lock(&mutex);
+    const TSet<FString>* children = root_children.Find(root_id);
+    ids = children ? children->Array() : TArray<FString>();
+}
+
+
+void FKamoLogStore::GetChildrenOfClass(const FString& class_name, TArray<FString>& ids) const
+{
+    FScopeLock lock(&mutex);
+    const TSet<FString>* objects = class_children.Find(class_name);
+    ids = objects ? objects->Array() : TArray<FString>();
+}
+
+
+bool FKamoLogStore::NeedsCompaction() const
+{
+    // Call with 'mutex' held
+    int64 sealed_bytes = 0;
+    int64 live_bytes = 0;
+    for (const auto& it : segments)
+    {
+        if (it.Key != active_segment)
+        {
+            sealed_bytes += it.Value.size;
+            live_bytes += it.Value.live_bytes;
+        }
+    }
+    return sealed_bytes >= segment_bytes && live_bytes * 2 < sealed_bytes;
+}
+
+
+void FKamoLogStore::Compact()
+{
+    KAMO_TRACE_SCOPE("LogStore.Compact");
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+
+    // Appends only go to the active segment, the sealed ones can be read without the lock
+    TArray<uint32> sealed;
+    {
+        FScopeLock lock(&mutex);
+        for (const auto& it : segments)
+        {
+            if (it.Key != active_segment)
+            {
+                sealed.Add(it.Key);
+            }
+        }
+    }
+    sealed.Sort();
+
+    struct FMove
+    {
+        FString id;
+        uint32 from_segment;
+        int64 from_offset;
+        FEntry entry;
+    };
+
+    int64 old_bytes = 0;
+    int64 new_bytes = 0;
+    TArray<uint8> output;
+    TArray<FMove> moves;
+    uint64 output_max_sequence = 0;
+
+    // Write out what's been copied so far as a new sealed segment and point the key directory at it
+    auto flush_output = [&]() -> bool
+    {
+        if (moves.Num() == 0)
+        {
+            return true;
+        }
+
+        uint32 number;
+        {
+            FScopeLock lock(&mutex);
+            number = next_segment++;
+        }
+
+        FString path = SegmentPath(number);
+        FString tmp_path = path + TEXT(".tmp");
+        {
+            TUniquePtr<IFileHandle> file(pf.OpenWrite(*tmp_path));
+            if (!file || !file->Write(output.GetData(), output.Num()) || !file->Flush(true))
+            {
+                UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Failed to write %s"), *tmp_path);
+                file.Reset();
+                pf.DeleteFile(*tmp_path);
+                return false;
+            }
+        }
+
+        if (!FKamoFileHelper::ReplaceAtomic(*path, *tmp_path) || !FKamoFileHelper::Sync(*directory))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Failed to rename %s"), *tmp_path);
+            pf.DeleteFile(*tmp_path);
+            return false;
+        }
+
+        FScopeLock lock(&mutex);
+        FSegment& segment = segments.Add(number);
+        segment.path = path;
+        segment.size = output.Num();
+        segment.live_bytes = 0;
+        segment.max_sequence = output_max_sequence;
+
+        for (FMove& move : moves)
+        {
+            // Skip what's been written again since it was copied
+            move.entry.segment = number;
+            const FEntry* current = keydir.Find(move.id);
+            if (current && current->segment == move.from_segment && current->offset == move.from_offset)
+            {
+                Apply(move.id, &move.entry);
+            }
+        }
+
+        new_bytes += output.Num();
+        output.Reset();
+        moves.Reset();
+        output_max_sequence = 0;
+        return true;
+    };
+
+    for (uint32 number : sealed)
+    {
+        FString path = SegmentPath(number);
+        TArray<uint8> data;
+        TArray<FRecord> records;
+        int64 scanned_bytes;
+        if (!FFileHelper::LoadFileToArray(data, *path) || !ScanSegment(data, records, scanned_bytes))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Can't read %s, compaction stopped."), *path);
+            return;
+        }
+        old_bytes += data.Num();
+
+        // Copy the live records, deletes are dropped as everything they can hide is in this set of segments
+        FScopeLock lock(&mutex);
+        for (const FRecord& record : records)
+        {
+            const FEntry* entry = keydir.Find(record.id);
+            if (!entry || entry->segment != number || entry->offset != record.state_offset)
+            {
+                continue;
+            }
+
+            if (output.Num() == 0)
+            {
+                EncodeHeader(output);
+            }
+
+            FMove& move = moves.AddDefaulted_GetRef();
+            move.id = record.id;
+            move.from_segment = number;
+            move.from_offset = record.state_offset;
+            move.entry = *entry;
+            move.entry.offset = output.Num() + (record.state_offset - record.offset);
+            output.Append(&data[record.offset], record.record_bytes);
+            output_max_sequence = FMath::Max(output_max_sequence, record.sequence);
+
+            if (output.Num() >= segment_bytes)
+            {
+                FScopeUnlock unlock(&mutex);
+                if (!flush_output())
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    if (!flush_output())
+    {
+        return;
+    }
+
+    // Nothing points at the old segments anymore. A delete record must not go before the states it hides,
+    // those are in segments with lower sequence numbers.
+    {
+        FScopeLock lock(&mutex);
+        sealed.Sort([this](uint32 a, uint32 b) { return segments[a].max_sequence < segments[b].max_sequence; });
+    }
+
+    for (uint32 number : sealed)
+    {
+        FString path;
+        {
+            FScopeLock lock(&mutex);
+            FSegment& segment = segments[number];
+            if (segment.live_bytes != 0)
+            {
+                UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: %s still has %lld live bytes after compaction"), *segment.path, segment.live_bytes);
+                return;
+            }
+            path = segment.path;
+            segments.Remove(number);
+        }
+
+        if (!pf.DeleteFile(*path))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoLogStore: Can't delete %s"), *path);
+            return;
+        }
+    }
+
+    FKamoFileHelper::Sync(*directory);
+
+    FScopeLock lock(&mutex);
+    num_compactions++;
+    compacted_bytes += old_bytes - new_bytes;
+    UE_LOG(LogKamoDriver, Log, TEXT("FKamoLogStore: Compacted %i segments from %lld to %lld bytes in %s"), sealed.Num(), old_bytes, new_bytes, *directory);
+}
+
+
+void FKamoLogStore::GatherStats(const TSharedPtr<FJsonObject>& stats) const
+{
+    FScopeLock lock(&mutex);
+    int64 total_bytes = 0;
+    int64 live_bytes = 0;
+    for (const auto& it : segments)
+    {
+        total_bytes += it.Value.size;
+        live_bytes += it.Value.live_bytes;
+    }
+
+    stats->SetNumberField("db_log_objects", keydir.Num());
+    stats->SetNumberField("db_log_segments", segments.Num());
+    stats->SetNumberField("db_log_bytes", total_bytes);
+    stats->SetNumberField("db_log_live_bytes", live_bytes);
+    stats->SetNumberField("db_log_compactions", num_compactions);
+    stats->SetNumberField("db_log_compacted_bytes", compacted_bytes);
+}
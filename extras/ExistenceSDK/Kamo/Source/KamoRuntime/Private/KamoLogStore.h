@@ -0,0 +1,152 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "Async/AsyncWork.h"
+#include "Misc/Optional.h"
+#include "KamoStructs.h"
+
+class IFileHandle;
+class IKamoFileHandle;
+
+
+/**
+ * Log structured object store of KamoLogDB.
+ *
+ * Every write is a record appended to the active segment file, nothing is ever rewritten in place. A
+ * record is uint32 payload size, uint32 payload CRC and the payload: sequence number, type (root, child
+ * or delete), object id, root id and state. The active segment is sealed and a new one started when it
+ * reaches the segment size.
+ *
+ * The key directory maps every live object to the segment and offset of its latest state and is kept
+ * in memory, a read is one seek. It's rebuilt on open by scanning the segments, the record with the
+ * highest sequence number wins. A torn record at the end of a segment is left out and writing carries
+ * on in a new segment.
+ *
+ * Compaction runs in the background once enough of the sealed segments is dead. It copies the live
+ * records of all sealed segments to new ones and deletes the old ones, oldest first, so a delete record
+ * never goes before the states it hides.
+ *
+ * The store directory is locked by the process that opens it. Thread safe.
+ */
+class FKamoLogStore
+{
+public:
+    FKamoLogStore();
+    ~FKamoLogStore();
+
+    // Lock 'directory' and recover the key directory. 'segment_bytes' is the size at which segments roll.
+    bool Open(const FString& directory, int64 segment_bytes);
+    void Close();
+
+    // A root object if 'root_id' is empty, a delete if 'state' is unset
+    struct FWrite
+    {
+        FString id;
+        FString root_id;
+        TOptional<FString> state;
+    };
+
+    // Append in one write, synced to disk if 'sync' is set
+    bool Append(const TArray<FWrite>& writes, bool sync);
+
+    bool Contains(const FString& id) const;
+    bool IsRoot(const FString& id) const;
+    bool Get(const FString& id, FString& state, FString* root_id = nullptr) const;
+    bool GetRoot(const FString& id, FString& root_id) const;  // Root id of a child object
+    uint64 GetSequence(const FString& id) const;  // Bumped on every write, 0 if not found
+
+    void GetRoots(TArray<FString>& ids) const;
+    void GetChildren(const FString& root_id, TArray<FString>& ids) const;
+    void GetChildrenOfClass(const FString& class_name, TArray<FString>& ids) const;
+
+    void GatherStats(const TSharedPtr<class FJsonObject>& stats) const;
+
+private:
+    struct FEntry
+    {
+        uint32 segment;
+        int64 offset;  // Of the state
+        int32 length;  // Of the state
+        int32 record_bytes;
+        uint64 sequence;
+        FString root_id;  // Empty for root objects
+    };
+
+    struct FSegment
+    {
+        FString path;
+        int64 size;
+        int64 live_bytes;  // Bytes of records in the key directory
+        uint64 max_sequence;
+        TUniquePtr<IFileHandle> reader;
+    };
+
+    struct FRecord
+    {
+        int64 offset;
+        uint64 sequence;
+        uint8 type;
+        FString id;
+        FString root_id;
+        int64 state_offset;
+        int32 state_length;
+        int32 record_bytes;
+    };
+
+    FString SegmentPath(uint32 segment) const;
+    static int32 EncodeRecord(TArray<uint8>& data, uint64 sequence, const FWrite& write);  // Returns the offset of the state in the record
+    static void EncodeHeader(TArray<uint8>& data);
+    static bool ScanSegment(const TArray<uint8>& data, TArray<FRecord>& records, int64& scanned_bytes);
+    bool Recover();
+    bool StartSegment();
+
+    // Call with 'mutex' held
+    bool ReadState(const FEntry& entry, FString& state) const;
+    void Apply(const FString& id, const FEntry* entry);
+    IFileHandle* GetReader(uint32 segment) const;
+
+    // Compaction, on a background task
+    bool NeedsCompaction() const;
+    void Compact();
+
+    class FCompactionWorker : public FNonAbandonableTask
+    {
+    public:
+        FKamoLogStore* store;
+        friend class FAsyncTask<FCompactionWorker>;
+
+        FORCEINLINE TStatId GetStatId() const
+        {
+            RETURN_QUICK_DECLARE_CYCLE_STAT(FCompactionWorker, STATGROUP_KamoAsync);
+        }
+
+        void DoWork() { store->Compact(); }
+    };
+
+    FAsyncTask<FCompactionWorker> compactor;
+
+    mutable FCriticalSection mutex;
+
+    FString directory;
+    int64 segment_bytes;
+    TUniquePtr<IKamoFileHandle> directory_lock;
+
+    // Key directory and what's derived from it
+    TMap<FString, FEntry> keydir;
+    TSet<FString> roots;
+    TMap<FString, TSet<FString>> root_children;  // Root id -> child ids
+    TMap<FString, TSet<FString>> class_children;  // Class name -> child ids
+
+    mutable TMap<uint32, FSegment> segments;
+    uint32 active_segment;
+    uint32 next_segment;
+    uint64 next_sequence;
+    TUniquePtr<IFileHandle> writer;
+
+    // Stats
+    int64 num_compactions;
+    int64 compacted_bytes;
+};
@@ -0,0 +1,223 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoRedisCache.h"
+#include "KamoStructs.h"
+
+#if WITH_REDIS_CLIENT
+#include "Dom/JsonObject.h"
+#include "HAL/RunnableThread.h"
+
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("RedisCacheHits"), STAT_RedisCacheHits, STATGROUP_Kamo);
+DECLARE_DWORD_COUNTER_STAT(TEXT("RedisCacheMisses"), STAT_RedisCacheMisses, STATGROUP_Kamo);
+DECLARE_MEMORY_STAT(TEXT("RedisCacheMemory"), STAT_RedisCacheMemory, STATGROUP_Kamo);
+
+
+FKamoRedisReadCache::FKamoRedisReadCache() :
+    num_bytes(0),
+    max_bytes(0),
+    enabled(false),
+    num_hits(0),
+    num_misses(0),
+    num_invalidations(0),
+    num_evictions(0),
+    thread(nullptr)
+{
+    for (auto& generation : generations)
+    {
+        generation = 0;
+    }
+}
+
+
+FKamoRedisReadCache::~FKamoRedisReadCache()
+{
+    Shutdown();
+}
+
+
+bool FKamoRedisReadCache::Start(const RedisSP& redis, int32 database_index, const FString& key_prefix, int64 _max_bytes)
+{
+    max_bytes = _max_bytes;
+
+    try
+    {
+        auto config = redis->command<std::vector<std::string>>("config", "get", "notify-keyspace-events");
+        FString flags = config.size() == 2 ? UTF8_TO_TCHAR(config[1].c_str()) : TEXT("");
+        if (!flags.Contains(TEXT("K"), ESearchCase::CaseSensitive) ||
+            !(flags.Contains(TEXT("A"), ESearchCase::CaseSensitive) || (flags.Contains(TEXT("g"), ESearchCase::CaseSensitive) && flags.Contains(TEXT("$")))))
+        {
+            UE_LOG(LogKamoDriver, Warning, TEXT("Redis read cache disabled, keyspace notifications are not enabled on the server (notify-keyspace-events='%s')."), *flags);
+            return false;
+        }
+
+        // Example: __keyspace@0__:ko:live:db:region.map_main_p~
+        channel_prefix = FString::Printf(TEXT("__keyspace@%i__:"), database_index);
+        subscriber = std::make_unique<sw::redis::Subscriber>(redis->subscriber());
+        subscriber->on_pmessage([this](std::string pattern, std::string channel, std::string event)
+        {
+            FString key = UTF8_TO_TCHAR(channel.c_str());
+            Invalidate(key.RightChop(channel_prefix.Len()));
+        });
+        subscriber->psubscribe(TCHAR_TO_UTF8(*(channel_prefix + key_prefix + TEXT(":*"))));
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Warning, TEXT("Redis read cache disabled, subscribe failed: %S"), e.what());
+        subscriber.reset();
+        return false;
+    }
+
+    enabled = true;
+    thread = FRunnableThread::Create(this, TEXT("KamoRedisCache"), 0, TPri_Normal);
+    UE_LOG(LogKamoDriver, Display, TEXT("Redis read cache enabled, %lld bytes max."), max_bytes);
+    return true;
+}
+
+
+void FKamoRedisReadCache::Shutdown()
+{
+    enabled = false;
+
+    // Deleting the subscriber disconnects it which ends the consume loop, see KamoRedisMQ
+    subscriber.reset();
+    if (thread)
+    {
+        thread->WaitForCompletion();
+        delete thread;
+        thread = nullptr;
+    }
+
+    Clear();
+}
+
+
+bool FKamoRedisReadCache::Get(const FString& key, TOptional<FString>& value)
+{
+    if (!enabled)
+    {
+        return false;
+    }
+
+    FScopeLock lock(&mutex);
+    if (const FEntry* entry = entries.Find(key))
+    {
+        INC_DWORD_STAT(STAT_RedisCacheHits);
+        num_hits++;
+        value = entry->value;
+        return true;
+    }
+
+    INC_DWORD_STAT(STAT_RedisCacheMisses);
+    num_misses++;
+    return false;
+}
+
+
+void FKamoRedisReadCache::Put(const FString& key, const TOptional<FString>& value, uint64 read_generation)
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    FScopeLock lock(&mutex);
+    if (read_generation != generations[GenerationIndex(key)])
+    {
+        // The key changed while the value was being read, it may be stale
+        return;
+    }
+
+    int64 bytes = (key.Len() + (value.IsSet() ? value->Len() : 0)) * sizeof(TCHAR) + sizeof(FEntry);
+    if (FEntry* existing = entries.Find(key))
+    {
+        num_bytes -= existing->bytes;
+    }
+    entries.Add(key, { value, bytes });
+    num_bytes += bytes;
+
+    if (num_bytes > max_bytes)
+    {
+        // Evict down to 3/4 of the limit. Map order is arbitrary which is good enough here.
+        for (auto it = entries.CreateIterator(); it && num_bytes > max_bytes * 3 / 4; ++it)
+        {
+            num_bytes -= it.Value().bytes;
+            it.RemoveCurrent();
+            num_evictions++;
+        }
+    }
+
+    SET_MEMORY_STAT(STAT_RedisCacheMemory, num_bytes);
+}
+
+
+void FKamoRedisReadCache::Invalidate(const FString& key)
+{
+    FScopeLock lock(&mutex);
+    generations[GenerationIndex(key)]++;
+    FEntry entry;
+    if (entries.RemoveAndCopyValue(key, entry))
+    {
+        num_bytes -= entry.bytes;
+        num_invalidations++;
+    }
+}
+
+
+void FKamoRedisReadCache::Clear()
+{
+    FScopeLock lock(&mutex);
+    for (auto& generation : generations)
+    {
+        generation++;
+    }
+    entries.Empty();
+    num_bytes = 0;
+    SET_MEMORY_STAT(STAT_RedisCacheMemory, 0);
+}
+
+
+void FKamoRedisReadCache::GatherStats(const TSharedPtr<FJsonObject>& stats) const
+{
+    uint64 hits = num_hits;
+    uint64 lookups = hits + num_misses;
+
+    FScopeLock lock(&mutex);
+    stats->SetBoolField("db_cache_enabled", enabled);
+    stats->SetNumberField("db_cache_entries", entries.Num());
+    stats->SetNumberField("db_cache_bytes", num_bytes);
+    stats->SetNumberField("db_cache_hits", hits);
+    stats->SetNumberField("db_cache_misses", num_misses);
+    stats->SetNumberField("db_cache_hit_rate", lookups ? (double)hits / lookups : 0.0);
+    stats->SetNumberField("db_cache_invalidations", num_invalidations);
+    stats->SetNumberField("db_cache_evictions", num_evictions);
+}
+
+
+uint32 FKamoRedisReadCache::Run()
+{
+    for (;;)
+    {
+        try
+        {
+            subscriber->consume();
+        }
+        catch (const sw::redis::TimeoutError&)
+        {
+            // No changes for a while
+        }
+        catch (const std::exception& e)
+        {
+            // Without notifications the cache can't be trusted anymore
+            if (enabled)
+            {
+                UE_LOG(LogKamoDriver, Warning, TEXT("Redis read cache disabled, notification channel failed: %S"), e.what());
+            }
+            enabled = false;
+            Clear();
+            return 0;
+        }
+    }
+}
+
+#endif // WITH_REDIS_CLIENT
@@ -0,0 +1,81 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "KamoRedisDriver.h"
+
+#if WITH_REDIS_CLIENT
+#include "HAL/Runnable.h"
+#include "Misc/Optional.h"
+#include "Misc/ScopeLock.h"
+
+#include <atomic>
+
+
+/**
+ * Client side cache of Redis string values.
+ *
+ * Entries are invalidated through keyspace notifications, which requires 'K' and 'A' (or 'g$') in the
+ * server's notify-keyspace-events config. If those aren't enabled the cache stays off. Keys that don't
+ * exist are cached as well so repeated lookups of missing keys are local too.
+ */
+class FKamoRedisReadCache : public FRunnable
+{
+public:
+    FKamoRedisReadCache();
+    virtual ~FKamoRedisReadCache() override;
+
+    // Subscribe to changes of keys starting with 'key_prefix'. Returns false if the cache can't be used.
+    bool Start(const RedisSP& redis, int32 database_index, const FString& key_prefix, int64 max_bytes);
+    void Shutdown();
+
+    bool IsEnabled() const { return enabled; }
+
+    // Returns true if 'key' is cached. 'value' is unset if the key doesn't exist.
+    bool Get(const FString& key, TOptional<FString>& value);
+
+    // Add a value read from Redis. Pass the generation of 'key' from before the read, the value is
+    // dropped if the key was invalidated in the meantime.
+    void Put(const FString& key, const TOptional<FString>& value, uint64 generation);
+    uint64 GetGeneration(const FString& key) const { return generations[GenerationIndex(key)]; }
+
+    void Invalidate(const FString& key);
+    void Clear();
+
+    void GatherStats(const TSharedPtr<FJsonObject>& stats) const;
+
+    // FRunnable
+    virtual uint32 Run() override;
+
+private:
+    struct FEntry
+    {
+        TOptional<FString> value;
+        int64 bytes;
+    };
+
+    mutable FCriticalSection mutex;
+    TMap<FString, FEntry> entries;
+    int64 num_bytes;
+    int64 max_bytes;
+
+    std::atomic<bool> enabled;
+
+    // Invalidation counters of keys by hash, so a write only drops concurrent reads of keys that share
+    // its slot instead of every read in flight.
+    static const int32 NumGenerations = 1024;
+    std::atomic<uint64> generations[NumGenerations];
+    static int32 GenerationIndex(const FString& key) { return GetTypeHash(key) % NumGenerations; }
+
+    std::atomic<uint64> num_hits;
+    std::atomic<uint64> num_misses;
+    std::atomic<uint64> num_invalidations;
+    std::atomic<uint64> num_evictions;
+
+    std::unique_ptr<sw::redis::Subscriber> subscriber;
+    FString channel_prefix;
+    class FRunnableThread* thread;
+};
+
+#endif // WITH_REDIS_CLIENT
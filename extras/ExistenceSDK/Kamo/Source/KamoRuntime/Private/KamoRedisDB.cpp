@@ -4,101 +4,396 @@
 #include "KamoRedisDB.h"
 #include "KamoRuntimeModule.h"
 #include "KamoFileHelper.h"
+#include "KamoTrace.h"
 
 
+#include "Async/Async.h"
 #include "GenericPlatform/GenericPlatformTime.h"
 
 #if WITH_REDIS_CLIENT
 
 static FString session_path; // MAEK COMPILE NOWW
 
-const float region_lock_refresh_interval = 4.4f; // TODO: Have this configurable
-const int region_lock_timeout_value = 20;  // 20 second timeout for the region lock. TODO: Have this configurable
+// Region lock defaults, override with -kamoredislockinterval= and -kamoredislocktimeout=
+const float default_region_lock_refresh_interval = 4.4f;
+const int32 default_region_lock_timeout = 20;
+
+// Number of buckets the child to root hash is split into in cluster mode
+const int32 child_root_buckets = 64;
+
+// Moves child objects between regions in one atomic step and updates the indexes and version stamps.
+// All objects are checked before anything is moved. Fails if an object doesn't exist, isn't in the
+// region it was looked up in or if its region is locked by someone else.
+// Every key touched is passed in KEYS:
+//   KEYS[1]    child to root hash
+//   KEYS[2..3] target versions and children
+//   then per object, 6 keys: source child key, target child key, source versions, source children, source lock,
+//   class children
+// ARGV: our lock id, target root id, then per object its id and source root id.
+static const char* move_objects_script = R"lua(
+local lock_id = ARGV[1]
+local to_root = ARGV[2]
+local num_objects = (#ARGV - 2) / 2
+
+local function object_keys(n)
+    local k = 4 + (n - 1) * 6
+    return KEYS[k], KEYS[k + 1], KEYS[k + 2], KEYS[k + 3], KEYS[k + 4], KEYS[k + 5]
+end
+
+for n = 1, num_objects do
+    local id = ARGV[1 + n * 2]
+    local from_root = ARGV[2 + n * 2]
+    local from_key, to_key, from_versions, from_children, from_lock, class_children = object_keys(n)
+    if redis.call('HGET', KEYS[1], id) ~= from_root or redis.call('EXISTS', from_key) == 0 then
+        return redis.error_reply('object not found: ' .. id .. ' in ' .. from_root)
+    end
+    local locker = redis.call('GET', from_lock)
+    if locker and locker ~= lock_id then
+        return redis.error_reply('region ' .. from_root .. ' of ' .. id .. ' is locked by ' .. locker)
+    end
+end
+
+for n = 1, num_objects do
+    local id = ARGV[1 + n * 2]
+    local from_root = ARGV[2 + n * 2]
+    local from_key, to_key, from_versions, from_children, from_lock, class_children = object_keys(n)
+    if from_root ~= to_root then
+        redis.call('RENAME', from_key, to_key)
+        redis.call('HDEL', from_versions, id)
+        redis.call('SREM', from_children, id)
+    end
+    redis.call('HINCRBY', KEYS[2], id, 1)
+    redis.call('SADD', KEYS[3], id)
+    redis.call('HSET', KEYS[1], id, to_root)
+    redis.call('SADD', class_children, id)
+end
+
+return num_objects
+)lua";
+
+// Extends all region locks we still own. KEYS are the lock keys, ARGV our lock id and the timeout in
+// milliseconds. Returns the TTL of each lock, 0 if it's gone or owned by someone else.
+static const char* refresh_locks_script = R"lua(
+local result = {}
+for i, key in ipairs(KEYS) do
+    if redis.call('GET', key) == ARGV[1] then
+        redis.call('PEXPIRE', key, ARGV[2])
+        result[i] = redis.call('PTTL', key)
+    else
+        result[i] = 0
+    end
+end
+return result
+)lua";
+
+// Serializer defaults, override with -kamoredisworkers=, -kamoredisbatch= and -kamoredisbatchbytes=
+const int32 default_num_writers = 4;
+const int32 default_write_batch_size = 500;
+const int32 default_write_batch_bytes = 4 * 1024 * 1024;
+
+
 
+// Deletes the lock in KEYS[1] if it's still ours, ARGV[1] is our lock id
+static const char* unlock_script = R"lua(
+if redis.call('GET', KEYS[1]) == ARGV[1] then
+    return redis.call('DEL', KEYS[1])
+end
+return 0
+)lua";
 
 
-class LockMutex : public sw::redis::RedLockMutexVessel
+// Region lock, a key holding our lock id with a TTL. The lock is taken for the full timeout and
+// extended by KamoRedisDB::RefreshRegionLocks() from there. Goes through the DB driver's connections
+// so it works the same in cluster mode.
+class LockMutex
 {
 public:
-    LockMutex(std::shared_ptr<sw::redis::Redis> instance, const FString& lock_name, const FString& lock_id, int timeout) :
-        sw::redis::RedLockMutexVessel(*instance),
+    LockMutex(const KamoRedisDB* db, const FString& lock_name, const FString& lock_id, int timeout) :
+        _db(db),
         _lock_name(lock_name),
         _lock_id(lock_id),
         _timeout(timeout),
-        _redisPtr(instance)
+        _locked(false)
     {
-        _lock_info.locked = false;
     }
 
     bool Lock()
     {
-        // First try the lock with short timeout just to see if we can acquire it
-        _lock_info = sw::redis::RedLockMutexVessel::lock(
-            TCHAR_TO_UTF8(*_lock_name),                 // resource
-            TCHAR_TO_UTF8(*_lock_id),                   // random_string
-            std::chrono::milliseconds(100),             // ttl
-            3                                           // retry_count
-        );
+        std::string name = TCHAR_TO_UTF8(*_lock_name);
+        std::string id = TCHAR_TO_UTF8(*_lock_id);
 
-        if (_lock_info.locked)
+        try
         {
-            // Immediately extend the lock by our given timeout value
-            Refresh();
-        }
+            for (int32 attempt = 0; attempt < 3 && !_locked; attempt++)
+            {
+                if (attempt > 0)
+                {
+                    FPlatformProcess::Sleep(0.05f);
+                }
 
-        if (!_lock_info.locked)
-        {
-            // See if we can get the lock id
-            FString locker = "(lock key missing!)";
-            auto val = _redisPtr->get(TCHAR_TO_UTF8(*_lock_name));
-            if (val)
+                _locked = _db->Call([&](auto& redis)
+                {
+                    return redis.set(name, id, std::chrono::seconds(_timeout), sw::redis::UpdateType::NOT_EXIST);
+                });
+            }
+
+            if (!_locked)
             {
-                locker = FString(val->c_str());
+                // See if we can get the lock id
+                FString locker = "(lock key missing!)";
+                auto val = _db->Call([&](auto& redis) { return redis.get(name); });
+                if (val)
+                {
+                    locker = FString(val->c_str());
+                }
+                UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::LockMutex on %s failed, already locked by %s."), *_lock_name, *locker);
             }
-            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::LockMutex on %s failed, already locked by %s."), *_lock_name, *locker);
-            return false;
+        }
+        catch (const std::exception& e)
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::LockMutex on %s failed: %S"), *_lock_name, e.what());
         }
 
-
-        return _lock_info.locked;
+        return _locked;
     }
 
     void Unlock()
     {
-        sw::redis::RedLockMutexVessel::unlock(_lock_info);
-    }
-    
-    bool Refresh()
-    {
-        _lock_info = sw::redis::RedLockMutexVessel::extend_lock(_lock_info, std::chrono::seconds(_timeout));
-        return _lock_info.locked;
+        if (!_locked)
+        {
+            return;
+        }
+
+        std::vector<std::string> keys = { TCHAR_TO_UTF8(*_lock_name) };
+        std::vector<std::string> args = { TCHAR_TO_UTF8(*_lock_id) };
+        try
+        {
+            _db->Call([&](auto& redis)
+            {
+                return redis.template eval<long long>(unlock_script, keys.begin(), keys.end(), args.begin(), args.end());
+            });
+        }
+        catch (const std::exception& e)
+        {
+            // It times out eventually
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::LockMutex failed to unlock %s: %S"), *_lock_name, e.what());
+        }
+        _locked = false;
     }
 
 private:
 
+    const KamoRedisDB* _db;
     FString _lock_name;
     FString _lock_id;
     int _timeout;
-    LockInfo _lock_info;
-    std::shared_ptr<sw::redis::Redis> _redisPtr;
+    bool _locked;
 };
 
 
 
 KamoRedisDB::KamoRedisDB() :
-    last_region_lock_refresh_seconds(1000.0f)  // High enough number to trigger a refresh on first tick.
+    num_writers(default_num_writers),
+    write_batch_size(default_write_batch_size),
+    write_batch_bytes(default_write_batch_bytes),
+    last_region_lock_refresh_ms(0.0f),
+    last_region_lock_refresh_seconds(1000.0f),  // High enough number to trigger a refresh on first tick.
+    region_lock_refresh_interval(default_region_lock_refresh_interval),
+    region_lock_timeout(default_region_lock_timeout)
 {
-    serializer.GetTask().db = this;
     region_lock_refresher.GetTask().db = this;
 }
 
 KamoRedisDB::~KamoRedisDB()
 {
-    serializer.EnsureCompletion(true);
+    StopWriters();
+    read_cache.Reset();
     region_lock_refresher.EnsureCompletion(true);
 }
 
 
+bool KamoRedisDB::OnSessionCreated()
+{
+    num_writers = config.num_writers > 0 ? config.num_writers : default_num_writers;
+    write_batch_size = config.write_batch_size > 0 ? config.write_batch_size : default_write_batch_size;
+    write_batch_bytes = config.write_batch_bytes > 0 ? config.write_batch_bytes : default_write_batch_bytes;
+
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredisworkers="), num_writers);
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredisbatch="), write_batch_size);
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredisbatchbytes="), write_batch_bytes);
+    num_writers = FMath::Clamp(num_writers, 1, 64);
+    write_batch_size = FMath::Max(write_batch_size, 1);
+
+    region_lock_refresh_interval = config.region_lock_refresh_interval > 0.0f ? config.region_lock_refresh_interval : default_region_lock_refresh_interval;
+    region_lock_timeout = config.region_lock_timeout > 0 ? config.region_lock_timeout : default_region_lock_timeout;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredislockinterval="), region_lock_refresh_interval);
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredislocktimeout="), region_lock_timeout);
+    UE_CLOG(region_lock_refresh_interval * 2.0f > region_lock_timeout, LogKamoDriver, Warning,
+        TEXT("KamoRedisDB: Region lock refresh interval %.1fs is more than half the lock timeout %is, locks may expire."), region_lock_refresh_interval, region_lock_timeout);
+
+    if (!KamoRedisDriver::OnSessionCreated() || !EnsureIndexes() || !RepairMoves())
+    {
+        return false;
+    }
+
+    journal_directory = config.journal_directory;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamojournal="), journal_directory);
+    if (!journal_directory.IsEmpty())
+    {
+        // One journal per tenant, session and server by default. The server id is the same after a
+        // restart so its journal is replayed, tools without one get a journal per process.
+        FString instance_name = config.instance_name.IsEmpty() ? FString::Printf(TEXT("pid%u"), FPlatformProcess::GetCurrentProcessId()) : config.instance_name;
+        journal_name = (Key() + TEXT("_") + instance_name).Replace(TEXT(":"), TEXT("_"));
+        FParse::Value(FCommandLine::Get(), TEXT("-kamojournalname="), journal_name);
+
+        if (!ReplayJournal())
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB: Failed to replay the write journal in %s, not starting."), *journal_directory);
+            return false;
+        }
+
+        journal = MakeUnique<FKamoWriteJournal>();
+        int32 sync_interval_ms = config.journal_sync_interval_ms > 0 ? config.journal_sync_interval_ms : 10;
+        if (!journal->Open(journal_directory, journal_name, sync_interval_ms))
+        {
+            journal.Reset();
+            return false;
+        }
+    }
+
+    StartWriters();
+
+    int32 read_cache_mb = config.read_cache_mb;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamorediscache="), read_cache_mb);
+    if (read_cache_mb > 0 && cluster_mode)
+    {
+        // Keyspace notifications are per node, the cache would only see changes on one shard
+        UE_LOG(LogKamoDriver, Warning, TEXT("KamoRedisDB: The read cache is not supported in cluster mode."));
+    }
+    else if (read_cache_mb > 0)
+    {
+        read_cache = MakeUnique<FKamoRedisReadCache>();
+        if (!read_cache->Start(redisPtr, database_index, Key(), (int64)read_cache_mb * 1024 * 1024))
+        {
+            read_cache.Reset();
+        }
+    }
+
+    return true;
+}
+
+
+void KamoRedisDB::CloseSession()
+{
+    // Flush the write queues while we still have a connection
+    StopWriters();
+
+    if (journal)
+    {
+        // A journal left behind is replayed on the next start. Only keep it if something didn't make
+        // it to the DB, a replay of old writes could overwrite what other servers write in the meantime.
+        journal->Sync();
+        int32 num_pending = journal->NumPending();
+        journal.Reset();
+        if (num_pending == 0)
+        {
+            FKamoWriteJournal::Reset(journal_directory, journal_name);
+        }
+        else
+        {
+            UE_LOG(LogKamoDriver, Warning, TEXT("KamoRedisDB: %i writes failed to reach the DB and are left in the journal %s."), num_pending, *journal_name);
+        }
+    }
+    read_cache.Reset();
+    KamoRedisDriver::CloseSession();
+}
+
+
+int32 KamoRedisDB::GetDefaultPoolSize() const
+{
+    // A connection per writer, plus the game thread, the region lock refresher and the page prefetch
+    // of FindObjectsStreamed()
+    return num_writers + 3;
+}
+
+
+KamoRedisDB::FWriter::FWriter(KamoRedisDB* _db) :
+    db(_db),
+    wake_event(FPlatformProcess::GetSynchEventFromPool(false)),
+    thread(nullptr),
+    stopping(false),
+    drain(true)
+{
+}
+
+
+KamoRedisDB::FWriter::~FWriter()
+{
+    FPlatformProcess::ReturnSynchEventToPool(wake_event);
+}
+
+
+uint32 KamoRedisDB::FWriter::Run()
+{
+    while (!stopping)
+    {
+        wake_event->Wait();
+        db->DoWork(*this);
+    }
+
+    // Anything queued after the last round
+    if (drain)
+    {
+        db->DoWork(*this);
+    }
+    return 0;
+}
+
+
+void KamoRedisDB::FWriter::Stop()
+{
+    stopping = true;
+    wake_event->Trigger();
+}
+
+
+void KamoRedisDB::StartWriters()
+{
+    for (int32 i = 0; i < num_writers; i++)
+    {
+        auto writer = MakeUnique<FWriter>(this);
+        writer->queue.SetPolicy(serialization_policy);
+        writer->thread = FRunnableThread::Create(writer.Get(), *FString::Printf(TEXT("KamoRedisWriter%i"), i), 0, TPri_Normal);
+        writers.Add(MoveTemp(writer));
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: Started %i writers, batch size %i objects or %i bytes."), num_writers, write_batch_size, write_batch_bytes);
+}
+
+
+void KamoRedisDB::StopWriters(bool drain)
+{
+    for (auto& writer : writers)
+    {
+        writer->drain = drain;
+        if (writer->thread)
+        {
+            // Stop() is called by Kill() and the writer drains its queue before exiting
+            writer->thread->Kill(true);
+            delete writer->thread;
+            writer->thread = nullptr;
+        }
+    }
+    writers.Empty();
+}
+
+
+KamoRedisDB::FWriter& KamoRedisDB::GetWriter(const KamoID& root_id) const
+{
+    return *writers[GetTypeHash(root_id()) % (uint32)writers.Num()];
+}
+
+
 void KamoRedisDB::Tick(float DeltaTime)
 {
     IKamoDriver::Tick(DeltaTime);
@@ -120,13 +415,28 @@ bool KamoRedisDB::AddRootObject(const KamoID& id, const FString& state, bool ign
     
     try
     {
-        if (redisPtr->exists(TCHAR_TO_UTF8(*key)) == 1)
+        if (Call([&](auto& redis) { return redis.exists(TCHAR_TO_UTF8(*key)); }) == 1)
         {
             UE_CLOG(!ignore_if_exists, LogKamoRuntime, Display, TEXT("KamoFileDB::AddRootObject. Already exists: %s"), *id());
             return false;
         }
 
-        if (!redisPtr->set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state)))
+        // The class indexes live on other shards in cluster mode
+        auto tx = Transaction(key);
+        tx.set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state));
+        if (!cluster_mode)
+        {
+            tx.sadd(TCHAR_TO_UTF8(*ClassRootsKey(id.class_name)), TCHAR_TO_UTF8(*id()))
+                .sadd(TCHAR_TO_UTF8(*RootClassesKey()), TCHAR_TO_UTF8(*id.class_name));
+        }
+        auto replies = tx.exec();
+        InvalidateCached(key);
+        if (cluster_mode)
+        {
+            clusterPtr->sadd(TCHAR_TO_UTF8(*ClassRootsKey(id.class_name)), TCHAR_TO_UTF8(*id()));
+            clusterPtr->sadd(TCHAR_TO_UTF8(*RootClassesKey()), TCHAR_TO_UTF8(*id.class_name));
+        }
+        if (!replies.get<bool>(0))
         {
             UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::AddRootObject failed for %s"), *id());
         }
@@ -143,10 +453,23 @@ bool KamoRedisDB::AddRootObject(const KamoID& id, const FString& state, bool ign
 
 bool KamoRedisDB::DeleteRootObject(const KamoID& id) 
 {
-    // NOTE: Not deleting child keys (yet)
+    // NOTE: Not deleting child keys (yet), they stay in the region's child index as well.
     try
     {
-        return redisPtr->del(TCHAR_TO_UTF8(*(RootKey(id)))) == 1;
+        if (cluster_mode)
+        {
+            clusterPtr->srem(TCHAR_TO_UTF8(*ClassRootsKey(id.class_name)), TCHAR_TO_UTF8(*id()));
+        }
+
+        auto tx = Transaction(RootKey(id));
+        tx.del(TCHAR_TO_UTF8(*VersionsKey(id)));
+        if (!cluster_mode)
+        {
+            tx.srem(TCHAR_TO_UTF8(*ClassRootsKey(id.class_name)), TCHAR_TO_UTF8(*id()));
+        }
+        auto replies = tx.del(TCHAR_TO_UTF8(*(RootKey(id)))).exec();
+        InvalidateCached(RootKey(id));
+        return replies.get<long long>(cluster_mode ? 1 : 2) == 1;
     }
     catch (const std::exception& e)
     {
@@ -162,13 +485,15 @@ bool KamoRedisDB::UpdateRootObject(const KamoID& id, const FString& state)
 
     try
     {
-        if (redisPtr->exists(TCHAR_TO_UTF8(*key)) != 1)
+        if (Call([&](auto& redis) { return redis.exists(TCHAR_TO_UTF8(*key)); }) != 1)
         {
             UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::UpdateRootObject: Object doesn't exist: %s"), *id());
             return false;
         }
 
-        if (!redisPtr->set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state)))
+        bool ok = Call([&](auto& redis) { return redis.set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state)); });
+        InvalidateCached(key);
+        if (!ok)
         {
             UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::UpdateRootObject failed for %s"), *id());
         }
@@ -196,10 +521,10 @@ KamoRootObject KamoRedisDB::GetRootObject(const KamoID& id) const
 
     try
     {
-        auto val = redisPtr->get(TCHAR_TO_UTF8(*key));
+        auto val = CachedGet(key);
         if (val)
         {
-            data = FString(val->c_str());
+            data = *val;
         }
         else
         {
@@ -239,40 +564,37 @@ KamoRootObject KamoRedisDB::GetRootObject(const KamoID& id) const
 
 TArray<KamoRootObject> KamoRedisDB::FindRootObjects(const FString& class_name) const
 {
-    // Note: 'class_name' is never used.
-
     TArray<KamoRootObject> objects;
-    
-    // Example: ko:live:db:region.map_main_p:
-    FString pattern = Key(FString::Printf(TEXT("*~")));
+    std::vector<std::string> ids;
 
-    long long cursor = 0;
-    long long count = 1000;
-
-    // Get all keys that match the pattern
-    std::vector<std::string> keys;
-    do
+    try
     {
-        cursor = redisPtr->scan(cursor, TCHAR_TO_UTF8(*pattern), count, std::back_inserter(keys));
-    } 
-    while (cursor != 0);
-
-    if (keys.empty())
+        if (!class_name.IsEmpty())
+        {
+            Call([&](auto& redis) { redis.smembers(TCHAR_TO_UTF8(*ClassRootsKey(class_name)), std::back_inserter(ids)); });
+        }
+        else
+        {
+            std::vector<std::string> class_names;
+            Call([&](auto& redis) { redis.smembers(TCHAR_TO_UTF8(*RootClassesKey()), std::back_inserter(class_names)); });
+            for (const auto& name : class_names)
+            {
+                FString class_roots_key = ClassRootsKey(UTF8_TO_TCHAR(name.c_str()));
+                Call([&](auto& redis) { redis.smembers(TCHAR_TO_UTF8(*class_roots_key), std::back_inserter(ids)); });
+            }
+        }
+    }
+    catch (const std::exception& e)
     {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::FindRootObjects failed: %S"), e.what());
         return objects;
-    }   
+    }
 
-    for (auto i = 0; i < keys.size(); i++)
+    for (const auto& id : ids)
     {
-        KamoID root_id, tmp;
-        if (ParseKey(keys[i].c_str(), root_id))
+        KamoRootObject root_object = GetRootObject(KamoID(UTF8_TO_TCHAR(id.c_str())));
+        if (!root_object.IsEmpty())
         {
-            KamoRootObject root_object = GetRootObject(root_id);
-            if (class_name != "" && root_object.id.class_name != class_name) 
-            {
-                continue;
-            }
-
             objects.Add(root_object);
         }
     }
@@ -303,7 +625,12 @@ bool KamoRedisDB::SetHandler(const KamoID& id, const KamoID& handler_id)
             Set(ob);
 
 			// Remove lock
-            LockMutex* rlmutex = region_locks.FindAndRemoveChecked(*id());
+            LockMutex* rlmutex;
+            {
+                FScopeLock lock(&region_locks_mutex);
+                rlmutex = region_locks.FindAndRemoveChecked(*id());
+                region_lock_health.Remove(*id());
+            }
             rlmutex->Unlock();
             delete rlmutex;
 		}
@@ -322,11 +649,17 @@ bool KamoRedisDB::SetHandler(const KamoID& id, const KamoID& handler_id)
 	// Try lock the root object
     if (!handler_id.IsEmpty() && !region_locks.Contains(*id()))
 	{
-        FString lock_name = Key("locks:" + id());
-        LockMutex* rlmutex = new LockMutex(redisPtr, lock_name, lock_id, region_lock_timeout_value);
-        region_locks.Add(*id(), rlmutex);
+        FString lock_name = LockKey(id);
+        LockMutex* rlmutex = new LockMutex(this, lock_name, lock_id, region_lock_timeout);
+        bool locked = rlmutex->Lock();
 
-        if (!rlmutex->Lock())
+        {
+            FScopeLock lock(&region_locks_mutex);
+            region_locks.Add(*id(), rlmutex);
+            region_lock_health.Add(*id(), { locked ? region_lock_timeout * 1000LL : 0LL, locked ? FPlatformTime::Seconds() : 0.0 });
+        }
+
+        if (!locked)
         {
             return false;
         }
@@ -353,7 +686,13 @@ bool KamoRedisDB::AddObject(const KamoID& root_id, const KamoID& id, const FStri
 
     try
     {
-        if (!redisPtr->set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state)))
+        auto tx = Transaction(key);
+        tx.set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state));
+        IndexChild(tx, root_id, id);
+        auto replies = tx.exec();
+        InvalidateCached(key);
+        UpdateChildRoots({ { id, root_id } });
+        if (!replies.get<bool>(0))
         {
             UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::AddObject %s failed."), *key);
             return false;
@@ -375,7 +714,13 @@ bool KamoRedisDB::DeleteObject(const KamoID& id)
     {
         try
         {
-            return redisPtr->del(TCHAR_TO_UTF8(*(ChildKey(root_id, id)))) == 1;
+            auto tx = Transaction(ChildKey(root_id, id));
+            tx.del(TCHAR_TO_UTF8(*(ChildKey(root_id, id))));
+            UnindexChild(tx, root_id, id);
+            auto replies = tx.exec();
+            InvalidateCached(ChildKey(root_id, id));
+            UpdateChildRoots({ { id, KamoID() } });
+            return replies.get<long long>(0) == 1;
         }
         catch (const std::exception& e)
         {
@@ -406,8 +751,10 @@ bool KamoRedisDB::UpdateObject(const KamoID& id, const FString& state)
 
 KamoChildObject KamoRedisDB::GetObject(const KamoID& id, bool fail_silently) const
 {
+    KAMO_TRACE_SCOPE("RedisDB.GetObject", id);
     KamoChildObject object;
-    KamoID root_id = FindRootIDOfChild(id, fail_silently);
+    bool cached_root = false;
+    KamoID root_id = CachedFindRootIDOfChild(id, fail_silently, cached_root);
     if (!root_id.IsValid())
     {
         return object;
@@ -418,10 +765,16 @@ KamoChildObject KamoRedisDB::GetObject(const KamoID& id, bool fail_silently) con
 
     try
     {
-        auto val = redisPtr->get(TCHAR_TO_UTF8(*key));
+        auto val = CachedGet(key);
         if (val)
         {
-            data = FString(val->c_str());
+            data = *val;
+        }
+        else if (cached_root)
+        {
+            // Moved or deleted since the root was cached, look it up again
+            InvalidateCached(TEXT("root#") + id());
+            return GetObject(id, fail_silently);
         }
         else
         {
@@ -480,6 +833,12 @@ bool KamoRedisDB::ParseKey(const FString& key, KamoID& root_id, KamoID* child_id
         root_key = fullkey.Left(fullkey.Len()-1);
     }
 
+    // Hash tag of cluster mode
+    if (root_key.StartsWith(TEXT("{")) && root_key.EndsWith(TEXT("}")))
+    {
+        root_key = root_key.Mid(1, root_key.Len() - 2);
+    }
+
     KamoID root(root_key);
     if (root.IsEmpty())
     {
@@ -500,90 +859,618 @@ bool KamoRedisDB::ParseKey(const FString& key, KamoID& root_id, KamoID* child_id
 
 TArray<KamoChildObject> KamoRedisDB::FindObjects(const KamoID& root_id, const FString& class_name) const
 {
+    KAMO_TRACE_SCOPE("RedisDB.FindObjects", root_id);
     TArray<KamoChildObject> objects;
-    FString pattern;
+    bool ok = FindObjectsStreamed(root_id, class_name, [&objects](TArray<KamoChildObject>& chunk)
+    {
+        objects.Append(MoveTemp(chunk));
+        return true;
+    }, 1000);
+
+    if (!ok)
+    {
+        // Callers can't tell a partial result from a complete one
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::FindObjects of '%s' '%s' failed after %i objects, returning none."), *root_id(), *class_name, objects.Num());
+        objects.Reset();
+        return objects;
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::FindObjects. Got %i objects."), objects.Num());
+    return objects;
+}
+
+
+bool KamoRedisDB::FindObjectsStreamed(const KamoID& root_id, const FString& class_name, TFunctionRef<bool(TArray<KamoChildObject>&)> callback, int32 chunk_size) const
+{
+    KAMO_TRACE_SCOPE("RedisDB.FindObjectsStreamed", root_id);
 
+    // Pages come from the region's child index, from the class index when looking up by class or from
+    // the child to root hash for all objects. The next page is fetched on a worker thread while the
+    // callback works on the current one.
+    TArray<FString> index_keys;
     if (!root_id.IsEmpty())
     {
-        // Example: ko:live:db:region.map_main_p:*
-        pattern = Key(root_id() + ":*");
+        index_keys.Add(ChildrenKey(root_id));
     }
-    else
+    else if (!class_name.IsEmpty())
     {
-        // Example: ko:live:db:region.*:player.*
-        pattern = Key(FString::Printf(TEXT("region.*:%s.*"), *class_name));
+        index_keys = ClassChildrenKeys(class_name);
     }
-
-    long long cursor = 0;
-    long long count = 1000;
-
-    // Get all keys that match the pattern
-    std::vector<std::string> keys;
-    do
+    else
     {
-        cursor = redisPtr->scan(cursor, TCHAR_TO_UTF8(*pattern), count, std::back_inserter(keys));
+        index_keys = ChildRootsKeys();
     }
-    while (cursor != 0);
 
-    if (keys.empty())
+    chunk_size = FMath::Max(chunk_size, 1);
+    TSet<FString> seen;  // SCAN may return an entry more than once
+    FObjectPage page = FetchObjectPage(root_id, class_name, index_keys, 0, 0, chunk_size);
+    for (;;)
     {
-        return objects;
-    }
+        if (!page.ok)
+        {
+            return false;
+        }
 
-    // Get all values that match the key set
-    std::vector<std::string> values;
-    redisPtr->mget(keys.begin(), keys.end(), std::back_inserter(values));
+        bool last = page.index >= index_keys.Num();
+        TFuture<FObjectPage> next;
+        if (!last)
+        {
+            next = Async(EAsyncExecution::ThreadPool, [this, root_id, class_name, index_keys, index = page.index, cursor = page.cursor, chunk_size]()
+            {
+                return FetchObjectPage(root_id, class_name, index_keys, index, cursor, chunk_size);
+            });
+        }
 
-    if (keys.size() != values.size())
-    {
-        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::FindObjects. Got %i keys but % values. Bailing out."), keys.size(), values.size());
-        return objects;
+        page.objects.RemoveAll([&seen](const KamoChildObject& object)
+        {
+            bool already_seen = false;
+            seen.Add(object.id(), &already_seen);
+            return already_seen;
+        });
+
+        if (page.objects.Num() > 0 && !callback(page.objects))
+        {
+            // Don't leave the fetch running against this object
+            if (next.IsValid())
+            {
+                next.Wait();
+            }
+            return true;
+        }
+
+        if (last)
+        {
+            return true;
+        }
+
+        page = next.Get();
     }
+}
 
-    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::FindObjects. Got %i keys and values."), keys.size());
-    
-    for (auto i = 0; i < keys.size(); i++)
+
+KamoRedisDB::FObjectPage KamoRedisDB::FetchObjectPage(const KamoID& root_id, const FString& class_name, const TArray<FString>& index_keys, int32 index, long long cursor, int32 chunk_size) const
+{
+    FObjectPage page = { index, cursor, {}, true };
+    TArray<KamoID> ids;
+    TArray<KamoID> root_ids;
+
+    try
     {
-        KamoChildObject object;
-        if (!ParseKey(keys[i].c_str(), object.root_id, &object.id) || object.id.IsEmpty())
+        const FString& index_key = index_keys[index];
+        if (!root_id.IsEmpty())
+        {
+            std::vector<std::string> members;
+            page.cursor = Call([&](auto& redis) { return redis.sscan(TCHAR_TO_UTF8(*index_key), cursor, chunk_size, std::back_inserter(members)); });
+            for (const auto& member : members)
+            {
+                ids.Add(KamoID(UTF8_TO_TCHAR(member.c_str())));
+                root_ids.Add(root_id);
+            }
+        }
+        else if (!class_name.IsEmpty())
+        {
+            std::vector<std::string> members;
+            page.cursor = Call([&](auto& redis) { return redis.sscan(TCHAR_TO_UTF8(*index_key), cursor, chunk_size, std::back_inserter(members)); });
+            if (!members.empty())
+            {
+                // All members of a class index key are in the same bucket of the child to root hash
+                std::vector<sw::redis::OptionalString> roots;
+                FString child_roots_key = ChildRootsKey(KamoID(UTF8_TO_TCHAR(members[0].c_str())));
+                Call([&](auto& redis) { redis.hmget(TCHAR_TO_UTF8(*child_roots_key), members.begin(), members.end(), std::back_inserter(roots)); });
+                for (size_t i = 0; i < members.size() && i < roots.size(); i++)
+                {
+                    // Not in the hash, deleted since the page was read
+                    if (roots[i])
+                    {
+                        ids.Add(KamoID(UTF8_TO_TCHAR(members[i].c_str())));
+                        root_ids.Add(KamoID(UTF8_TO_TCHAR(roots[i]->c_str())));
+                    }
+                }
+            }
+        }
+        else
+        {
+            std::unordered_map<std::string, std::string> entries;
+            page.cursor = Call([&](auto& redis) { return redis.hscan(TCHAR_TO_UTF8(*index_key), cursor, chunk_size, std::inserter(entries, entries.begin())); });
+            for (const auto& entry : entries)
+            {
+                ids.Add(KamoID(UTF8_TO_TCHAR(entry.first.c_str())));
+                root_ids.Add(KamoID(UTF8_TO_TCHAR(entry.second.c_str())));
+            }
+        }
+
+        if (page.cursor == 0)
+        {
+            page.index++;
+        }
+
+        if (ids.Num() == 0)
+        {
+            return page;
+        }
+
+        // Get all values of the indexed objects
+        std::vector<std::string> keys;
+        keys.reserve(ids.Num());
+        for (int32 i = 0; i < ids.Num(); i++)
+        {
+            keys.push_back(TCHAR_TO_UTF8(*ChildKey(root_ids[i], ids[i])));
+        }
+
+        std::vector<sw::redis::OptionalString> values;
+        MultiGet(root_ids, keys, values);
+        if (keys.size() != values.size())
         {
-            return objects;
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::FindObjects. Got %i keys but %i values. Bailing out."), keys.size(), values.size());
+            page.ok = false;
+            return page;
         }
 
-        object.state = values[i].c_str();
-        objects.Add(object);
+        page.objects.Reserve(ids.Num());
+        for (int32 i = 0; i < ids.Num(); i++)
+        {
+            if (!values[i])
+            {
+                UE_LOG(LogKamoDriver, Warning, TEXT("KamoRedisDB::FindObjects. Index entry without object: %s"), UTF8_TO_TCHAR(keys[i].c_str()));
+                continue;
+            }
+
+            KamoChildObject& object = page.objects.AddDefaulted_GetRef();
+            object.id = ids[i];
+            object.root_id = root_ids[i];
+            object.state = values[i]->c_str();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::FindObjects failed: %S"), e.what());
+        page.ok = false;
     }
 
-    return objects;
+    return page;
 }
 
 bool KamoRedisDB::MoveObject(const KamoID& id, const KamoID& root_id) 
 {
-    KamoID from_root_id = FindRootIDOfChild(id);
-    if (from_root_id.IsEmpty())
+    return MoveObjects({ id }, root_id);
+}
+
+
+bool KamoRedisDB::MoveObjects(const TArray<KamoID>& ids, const KamoID& root_id)
+{
+    KAMO_TRACE_SCOPE("RedisDB.MoveObjects", root_id);
+    if (ids.Num() == 0)
     {
-        return false;
+        return true;
+    }
+
+    if (cluster_mode)
+    {
+        return MoveObjectsTwoPhase(ids, root_id);
     }
 
-    FString from_key = ChildKey(from_root_id, id);
-    FString to_key = ChildKey(root_id, id);
+    // The source regions are looked up here so the script gets all of its keys, it fails if an object
+    // was moved in the meantime. See 'move_objects_script' for the layout.
+    std::vector<std::string> keys = {
+        TCHAR_TO_UTF8(*ChildRootsKey(KamoID())),
+        TCHAR_TO_UTF8(*VersionsKey(root_id)),
+        TCHAR_TO_UTF8(*ChildrenKey(root_id))
+    };
+    std::vector<std::string> args = { TCHAR_TO_UTF8(*lock_id), TCHAR_TO_UTF8(*root_id()) };
+    TSet<FString> unique_ids;
+    TArray<FString> moved_keys;  // Both ends, for the read cache
+    for (const auto& id : ids)
+    {
+        if (unique_ids.Contains(id()))
+        {
+            continue;
+        }
+        unique_ids.Add(id());
+
+        KamoID from_root = FindRootIDOfChild(id);
+        if (!from_root.IsValid())
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects to '%s' failed, object not found: %s"), *root_id(), *id());
+            return false;
+        }
+
+        keys.push_back(TCHAR_TO_UTF8(*ChildKey(from_root, id)));
+        keys.push_back(TCHAR_TO_UTF8(*ChildKey(root_id, id)));
+        keys.push_back(TCHAR_TO_UTF8(*VersionsKey(from_root)));
+        keys.push_back(TCHAR_TO_UTF8(*ChildrenKey(from_root)));
+        keys.push_back(TCHAR_TO_UTF8(*LockKey(from_root)));
+        keys.push_back(TCHAR_TO_UTF8(*ClassChildrenKey(id)));
+        args.push_back(TCHAR_TO_UTF8(*id()));
+        args.push_back(TCHAR_TO_UTF8(*from_root()));
+        moved_keys.Add(ChildKey(from_root, id));
+        moved_keys.Add(ChildKey(root_id, id));
+    }
 
     try
     {
-        redisPtr->rename(TCHAR_TO_UTF8(*from_key), TCHAR_TO_UTF8(*to_key));
+        redisPtr->eval<long long>(move_objects_script, keys.begin(), keys.end(), args.begin(), args.end());
+        for (const FString& key : moved_keys)
+        {
+            InvalidateCached(key);
+        }
     }
     catch (const std::exception& e)
     {
-        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObject of '%s' to '%s' failed: %S"), *from_key, *to_key, e.what());
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects of %i objects to '%s' failed: %S"), unique_ids.Num(), *root_id(), e.what());
         return false;
     }
 
-    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::MoveObject of '%s' to '%s' succeeded."), *from_key, *to_key);
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::MoveObjects of %i objects to '%s' succeeded."), unique_ids.Num(), *root_id());
 
     return true;
 }
 
-// Handler
+
+bool KamoRedisDB::MoveObjectsTwoPhase(const TArray<KamoID>& ids, const KamoID& root_id)
+{
+    // In cluster mode regions live on different shards so a move can't be a single script. All keys of
+    // a region share a slot though, so each region is changed atomically:
+    //   1. Each source region is WATCHed on its own connection while its lock and objects are read.
+    //   2. The copies are written to the target region along with a move intent record, guarded by a
+    //      WATCH on the target lock.
+    //   3. The originals are deleted in the WATCHed source transactions. This is the commit point, if a
+    //      source changed since it was read the copies are removed again and the move fails.
+    //   4. The child index is pointed at the target and the intent is cleared.
+    // A crash between 2 and 4 leaves the intent behind, RepairMoves() finishes or rolls back the move.
+
+    struct FSource
+    {
+        KamoID root_id;
+        TArray<KamoID> ids;
+        TOptional<sw::redis::Transaction> tx;
+    };
+
+    TMap<FString, FSource> sources;  // Source region -> object ids
+    TSet<FString> unique_ids;
+    for (const auto& id : ids)
+    {
+        if (unique_ids.Contains(id()))
+        {
+            continue;
+        }
+        unique_ids.Add(id());
+
+        KamoID from_root = FindRootIDOfChild(id);
+        if (!from_root.IsValid())
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects to '%s' failed, object not found: %s"), *root_id(), *id());
+            return false;
+        }
+
+        // Already there
+        if (from_root() != root_id())
+        {
+            FSource& source = sources.FindOrAdd(from_root());
+            source.root_id = from_root;
+            source.ids.Add(id);
+        }
+    }
+
+    if (sources.Num() == 0)
+    {
+        return true;
+    }
+
+    auto check_lock = [this, &root_id](sw::redis::Redis& redis, const KamoID& region) -> bool
+    {
+        auto locker = redis.get(TCHAR_TO_UTF8(*LockKey(region)));
+        if (locker && UTF8_TO_TCHAR(locker->c_str()) != lock_id)
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects to '%s' failed, region %s is locked by %S"), *root_id(), *region(), locker->c_str());
+            return false;
+        }
+        return true;
+    };
+
+    TArray<KamoChildObject> objects;
+    try
+    {
+        // Phase 1, the source transactions get their own connections as they're held until phase 3
+        for (auto& it : sources)
+        {
+            FSource& source = it.Value;
+            std::vector<std::string> keys = { TCHAR_TO_UTF8(*LockKey(source.root_id)) };
+            for (const auto& id : source.ids)
+            {
+                keys.push_back(TCHAR_TO_UTF8(*ChildKey(source.root_id, id)));
+            }
+
+            source.tx.Emplace(Transaction(RootKey(source.root_id), true));
+            sw::redis::Redis redis = source.tx->redis();
+            redis.watch(keys.begin(), keys.end());
+            if (!check_lock(redis, source.root_id))
+            {
+                return false;
+            }
+
+            std::vector<sw::redis::OptionalString> values;
+            redis.mget(keys.begin() + 1, keys.end(), std::back_inserter(values));
+            for (int32 i = 0; i < source.ids.Num(); i++)
+            {
+                if (i >= (int32)values.size() || !values[i])
+                {
+                    UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects to '%s' failed, %s missing in %s"), *root_id(), *source.ids[i](), *it.Key);
+                    return false;
+                }
+                KamoChildObject object;
+                object.id = source.ids[i];
+                object.root_id = root_id;
+                object.state = UTF8_TO_TCHAR(values[i]->c_str());
+                objects.Add(object);
+            }
+        }
+
+        // Phase 2
+        {
+            auto tx = Transaction(RootKey(root_id));
+            sw::redis::Redis redis = tx.redis();
+            redis.watch(TCHAR_TO_UTF8(*LockKey(root_id)));
+            if (!check_lock(redis, root_id))
+            {
+                return false;
+            }
+
+            // Intent format: <source root id> <unix time>
+            clusterPtr->sadd(TCHAR_TO_UTF8(*MovesKey()), TCHAR_TO_UTF8(*root_id()));
+            FString timestamp = FString::Printf(TEXT(" %lld"), FDateTime::UtcNow().ToUnixTimestamp());
+            for (const auto& it : sources)
+            {
+                for (const auto& id : it.Value.ids)
+                {
+                    tx.hset(TCHAR_TO_UTF8(*MovesKey(root_id)), TCHAR_TO_UTF8(*id()), TCHAR_TO_UTF8(*(it.Key + timestamp)));
+                }
+            }
+            for (const auto& object : objects)
+            {
+                tx.set(TCHAR_TO_UTF8(*ChildKey(root_id, object.id)), TCHAR_TO_UTF8(*object.state));
+                IndexChild(tx, root_id, object.id);
+            }
+            tx.exec();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects of %i objects to '%s' failed: %S"), unique_ids.Num(), *root_id(), e.what());
+        return false;
+    }
+
+    // Phase 3, a source that fails here keeps its objects and the copies are dropped
+    TArray<TPair<KamoID, KamoID>> children;
+    TArray<KamoID> failed_ids;
+    for (auto& it : sources)
+    {
+        FSource& source = it.Value;
+        try
+        {
+            for (const auto& id : source.ids)
+            {
+                source.tx->del(TCHAR_TO_UTF8(*ChildKey(source.root_id, id)));
+                UnindexChild(*source.tx, source.root_id, id);
+            }
+            source.tx->exec();
+            for (const auto& id : source.ids)
+            {
+                InvalidateCached(ChildKey(source.root_id, id));
+                children.Add({ id, root_id });
+            }
+        }
+        catch (const std::exception& e)
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects of %i objects from %s to '%s' failed: %S"), source.ids.Num(), *it.Key, *root_id(), e.what());
+            failed_ids.Append(source.ids);
+        }
+        source.tx.Reset();
+    }
+
+    // Phase 4
+    try
+    {
+        UpdateChildRoots(children);
+
+        auto tx = Transaction(RootKey(root_id));
+        for (const auto& child : children)
+        {
+            tx.hdel(TCHAR_TO_UTF8(*MovesKey(root_id)), TCHAR_TO_UTF8(*child.Key()));
+        }
+        for (const auto& id : failed_ids)
+        {
+            tx.del(TCHAR_TO_UTF8(*ChildKey(root_id, id)));
+            UnindexChild(tx, root_id, id);
+            tx.hdel(TCHAR_TO_UTF8(*MovesKey(root_id)), TCHAR_TO_UTF8(*id()));
+            InvalidateCached(ChildKey(root_id, id));
+        }
+        tx.exec();
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::MoveObjects to '%s' failed to finish, it's repaired on next startup: %S"), *root_id(), e.what());
+        return false;
+    }
+
+    if (failed_ids.Num())
+    {
+        return false;
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::MoveObjects of %i objects from %i regions to '%s' succeeded."), unique_ids.Num(), sources.Num(), *root_id());
+    return true;
+}
+
+
+bool KamoRedisDB::RepairMoves()
+{
+    // Finishes or rolls back moves left behind by MoveObjectsTwoPhase(). An original that still exists
+    // means the move didn't commit. Recent intents may belong to a move in flight on another server and
+    // are left alone. Child to root entries lost to a crash right after a region write aren't recovered
+    // here, see the header.
+    if (!cluster_mode)
+    {
+        return true;
+    }
+
+    const int64 min_age_seconds = 60;
+    int64 now = FDateTime::UtcNow().ToUnixTimestamp();
+
+    try
+    {
+        std::vector<std::string> targets;
+        clusterPtr->smembers(TCHAR_TO_UTF8(*MovesKey()), std::back_inserter(targets));
+        for (const auto& target : targets)
+        {
+            KamoID root_id(UTF8_TO_TCHAR(target.c_str()));
+            std::unordered_map<std::string, std::string> intents;
+            clusterPtr->hgetall(TCHAR_TO_UTF8(*MovesKey(root_id)), std::inserter(intents, intents.begin()));
+
+            TArray<TPair<KamoID, KamoID>> children;
+            for (const auto& intent : intents)
+            {
+                KamoID id(UTF8_TO_TCHAR(intent.first.c_str()));
+                FString from_root_id, timestamp;
+                FString(UTF8_TO_TCHAR(intent.second.c_str())).Split(TEXT(" "), &from_root_id, &timestamp);
+                if (now - FCString::Atoi64(*timestamp) < min_age_seconds)
+                {
+                    continue;
+                }
+                KamoID from_root(from_root_id);
+
+                auto tx = Transaction(RootKey(root_id));
+                bool committed = clusterPtr->exists(TCHAR_TO_UTF8(*ChildKey(from_root, id))) == 0;
+                if (committed)
+                {
+                    // The original may still be indexed if the source transaction didn't finish
+                    auto source_tx = Transaction(RootKey(from_root));
+                    UnindexChild(source_tx, from_root, id);
+                    source_tx.exec();
+                    children.Add({ id, root_id });
+                }
+                else
+                {
+                    tx.del(TCHAR_TO_UTF8(*ChildKey(root_id, id)));
+                    UnindexChild(tx, root_id, id);
+                }
+                tx.hdel(TCHAR_TO_UTF8(*MovesKey(root_id)), TCHAR_TO_UTF8(*id()));
+                tx.exec();
+
+                UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: %s interrupted move of %s from %s to %s."),
+                    committed ? TEXT("Finished") : TEXT("Rolled back"), *id(), *from_root(), *root_id());
+            }
+
+            UpdateChildRoots(children);
+            if (clusterPtr->hlen(TCHAR_TO_UTF8(*MovesKey(root_id))) == 0)
+            {
+                clusterPtr->srem(TCHAR_TO_UTF8(*MovesKey()), target);
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::RepairMoves failed: %S"), e.what());
+        return false;
+    }
+
+    return true;
+}
+
+
+TArray<KamoChildObject> KamoRedisDB::GetObjects(const KamoID& root_id, const TArray<KamoID>& ids) const
+{
+    TArray<KamoChildObject> objects;
+    if (ids.Num() == 0)
+    {
+        return objects;
+    }
+
+    std::vector<std::string> keys;
+    keys.reserve(ids.Num());
+    for (const auto& id : ids)
+    {
+        keys.push_back(TCHAR_TO_UTF8(*ChildKey(root_id, id)));
+    }
+
+    std::vector<sw::redis::OptionalString> values;
+    try
+    {
+        // Keys of a region share a hash tag so this is a single node in cluster mode too
+        Call([&](auto& redis) { redis.mget(keys.begin(), keys.end(), std::back_inserter(values)); });
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::GetObjects in %s failed: %S"), *root_id(), e.what());
+        return objects;
+    }
+
+    for (auto i = 0; i < values.size() && i < ids.Num(); i++)
+    {
+        if (values[i])
+        {
+            KamoChildObject object;
+            object.id = ids[i];
+            object.root_id = root_id;
+            object.state = values[i]->c_str();
+            objects.Add(object);
+        }
+    }
+
+    return objects;
+}
+
+
+bool KamoRedisDB::GetObjectVersions(const KamoID& root_id, TMap<FString, int64>& versions) const
+{
+    // Objects written by other tools may not have a version stamp so the child index is the authority
+    // on which objects exist. Unstamped objects get version 0.
+    std::vector<std::string> ids;
+    std::unordered_map<std::string, std::string> stamps;
+
+    try
+    {
+        Call([&](auto& redis)
+        {
+            redis.smembers(TCHAR_TO_UTF8(*ChildrenKey(root_id)), std::back_inserter(ids));
+            redis.hgetall(TCHAR_TO_UTF8(*VersionsKey(root_id)), std::inserter(stamps, stamps.begin()));
+        });
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::GetObjectVersions of %s failed: %S"), *root_id(), e.what());
+        return false;
+    }
+
+    for (const auto& id : ids)
+    {
+        auto stamp = stamps.find(id);
+        versions.Add(UTF8_TO_TCHAR(id.c_str()), stamp != stamps.end() ? FCString::Atoi64(UTF8_TO_TCHAR(stamp->second.c_str())) : 0);
+    }
+
+    return true;
+}
+
+// Handler
 
 bool KamoRedisDB::AddHandlerObject(const KamoHandlerObject& handler) {
     auto json_object = GetJsonObject(handler.state);
@@ -650,7 +1537,7 @@ KamoHandlerObject KamoRedisDB::GetHandlerInfo(const KamoID& handler_id) const
 
     try
     {
-        if (redisPtr->exists(TCHAR_TO_UTF8(*RootKey(handler_id))) == 0)
+        if (!CachedGet(key).IsSet())
         {
             return handler_object;
         }
@@ -699,87 +1586,202 @@ bool KamoRedisDB::Set(const KamoRootObject& object) {
 }
 
 
-void KamoRedisDB::DoWork()
+void KamoRedisDB::DoWork(FWriter& writer)
 {
-    // While there are objects to be serialized, pop one from the map that has the highest priority
+    // While there are objects to be serialized, take a batch of the ones with the highest priority
+    // and write them out in a single round trip.
+    TArray<FKamoSerializationQueue::Record> batch;
     for (;;)
     {
-        SerializationRecord object;
-        object.priority = -1;
+        if (writer.stopping && !writer.drain)
+        {
+            return;
+        }
+
+        batch.Reset();
         {
-            FScopeLock lock(&mutex);
-            if (objects_for_serialization.Num() == 0)
+            FScopeLock lock(&writer.mutex);
+            if (writer.queue.Num() == 0)
             {
                 return; 
             }
 
-            for (auto it = objects_for_serialization.CreateIterator(); it; ++it)
-            {
-                if (it.Value().priority >= object.priority)
-                {
-                    object = it.Value();
-                }
-            }
+            writer.queue.PopBatch(write_batch_size, write_batch_bytes, batch);
         }
-        
-        FString key = ChildKey(object.root_id, object.id);
-        try
+
+        bool written = WriteBatch(batch);
+        if (written && journal)
         {
-            if (!redisPtr->set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*object.state)))
+            for (const auto& object : batch)
             {
-                UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::DoWork failed for %s"), *key);
+                journal->Commit(object.id, object.journal_sequence);
             }
         }
-        catch (const std::exception& e)
-        {
-            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::UpdateRootObject failed: %S"), e.what());
-        }
 
-        // Always remove the object from the queue even though it failed to write out because we might
-        // be in an unrecoverable state with the file writing and thus erroring infinitely.
+        // Always consider the objects written even though they failed to write out because we might
+        // be in an unrecoverable state with the connection and thus erroring infinitely. Objects that were
+        // queued again while the batch was in flight stay in the queue for the next round.
         {
-            FScopeLock lock(&mutex);
-            objects_for_serialization.Remove(object.id());
+            FScopeLock lock(&writer.mutex);
+            for (const auto& object : batch)
+            {
+                writer.queue.Complete(object);
+            }
         }
     }    
 }
 
 
-void KamoRedisDB::RefreshRegionLocks()
+bool KamoRedisDB::WriteBatch(const TArray<FKamoSerializationQueue::Record>& batch)
 {
-    // Refresh the locks
-    for (auto rl : region_locks)
+    FKamoTraceScope trace_scope(TEXT("RedisDB.WriteBatch"));
+    int64 bytes = 0;
+
+    // A transaction can only touch one shard so in cluster mode there's one per region
+    TMap<FString, TArray<int32>> transactions;
+    for (int32 i = 0; i < batch.Num(); i++)
+    {
+        transactions.FindOrAdd(cluster_mode ? batch[i].root_id() : FString()).Add(i);
+    }
+
+    try
     {
-        rl.Value->Refresh();
+        // Each object is a SET of the state followed by its index updates. Each transaction is sent
+        // in a single pipeline.
+        TArray<TPair<KamoID, KamoID>> children;
+        for (const auto& transaction : transactions)
+        {
+            const TArray<int32>& objects = transaction.Value;
+            auto tx = Transaction(ChildKey(batch[objects[0]].root_id, batch[objects[0]].id));
+            for (int32 i : objects)
+            {
+                const auto& object = batch[i];
+                FTCHARToUTF8 state(*object.state);
+                bytes += state.Length();
+                tx.set(TCHAR_TO_UTF8(*ChildKey(object.root_id, object.id)), sw::redis::StringView(state.Get(), state.Length()));
+                IndexChild(tx, object.root_id, object.id);
+            }
+
+            auto replies = tx.exec();
+            for (int32 j = 0; j < objects.Num(); j++)
+            {
+                const auto& object = batch[objects[j]];
+                InvalidateCached(ChildKey(object.root_id, object.id));
+                if (!replies.get<bool>(j * (1 + ChildIndexCommands())))
+                {
+                    UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::WriteBatch failed for %s"), *ChildKey(object.root_id, object.id));
+                }
+                children.Add({ object.id, object.root_id });
+            }
+        }
+
+        // Not atomic with the transactions above, see RepairMoves()
+        UpdateChildRoots(children);
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::WriteBatch of %i objects failed: %S"), batch.Num(), e.what());
+        return false;
     }
+
+    trace_scope.SetBytes(bytes);
+    UE_LOG(LogKamoDriver, VeryVerbose, TEXT("KamoRedisDB::WriteBatch wrote %i objects, %lld bytes."), batch.Num(), bytes);
+    return true;
 }
 
 
-bool KamoRedisDB::Set(const KamoChildObject& object)
+void KamoRedisDB::RefreshRegionLocks()
 {
-    SerializationRecord rec = { object.id, object.root_id, object.state, 0 };
-    
+    KAMO_TRACE_SCOPE("RedisDB.RefreshRegionLocks");
+
+    TArray<FString> root_ids;
+    {
+        FScopeLock lock(&region_locks_mutex);
+        region_locks.GetKeys(root_ids);
+    }
+
+    if (root_ids.Num() == 0)
+    {
+        return;
+    }
+
+    std::vector<std::string> keys;
+    keys.reserve(root_ids.Num());
+    for (const FString& root_id : root_ids)
+    {
+        keys.push_back(TCHAR_TO_UTF8(*LockKey(KamoID(root_id))));
+    }
+    std::vector<std::string> args = { TCHAR_TO_UTF8(*lock_id), std::to_string(region_lock_timeout * 1000LL) };
+    std::vector<long long> ttls;
+
+    double start_time = FPlatformTime::Seconds();
+    try
+    {
+        if (!cluster_mode)
+        {
+            redisPtr->eval(refresh_locks_script, keys.begin(), keys.end(), args.begin(), args.end(), std::back_inserter(ttls));
+        }
+        else
+        {
+            // A script can't span slots, so each lock is refreshed on its own node
+            for (const auto& key : keys)
+            {
+                std::vector<std::string> lock_key = { key };
+                clusterPtr->eval(refresh_locks_script, lock_key.begin(), lock_key.end(), args.begin(), args.end(), std::back_inserter(ttls));
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::RefreshRegionLocks of %i locks failed: %S"), root_ids.Num(), e.what());
+        return;
+    }
+
+    double now = FPlatformTime::Seconds();
+    FScopeLock lock(&region_locks_mutex);
+    last_region_lock_refresh_ms = (now - start_time) * 1000.0;
+    for (int32 i = 0; i < root_ids.Num() && i < (int32)ttls.size(); i++)
     {
-        FScopeLock lock(&mutex);
-        if (objects_for_serialization.Contains(object.id()))
+        // Skip locks released during the refresh
+        FRegionLockHealth* health = region_lock_health.Find(root_ids[i]);
+        if (!health)
+        {
+            continue;
+        }
+
+        if (ttls[i] > 0)
+        {
+            health->ttl_ms = ttls[i];
+            health->last_refresh_time = now;
+        }
+        else
         {
-            // Bump priority by one.
-            // TODO: Have class based priority jumps, i.e. important stuff gets bumped by 10 while
-            // insignificant stuff gets bumped by less.
-            // TODO: Add max. age priority as well to prevent starvation.
-            rec.priority = objects_for_serialization[object.id()].priority + 1;
+            UE_CLOG(health->ttl_ms > 0, LogKamoDriver, Error, TEXT("KamoRedisDB::RefreshRegionLocks: Lost the lock on region %s."), *root_ids[i]);
+            health->ttl_ms = 0;
         }
-        objects_for_serialization.Add(object.id(), rec);
     }
 
-    
-    if (serializer.IsDone())
+    UE_LOG(LogKamoDriver, VeryVerbose, TEXT("KamoRedisDB::RefreshRegionLocks refreshed %i locks in %.1f ms."), root_ids.Num(), last_region_lock_refresh_ms);
+}
+
+
+bool KamoRedisDB::Set(const KamoChildObject& object)
+{
+    if (writers.Num() == 0)
     {
-        serializer.StartBackgroundTask(GIOThreadPool);
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::Set: No session, can't write %s"), *object.id());
+        return false;
     }
-    else
+
+    // Journal first so the write survives a crash from here on
+    uint64 journal_sequence = journal ? journal->Append(object.id, object.root_id, object.state) : 0;
+
+    FWriter& writer = GetWriter(object.root_id);
     {
+        FScopeLock lock(&writer.mutex);
+        writer.queue.Push(object.id, object.root_id, object.state, journal_sequence);
     }
+    writer.wake_event->Trigger();
     
     return true;	
 }
@@ -794,16 +1796,117 @@ bool KamoRedisDB::Set(const KamoHandlerObject& object) {
     return AddHandlerObject(object) || UpdateRootObject(object.id, new_state);
 }
 
-bool KamoRedisDB::Delete(const KamoID& id) {
-    return DeleteRootObject(id) || DeleteObject(id);
-}
-
+bool KamoRedisDB::ReplayJournal()
+{
+    KAMO_TRACE_SCOPE("RedisDB.ReplayJournal");
+    TArray<FKamoWriteJournal::Entry> entries;
+    if (!FKamoWriteJournal::Recover(journal_directory, journal_name, entries))
+    {
+        return false;
+    }
+
+    if (entries.Num() > 0)
+    {
+        TSet<FString> root_ids;
+        for (const auto& entry : entries)
+        {
+            root_ids.Add(entry.root_id());
+        }
+
+        TArray<KamoID> lock_roots;
+        std::vector<std::string> lock_keys;
+        for (const FString& root_id : root_ids)
+        {
+            lock_roots.Add(KamoID(root_id));
+            lock_keys.push_back(TCHAR_TO_UTF8(*LockKey(KamoID(root_id))));
+        }
+
+        // A region locked by another server has moved on and our writes to it are stale. Our own locks
+        // from before a crash are still around until they time out, so wait that long for them.
+        TSet<FString> locked_roots;
+        double deadline = FPlatformTime::Seconds() + region_lock_timeout;
+        try
+        {
+            for (;;)
+            {
+                std::vector<sw::redis::OptionalString> lockers;
+                MultiGet(lock_roots, lock_keys, lockers);
+
+                locked_roots.Reset();
+                int32 i = 0;
+                for (const FString& root_id : root_ids)
+                {
+                    if (lockers[i++])
+                    {
+                        locked_roots.Add(root_id);
+                    }
+                }
+
+                if (locked_roots.Num() == 0 || FPlatformTime::Seconds() >= deadline)
+                {
+                    break;
+                }
+
+                UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::ReplayJournal: Waiting for %i region locks to expire."), locked_roots.Num());
+                FPlatformProcess::Sleep(1.0f);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::ReplayJournal failed to check region locks: %S"), e.what());
+            return false;
+        }
+
+        TArray<FKamoSerializationQueue::Record> batch;
+        int32 num_written = 0;
+        int32 num_skipped = 0;
+        for (int32 i = 0; i < entries.Num(); i++)
+        {
+            const auto& entry = entries[i];
+            if (locked_roots.Contains(entry.root_id()))
+            {
+                UE_LOG(LogKamoDriver, Warning, TEXT("KamoRedisDB::ReplayJournal: Dropping write of %s, region %s is locked by another server."), *entry.id(), *entry.root_id());
+                num_skipped++;
+            }
+            else
+            {
+                batch.Add({ entry.id, entry.root_id, entry.state, 0, 0.0, 0, entry.sequence });
+            }
+
+            if (batch.Num() >= write_batch_size || (i == entries.Num() - 1 && batch.Num() > 0))
+            {
+                if (!WriteBatch(batch))
+                {
+                    return false;
+                }
+                num_written += batch.Num();
+                batch.Reset();
+            }
+        }
+
+        UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB::ReplayJournal: Replayed %i writes, dropped %i."), num_written, num_skipped);
+    }
+
+    return FKamoWriteJournal::Reset(journal_directory, journal_name);
+}
+
+
+bool KamoRedisDB::Delete(const KamoID& id) {
+    return DeleteRootObject(id) || DeleteObject(id);
+}
+
 
 bool KamoRedisDB::DeleteChildObject(const KamoID& root_id, const KamoID& id)
 {
     try
     {
-        return redisPtr->del(TCHAR_TO_UTF8(*(ChildKey(root_id, id)))) == 1;
+        auto tx = Transaction(ChildKey(root_id, id));
+        tx.del(TCHAR_TO_UTF8(*(ChildKey(root_id, id))));
+        UnindexChild(tx, root_id, id);
+        auto replies = tx.exec();
+        InvalidateCached(ChildKey(root_id, id));
+        UpdateChildRoots({ { id, KamoID() } });
+        return replies.get<long long>(0) == 1;
     }
     catch (const std::exception& e)
     {
@@ -857,24 +1960,26 @@ TSharedPtr<KamoObject> KamoRedisDB::Get(const KamoID& id) const
 
 bool KamoRedisDB::IsSerializationPending(const KamoID& id, bool bump_priority)
 {
-    FScopeLock lock(&mutex);
-    if (id.IsEmpty())
+    // The region of 'id' isn't known here so all writers are checked
+    for (auto& writer : writers)
     {
-        // See if any object is pending serialization
-        return objects_for_serialization.Num() > 0;
-    }
-    else if (objects_for_serialization.Contains(id()))
-    {
-        if (bump_priority)
+        FScopeLock lock(&writer->mutex);
+        if (id.IsEmpty())
         {
-            SerializationRecord& rec = objects_for_serialization[id()];
-            if (rec.priority < 1000000000)
+            // See if any object is pending serialization
+            if (!writer->queue.IsEmpty())
             {
-                // TODO: Class based bumpness
-                rec.priority += 1000;
+                return true;
             }
         }
-        return true;
+        else if (writer->queue.Contains(id()))
+        {
+            if (bump_priority)
+            {
+                writer->queue.Bump(id());
+            }
+            return true;
+        }
     }
     return false;
 }
@@ -882,8 +1987,29 @@ bool KamoRedisDB::IsSerializationPending(const KamoID& id, bool bump_priority)
 
 bool KamoRedisDB::CancelIfPending(const KamoID& id)
 {
-    FScopeLock lock(&mutex);
-    return objects_for_serialization.Remove(id()) > 0;
+    bool removed = false;
+    for (auto& writer : writers)
+    {
+        FScopeLock lock(&writer->mutex);
+        removed |= writer->queue.Remove(id());
+    }
+
+    if (removed && journal)
+    {
+        journal->Discard(id);
+    }
+    return removed;
+}
+
+
+void KamoRedisDB::SetSerializationPolicy(const KamoSerializationPolicy& policy)
+{
+    serialization_policy = policy;
+    for (auto& writer : writers)
+    {
+        FScopeLock lock(&writer->mutex);
+        writer->queue.SetPolicy(policy);
+    }
 }
 
 
@@ -908,51 +2034,546 @@ FString KamoRedisDB::GetJsonString(const TSharedPtr<FJsonObject>& json_object) c
 
 FString KamoRedisDB::RootKey(const KamoID& root_id) const
 {
-    return Key(root_id() + "~");
+    return Key(HashTag(root_id()) + "~");
 }
 
 
 FString KamoRedisDB::ChildKey(const KamoID& root_id, const KamoID& child_id) const
 {
-    return Key(root_id() + ":" + child_id());
+    return Key(HashTag(root_id()) + ":" + child_id());
+}
+
+
+FString KamoRedisDB::LockKey(const KamoID& root_id) const
+{
+    return Key("locks:" + HashTag(root_id()));
 }
 
 
 KamoID KamoRedisDB::FindRootIDOfChild(const KamoID& child_id, bool fail_silently) const
 {
-    TArray<KamoChildObject> objects;
-    FString pattern;
     KamoID root_id;
 
-    // Example: To search for "player.514" the pattern is: ko:live:db:region.*:player.514
-    pattern = Key("region.*:") + child_id();
-    long long cursor = 0;
-    long long count = 1000;
+    try
+    {
+        FString child_roots_key = ChildRootsKey(child_id);
+        auto val = Call([&](auto& redis) { return redis.hget(TCHAR_TO_UTF8(*child_roots_key), TCHAR_TO_UTF8(*child_id())); });
+        if (val)
+        {
+            root_id = KamoID(UTF8_TO_TCHAR(val->c_str()));
+        }
+        else
+        {
+            UE_CLOG(!fail_silently, LogKamoDriver, Error, TEXT("KamoRedisDB::FindRootIDOfChild: Object %s not found!"), *child_id());
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::FindRootIDOfChild of %s failed: %S"), *child_id(), e.what());
+    }
 
-    // Get all keys that match the pattern
-    //std::vector<std::string> keys;
-    std::vector<std::string> keys;
-    do
+    return root_id;
+}
+
+
+FString KamoRedisDB::VersionsKey(const KamoID& root_id) const
+{
+    return Key("versions:" + HashTag(root_id()));
+}
+
+
+FString KamoRedisDB::ChildrenKey(const KamoID& root_id) const
+{
+    return Key("children:" + HashTag(root_id()));
+}
+
+
+FString KamoRedisDB::ChildRootsKey(const KamoID& child_id) const
+{
+    if (!cluster_mode)
+    {
+        return Key("childroots");
+    }
+
+    // Spread over the shards, one hash would be a hot spot
+    int32 bucket = GetTypeHash(child_id()) % child_root_buckets;
+    return Key("childroots:" + HashTag(FString::Printf(TEXT("childroots.%i"), bucket)));
+}
+
+
+FString KamoRedisDB::ClassChildrenKey(const KamoID& child_id) const
+{
+    if (!cluster_mode)
     {
-        cursor = redisPtr->scan(cursor, TCHAR_TO_UTF8(*pattern), count, std::back_inserter(keys));
-    } 
-    while (cursor != 0);
+        return Key("classchildren:" + child_id.class_name);
+    }
+
+    // Split like the child to root hash and in the same slots, so both are updated in one pipeline
+    int32 bucket = GetTypeHash(child_id()) % child_root_buckets;
+    return Key("classchildren:" + child_id.class_name + ":" + HashTag(FString::Printf(TEXT("childroots.%i"), bucket)));
+}
+
+
+TArray<FString> KamoRedisDB::ClassChildrenKeys(const FString& class_name) const
+{
+    if (!cluster_mode)
+    {
+        return { Key("classchildren:" + class_name) };
+    }
 
-    if (!keys.empty())
+    TArray<FString> keys;
+    for (int32 bucket = 0; bucket < child_root_buckets; bucket++)
     {
-        if (keys.size() > 1)
+        keys.Add(Key("classchildren:" + class_name + ":" + HashTag(FString::Printf(TEXT("childroots.%i"), bucket))));
+    }
+    return keys;
+}
+
+
+TArray<FString> KamoRedisDB::ChildRootsKeys() const
+{
+    if (!cluster_mode)
+    {
+        return { Key("childroots") };
+    }
+
+    TArray<FString> keys;
+    for (int32 bucket = 0; bucket < child_root_buckets; bucket++)
+    {
+        keys.Add(Key("childroots:" + HashTag(FString::Printf(TEXT("childroots.%i"), bucket))));
+    }
+    return keys;
+}
+
+
+void KamoRedisDB::UpdateChildRoots(const TArray<TPair<KamoID, KamoID>>& children) const
+{
+    if (!cluster_mode)
+    {
+        // Part of the region transaction, see IndexChild()
+        return;
+    }
+
+    TMap<FString, TArray<const TPair<KamoID, KamoID>*>> buckets;
+    for (const auto& child : children)
+    {
+        buckets.FindOrAdd(ChildRootsKey(child.Key)).Add(&child);
+    }
+
+    for (const auto& bucket : buckets)
+    {
+        auto pipe = Pipeline(bucket.Key);
+        for (const auto* child : bucket.Value)
         {
-            UE_CLOG(!fail_silently, LogKamoDriver, Error, TEXT("KamoRedisDB::FindRootIDOfChild: Object %s found in %i places!"), *child_id(), keys.size());
+            // The class index shares the bucket's slot
+            std::string id = TCHAR_TO_UTF8(*child->Key());
+            std::string class_children_key = TCHAR_TO_UTF8(*ClassChildrenKey(child->Key));
+            if (child->Value.IsValid())
+            {
+                pipe.hset(TCHAR_TO_UTF8(*bucket.Key), id, TCHAR_TO_UTF8(*child->Value()))
+                    .sadd(class_children_key, id);
+            }
+            else
+            {
+                pipe.hdel(TCHAR_TO_UTF8(*bucket.Key), id)
+                    .srem(class_children_key, id);
+            }
         }
-        KamoID found_child_id;
-        ParseKey(keys[0].c_str(), root_id, &found_child_id);
+        pipe.exec();
     }
-    else
+}
+
+
+int32 KamoRedisDB::ChildIndexCommands() const
+{
+    return cluster_mode ? 2 : 4;
+}
+
+
+void KamoRedisDB::MultiGet(const TArray<KamoID>& root_ids, const std::vector<std::string>& keys, std::vector<sw::redis::OptionalString>& values) const
+{
+    if (!cluster_mode)
     {
-        UE_CLOG(!fail_silently, LogKamoDriver, Error, TEXT("KamoRedisDB::FindRootIDOfChild: Object %s not found!"), *child_id());
+        redisPtr->mget(keys.begin(), keys.end(), std::back_inserter(values));
+        return;
     }
 
-    return root_id;
+    // MGET can't span slots, so one per region
+    TMap<FString, TArray<int32>> regions;
+    for (int32 i = 0; i < root_ids.Num(); i++)
+    {
+        regions.FindOrAdd(root_ids[i]()).Add(i);
+    }
+
+    values.resize(keys.size());
+    for (const auto& region : regions)
+    {
+        std::vector<std::string> region_keys;
+        for (int32 i : region.Value)
+        {
+            region_keys.push_back(keys[i]);
+        }
+
+        std::vector<sw::redis::OptionalString> region_values;
+        clusterPtr->mget(region_keys.begin(), region_keys.end(), std::back_inserter(region_values));
+        for (int32 j = 0; j < region.Value.Num() && j < (int32)region_values.size(); j++)
+        {
+            values[region.Value[j]] = region_values[j];
+        }
+    }
+}
+
+
+FString KamoRedisDB::MovesKey(const KamoID& root_id) const
+{
+    if (root_id.IsEmpty())
+    {
+        return Key("moves");
+    }
+    return Key("moves:" + HashTag(root_id()));
+}
+
+
+FString KamoRedisDB::ClassRootsKey(const FString& class_name) const
+{
+    return Key("roots:" + class_name);
+}
+
+
+FString KamoRedisDB::RootClassesKey() const
+{
+    return Key("rootclasses");
+}
+
+
+void KamoRedisDB::IndexChild(sw::redis::Transaction& tx, const KamoID& root_id, const KamoID& child_id) const
+{
+    // Note, any tool writing objects outside of this driver must maintain the indexes and version
+    // stamps as well, otherwise lookups miss the object and runtime snapshots may serve stale state.
+    // Keep ChildIndexCommands() and 'move_objects_script' in sync.
+    // In cluster mode the child to root hash and the class index are on another shard and updated by
+    // UpdateChildRoots().
+    std::string id = TCHAR_TO_UTF8(*child_id());
+    std::string root = TCHAR_TO_UTF8(*root_id());
+    tx.hincrby(TCHAR_TO_UTF8(*VersionsKey(root_id)), id, 1)
+        .sadd(TCHAR_TO_UTF8(*ChildrenKey(root_id)), id);
+    if (!cluster_mode)
+    {
+        tx.hset(TCHAR_TO_UTF8(*ChildRootsKey(child_id)), id, root)
+            .sadd(TCHAR_TO_UTF8(*ClassChildrenKey(child_id)), id);
+    }
+}
+
+
+void KamoRedisDB::UnindexChild(sw::redis::Transaction& tx, const KamoID& root_id, const KamoID& child_id) const
+{
+    std::string id = TCHAR_TO_UTF8(*child_id());
+    tx.hdel(TCHAR_TO_UTF8(*VersionsKey(root_id)), id)
+        .srem(TCHAR_TO_UTF8(*ChildrenKey(root_id)), id);
+    if (!cluster_mode)
+    {
+        tx.hdel(TCHAR_TO_UTF8(*ChildRootsKey(child_id)), id)
+            .srem(TCHAR_TO_UTF8(*ClassChildrenKey(child_id)), id);
+    }
+}
+
+
+bool KamoRedisDB::EnsureIndexes()
+{
+    // Keyspaces written before the indexes existed are indexed once. The marker holds the version of
+    // the indexes, version 2 added the class index.
+    const std::string index_version = "2";
+    const int32 index_lock_timeout = 600;
+    std::string marker_key = TCHAR_TO_UTF8(*Key("indexes"));
+    auto is_current = [&]()
+    {
+        auto version = Call([&](auto& redis) { return redis.get(marker_key); });
+        return version && *version == index_version;
+    };
+
+    FString builder_id = FString::Printf(TEXT("indexes - %S"), sw::redis::RedLockUtils::lock_id().c_str());
+    LockMutex build_lock(this, Key("locks:indexes"), builder_id, index_lock_timeout);
+    bool ok = true;
+    try
+    {
+        if (is_current())
+        {
+            return true;
+        }
+
+        bool has_indexes = Call([&](auto& redis) { return redis.exists(marker_key); }) == 1;
+        if (!has_indexes && cluster_mode)
+        {
+            // The indexes can't be built across a cluster. Keyspaces migrated to a cluster must come with
+            // their indexes, objects without them would never be found.
+            if (ClusterHasRootKeys())
+            {
+                UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB: Cluster keyspace %s has objects but no indexes. Build the indexes before migrating it to a cluster."), *Key());
+                return false;
+            }
+
+            UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: New cluster keyspace %s, indexes are maintained on write."), *Key());
+            clusterPtr->set(marker_key, index_version);
+            return true;
+        }
+
+        // One server builds the indexes, the others wait for it
+        double give_up_time = FPlatformTime::Seconds() + index_lock_timeout;
+        while (!build_lock.Lock())
+        {
+            if (FPlatformTime::Seconds() > give_up_time)
+            {
+                UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB: Timed out waiting for the object indexes of %s."), *Key());
+                return false;
+            }
+            FPlatformProcess::Sleep(5.0f);
+            if (is_current())
+            {
+                return true;
+            }
+        }
+
+        if (!is_current())
+        {
+            ok = has_indexes ? BuildClassIndex() : BuildIndexes(builder_id);
+            if (ok)
+            {
+                Call([&](auto& redis) { return redis.set(marker_key, index_version); });
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::EnsureIndexes failed: %S"), e.what());
+        ok = false;
+    }
+
+    build_lock.Unlock();
+    return ok;
+}
+
+
+bool KamoRedisDB::ClusterHasRootKeys() const
+{
+    // SCAN only covers the node it's sent to, so each master is scanned. A master is reached through a
+    // hash tag of one of its slots, the client doesn't expose the slot hash so CLUSTER KEYSLOT finds one.
+    auto node = clusterPtr->redis(TCHAR_TO_UTF8(*Key()), false);
+
+    // Lines of "<id> <host:port@bus port> <flags> <master id> <ping> <pong> <epoch> <link state> <slots>..."
+    // Largest slot range of each master
+    TMap<FString, TPair<int64, int64>> masters;
+    FString nodes = UTF8_TO_TCHAR(node.command<std::string>("cluster", "nodes").c_str());
+    TArray<FString> lines;
+    nodes.ParseIntoArrayLines(lines);
+    for (const FString& line : lines)
+    {
+        TArray<FString> fields;
+        line.ParseIntoArrayWS(fields);
+        if (fields.Num() < 9 || !fields[2].Contains(TEXT("master")) || fields[2].Contains(TEXT("fail")))
+        {
+            continue;
+        }
+
+        for (int32 i = 8; i < fields.Num(); i++)
+        {
+            // Single slots, ranges, and importing or migrating slots in brackets which are skipped
+            FString first, last;
+            if (fields[i].StartsWith(TEXT("[")) || !fields[i].Split(TEXT("-"), &first, &last))
+            {
+                first = last = fields[i];
+            }
+            if (!first.IsNumeric() || !last.IsNumeric())
+            {
+                continue;
+            }
+
+            TPair<int64, int64> range(FCString::Atoi64(*first), FCString::Atoi64(*last));
+            TPair<int64, int64>* largest = masters.Find(fields[0]);
+            if (!largest || range.Value - range.Key > largest->Value - largest->Key)
+            {
+                masters.Add(fields[0], range);
+            }
+        }
+    }
+
+    if (masters.Num() == 0)
+    {
+        throw std::runtime_error("no masters with slots in CLUSTER NODES");
+    }
+
+    std::string pattern = TCHAR_TO_UTF8(*Key("*~"));
+    for (const auto& master : masters)
+    {
+        std::string tag;
+        for (int32 n = 0; tag.empty(); n++)
+        {
+            if (n > 16384 * 16)
+            {
+                throw std::runtime_error("no hash tag found for a cluster master");
+            }
+
+            std::string candidate = std::to_string(n);
+            long long slot = node.command<long long>("cluster", "keyslot", candidate);
+            if (slot >= master.Value.Key && slot <= master.Value.Value)
+            {
+                tag = candidate;
+            }
+        }
+
+        auto master_node = clusterPtr->redis(tag, false);
+        std::vector<std::string> keys;
+        long long cursor = 0;
+        do
+        {
+            cursor = master_node.scan(cursor, pattern, 1000, std::back_inserter(keys));
+        }
+        while (cursor != 0 && keys.empty());
+
+        if (!keys.empty())
+        {
+            UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: Found %S on cluster node %s."), keys[0].c_str(), *master.Key);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool KamoRedisDB::BuildIndexes(const FString& builder_id)
+{
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: Building object indexes for %s"), *Key());
+
+    // Root keys end with '~', child keys live under regions. Example: ko:live:db:region.map_main_p:player.743
+    TMap<FString, TArray<KamoID>> regions;
+    int32 num_roots = 0;
+    try
+    {
+        std::vector<std::string> keys;
+        long long count = 1000;
+        for (const FString& pattern : { Key("*~"), Key("region.*:*") })
+        {
+            long long cursor = 0;
+            do
+            {
+                cursor = redisPtr->scan(cursor, TCHAR_TO_UTF8(*pattern), count, std::back_inserter(keys));
+            }
+            while (cursor != 0);
+        }
+
+        auto tx = redisPtr->transaction(true, false);
+        for (const auto& key : keys)
+        {
+            FString fullkey = key.c_str();
+            KamoID root_id, child_id;
+            if (fullkey.EndsWith("~"))
+            {
+                if (ParseKey(fullkey, root_id))
+                {
+                    tx.sadd(TCHAR_TO_UTF8(*ClassRootsKey(root_id.class_name)), TCHAR_TO_UTF8(*root_id()))
+                        .sadd(TCHAR_TO_UTF8(*RootClassesKey()), TCHAR_TO_UTF8(*root_id.class_name));
+                    num_roots++;
+                }
+            }
+            else if (ParseKey(fullkey, root_id, &child_id) && !child_id.IsEmpty())
+            {
+                regions.FindOrAdd(root_id()).Add(child_id);
+            }
+        }
+        tx.exec();
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::BuildIndexes failed: %S"), e.what());
+        return false;
+    }
+
+    // Region by region under its lock, so objects deleted since the scan aren't indexed again. A region
+    // that can't be locked is owned by a running server, which indexes its own writes.
+    int32 num_children = 0;
+    for (const auto& region : regions)
+    {
+        KamoID root_id(region.Key);
+        LockMutex region_lock(this, LockKey(root_id), builder_id, region_lock_timeout);
+        bool locked = region_lock.Lock();
+        UE_CLOG(!locked, LogKamoDriver, Warning, TEXT("KamoRedisDB: Indexing region %s without its lock."), *root_id());
+
+        try
+        {
+            auto pipe = redisPtr->pipeline(false);
+            for (const auto& child_id : region.Value)
+            {
+                pipe.exists(TCHAR_TO_UTF8(*ChildKey(root_id, child_id)));
+            }
+            auto replies = pipe.exec();
+
+            auto tx = redisPtr->transaction(true, false);
+            for (int32 i = 0; i < region.Value.Num(); i++)
+            {
+                if (replies.get<long long>(i) == 1)
+                {
+                    const KamoID& child_id = region.Value[i];
+                    tx.sadd(TCHAR_TO_UTF8(*ChildrenKey(root_id)), TCHAR_TO_UTF8(*child_id()))
+                        .hset(TCHAR_TO_UTF8(*ChildRootsKey(child_id)), TCHAR_TO_UTF8(*child_id()), TCHAR_TO_UTF8(*root_id()))
+                        .sadd(TCHAR_TO_UTF8(*ClassChildrenKey(child_id)), TCHAR_TO_UTF8(*child_id()));
+                    num_children++;
+                }
+            }
+            tx.exec();
+        }
+        catch (const std::exception& e)
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::BuildIndexes of region %s failed: %S"), *root_id(), e.what());
+            region_lock.Unlock();
+            return false;
+        }
+        region_lock.Unlock();
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: Indexed %i root objects and %i child objects."), num_roots, num_children);
+    return true;
+}
+
+
+bool KamoRedisDB::BuildClassIndex()
+{
+    // The child to root hash has every child. A child deleted while this runs may be left in the class
+    // index, lookups skip entries the hash doesn't have.
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: Building the class index for %s"), *Key());
+
+    int32 num_children = 0;
+    try
+    {
+        for (const FString& bucket_key : ChildRootsKeys())
+        {
+            long long cursor = 0;
+            do
+            {
+                std::unordered_map<std::string, std::string> entries;
+                cursor = Call([&](auto& redis) { return redis.hscan(TCHAR_TO_UTF8(*bucket_key), cursor, 1000, std::inserter(entries, entries.begin())); });
+                if (entries.empty())
+                {
+                    continue;
+                }
+
+                auto pipe = Pipeline(bucket_key);
+                for (const auto& entry : entries)
+                {
+                    pipe.sadd(TCHAR_TO_UTF8(*ClassChildrenKey(KamoID(UTF8_TO_TCHAR(entry.first.c_str())))), entry.first);
+                }
+                pipe.exec();
+                num_children += (int32)entries.size();
+            }
+            while (cursor != 0);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::BuildClassIndex failed: %S"), e.what());
+        return false;
+    }
+
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisDB: Indexed %i child objects by class."), num_children);
+    return true;
 }
 
 
@@ -968,7 +2589,13 @@ bool KamoRedisDB::UpdateChildObject(const KamoID& root_id, const KamoID& child_i
     FString key = ChildKey(root_id, child_id);
     try
     {
-        if (!redisPtr->set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state)))
+        auto tx = Transaction(key);
+        tx.set(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*state));
+        IndexChild(tx, root_id, child_id);
+        auto replies = tx.exec();
+        InvalidateCached(key);
+        UpdateChildRoots({ { child_id, root_id } });
+        if (!replies.get<bool>(0))
         {
             UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisDB::UpdateChildObject failed for %s"), *key);
         }
@@ -981,4 +2608,101 @@ bool KamoRedisDB::UpdateChildObject(const KamoID& root_id, const KamoID& child_i
     return true;
 }
 
+
+TOptional<FString> KamoRedisDB::CachedGet(const FString& key) const
+{
+    TOptional<FString> value;
+    if (read_cache && read_cache->Get(key, value))
+    {
+        return value;
+    }
+
+    uint64 generation = read_cache ? read_cache->GetGeneration(key) : 0;
+    auto val = Call([&](auto& redis) { return redis.get(TCHAR_TO_UTF8(*key)); });
+    if (val)
+    {
+        value = FString(val->c_str());
+    }
+
+    if (read_cache)
+    {
+        read_cache->Put(key, value, generation);
+    }
+    return value;
+}
+
+
+KamoID KamoRedisDB::CachedFindRootIDOfChild(const KamoID& child_id, bool fail_silently, bool& cached) const
+{
+    // Keyspace notifications only name the child roots hash, not the field that changed, so these
+    // entries are never invalidated by them. Callers must check the child key exists under the root.
+    FString cache_key = TEXT("root#") + child_id();
+    TOptional<FString> value;
+    cached = read_cache && read_cache->Get(cache_key, value) && value.IsSet();
+    if (cached)
+    {
+        return KamoID(*value);
+    }
+
+    uint64 generation = read_cache ? read_cache->GetGeneration(cache_key) : 0;
+    KamoID root_id = FindRootIDOfChild(child_id, fail_silently);
+    if (read_cache && root_id.IsValid())
+    {
+        read_cache->Put(cache_key, root_id(), generation);
+    }
+    return root_id;
+}
+
+
+void KamoRedisDB::InvalidateCached(const FString& key) const
+{
+    // Keyspace notifications will do this as well, this just closes the gap for our own writes
+    if (read_cache)
+    {
+        read_cache->Invalidate(key);
+    }
+}
+
+
+void KamoRedisDB::GatherStats(const TSharedPtr<FJsonObject>& stats) const
+{
+    if (read_cache)
+    {
+        read_cache->GatherStats(stats);
+    }
+
+    // Lock health. The remaining TTL is an estimate based on the last refresh.
+    double now = FPlatformTime::Seconds();
+    int32 num_lost = 0;
+    double min_ttl_ms = region_lock_timeout * 1000.0;
+    double max_refresh_age = 0.0;
+    {
+        FScopeLock lock(&region_locks_mutex);
+        for (const auto& it : region_lock_health)
+        {
+            if (it.Value.ttl_ms <= 0)
+            {
+                num_lost++;
+                continue;
+            }
+
+            double age = now - it.Value.last_refresh_time;
+            min_ttl_ms = FMath::Min(min_ttl_ms, FMath::Max(it.Value.ttl_ms - age * 1000.0, 0.0));
+            max_refresh_age = FMath::Max(max_refresh_age, age);
+        }
+
+        stats->SetNumberField("db_region_locks", region_locks.Num());
+        stats->SetNumberField("db_region_lock_refresh_ms", last_region_lock_refresh_ms);
+    }
+
+    stats->SetNumberField("db_region_locks_lost", num_lost);
+    stats->SetNumberField("db_region_lock_min_ttl_ms", min_ttl_ms);
+    stats->SetNumberField("db_region_lock_max_refresh_age", max_refresh_age);
+
+    if (journal)
+    {
+        stats->SetNumberField("db_journal_pending", journal->NumPending());
+    }
+}
+
 #endif // WITH_REDIS_CLIENT
@@ -6,11 +6,18 @@
 #include "KamoDB.h"
 #include "KamoRedisDriver.h"
 #include "KamoStructs.h"
+#include "KamoSerializationQueue.h"
+#include "KamoRedisCache.h"
+#include "KamoWriteJournal.h"
 
 #if WITH_REDIS_CLIENT
 #include <redis++/recipes/redlock.h>
 
 #include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+
+#include <atomic>
 
 
 /**
@@ -24,46 +31,114 @@ class KAMORUNTIME_API KamoRedisDB : public IKamoDB, public KamoRedisDriver
     bool ParseKey(const FString& key, KamoID& root_id, KamoID* child_id=nullptr) const;
     FString RootKey(const KamoID& root_id) const;
     FString ChildKey(const KamoID& root_id, const KamoID& child_id) const;
+    FString LockKey(const KamoID& root_id) const;
 
     KamoID FindRootIDOfChild(const KamoID& child_id, bool fail_silently=false) const; // Returns root_id of child_id if it exists.
     bool UpdateChildObject(const KamoID& root_id, const KamoID& child_id, const FString& state);
 
-    // Region locks
+    // Version stamps, a hash per region with a counter per child object.
+    FString VersionsKey(const KamoID& root_id) const;
+
+    // Object indexes, kept up to date in the same transaction as the writes so lookups don't need SCAN.
+    FString ChildrenKey(const KamoID& root_id) const;  // Set of child ids per region
+    FString ChildRootsKey(const KamoID& child_id) const;  // Hash of child id -> root id, split in buckets in cluster mode
+    TArray<FString> ChildRootsKeys() const;  // All of the buckets
+    FString ClassChildrenKey(const KamoID& child_id) const;  // Set of child ids per class, in the slot of the child's bucket
+    TArray<FString> ClassChildrenKeys(const FString& class_name) const;  // All of the buckets of a class
+    FString ClassRootsKey(const FString& class_name) const;  // Set of root ids per class
+    FString RootClassesKey() const;  // Set of root class names
+    void IndexChild(sw::redis::Transaction& tx, const KamoID& root_id, const KamoID& child_id) const;  // Also bumps the version stamp
+    void UnindexChild(sw::redis::Transaction& tx, const KamoID& root_id, const KamoID& child_id) const;
+    int32 ChildIndexCommands() const;  // Number of commands IndexChild() adds
+    bool EnsureIndexes();
+    bool BuildIndexes(const FString& builder_id);  // Full build from a SCAN, not in cluster mode
+    bool BuildClassIndex();  // From the child to root hash
+    bool ClusterHasRootKeys() const;  // Scans every master for root objects, throws on Redis errors
+
+    // Cluster mode helpers. The child to root hash and the class index can't be in a region transaction
+    // so they're updated after it, an invalid root id removes the child. Moves go through here too.
+    void UpdateChildRoots(const TArray<TPair<KamoID, KamoID>>& children) const;
+    void MultiGet(const TArray<KamoID>& root_ids, const std::vector<std::string>& keys, std::vector<sw::redis::OptionalString>& values) const;
+    bool MoveObjectsTwoPhase(const TArray<KamoID>& ids, const KamoID& root_id);
+    // Not repaired: a crash after a region transaction but before its UpdateChildRoots() leaves the
+    // child to root hash without the child, or pointing at its old root. The region's own children set
+    // is right so loading the region finds it, lookups by id or class miss it until it's written again.
+    bool RepairMoves();
+    FString MovesKey(const KamoID& root_id = KamoID()) const;  // Hash of child id -> source root of unfinished moves, or the set of their target roots
+
+    // A page of FindObjectsStreamed(), the objects of one SSCAN or HSCAN round of the index keys
+    struct FObjectPage
+    {
+        int32 index;  // Index key to scan next
+        long long cursor;  // Scan cursor in that key
+        TArray<KamoChildObject> objects;
+        bool ok;
+    };
+    FObjectPage FetchObjectPage(const KamoID& root_id, const FString& class_name, const TArray<FString>& index_keys, int32 index, long long cursor, int32 chunk_size) const;
+
+    // Optional read cache of root and child objects
+    TUniquePtr<FKamoRedisReadCache> read_cache;
+    TOptional<FString> CachedGet(const FString& key) const;
+    void InvalidateCached(const FString& key) const;
+    // Root of a child, cached under a key outside the Redis namespace. Moves and deletes don't
+    // invalidate it, a stale root is detected by its child key being gone. See GetObject().
+    KamoID CachedFindRootIDOfChild(const KamoID& child_id, bool fail_silently, bool& cached) const;
+
+    // Region locks, keyed on root id. The refresher runs on a worker thread so access is guarded.
+    friend class LockMutex;
     FString lock_id;
     TMap<FString, class LockMutex*> region_locks;
+    mutable FCriticalSection region_locks_mutex;
 
-    // Serialization job management
-    struct SerializationRecord
+    // Lock health, updated by the refresher
+    struct FRegionLockHealth
     {
-        KamoID id;
-        KamoID root_id;
-        FString state;
-        int priority;
+        int64 ttl_ms;  // Time to live after the last refresh, 0 if the lock is lost
+        double last_refresh_time;  // FPlatformTime::Seconds() of the last successful refresh
     };
+    TMap<FString, FRegionLockHealth> region_lock_health;
+    float last_region_lock_refresh_ms;
 
-    FCriticalSection mutex;
-    TMap<FString, SerializationRecord> objects_for_serialization;
-
-    // Serializer worker
-    class FDBSerializerWorker : public FNonAbandonableTask
+    // Serializer. Writes are sharded by region over a set of persistent writer threads so writes to
+    // a region stay in order. Each writer has its own queue and wakes up when something is queued.
+    class FWriter : public FRunnable
     {
     public:
-        KamoRedisDB* db;
-        friend class FAsyncTask<FDBSerializerWorker>;
+        FWriter(KamoRedisDB* _db);
+        virtual ~FWriter() override;
 
-        FORCEINLINE TStatId GetStatId() const
-        {
-            RETURN_QUICK_DECLARE_CYCLE_STAT(FDBSerializerWorker, STATGROUP_KamoAsync);
-        }
-
-        void DoWork() 
-        { 
-            db->DoWork(); 
-        }        
+        KamoRedisDB* db;
+        FCriticalSection mutex;
+        FKamoSerializationQueue queue;
+        FEvent* wake_event;
+        FRunnableThread* thread;
+        std::atomic<bool> stopping;
+        std::atomic<bool> drain;  // Write out the queue before stopping
+
+        // FRunnable
+        virtual uint32 Run() override;
+        virtual void Stop() override;
     };
 
-    FAsyncTask<FDBSerializerWorker> serializer;
-    void DoWork();
+    TArray<TUniquePtr<FWriter>> writers;
+    int32 num_writers;
+    KamoSerializationPolicy serialization_policy;
+    FWriter& GetWriter(const KamoID& root_id) const;
+    void StartWriters();
+    void StopWriters(bool drain = true);
+    void DoWork(FWriter& writer);
+
+    // Batch limits of the serializer. Each batch is sent to Redis in a single pipeline.
+    int32 write_batch_size;
+    int32 write_batch_bytes;
+    bool WriteBatch(const TArray<FKamoSerializationQueue::Record>& batch);
+
+    // Optional local journal of queued writes. What didn't reach Redis is replayed on the next start,
+    // before any region is locked, and shutdown doesn't need to wait for the queues to drain.
+    TUniquePtr<FKamoWriteJournal> journal;
+    FString journal_directory;
+    FString journal_name;
+    bool ReplayJournal();
 
     // Region lock refresher
     class FRegionLockRefresher : public FNonAbandonableTask
@@ -81,8 +156,14 @@ class KAMORUNTIME_API KamoRedisDB : public IKamoDB, public KamoRedisDriver
     };
 
     FAsyncTask<FRegionLockRefresher> region_lock_refresher;
-    void RefreshRegionLocks();
+    void RefreshRegionLocks();  // Refreshes all locks in a single script call
     float last_region_lock_refresh_seconds;
+    float region_lock_refresh_interval;
+    int32 region_lock_timeout;
+
+protected:
+    // KamoRedisDriver
+    int32 GetDefaultPoolSize() const override;
 
 public:
 	KamoRedisDB();
@@ -90,6 +171,8 @@ public:
 
 	// IKamoDriver
 	FString GetDriverType() const override { return "db"; }
+    bool OnSessionCreated() override;
+    void CloseSession() override;
     void Tick(float DeltaTime) override;
 
 	// IKamoDB
@@ -107,6 +190,7 @@ public:
     
     // Remove object from serialization queue if it's there. Returns true if removed.
     virtual bool CancelIfPending(const KamoID& id) override;
+    virtual void SetSerializationPolicy(const KamoSerializationPolicy& policy) override;
     
     // Root object API
     virtual bool AddRootObject(const KamoID& id, const FString& state, bool ignore_if_exists=false);
@@ -125,7 +209,12 @@ public:
     virtual KamoChildObject GetObject(const KamoID& id, bool fail_silently = false) const override;
     // Specify either 'root_id', 'class_name'
     virtual TArray<KamoChildObject> FindObjects(const KamoID& root_id, const FString& class_name) const;
+    virtual bool FindObjectsStreamed(const KamoID& root_id, const FString& class_name, TFunctionRef<bool(TArray<KamoChildObject>&)> callback, int32 chunk_size = 500) const override;
     virtual bool MoveObject(const KamoID& id, const KamoID& root_id);
+    virtual bool MoveObjects(const TArray<KamoID>& ids, const KamoID& root_id) override;
+    virtual TArray<KamoChildObject> GetObjects(const KamoID& root_id, const TArray<KamoID>& ids) const override;
+    virtual bool GetObjectVersions(const KamoID& root_id, TMap<FString, int64>& versions) const override;
+    virtual void GatherStats(const TSharedPtr<FJsonObject>& stats) const override;
     
     // Handler API
     virtual bool AddHandlerObject(const KamoHandlerObject& handler);
@@ -34,6 +34,7 @@ bool KamoRedisDriver::OnSessionCreated()
 	// Redis URL is specified in environment variable or on command line.
 	// The default is localhost:6379/0 and no password.
 	// Example: redis://localhost:6379/0
+	// For Redis Cluster use any of the cluster nodes: redis-cluster://10.0.0.1:6379
 
 	FString origin = "environment variable KAMO_REDIS_URL";
 	FString redis_url = FPlatformMisc::GetEnvironmentVariable(TEXT("KAMO_REDIS_URL"));
@@ -54,13 +55,22 @@ bool KamoRedisDriver::OnSessionCreated()
 	int32 port = 6379;
 	int database = 0;
 
-	if (!redis_url.StartsWith("redis://"))
+	FString url;
+	cluster_mode = redis_url.StartsWith("redis-cluster://");
+	if (cluster_mode)
+	{
+		url = redis_url.RightChop(16); // Chop 'redis-cluster://' from the string
+	}
+	else if (redis_url.StartsWith("redis://"))
+	{
+		url = redis_url.RightChop(8); // Chop 'redis://' from the string
+	}
+	else
 	{
 		UE_LOG(LogKamoDriver, Error, TEXT("Malformed redis driver URL set from %s: %s "), *origin, *redis_url);
 		return false;
 	}
 
-	FString url = redis_url.RightChop(8); // Chop 'redis://' from the string
 	FString left, right;
 
 	if (url.Split("/", &left, &right))
@@ -85,10 +95,15 @@ bool KamoRedisDriver::OnSessionCreated()
 	connectionOptions.port = port;
 	connectionOptions.password = "";
 	connectionOptions.db = database;
+	database_index = database;
 	connectionOptions.socket_timeout = std::chrono::milliseconds(0);
 
+	// Pool size, i.e. max number of connections. Can be overridden with -kamoredispool=
+	int32 pool_size = config.connection_pool_size > 0 ? config.connection_pool_size : GetDefaultPoolSize();
+	FParse::Value(FCommandLine::Get(), TEXT("-kamoredispool="), pool_size);
+
 	ConnectionPoolOptions poolOptions;
-	poolOptions.size = 3;  // Pool size, i.e. max number of connections.
+	poolOptions.size = FMath::Max(pool_size, 1);
 
 	// Optional. Max time to wait for a connection. 0ms by default, which means wait forever.
 	// Say, the pool size is 3, while 4 threds try to fetch the connection, one of them will be blocked.
@@ -100,8 +115,33 @@ bool KamoRedisDriver::OnSessionCreated()
 	poolOptions.connection_lifetime = std::chrono::minutes(10);
 
 
-	UE_LOG(LogKamoDriver, Display, TEXT("Initializing Redis driver for %s using %s: %s "), *GetSessionURL(), *origin, *redis_url);
-	
+	UE_LOG(LogKamoDriver, Display, TEXT("Initializing Redis driver for %s using %s: %s, pool size %i"), *GetSessionURL(), *origin, *redis_url, (int32)poolOptions.size);
+
+	if (cluster_mode)
+	{
+		if (database != 0)
+		{
+			UE_LOG(LogKamoDriver, Error, TEXT("Redis Cluster only supports database 0, got %i from %s"), database, *origin);
+			return false;
+		}
+
+		// The pool options apply to each node
+		try
+		{
+			clusterPtr = std::make_shared<RedisCluster>(connectionOptions, poolOptions);
+			clusterPtr->exists(TCHAR_TO_UTF8(*Key()));  // Connections are lazy, fail here rather than on first use
+		}
+		catch (const std::exception& e)
+		{
+			UE_LOG(LogKamoDriver, Error, TEXT("Redis Cluster connection failed: %S"), e.what());
+			clusterPtr.reset();
+			return false;
+		}
+
+		UE_LOG(LogKamoDriver, Display, TEXT("Redis Cluster connection active."));
+		return true;
+	}
+
 	redisPtr = CreateRedisInstance(connectionOptions, poolOptions);
 	if (!redisPtr)
 	{
@@ -144,10 +184,34 @@ RedisSP KamoRedisDriver::CreateRedisInstance(const sw::redis::ConnectionOptions&
 }
 
 
+sw::redis::Transaction KamoRedisDriver::Transaction(const FString& key, bool new_connection) const
+{
+	if (!cluster_mode)
+	{
+		return redisPtr->transaction(true, new_connection);
+	}
+
+	// The node is picked the same way the cluster does it, by the hash tag of the key if it has one
+	return clusterPtr->transaction(TCHAR_TO_UTF8(*key), true, new_connection);
+}
+
+
+sw::redis::Pipeline KamoRedisDriver::Pipeline(const FString& key) const
+{
+	if (!cluster_mode)
+	{
+		return redisPtr->pipeline(false);
+	}
+
+	return clusterPtr->pipeline(TCHAR_TO_UTF8(*key), false);
+}
+
+
 void KamoRedisDriver::CloseSession()
 {
 	IKamoDriver::CloseSession();
 	redisPtr.reset();
+	clusterPtr.reset();
 }
 
 
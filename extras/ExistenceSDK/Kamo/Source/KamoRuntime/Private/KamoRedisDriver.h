@@ -67,6 +67,30 @@ public:
 protected:
 
     RedisSP redisPtr;
+    int32 database_index = 0;
+
+    // Cluster mode, enabled with a redis-cluster:// URL. 'redisPtr' is then null and commands go through
+    // 'clusterPtr', which routes each one to the node serving its key. Keys that must live on the same
+    // shard share a hash tag, see HashTag().
+    bool cluster_mode = false;
+    std::shared_ptr<sw::redis::RedisCluster> clusterPtr;
+    FString HashTag(const FString& tag) const { return cluster_mode ? TEXT("{") + tag + TEXT("}") : tag; }
+
+    // Runs 'func' on 'redisPtr' or 'clusterPtr', they have the same command API. Example:
+    //   auto val = Call([&](auto& redis) { return redis.get(key); });
+    template <typename FuncType>
+    auto Call(FuncType&& func) const -> decltype(func(std::declval<sw::redis::Redis&>()))
+    {
+        return cluster_mode ? func(*clusterPtr) : func(*redisPtr);
+    }
+
+    // A transaction or pipeline on a connection of the node serving 'key', taken from the pool unless
+    // 'new_connection' is set. Transactions held open across other calls, e.g. with a WATCH, should
+    // use a new connection so they don't starve the pool.
+    sw::redis::Transaction Transaction(const FString& key, bool new_connection = false) const;
+    sw::redis::Pipeline Pipeline(const FString& key) const;
+
+    virtual int32 GetDefaultPoolSize() const { return 3; }
     RedisSP CreateRedisInstance(const sw::redis::ConnectionOptions& connectionOptions, const sw::redis::ConnectionPoolOptions& poolOptions) const;
 };
 
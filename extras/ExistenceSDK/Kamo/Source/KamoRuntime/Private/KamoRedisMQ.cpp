@@ -2,6 +2,7 @@
 
 #include "KamoRedisMQ.h"
 #include "KamoFileHelper.h"
+#include "KamoTrace.h"
 
 #include "KamoRedisMQ.h"
 #include "HAL/PlatformFileManager.h"
@@ -10,58 +11,94 @@
 #if WITH_REDIS_CLIENT
 using namespace sw::redis;
 
+// Consumer group of the inbox streams. There is one consumer per stream, the handler it belongs to.
+static const char* consumer_group = "kamo";
+
+// How long XREADGROUP blocks waiting for messages. Also bounds how long acks and shutdown wait.
+static const std::chrono::milliseconds read_block_time(100);
+
+static const int32 default_read_batch_size = 100;
+static const int32 default_max_stream_length = 10000;
+
+// XREADGROUP reply, entry id and fields. The fields are null for entries deleted while pending.
+using StreamEntry = std::pair<std::string, Optional<std::vector<std::pair<std::string, std::string>>>>;
+using StreamEntries = std::vector<StreamEntry>;
+
+
 KamoRedisMQ::KamoRedisMQ() :
-    thread(nullptr)
+    thread(nullptr),
+    stopping(false),
+    read_batch_size(default_read_batch_size),
+    max_stream_length(default_max_stream_length)
 {
 }
 
 
 KamoRedisMQ::~KamoRedisMQ()
 {
+    StopConsumer();
 }
 
 
 bool KamoRedisMQ::OnSessionCreated()
 {
-    if (KamoRedisDriver::OnSessionCreated())
-    {
-        subscriberPtr = std::make_unique<sw::redis::Subscriber>(redisPtr->subscriber());
-        return true;
-    }
-    else
+    if (!KamoRedisDriver::OnSessionCreated())
     {
         return false;
     }
+
+    // Can be overridden with -kamoredismqbatch= and -kamoredismqmaxlen=
+    read_batch_size = config.message_batch_size > 0 ? config.message_batch_size : default_read_batch_size;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredismqbatch="), read_batch_size);
+    read_batch_size = FMath::Max(read_batch_size, 1);
+
+    max_stream_length = config.message_stream_max_length > 0 ? config.message_stream_max_length : default_max_stream_length;
+    FParse::Value(FCommandLine::Get(), TEXT("-kamoredismqmaxlen="), max_stream_length);
+    max_stream_length = FMath::Max(max_stream_length, 0);
+
+    return true;
 }
 
+
+void KamoRedisMQ::CloseSession()
+{
+    StopConsumer();
+    KamoRedisDriver::CloseSession();
+}
+
+
 bool KamoRedisMQ::CreateMessageQueue()
-{   
+{
     if (!initialized)
-    { 
-        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ::CreateMessageQueue: Driver not initialized, tenant=%s, session=%s"), *tenant_name, *session_info); 
-        return false;	
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ::CreateMessageQueue: Driver not initialized, tenant=%s, session=%s"), *tenant_name, *session_info);
+        return false;
     }
 
+    // Start from the beginning of the stream if it's new so nothing sent before the group exists is missed.
+    // If the group exists we pick up where the previous session of this handler left off.
     try
     {
-        subscriberPtr->subscribe(StringCast<char>(*Key()).Get());
-        subscriberPtr->on_message([this](std::string channel, std::string msg)
+        Call([&](auto& redis) { redis.xgroup_create(TCHAR_TO_UTF8(*Key()), consumer_group, "0", true); });
+    }
+    catch (const ReplyError& e)
+    {
+        if (FCStringAnsi::Strncmp(e.what(), "BUSYGROUP", 9) != 0)
         {
-            // Process message of MESSAGE type.
-            if (FString(channel.c_str()) == Key())
-            {
-                FScopeLock lock(&mutex);
-                payloads.Add(UTF8_TO_TCHAR(msg.c_str()));
-            }
-        });
+            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ::CreateMessageQueue: Can't create consumer group: %S"), e.what());
+            return false;
+        }
     }
     catch (const std::exception& e)
     {
-        UE_LOG(LogKamoDriver, Error, TEXT("Redis subscribe failed: %S"), e.what());
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ::CreateMessageQueue: Can't create consumer group: %S"), e.what());
         return false;
     }
 
-    // Create thread for subscription channel
+    UE_LOG(LogKamoDriver, Display, TEXT("KamoRedisMQ: Reading %s in batches of %i, max length %i."), *Key(), read_batch_size, max_stream_length);
+
+    // Create thread for the consumer
+    stopping = false;
     thread = FRunnableThread::Create(this, TEXT("KamoRedisMQ"), 0, TPri_Normal);
     return true;
 }
@@ -69,30 +106,22 @@ bool KamoRedisMQ::CreateMessageQueue()
 
 bool KamoRedisMQ::DeleteMessageQueue()
 {
-    try
-    {
-        subscriberPtr->unsubscribe(StringCast<char>(*Key()).Get());
-    }
-    catch (const std::exception& e)
-    {
-        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ::DeleteMessageQueue failed: %S"), e.what());
-        return false;
-    }
+    // The stream and the group are kept so messages sent while this handler restarts are delivered
+    // when it's back. What was read but not processed is redelivered then too.
+    StopConsumer();
+    return true;
+}
 
-    // Deleting the object will trigger a disconnect on the subscriber, which will in turn end the Consume loop 
-    // and the worker thread will exit.
-    // Note: It is a bad design pattern in redis++ that one needs to delete the object to trigger a disconnect.
-    // As the pointer reference is defined as unique we can be somewhat certain that this is the only reference
-    // to the object and a reset() will call 'delete' on the instance.
-    subscriberPtr.reset();
 
+void KamoRedisMQ::StopConsumer()
+{
     if (thread)
     {
-        thread->WaitForCompletion();
+        // Stop() is called by Kill() and the thread acks what's been processed before exiting
+        thread->Kill(true);
+        delete thread;
         thread = nullptr;
     }
-
-    return true;
 }
 
 
@@ -123,11 +152,21 @@ bool KamoRedisMQ::SendMessage(const FString& inbox_address, const FString& messa
         key = Key(parts);
     }
 
-    if (message_type == "command") 
+    if (message_type == "command")
     {
+        KAMO_TRACE_SCOPE("RedisMQ.Send", KamoID(), payload.Len());
         try
         {
-            long long retval = redisPtr->publish(TCHAR_TO_UTF8(*key), TCHAR_TO_UTF8(*payload));
+            std::string stream = TCHAR_TO_UTF8(*key);
+            std::vector<std::pair<std::string, std::string>> fields = { { "payload", TCHAR_TO_UTF8(*payload) } };
+            if (max_stream_length > 0)
+            {
+                Call([&](auto& redis) { return redis.xadd(stream, "*", fields.begin(), fields.end(), max_stream_length, true); });
+            }
+            else
+            {
+                Call([&](auto& redis) { return redis.xadd(stream, "*", fields.begin(), fields.end()); });
+            }
         }
         catch (const std::exception& e)
         {
@@ -136,49 +175,127 @@ bool KamoRedisMQ::SendMessage(const FString& inbox_address, const FString& messa
         }
         return true;
     }
-    
+
     return false;
 }
 
+
 bool KamoRedisMQ::ReceiveMessage(KamoMessage& message)
 {
-    if (payloads.Num())
+    return inbound.Dequeue(message);
+}
+
+
+int32 KamoRedisMQ::ReceiveMessages(TArray<KamoMessage>& messages, int32 max_messages)
+{
+    int32 num_received = 0;
+    KamoMessage* message;
+    while (num_received < max_messages && (message = inbound.Peek()) != nullptr)
     {
-        FScopeLock lock(&mutex);
-        message.message_type = "command";
-        message.payload = payloads.Pop();
-        return true;
+        messages.Add(MoveTemp(*message));
+        inbound.Pop();
+        num_received++;
     }
-    else
+    return num_received;
+}
+
+
+void KamoRedisMQ::AcknowledgeMessage(const KamoMessage& message)
+{
+    pending_acks.Enqueue(TCHAR_TO_UTF8(*message.message_id));
+}
+
+
+void KamoRedisMQ::FlushAcks()
+{
+    std::vector<std::string> acks;
+    Swap(acks, dead_entries);
+
+    std::string id;
+    while (pending_acks.Dequeue(id))
     {
-        return false;
+        acks.push_back(MoveTemp(id));
+    }
+
+    if (acks.empty())
+    {
+        return;
+    }
+
+    // Acked entries are deleted right away, nothing reads them again
+    KAMO_TRACE_SCOPE("RedisMQ.Ack", KamoID(), (int32)acks.size());
+    std::string stream = TCHAR_TO_UTF8(*Key());
+    try
+    {
+        auto pipe = Pipeline(Key());
+        pipe.xack(stream, consumer_group, acks.begin(), acks.end());
+        pipe.xdel(stream, acks.begin(), acks.end());
+        pipe.exec();
+    }
+    catch (const std::exception& e)
+    {
+        // The messages are redelivered on the next start
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ: Failed to ack %i messages: %S"), (int32)acks.size(), e.what());
     }
 }
 
-void KamoRedisMQ::Consume()
+
+int32 KamoRedisMQ::ReadBatch(const std::string& id, std::string& last_id)
 {
-    for (;;)
+    std::vector<std::pair<std::string, StreamEntries>> result;
+    try
     {
-        try
+        Call([&](auto& redis)
         {
-            subscriberPtr->consume();
-        }
-        catch (const TimeoutError& e)
+            redis.xreadgroup(consumer_group, TCHAR_TO_UTF8(*session_info), TCHAR_TO_UTF8(*Key()), id,
+                read_block_time, read_batch_size, std::back_inserter(result));
+        });
+    }
+    catch (const std::exception& e)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ: XREADGROUP failed: %S"), e.what());
+        return -1;
+    }
+
+    if (result.empty() || result[0].second.empty())
+    {
+        return 0;
+    }
+
+    const StreamEntries& entries = result[0].second;
+    KAMO_TRACE_SCOPE("RedisMQ.Read", KamoID(), (int32)entries.size());
+    last_id = entries.back().first;
+
+    for (const StreamEntry& entry : entries)
+    {
+        const char* payload = nullptr;
+        if (entry.second)
         {
-            // ignore
-            UE_LOG(LogKamoDriver, Warning, TEXT("KamoRedisMQ::ReceiveMessage timed out: %S"), e.what());
+            for (const auto& field : *entry.second)
+            {
+                if (field.first == "payload")
+                {
+                    payload = field.second.c_str();
+                }
+            }
         }
-        catch (const sw::redis::IoError& e)
+
+        if (payload)
         {
-            // Most likely "Failed to get reply: connection aborted". We simply quit now.
-            return;
+            KamoMessage message;
+            message.message_type = "command";
+            message.message_id = UTF8_TO_TCHAR(entry.first.c_str());
+            message.payload = UTF8_TO_TCHAR(payload);
+            inbound.Enqueue(MoveTemp(message));
         }
-        catch (const std::exception& e)
+        else
         {
-            UE_LOG(LogKamoDriver, Error, TEXT("KamoRedisMQ::ReceiveMessage failed: %S"), e.what());
-            return;
+            // Deleted or malformed, just get it out of the pending list
+            dead_entries.push_back(entry.first);
         }
     }
+
+    return (int32)entries.size();
 }
 
 
@@ -189,8 +306,38 @@ void KamoRedisMQ::Tick(float DeltaTime)
 
 uint32 KamoRedisMQ::Run()
 {
-    Consume();
+    // Start with what was delivered to this handler before but never acked, e.g. if it crashed.
+    // The pending list is paged through by id, after that only new messages are read.
+    bool read_pending = true;
+    std::string pending_id = "0";
+
+    while (!stopping)
+    {
+        FlushAcks();
+
+        std::string last_id;
+        int32 num_read = ReadBatch(read_pending ? pending_id : std::string(">"), last_id);
+        if (num_read < 0)
+        {
+            // Connection trouble, back off a little
+            FPlatformProcess::Sleep(1.0f);
+        }
+        else if (read_pending)
+        {
+            read_pending = num_read == read_batch_size;
+            pending_id = last_id;
+            UE_CLOG(num_read > 0, LogKamoDriver, Display, TEXT("KamoRedisMQ: Redelivering %i unacknowledged messages."), num_read);
+        }
+    }
+
+    FlushAcks();
     return 0;
 }
 
+
+void KamoRedisMQ::Stop()
+{
+    stopping = true;
+}
+
 #endif // WITH_REDIS_CLIENT
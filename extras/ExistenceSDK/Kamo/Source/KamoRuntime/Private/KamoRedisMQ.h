@@ -8,13 +8,22 @@
 #include "CoreMinimal.h"
 #include "Misc/ScopeLock.h"
 #include "HAL/Runnable.h"
+#include "Containers/Queue.h"
+
+#include <atomic>
 
 
 #if WITH_REDIS_CLIENT
 
+/**
+ * Message queue on Redis Streams. Each handler has an inbox stream which senders XADD to. The handler
+ * reads it in batches with XREADGROUP on a consumer thread and acks a message once it's processed, so
+ * messages sent while the handler is down or reconnecting are delivered when it's back, in order.
+ * Acked messages are deleted from the stream and MAXLEN trimming caps the stream of a dead handler.
+ */
 class KAMORUNTIME_API KamoRedisMQ : public IKamoMQ, public KamoRedisDriver, public FRunnable
 {
-    
+
 public:
 	KamoRedisMQ();
 	virtual ~KamoRedisMQ() override;
@@ -22,30 +31,45 @@ public:
 	// IKamoDriver
 	FString GetDriverType() const override { return "mq";  }
 	bool OnSessionCreated() override;
+	void CloseSession() override;
 	void Tick(float DeltaTime) override;
 
 
 	// IKamoMQ
 	class IKamoDriver* GetDriver() override { return nullptr; }
-	
+
 	virtual bool CreateMessageQueue() override;
 	virtual bool DeleteMessageQueue() override;
     virtual bool ReceiveMessage(KamoMessage& message) override;
+    virtual int32 ReceiveMessages(TArray<KamoMessage>& messages, int32 max_messages) override;
+    virtual void AcknowledgeMessage(const KamoMessage& message) override;
 	virtual bool SendMessage(const FString& inbox_address, const FString& message_type, const FString& payload) override;
 
 	// FRunnable
 	virtual uint32 Run() override;
+	virtual void Stop() override;
 
 private:
 
-	void Consume();
+	// Read a batch from the inbox stream. 'id' is ">" for new messages or an id for the ones delivered
+	// to us earlier but never acked, starting after 'id'. Returns the number of messages read or -1 on
+	// error, 'last_id' is the id of the last one.
+	int32 ReadBatch(const std::string& id, std::string& last_id);
+	void FlushAcks();
+	void StopConsumer();
+
+	// The consumer thread and the game thread only talk through these, each has one producer and one
+	// consumer so no locking is needed.
+	TQueue<KamoMessage, EQueueMode::Spsc> inbound;  // Consumer thread -> game thread, in stream order
+	TQueue<std::string, EQueueMode::Spsc> pending_acks;  // Game thread -> consumer thread, processed message ids
+
+	std::vector<std::string> dead_entries;  // Consumer thread only, pending entries with nothing to deliver
 
-	std::unique_ptr<sw::redis::Subscriber> subscriberPtr;
-	FCriticalSection mutex;
 	class FRunnableThread* thread;
-	
+	std::atomic<bool> stopping;
 
-	TArray<FString> payloads;
+	int32 read_batch_size;  // Max messages per XREADGROUP
+	int32 max_stream_length;  // Approximate MAXLEN of the inbox streams, 0 is no limit
 };
 
 #endif // WITH_REDIS_CLIENT
@@ -0,0 +1,490 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoRegionPack.h"
+#include "KamoRuntimeModule.h"
+#include "KamoFileHelper.h"
+#include "KamoTrace.h"
+
+#include "Async/MappedFileHandle.h"
+#include "HAL/PlatformFileManager.h"
+#include "HAL/PlatformProcess.h"
+#include "Misc/Crc.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeExit.h"
+
+
+static const uint32 pack_magic = 0x4B50414B; // 'KPAK'
+static const uint32 pack_format_version = 1;
+
+// Header: magic, version, generation, index entries, index bytes, end of the compacted states
+static const int32 header_bytes = 4 + 4 + 8 + 4 + 4 + 8;
+
+// Size and CRC
+static const int32 record_header_bytes = 8;
+
+// Record payload: type, id length, id, state
+enum class ERecordType : uint8
+{
+    Put,
+    Delete,
+};
+
+// Compact when more than half of the file is dead and it's at least this big
+static const int64 min_compact_bytes = 1024 * 1024;
+
+// How long a writer waits for the lock of another writer
+static const double lock_timeout_seconds = 5.0;
+
+
+namespace
+{
+    template <typename T>
+    void Write(TArray<uint8>& data, T value)
+    {
+        data.Append((const uint8*)&value, sizeof(T));
+    }
+
+    template <typename T>
+    T Read(const uint8* data)
+    {
+        T value;
+        FMemory::Memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    void WriteUTF8(TArray<uint8>& data, const FString& value, bool with_length)
+    {
+        FTCHARToUTF8 utf8(*value);
+        if (with_length)
+        {
+            Write<uint16>(data, (uint16)utf8.Length());
+        }
+        data.Append((const uint8*)utf8.Get(), utf8.Length());
+    }
+
+    FString ReadUTF8(const uint8* data, int32 length)
+    {
+        FUTF8ToTCHAR tchar((const ANSICHAR*)data, length);
+        return FString(tchar.Length(), tchar.Get());
+    }
+}
+
+
+FKamoRegionPack::FKamoRegionPack(const FString& _directory) :
+    directory(_directory),
+    pack_path(PackFilename(_directory)),
+    lock_path(PackFilename(_directory) + TEXT(".lock")),
+    live_bytes(0),
+    scanned_size(0),
+    generation(0),
+    change_count(0),
+    file_size(0)
+{
+}
+
+
+FKamoRegionPack::~FKamoRegionPack()
+{
+    Unmap();
+}
+
+
+FString FKamoRegionPack::PackFilename(const FString& directory)
+{
+    return directory / TEXT("_objects.pack");
+}
+
+
+void FKamoRegionPack::Unmap()
+{
+    mapped_region.Reset();
+    mapped_file.Reset();
+}
+
+
+bool FKamoRegionPack::Refresh()
+{
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    FFileStatData stat = pf.GetStatData(*pack_path);
+    if (!stat.bIsValid)
+    {
+        // No objects written to the region yet, or the region has been deleted
+        Unmap();
+        change_count += index.Num() > 0 ? 1 : 0;
+        index.Reset();
+        live_bytes = scanned_size = file_size = 0;
+        generation = 0;
+        return pf.DirectoryExists(*directory);
+    }
+
+    if (stat.FileSize == file_size && stat.ModificationTime == modification_time && scanned_size == file_size)
+    {
+        return true;
+    }
+
+    KAMO_TRACE_SCOPE("RegionPack.Refresh", KamoID(), stat.FileSize);
+    file_size = stat.FileSize;
+    modification_time = stat.ModificationTime;
+    return Map();
+}
+
+
+bool FKamoRegionPack::Map()
+{
+    Unmap();
+
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    mapped_file.Reset(pf.OpenMapped(*pack_path));
+    if (mapped_file && mapped_file->GetFileSize() >= header_bytes)
+    {
+        mapped_region.Reset(mapped_file->MapRegion(0, mapped_file->GetFileSize()));
+    }
+
+    if (!mapped_region)
+    {
+        // Most likely a writer is creating the file, leave the index as it was
+        Unmap();
+        return true;
+    }
+
+    const uint8* data = mapped_region->GetMappedPtr();
+    int64 size = mapped_region->GetMappedSize();
+    file_size = size;
+
+    if (Read<uint32>(data) != pack_magic || Read<uint32>(data + 4) != pack_format_version)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Unknown format: %s"), *pack_path);
+        Unmap();
+        return false;
+    }
+
+    // A new generation means the file was compacted, start over. Otherwise only the records appended
+    // since the last time are scanned.
+    uint64 file_generation = Read<uint64>(data + 8);
+    if (file_generation != generation || scanned_size == 0 || scanned_size > size)
+    {
+        generation = file_generation;
+        if (!ParseIndex(data, size))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Corrupt index: %s"), *pack_path);
+            index.Reset();
+            scanned_size = 0;
+            Unmap();
+            return false;
+        }
+    }
+
+    return ScanRecords(data, size);
+}
+
+
+bool FKamoRegionPack::ParseIndex(const uint8* data, int64 size)
+{
+    index.Reset();
+    live_bytes = 0;
+    change_count++;
+
+    int32 num_entries = Read<uint32>(data + 16);
+    int64 index_end = header_bytes + (int64)Read<uint32>(data + 20);
+    int64 data_end = Read<int64>(data + 24);
+    if (index_end > size || data_end > size || data_end < index_end)
+    {
+        return false;
+    }
+
+    index.Reserve(num_entries);
+    int64 offset = header_bytes;
+    for (int32 i = 0; i < num_entries; i++)
+    {
+        if (offset + 2 > index_end)
+        {
+            return false;
+        }
+        uint16 id_length = Read<uint16>(data + offset);
+        offset += 2;
+        if (offset + id_length + 12 > index_end)
+        {
+            return false;
+        }
+
+        FString id = ReadUTF8(data + offset, id_length);
+        offset += id_length;
+        FEntry entry = { Read<int64>(data + offset), Read<int32>(data + offset + 8) };
+        offset += 12;
+        if (entry.offset < index_end || entry.offset + entry.length > data_end)
+        {
+            return false;
+        }
+
+        index.Add(MoveTemp(id), entry);
+        live_bytes += entry.length;
+    }
+
+    scanned_size = data_end;
+    return true;
+}
+
+
+bool FKamoRegionPack::ScanRecords(const uint8* data, int64 size)
+{
+    int64 offset = scanned_size;
+    while (offset + record_header_bytes <= size)
+    {
+        uint32 payload_size = Read<uint32>(data + offset);
+        uint32 crc = Read<uint32>(data + offset + 4);
+        const uint8* payload = data + offset + record_header_bytes;
+        if (offset + record_header_bytes + (int64)payload_size > size || payload_size < 3 || FCrc::MemCrc32(payload, payload_size) != crc)
+        {
+            // Being written right now, or torn by a crash. Picked up on the next refresh if it's the former.
+            break;
+        }
+
+        ERecordType type = (ERecordType)payload[0];
+        uint16 id_length = Read<uint16>(payload + 1);
+        if (3 + (uint32)id_length > payload_size)
+        {
+            break;
+        }
+
+        FString id = ReadUTF8(payload + 3, id_length);
+        if (FEntry* previous = index.Find(id))
+        {
+            live_bytes -= previous->length;
+        }
+
+        if (type == ERecordType::Put)
+        {
+            FEntry entry;
+            entry.offset = offset + record_header_bytes + 3 + id_length;
+            entry.length = payload_size - 3 - id_length;
+            index.Add(MoveTemp(id), entry);
+            live_bytes += entry.length;
+        }
+        else
+        {
+            index.Remove(id);
+        }
+
+        offset += record_header_bytes + payload_size;
+        change_count++;
+    }
+
+    scanned_size = offset;
+    return true;
+}
+
+
+bool FKamoRegionPack::Get(const FString& id, FString& state) const
+{
+    const FEntry* entry = index.Find(id);
+    if (!entry || !mapped_region)
+    {
+        return false;
+    }
+
+    state = ReadUTF8(mapped_region->GetMappedPtr() + entry->offset, entry->length);
+    return true;
+}
+
+
+IKamoFileHandle* FKamoRegionPack::Lock() const
+{
+    // The pack itself is renamed over when compacted so the lock is on a separate file
+    double start_time = FPlatformTime::Seconds();
+    for (;;)
+    {
+        IKamoFileHandle* lock = FKamoFileHelper::OpenWrite(*lock_path, true, false);
+        if (lock || FPlatformTime::Seconds() - start_time > lock_timeout_seconds)
+        {
+            return lock;
+        }
+        FPlatformProcess::Sleep(0.001f);
+    }
+}
+
+
+bool FKamoRegionPack::Append(const TArray<FWrite>& writes, bool sync)
+{
+    KAMO_TRACE_SCOPE("RegionPack.Append", KamoID(), writes.Num());
+    TUniquePtr<IKamoFileHandle> lock(Lock());
+    if (!lock)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Timed out waiting for the lock of %s"), *pack_path);
+        return false;
+    }
+
+    // With the lock held nobody is writing, so an unreadable tail is a torn record of a crashed writer.
+    // Records appended after it would never be read, rewrite the file without it.
+    if (!Refresh())
+    {
+        return false;
+    }
+
+    // Everything picked up from here on was written by us
+    uint64 external_change_count = change_count;
+    ON_SCOPE_EXIT { change_count = external_change_count; };
+
+    if (mapped_region && scanned_size < file_size)
+    {
+        UE_LOG(LogKamoDriver, Warning, TEXT("FKamoRegionPack: Dropping %lld bytes of torn records at the end of %s"), file_size - scanned_size, *pack_path);
+        if (!Compact())
+        {
+            return false;
+        }
+    }
+
+    // Some platforms don't allow writing to a file that's mapped, remapped by the refresh below
+    Unmap();
+    file_size = -1;
+
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    TUniquePtr<IFileHandle> file(pf.OpenWrite(*pack_path, true, true));
+    if (!file)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Can't open %s for writing"), *pack_path);
+        Refresh();
+        return false;
+    }
+
+    TArray<uint8> data;
+    if (file->Size() < header_bytes)
+    {
+        // New pack, or one that a crashed writer didn't get to write the header for
+        if (file->Size() > 0)
+        {
+            file.Reset(pf.OpenWrite(*pack_path, false, true));
+            if (!file)
+            {
+                UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Can't truncate %s"), *pack_path);
+                Refresh();
+                return false;
+            }
+        }
+        Write<uint32>(data, pack_magic);
+        Write<uint32>(data, pack_format_version);
+        Write<uint64>(data, FPlatformTime::Cycles64());
+        Write<uint32>(data, 0);
+        Write<uint32>(data, 0);
+        Write<int64>(data, header_bytes);
+    }
+
+    for (const FWrite& write : writes)
+    {
+        int32 start = data.Num();
+        data.AddZeroed(record_header_bytes);
+        data.Add((uint8)(write.state.IsSet() ? ERecordType::Put : ERecordType::Delete));
+        WriteUTF8(data, write.id, true);
+        if (write.state.IsSet())
+        {
+            WriteUTF8(data, write.state.GetValue(), false);
+        }
+
+        uint32 payload_size = data.Num() - start - record_header_bytes;
+        uint32 crc = FCrc::MemCrc32(&data[start + record_header_bytes], payload_size);
+        FMemory::Memcpy(&data[start], &payload_size, sizeof(payload_size));
+        FMemory::Memcpy(&data[start + 4], &crc, sizeof(crc));
+    }
+
+    if (!file->Write(data.GetData(), data.Num()) || (sync && !file->Flush(true)))
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Failed to write %i bytes to %s"), data.Num(), *pack_path);
+        file.Reset();
+        Refresh();
+        return false;
+    }
+    file.Reset();
+
+    if (!Refresh())
+    {
+        return false;
+    }
+
+    if (file_size >= min_compact_bytes && live_bytes * 2 < file_size)
+    {
+        return Compact();
+    }
+    return true;
+}
+
+
+void FKamoRegionPack::FlattenIndex(TArray<uint8>& data) const
+{
+    // Header and index first, then the states in the same order
+    TArray<FString> ids;
+    index.GetKeys(ids);
+    ids.Sort();
+
+    TArray<uint8> index_data;
+    int64 index_bytes = 0;
+    for (const FString& id : ids)
+    {
+        index_bytes += 2 + FTCHARToUTF8(*id).Length() + 12;
+    }
+
+    int64 state_offset = header_bytes + index_bytes;
+    for (const FString& id : ids)
+    {
+        const FEntry& entry = index[id];
+        WriteUTF8(index_data, id, true);
+        Write<int64>(index_data, state_offset);
+        Write<int32>(index_data, entry.length);
+        state_offset += entry.length;
+    }
+
+    data.Reserve(state_offset);
+    Write<uint32>(data, pack_magic);
+    Write<uint32>(data, pack_format_version);
+    Write<uint64>(data, generation + 1);
+    Write<uint32>(data, ids.Num());
+    Write<uint32>(data, (uint32)index_bytes);
+    Write<int64>(data, state_offset);
+    data.Append(index_data);
+
+    const uint8* mapped = mapped_region->GetMappedPtr();
+    for (const FString& id : ids)
+    {
+        const FEntry& entry = index[id];
+        data.Append(mapped + entry.offset, entry.length);
+    }
+}
+
+
+bool FKamoRegionPack::Compact()
+{
+    // Called with the lock held and the index up to date
+    KAMO_TRACE_SCOPE("RegionPack.Compact", KamoID(), file_size);
+    if (!mapped_region)
+    {
+        return false;
+    }
+
+    int64 old_size = file_size;
+    TArray<uint8> data;
+    FlattenIndex(data);
+
+    FString tmp_path = pack_path + TEXT(".tmp");
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    {
+        TUniquePtr<IFileHandle> file(pf.OpenWrite(*tmp_path));
+        if (!file || !file->Write(data.GetData(), data.Num()) || !file->Flush(true))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Failed to write %s"), *tmp_path);
+            file.Reset();
+            pf.DeleteFile(*tmp_path);
+            return false;
+        }
+    }
+
+    Unmap();
+    if (!FKamoFileHelper::ReplaceAtomic(*pack_path, *tmp_path))
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoRegionPack: Failed to replace %s"), *pack_path);
+        pf.DeleteFile(*tmp_path);
+        file_size = 0;
+        return Refresh();
+    }
+
+    UE_LOG(LogKamoDriver, Log, TEXT("FKamoRegionPack: Compacted %s from %lld to %i bytes, %i objects."), *pack_path, old_size, data.Num(), index.Num());
+    file_size = 0;
+    return Refresh();
+}
@@ -0,0 +1,87 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/DateTime.h"
+#include "Misc/Optional.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+
+/**
+ * Packed object file of a KamoFileDB region, all child objects of the region in a single file.
+ *
+ * Layout: a header, an index of object id -> offset and length of its state, the states, and then the
+ * records appended since the file was last compacted. A record is uint32 payload size, uint32 payload
+ * CRC and the payload: type (put or delete), object id and state. A torn record at the end is ignored.
+ *
+ * Reads go through a memory mapping of the file. The index is kept in memory and only the appended
+ * records are scanned when the file grows. Writers hold an exclusive lock on a lock file next to the
+ * pack, so several processes can share a region. Compaction rewrites the file with everything in the
+ * index and renames it over the old one, readers notice by the generation in the header.
+ *
+ * Not thread safe, KamoFileDB guards access.
+ */
+class FKamoRegionPack
+{
+public:
+    FKamoRegionPack(const FString& directory);
+    ~FKamoRegionPack();
+
+    static FString PackFilename(const FString& directory);
+
+    // Pick up changes made by other writers. Returns false if the region directory is gone.
+    bool Refresh();
+
+    bool Contains(const FString& id) const { return index.Contains(id); }
+    bool Get(const FString& id, FString& state) const;
+    void GetIDs(TArray<FString>& ids) const { index.GetKeys(ids); }
+    int32 Num() const { return index.Num(); }
+
+    // Bumped when changes made by other writers are picked up. Appends through this object don't count.
+    uint64 GetChangeCount() const { return change_count; }
+
+    // A put, or a delete if 'state' is unset
+    struct FWrite
+    {
+        FString id;
+        TOptional<FString> state;
+    };
+
+    // Append under the writer lock and compact if enough of the file is dead. 'sync' flushes the
+    // records to disk before returning.
+    bool Append(const TArray<FWrite>& writes, bool sync = false);
+
+private:
+    struct FEntry
+    {
+        int64 offset;
+        int32 length;
+    };
+
+    bool Map();
+    void Unmap();
+    bool ParseIndex(const uint8* data, int64 size);
+    bool ScanRecords(const uint8* data, int64 size);
+    void FlattenIndex(TArray<uint8>& data) const;
+    class IKamoFileHandle* Lock() const;
+    bool Compact();
+
+    FString directory;
+    FString pack_path;
+    FString lock_path;
+
+    TMap<FString, FEntry> index;
+    int64 live_bytes;  // Bytes of states in the index
+    int64 scanned_size;  // Bytes of the file covered by the index
+    uint64 generation;
+    uint64 change_count;
+
+    // What was mapped, to tell if the file has changed
+    int64 file_size;
+    FDateTime modification_time;
+    TUniquePtr<IMappedFileHandle> mapped_file;
+    TUniquePtr<IMappedFileRegion> mapped_region;
+};
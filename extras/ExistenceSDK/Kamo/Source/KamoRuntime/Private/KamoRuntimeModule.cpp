@@ -1,6 +1,9 @@
 // Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
 
 #include "KamoRuntimeModule.h"
+#include "KamoTrace.h"
+
+#include "Misc/CommandLine.h"
 
 DEFINE_LOG_CATEGORY(LogKamoRuntime);
 
@@ -16,6 +19,10 @@ FKamoRuntimeModule::~FKamoRuntimeModule()
 
 void FKamoRuntimeModule::StartupModule()
 {
+    if (FParse::Param(FCommandLine::Get(), TEXT("kamotrace")))
+    {
+        FKamoTrace::Start();
+    }
 }
 
 void FKamoRuntimeModule::ShutdownModule()
@@ -0,0 +1,248 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoSerializationQueue.h"
+
+
+FKamoSerializationQueue::FKamoSerializationQueue() :
+    next_sequence(0),
+    fifo_head(0)
+{
+}
+
+
+void FKamoSerializationQueue::SetPolicy(const KamoSerializationPolicy& new_policy)
+{
+    policy = new_policy;
+
+    // Aging rate is part of the heap order
+    for (int32 i = heap.Num() / 2 - 1; i >= 0; i--)
+    {
+        SiftDown(i);
+    }
+}
+
+
+void FKamoSerializationQueue::Push(const KamoID& id, const KamoID& root_id, const FString& state, uint64 journal_sequence)
+{
+    FString key = id();
+    if (int32* found = index.Find(key))
+    {
+        int32 i = *found;
+        Record& record = heap[i];
+        record.root_id = root_id;
+        record.state = state;
+        record.sequence = ++next_sequence;
+        record.journal_sequence = journal_sequence;
+        if (record.priority < policy.max_priority)
+        {
+            record.priority += policy.requeue_priority;
+        }
+        SiftUp(i);
+        return;
+    }
+
+    const int32* class_priority = policy.class_priority.Find(id.class_name);
+    Record record = { id, root_id, state, class_priority ? *class_priority : 0, FPlatformTime::Seconds(), ++next_sequence, journal_sequence };
+    fifo.Add({ key, record.enqueue_time });
+
+    int32 i = heap.Add(MoveTemp(record));
+    index.Add(key, i);
+    SiftUp(i);
+}
+
+
+const FKamoSerializationQueue::Record* FKamoSerializationQueue::Peek() const
+{
+    int32 i = NextIndex();
+    return i != INDEX_NONE ? &heap[i] : nullptr;
+}
+
+
+bool FKamoSerializationQueue::Pop(Record& record)
+{
+    int32 i = NextIndex();
+    if (i == INDEX_NONE)
+    {
+        return false;
+    }
+
+    record = heap[i];
+    RemoveAt(i);
+    in_flight.Add(record.id(), record.sequence);
+    return true;
+}
+
+
+int32 FKamoSerializationQueue::PopBatch(int32 max_count, int32 max_bytes, TArray<Record>& batch)
+{
+    int32 num_popped = 0;
+    int64 batch_bytes = 0;
+    while (num_popped < max_count)
+    {
+        const Record* next = Peek();
+        if (!next)
+        {
+            break;
+        }
+
+        batch_bytes += FTCHARToUTF8_Convert::ConvertedLength(*next->state, next->state.Len());
+        if (num_popped > 0 && batch_bytes > max_bytes)
+        {
+            break;
+        }
+
+        Pop(batch.AddDefaulted_GetRef());
+        num_popped++;
+    }
+    return num_popped;
+}
+
+
+void FKamoSerializationQueue::Complete(const Record& record)
+{
+    FString key = record.id();
+    const uint32* sequence = in_flight.Find(key);
+    if (sequence && *sequence == record.sequence)
+    {
+        in_flight.Remove(key);
+    }
+}
+
+
+bool FKamoSerializationQueue::Bump(const FString& id)
+{
+    int32* found = index.Find(id);
+    if (!found)
+    {
+        return false;
+    }
+
+    int32 i = *found;
+    if (heap[i].priority < policy.max_priority)
+    {
+        heap[i].priority += policy.pending_priority;
+        SiftUp(i);
+    }
+    return true;
+}
+
+
+bool FKamoSerializationQueue::Remove(const FString& id)
+{
+    bool removed = in_flight.Remove(id) > 0;
+    if (int32* found = index.Find(id))
+    {
+        RemoveAt(*found);
+        removed = true;
+    }
+    return removed;
+}
+
+
+int32 FKamoSerializationQueue::NextIndex() const
+{
+    if (heap.Num() == 0)
+    {
+        fifo.Reset();
+        fifo_head = 0;
+        return INDEX_NONE;
+    }
+
+    // Skip entries of records that have been written or cancelled since
+    while (fifo_head < fifo.Num())
+    {
+        const FifoEntry& entry = fifo[fifo_head];
+        const int32* found = index.Find(entry.id);
+        if (found && heap[*found].enqueue_time == entry.enqueue_time)
+        {
+            break;
+        }
+        fifo_head++;
+    }
+
+    if (fifo_head > 1024 && fifo_head > fifo.Num() / 2)
+    {
+        fifo.RemoveAt(0, fifo_head, false);
+        fifo_head = 0;
+    }
+
+    // The oldest object goes first once it's past the deadline
+    if (fifo_head < fifo.Num() && policy.deadline > 0.0f)
+    {
+        const FifoEntry& oldest = fifo[fifo_head];
+        if (FPlatformTime::Seconds() - oldest.enqueue_time >= policy.deadline)
+        {
+            return index[oldest.id];
+        }
+    }
+
+    return 0;
+}
+
+
+void FKamoSerializationQueue::SwapRecords(int32 a, int32 b)
+{
+    heap.Swap(a, b);
+    index[heap[a].id()] = a;
+    index[heap[b].id()] = b;
+}
+
+
+void FKamoSerializationQueue::SiftUp(int32 i)
+{
+    while (i > 0)
+    {
+        int32 parent = (i - 1) / 2;
+        if (!IsBefore(i, parent))
+        {
+            break;
+        }
+        SwapRecords(i, parent);
+        i = parent;
+    }
+}
+
+
+void FKamoSerializationQueue::SiftDown(int32 i)
+{
+    for (;;)
+    {
+        int32 best = i;
+        int32 left = i * 2 + 1;
+        int32 right = left + 1;
+        if (left < heap.Num() && IsBefore(left, best))
+        {
+            best = left;
+        }
+        if (right < heap.Num() && IsBefore(right, best))
+        {
+            best = right;
+        }
+        if (best == i)
+        {
+            break;
+        }
+        SwapRecords(i, best);
+        i = best;
+    }
+}
+
+
+void FKamoSerializationQueue::RemoveAt(int32 i)
+{
+    index.Remove(heap[i].id());
+
+    int32 last = heap.Num() - 1;
+    if (i != last)
+    {
+        heap.Swap(i, last);
+        index[heap[i].id()] = i;
+    }
+    heap.Pop(false);
+
+    if (i < heap.Num())
+    {
+        SiftUp(i);
+        SiftDown(i);
+    }
+}
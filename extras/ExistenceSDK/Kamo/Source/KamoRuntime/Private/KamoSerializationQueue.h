@@ -0,0 +1,86 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "KamoStructs.h"
+
+
+/**
+ * Priority queue of objects waiting to be written to DB, shared by the DB drivers.
+ *
+ * An indexed binary heap keyed on object id so priority bumps and removals are O(log n). Waiting
+ * objects gain 'aging_rate' priority points per second, and an object that has waited longer than
+ * the policy deadline is written before anything else. An object popped for writing is "in flight"
+ * until Complete() is called and still counts as pending.
+ *
+ * Not thread safe, the drivers guard it with their own mutex.
+ */
+class FKamoSerializationQueue
+{
+public:
+    struct Record
+    {
+        KamoID id;
+        KamoID root_id;
+        FString state;
+        int32 priority;
+        double enqueue_time;
+        uint32 sequence; // Distinguishes a re-queued record from the one being written
+        uint64 journal_sequence; // Position in the driver's write journal, if any
+    };
+
+    FKamoSerializationQueue();
+
+    void SetPolicy(const KamoSerializationPolicy& new_policy);
+
+    // Add 'id' or replace the state if it's already queued. A re-queued object gets a priority bump.
+    void Push(const KamoID& id, const KamoID& root_id, const FString& state, uint64 journal_sequence = 0);
+
+    // Returns the record that Pop() would return next or null if the queue is empty.
+    const Record* Peek() const;
+
+    // Take the next record and mark it in flight. Returns false if the queue is empty.
+    bool Pop(Record& record);
+
+    // Pop records onto 'batch' until it has 'max_count' records or their states would go over 'max_bytes'
+    // as UTF-8, which is how the drivers write them. At least one record is taken so an oversized state
+    // doesn't stall the queue. Returns the number of records popped.
+    int32 PopBatch(int32 max_count, int32 max_bytes, TArray<Record>& batch);
+
+    // Clear the in flight flag of a popped record.
+    void Complete(const Record& record);
+
+    // Bump the priority of a queued object by the policy 'pending_priority'.
+    bool Bump(const FString& id);
+
+    bool Contains(const FString& id) const { return index.Contains(id) || in_flight.Contains(id); }
+    bool Remove(const FString& id);
+
+    int32 Num() const { return heap.Num(); }
+    bool IsEmpty() const { return heap.Num() == 0 && in_flight.Num() == 0; }
+
+private:
+    KamoSerializationPolicy policy;
+    TArray<Record> heap;
+    TMap<FString, int32> index;  // id -> heap index
+    TMap<FString, uint32> in_flight;  // id -> sequence
+    uint32 next_sequence;
+
+    // Insertion order for the deadline check. Entries of removed records are skipped lazily.
+    struct FifoEntry
+    {
+        FString id;
+        double enqueue_time;
+    };
+    mutable TArray<FifoEntry> fifo;
+    mutable int32 fifo_head;
+
+    int32 NextIndex() const;
+    double Rank(const Record& record) const { return record.priority - policy.aging_rate * record.enqueue_time; }
+    bool IsBefore(int32 a, int32 b) const { return Rank(heap[a]) > Rank(heap[b]); }
+    void SwapRecords(int32 a, int32 b);
+    void SiftUp(int32 i);
+    void SiftDown(int32 i);
+    void RemoveAt(int32 i);
+};
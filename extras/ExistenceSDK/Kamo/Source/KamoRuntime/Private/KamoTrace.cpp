@@ -0,0 +1,180 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoTrace.h"
+#include "KamoRuntimeModule.h"
+
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformTLS.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Policies/CondensedJsonPrintPolicy.h"
+#include "Serialization/JsonWriter.h"
+
+
+std::atomic<bool> FKamoTrace::enabled(false);
+
+
+namespace
+{
+    struct FKamoTraceEvent
+    {
+        const TCHAR* name;
+        KamoID id;
+        int64 bytes;
+        uint64 start_cycles;
+        uint64 end_cycles;
+    };
+
+    // Events of one thread. The lock is only contended while a recording starts or is exported.
+    struct FKamoTraceBuffer
+    {
+        FCriticalSection mutex;
+        TArray<FKamoTraceEvent> events;
+        uint32 thread_id = 0;
+    };
+
+    typedef TSharedPtr<FKamoTraceBuffer, ESPMode::ThreadSafe> FKamoTraceBufferPtr;
+
+    const int32 max_trace_events = 2 * 1024 * 1024; // Stop recording when this many events are buffered
+
+    // Buffers outlive their threads so nothing recorded is lost before the export
+    FCriticalSection trace_mutex;
+    TArray<FKamoTraceBufferPtr> trace_buffers;
+    std::atomic<int32> num_trace_events(0);
+    uint64 trace_start_cycles = 0;
+
+    FKamoTraceBuffer& GetThreadBuffer()
+    {
+        static thread_local FKamoTraceBufferPtr buffer;
+        if (!buffer)
+        {
+            buffer = MakeShared<FKamoTraceBuffer, ESPMode::ThreadSafe>();
+            buffer->thread_id = FPlatformTLS::GetCurrentThreadId();
+            FScopeLock lock(&trace_mutex);
+            trace_buffers.Add(buffer);
+        }
+        return *buffer;
+    }
+}
+
+
+void FKamoTrace::Start()
+{
+    FScopeLock lock(&trace_mutex);
+    for (auto& buffer : trace_buffers)
+    {
+        FScopeLock buffer_lock(&buffer->mutex);
+        buffer->events.Reset();
+    }
+    num_trace_events = 0;
+    trace_start_cycles = FPlatformTime::Cycles64();
+    enabled = true;
+    UE_LOG(LogKamoRuntime, Display, TEXT("Kamo trace started."));
+}
+
+
+void FKamoTrace::Stop()
+{
+    enabled = false;
+    UE_LOG(LogKamoRuntime, Display, TEXT("Kamo trace stopped, %i events recorded."), FMath::Min(num_trace_events.load(), max_trace_events));
+}
+
+
+void FKamoTrace::AddEvent(const TCHAR* name, const KamoID& id, int64 bytes, uint64 start_cycles, uint64 end_cycles)
+{
+    if (!IsEnabled())
+    {
+        return;
+    }
+
+    if (num_trace_events.fetch_add(1, std::memory_order_relaxed) >= max_trace_events)
+    {
+        if (enabled.exchange(false))
+        {
+            UE_LOG(LogKamoRuntime, Warning, TEXT("Kamo trace buffer full, recording stopped."));
+        }
+        return;
+    }
+
+    FKamoTraceBuffer& buffer = GetThreadBuffer();
+    FScopeLock lock(&buffer.mutex);
+    buffer.events.Add({ name, id, bytes, start_cycles, end_cycles });
+}
+
+
+bool FKamoTrace::Export(const FString& path)
+{
+    FString json;
+    auto writer = TJsonWriterFactory<TCHAR, TCondensedJsonPrintPolicy<TCHAR>>::Create(&json);
+
+    {
+        FScopeLock lock(&trace_mutex);
+
+        json.Reserve(FMath::Min(num_trace_events.load(), max_trace_events) * 160);
+        writer->WriteObjectStart();
+        writer->WriteArrayStart(TEXT("traceEvents"));
+
+        for (auto& buffer : trace_buffers)
+        {
+            FScopeLock buffer_lock(&buffer->mutex);
+            for (const auto& event : buffer->events)
+            {
+                // Complete events, timestamps in microseconds
+                writer->WriteObjectStart();
+                writer->WriteValue(TEXT("name"), event.name);
+                writer->WriteValue(TEXT("cat"), TEXT("kamo"));
+                writer->WriteValue(TEXT("ph"), TEXT("X"));
+                writer->WriteValue(TEXT("ts"), FPlatformTime::ToMilliseconds64(event.start_cycles - trace_start_cycles) * 1000.0);
+                writer->WriteValue(TEXT("dur"), FPlatformTime::ToMilliseconds64(event.end_cycles - event.start_cycles) * 1000.0);
+                writer->WriteValue(TEXT("pid"), 1);
+                writer->WriteValue(TEXT("tid"), (int64)buffer->thread_id);
+                writer->WriteObjectStart(TEXT("args"));
+                if (!event.id.IsEmpty())
+                {
+                    writer->WriteValue(TEXT("id"), event.id());
+                    writer->WriteValue(TEXT("class"), event.id.class_name);
+                }
+                if (event.bytes)
+                {
+                    writer->WriteValue(TEXT("bytes"), event.bytes);
+                }
+                writer->WriteObjectEnd();
+                writer->WriteObjectEnd();
+            }
+        }
+
+        writer->WriteArrayEnd();
+        writer->WriteObjectEnd();
+        writer->Close();
+    }
+
+    if (!FFileHelper::SaveStringToFile(json, *path, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM))
+    {
+        UE_LOG(LogKamoRuntime, Error, TEXT("Failed to write Kamo trace to %s"), *path);
+        return false;
+    }
+
+    UE_LOG(LogKamoRuntime, Display, TEXT("Kamo trace written to %s"), *path);
+    return true;
+}
+
+
+static FAutoConsoleCommand KamoTraceStartCommand(
+    TEXT("kamo.trace.start"),
+    TEXT("Start recording the Kamo trace channel."),
+    FConsoleCommandDelegate::CreateStatic(&FKamoTrace::Start)
+);
+
+
+static FAutoConsoleCommand KamoTraceStopCommand(
+    TEXT("kamo.trace.stop"),
+    TEXT("Stop recording the Kamo trace channel and export it as Chrome trace JSON. Optional argument is the file name."),
+    FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& args)
+    {
+        FKamoTrace::Stop();
+
+        FString path = args.Num() ? args[0] :
+            FPaths::Combine(FPaths::ProfilingDir(), FString::Printf(TEXT("kamo-trace-%s.json"), *FDateTime::Now().ToString()));
+        FKamoTrace::Export(path);
+    })
+);
@@ -0,0 +1,420 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoWriteJournal.h"
+#include "KamoRuntimeModule.h"
+#include "KamoTrace.h"
+
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/Crc.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("JournalPending"), STAT_JournalPending, STATGROUP_Kamo);
+
+// Start a new segment when the current one is this big
+const int64 max_segment_bytes = 64 * 1024 * 1024;
+
+// ...or when everything in it is committed and it's at least this big
+const int64 min_segment_bytes = 1024 * 1024;
+
+// Size and CRC
+const int32 record_header_bytes = 8;
+
+// Type, sequence and the length of an empty id. A shorter record is a torn write, typically a zero
+// filled tail, and would pass the CRC check as MemCrc32 of nothing is 0.
+const uint32 min_payload_bytes = 1 + 8 + 4;
+
+
+FKamoWriteJournal::FKamoWriteJournal() :
+    sync_interval_ms(10),
+    next_sequence(0),
+    segment_bytes(0),
+    file(nullptr),
+    num_appended(0),
+    num_durable(0),
+    write_failed(false),
+    stopping(false),
+    wake_event(FPlatformProcess::GetSynchEventFromPool(false)),
+    synced_event(FPlatformProcess::GetSynchEventFromPool(false)),
+    thread(nullptr)
+{
+}
+
+
+FKamoWriteJournal::~FKamoWriteJournal()
+{
+    Close();
+    FPlatformProcess::ReturnSynchEventToPool(wake_event);
+    FPlatformProcess::ReturnSynchEventToPool(synced_event);
+}
+
+
+FString FKamoWriteJournal::SegmentFilename(const FString& directory, const FString& name, int32 segment)
+{
+    return FPaths::Combine(directory, FString::Printf(TEXT("%s.%06i.journal"), *name, segment));
+}
+
+
+void FKamoWriteJournal::FindSegments(const FString& directory, const FString& name, TArray<int32>& segments)
+{
+    TArray<FString> filenames;
+    IFileManager::Get().FindFiles(filenames, *directory, TEXT(".journal"));
+
+    FString prefix = name + TEXT(".");
+    for (const FString& filename : filenames)
+    {
+        FString number = FPaths::GetBaseFilename(filename);
+        if (number.RemoveFromStart(prefix) && number.IsNumeric())
+        {
+            segments.Add(FCString::Atoi(*number));
+        }
+    }
+    segments.Sort();
+}
+
+
+bool FKamoWriteJournal::Recover(const FString& directory, const FString& name, TArray<Entry>& entries)
+{
+    TArray<int32> segments;
+    FindSegments(directory, name, segments);
+
+    TMap<FString, Entry> writes;
+    int32 num_records = 0;
+    for (int32 segment : segments)
+    {
+        FString filename = SegmentFilename(directory, name, segment);
+        TArray<uint8> data;
+        if (!FFileHelper::LoadFileToArray(data, *filename))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoWriteJournal::Recover: Can't read %s"), *filename);
+            return false;
+        }
+
+        int32 offset = 0;
+        while (offset + record_header_bytes <= data.Num())
+        {
+            uint32 size;
+            uint32 crc;
+            FMemory::Memcpy(&size, &data[offset], sizeof(size));
+            FMemory::Memcpy(&crc, &data[offset + 4], sizeof(crc));
+            if (size < min_payload_bytes || offset + record_header_bytes + (int64)size > data.Num()
+                || FCrc::MemCrc32(data.GetData() + offset + record_header_bytes, size) != crc)
+            {
+                // Torn write at the end of the segment
+                UE_LOG(LogKamoDriver, Warning, TEXT("FKamoWriteJournal::Recover: Ignoring %i bytes of incomplete records at the end of %s"), data.Num() - offset, *filename);
+                break;
+            }
+
+            TArrayView<const uint8> payload(data.GetData() + offset + record_header_bytes, size);
+            FMemoryReaderView reader(payload);
+            uint8 type = 0;
+            uint64 sequence = 0;
+            FString id;
+            FString root_id;
+            FString state;
+            reader << type << sequence << id;
+            if (type == (uint8)ERecordType::Write)
+            {
+                reader << root_id << state;
+            }
+
+            if (reader.IsError() || type > (uint8)ERecordType::Discard || id.IsEmpty())
+            {
+                UE_LOG(LogKamoDriver, Warning, TEXT("FKamoWriteJournal::Recover: Ignoring %i bytes from a malformed record at the end of %s"), data.Num() - offset, *filename);
+                break;
+            }
+
+            if (type == (uint8)ERecordType::Write)
+            {
+                writes.Add(id, { KamoID(id), KamoID(root_id), MoveTemp(state), sequence });
+            }
+            else
+            {
+                const Entry* write = writes.Find(id);
+                if (write && (type == (uint8)ERecordType::Discard || write->sequence <= sequence))
+                {
+                    writes.Remove(id);
+                }
+            }
+
+            offset += record_header_bytes + size;
+            num_records++;
+        }
+    }
+
+    writes.GenerateValueArray(entries);
+    entries.Sort([](const Entry& a, const Entry& b) { return a.sequence < b.sequence; });
+
+    UE_CLOG(segments.Num() > 0, LogKamoDriver, Display, TEXT("FKamoWriteJournal::Recover: %i uncommitted writes in %i records, %i segments of %s."),
+        entries.Num(), num_records, segments.Num(), *name);
+    return true;
+}
+
+
+bool FKamoWriteJournal::Reset(const FString& directory, const FString& name)
+{
+    TArray<int32> segments;
+    FindSegments(directory, name, segments);
+
+    bool ok = true;
+    for (int32 segment : segments)
+    {
+        FString filename = SegmentFilename(directory, name, segment);
+        if (!IFileManager::Get().Delete(*filename))
+        {
+            UE_LOG(LogKamoDriver, Error, TEXT("FKamoWriteJournal::Reset: Can't delete %s"), *filename);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+
+bool FKamoWriteJournal::Open(const FString& _directory, const FString& _name, int32 _sync_interval_ms)
+{
+    directory = _directory;
+    name = _name;
+    sync_interval_ms = FMath::Max(_sync_interval_ms, 1);
+
+    IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+    if (!pf.DirectoryExists(*directory) && !pf.CreateDirectoryTree(*directory))
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoWriteJournal: Cannot create directory: %s"), *directory);
+        return false;
+    }
+
+    // Never append to segments of a previous session
+    TArray<int32> existing;
+    FindSegments(directory, name, existing);
+    segments.Add(existing.Num() ? existing.Last() + 1 : 0);
+    segment_bytes = 0;
+    if (!OpenSegment(segments.Last()))
+    {
+        segments.Reset();
+        return false;
+    }
+
+    stopping = false;
+    write_failed = false;
+    thread = FRunnableThread::Create(this, TEXT("KamoWriteJournal"), 0, TPri_AboveNormal);
+    UE_LOG(LogKamoDriver, Display, TEXT("FKamoWriteJournal: Journaling writes to %s, synced every %i ms."), *SegmentFilename(directory, name, segments.Last()), sync_interval_ms);
+    return true;
+}
+
+
+void FKamoWriteJournal::Close()
+{
+    if (thread)
+    {
+        // Stop() is called by Kill() and the thread writes out what's left before exiting
+        thread->Kill(true);
+        delete thread;
+        thread = nullptr;
+    }
+
+    delete file;
+    file = nullptr;
+}
+
+
+bool FKamoWriteJournal::OpenSegment(int32 segment)
+{
+    delete file;
+
+    FString filename = SegmentFilename(directory, name, segment);
+    file = FPlatformFileManager::Get().GetPlatformFile().OpenWrite(*filename, true);
+    if (!file)
+    {
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoWriteJournal: Can't open %s for writing"), *filename);
+        return false;
+    }
+    return true;
+}
+
+
+void FKamoWriteJournal::AppendRecord(ERecordType type, uint64 sequence, const KamoID& id, const KamoID* root_id, const FString* state)
+{
+    // Called with 'mutex' held
+    int32 start = buffer.Num();
+    buffer.AddZeroed(record_header_bytes);
+
+    FMemoryWriter writer(buffer, false, true);
+    uint8 type_value = (uint8)type;
+    FString id_string = id();
+    writer << type_value << sequence << id_string;
+    if (root_id && state)
+    {
+        FString root_id_string = (*root_id)();
+        writer << root_id_string << const_cast<FString&>(*state);
+    }
+
+    uint32 size = buffer.Num() - start - record_header_bytes;
+    uint32 crc = FCrc::MemCrc32(&buffer[start + record_header_bytes], size);
+    FMemory::Memcpy(&buffer[start], &size, sizeof(size));
+    FMemory::Memcpy(&buffer[start + 4], &crc, sizeof(crc));
+
+    segment_bytes += record_header_bytes + size;
+    num_appended++;
+}
+
+
+uint64 FKamoWriteJournal::Append(const KamoID& id, const KamoID& root_id, const FString& state)
+{
+    FScopeLock lock(&mutex);
+    uint64 sequence = ++next_sequence;
+    AppendRecord(ERecordType::Write, sequence, id, &root_id, &state);
+
+    int32 segment = segments.Last();
+    FString key = id();
+    if (FPending* previous = pending.Find(key))
+    {
+        segment_pending[previous->segment]--;
+    }
+    else
+    {
+        INC_DWORD_STAT(STAT_JournalPending);
+    }
+    pending.Add(key, { sequence, segment });
+    segment_pending.FindOrAdd(segment)++;
+    return sequence;
+}
+
+
+void FKamoWriteJournal::Commit(const KamoID& id, uint64 sequence)
+{
+    FScopeLock lock(&mutex);
+    FString key = id();
+    const FPending* write = pending.Find(key);
+    if (!write || write->sequence != sequence)
+    {
+        return;
+    }
+
+    AppendRecord(ERecordType::Commit, sequence, id);
+    segment_pending[write->segment]--;
+    pending.Remove(key);
+    DEC_DWORD_STAT(STAT_JournalPending);
+}
+
+
+void FKamoWriteJournal::Discard(const KamoID& id)
+{
+    FScopeLock lock(&mutex);
+    FString key = id();
+    const FPending* write = pending.Find(key);
+    if (!write)
+    {
+        // Nothing to replay for this object
+        return;
+    }
+
+    AppendRecord(ERecordType::Discard, ++next_sequence, id);
+    segment_pending[write->segment]--;
+    pending.Remove(key);
+    DEC_DWORD_STAT(STAT_JournalPending);
+}
+
+
+void FKamoWriteJournal::Sync()
+{
+    uint64 target = num_appended;
+    while (thread && num_durable < target && !write_failed)
+    {
+        wake_event->Trigger();
+        synced_event->Wait(100);
+    }
+}
+
+
+int32 FKamoWriteJournal::NumPending() const
+{
+    FScopeLock lock(&mutex);
+    return pending.Num();
+}
+
+
+uint32 FKamoWriteJournal::Run()
+{
+    while (!stopping)
+    {
+        wake_event->Wait(sync_interval_ms);
+        WriteOut();
+    }
+
+    WriteOut();
+    return 0;
+}
+
+
+void FKamoWriteJournal::Stop()
+{
+    stopping = true;
+    wake_event->Trigger();
+}
+
+
+void FKamoWriteJournal::WriteOut()
+{
+    TArray<uint8> data;
+    uint64 appended;
+    int32 segment;
+    int32 next_segment = INDEX_NONE;
+    {
+        FScopeLock lock(&mutex);
+        if (buffer.Num() == 0)
+        {
+            return;
+        }
+
+        Swap(data, buffer);
+        appended = num_appended;
+        segment = segments.Last();
+
+        // Everything swapped out belongs to the current segment, later records go to the next one
+        if (segment_bytes >= max_segment_bytes || (pending.Num() == 0 && segment_bytes >= min_segment_bytes))
+        {
+            next_segment = segments.Last() + 1;
+            segments.Add(next_segment);
+            segment_bytes = 0;
+        }
+    }
+
+    KAMO_TRACE_SCOPE("WriteJournal.WriteOut", KamoID(), data.Num());
+    if (!file || !file->Write(data.GetData(), data.Num()) || !file->Flush(true))
+    {
+        // Not durable, Sync() keeps waiting. The records are lost to the journal but still reach the
+        // DB through the write queues.
+        UE_LOG(LogKamoDriver, Error, TEXT("FKamoWriteJournal: Failed to write %i bytes to %s"), data.Num(), *SegmentFilename(directory, name, segment));
+        write_failed = true;
+    }
+    else
+    {
+        num_durable = appended;
+    }
+    synced_event->Trigger();
+
+    if (next_segment != INDEX_NONE)
+    {
+        OpenSegment(next_segment);
+        TrimSegments();
+    }
+}
+
+
+void FKamoWriteJournal::TrimSegments()
+{
+    // Only delete from the front. A commit record may refer to a write in an older segment so
+    // removing a segment in the middle could bring that write back on recovery.
+    FScopeLock lock(&mutex);
+    while (segments.Num() > 1 && segment_pending.FindRef(segments[0]) == 0)
+    {
+        IFileManager::Get().Delete(*SegmentFilename(directory, name, segments[0]));
+        segment_pending.Remove(segments[0]);
+        segments.RemoveAt(0);
+    }
+}
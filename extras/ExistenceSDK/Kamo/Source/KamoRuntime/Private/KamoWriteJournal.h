@@ -0,0 +1,110 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "KamoStructs.h"
+#include "HAL/Runnable.h"
+
+#include <atomic>
+
+
+/**
+ * Append-only local journal of object writes that haven't reached the DB yet.
+ *
+ * Each write is appended as a record and committed once the DB has it. Records are written out and
+ * flushed to disk in groups by a background thread every 'sync_interval_ms'. The journal is split
+ * into segment files, a segment is deleted when it and all older segments have nothing uncommitted
+ * left. After a crash, Recover() returns the writes that were never committed so they can be replayed.
+ *
+ * Record format: uint32 payload size, uint32 payload CRC, payload. A torn or malformed record ends
+ * recovery of its segment, it and anything after it are ignored.
+ */
+class FKamoWriteJournal : public FRunnable
+{
+public:
+    struct Entry
+    {
+        KamoID id;
+        KamoID root_id;
+        FString state;
+        uint64 sequence;
+    };
+
+    FKamoWriteJournal();
+    virtual ~FKamoWriteJournal() override;
+
+    // Read the uncommitted writes of the journal 'name' in 'directory', latest write per object.
+    static bool Recover(const FString& directory, const FString& name, TArray<Entry>& entries);
+
+    // Delete all segments of the journal, call after the recovered writes are safely in the DB.
+    static bool Reset(const FString& directory, const FString& name);
+
+    bool Open(const FString& directory, const FString& name, int32 sync_interval_ms);
+
+    // Flush and close. Uncommitted writes stay in the journal.
+    void Close();
+
+    bool IsOpen() const { return thread != nullptr; }
+
+    // Add a write, returns its sequence number for Commit()
+    uint64 Append(const KamoID& id, const KamoID& root_id, const FString& state);
+
+    // Mark a write as being in the DB. Ignored if the object has been written again since.
+    void Commit(const KamoID& id, uint64 sequence);
+
+    // Forget any pending write of 'id', used when the object is deleted.
+    void Discard(const KamoID& id);
+
+    // Block until everything appended so far is on disk, or a write to disk has failed.
+    void Sync();
+
+    int32 NumPending() const;
+
+    // FRunnable
+    virtual uint32 Run() override;
+    virtual void Stop() override;
+
+private:
+    enum class ERecordType : uint8
+    {
+        Write,
+        Commit,
+        Discard,
+    };
+
+    static FString SegmentFilename(const FString& directory, const FString& name, int32 segment);
+    static void FindSegments(const FString& directory, const FString& name, TArray<int32>& segments);
+    void AppendRecord(ERecordType type, uint64 sequence, const KamoID& id, const KamoID* root_id = nullptr, const FString* state = nullptr);
+    bool OpenSegment(int32 segment);
+    void WriteOut();
+    void TrimSegments();
+
+    FString directory;
+    FString name;
+    int32 sync_interval_ms;
+
+    mutable FCriticalSection mutex;
+    TArray<uint8> buffer;  // Records not written out yet
+    uint64 next_sequence;
+
+    // Latest uncommitted write per object and the segment it's in
+    struct FPending
+    {
+        uint64 sequence;
+        int32 segment;
+    };
+    TMap<FString, FPending> pending;
+    TMap<int32, int32> segment_pending;  // Segment -> number of uncommitted writes
+    TArray<int32> segments;  // Segments on disk, oldest first. The last one is being written to.
+    int64 segment_bytes;
+    class IFileHandle* file;
+
+    std::atomic<uint64> num_appended;  // Records
+    std::atomic<uint64> num_durable;
+    std::atomic<bool> write_failed;  // Sync() gives up, the journal can't promise durability anymore
+    std::atomic<bool> stopping;
+    FEvent* wake_event;
+    FEvent* synced_event;
+    class FRunnableThread* thread;
+};
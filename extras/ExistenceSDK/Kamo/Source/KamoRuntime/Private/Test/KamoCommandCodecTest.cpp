@@ -0,0 +1,124 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoCommandCodec.h"
+#include "KamoTestHelpers.h"
+
+#include "Misc/AutomationTest.h"
+#include "Misc/Base64.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace
+{
+    KamoCommand MakeCommand(const TCHAR* name, const TCHAR* kamo_id, const TCHAR* region_id, const TCHAR* parameters)
+    {
+        KamoCommand command;
+        command.command = name;
+        command.kamo_id = *kamo_id ? KamoID(kamo_id) : KamoID();
+        command.region_id = *region_id ? KamoID(region_id) : KamoID();
+        command.parameters = parameters;
+        return command;
+    }
+
+    // Interned and custom command names, with and without ids and parameters. Parameters are condensed
+    // JSON with string values so they come back the same from the JSON encoding.
+    TArray<KamoCommand> MakeCommands()
+    {
+        return {
+            MakeCommand(TEXT("move_object"), TEXT("player.1"), TEXT("region.map_main_p"), TEXT("")),
+            MakeCommand(TEXT("apply_state"), TEXT("player.1"), TEXT(""), TEXT("{\"name\":\"t\u00e4v\u00e5\"}")),
+            MakeCommand(TEXT("my_custom_command"), TEXT(""), TEXT("region.2"), TEXT("{\"reason\":\"test\"}")),
+            MakeCommand(TEXT("exit_process"), TEXT(""), TEXT(""), TEXT("")),
+        };
+    }
+
+    void TestCommands(FAutomationTestBase& test, const FString& what, const TArray<KamoCommand>& decoded, const TArray<KamoCommand>& expected, bool json)
+    {
+        if (!test.TestEqual(*(what + TEXT(" count")), decoded.Num(), expected.Num()))
+        {
+            return;
+        }
+
+        for (int32 i = 0; i < expected.Num(); i++)
+        {
+            FString prefix = FString::Printf(TEXT("%s %i "), *what, i);
+            test.TestEqual(*(prefix + TEXT("command")), decoded[i].command, expected[i].command);
+            test.TestTrue(*(prefix + TEXT("kamo_id")), decoded[i].kamo_id == expected[i].kamo_id);
+            test.TestTrue(*(prefix + TEXT("region_id")), decoded[i].region_id == expected[i].region_id);
+
+            // The JSON encoding always has a parameters object
+            FString parameters = json && expected[i].parameters.IsEmpty() ? TEXT("{}") : expected[i].parameters;
+            test.TestEqual(*(prefix + TEXT("parameters")), decoded[i].parameters, parameters);
+        }
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoCommandCodecRoundTrip, "Kamo.CommandCodec.RoundTrip", KamoTest::Flags)
+
+bool FTestKamoCommandCodecRoundTrip::RunTest(const FString& Parameters)
+{
+    TArray<KamoCommand> commands = MakeCommands();
+
+    FString binary = FKamoCommandCodec::Encode(commands);
+    TArray<KamoCommand> decoded;
+    TestTrue(TEXT("Decode binary"), FKamoCommandCodec::Decode(binary, decoded));
+    TestCommands(*this, TEXT("Binary"), decoded, commands, false);
+
+    FString json = FKamoCommandCodec::Encode(commands, true);
+    TestTrue(TEXT("JSON payload"), json.StartsWith(TEXT("{")));
+    decoded.Reset();
+    TestTrue(TEXT("Decode JSON"), FKamoCommandCodec::Decode(json, decoded));
+    TestCommands(*this, TEXT("JSON"), decoded, commands, true);
+
+    // The binary envelope is the smaller one, that's what it's for
+    TestTrue(TEXT("Binary is smaller"), binary.Len() < json.Len());
+
+    decoded.Reset();
+    TestTrue(TEXT("Decode no commands"), FKamoCommandCodec::Decode(FKamoCommandCodec::Encode(TArray<KamoCommand>()), decoded));
+    TestEqual(TEXT("No commands"), decoded.Num(), 0);
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoCommandCodecMalformed, "Kamo.CommandCodec.Malformed", KamoTest::Flags)
+
+bool FTestKamoCommandCodecMalformed::RunTest(const FString& Parameters)
+{
+    TArray<uint8> data;
+    FKamoCommandCodec::EncodeBinary(MakeCommands(), data);
+
+    // Every truncation of the envelope is rejected
+    for (int32 length = 0; length < data.Num(); length++)
+    {
+        TArray<uint8> truncated(data.GetData(), length);
+        TArray<KamoCommand> decoded;
+        if (FKamoCommandCodec::DecodeBinary(truncated, decoded))
+        {
+            AddError(FString::Printf(TEXT("Envelope truncated to %i of %i bytes was decoded"), length, data.Num()));
+            break;
+        }
+    }
+
+    // A newer envelope version isn't guessed at
+    TArray<uint8> newer = data;
+    newer[2]++;
+    TArray<KamoCommand> decoded;
+    AddExpectedError(TEXT("is newer than"), EAutomationExpectedErrorFlags::Contains, 1);
+    TestFalse(TEXT("Newer version"), FKamoCommandCodec::DecodeBinary(newer, decoded));
+
+    // An interned command id past the table of the envelope's version
+    TArray<uint8> unknown_id = { 'K', 'C', 1, 1, 0, 100 };
+    decoded.Reset();
+    AddExpectedError(TEXT("Unknown command id"), EAutomationExpectedErrorFlags::Contains, 1);
+    TestFalse(TEXT("Unknown command id"), FKamoCommandCodec::DecodeBinary(unknown_id, decoded));
+
+    // Neither JSON nor an envelope
+    decoded.Reset();
+    TestFalse(TEXT("Garbage"), FKamoCommandCodec::Decode(FBase64::Encode(TEXT("not a command")), decoded));
+
+    return true;
+}
+
+#endif
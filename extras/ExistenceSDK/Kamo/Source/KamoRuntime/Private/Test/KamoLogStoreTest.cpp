@@ -0,0 +1,199 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoLogStore.h"
+#include "KamoTestHelpers.h"
+
+#include "HAL/FileManager.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace
+{
+    TArray<FString> SegmentPaths(const KamoTest::FTestDirectory& store_directory)
+    {
+        return store_directory.FindFiles(TEXT("segment_*.log"));
+    }
+
+    int64 TotalBytes(const KamoTest::FTestDirectory& store_directory)
+    {
+        int64 bytes = 0;
+        for (const FString& path : SegmentPaths(store_directory))
+        {
+            bytes += IFileManager::Get().FileSize(*path);
+        }
+        return bytes;
+    }
+
+    bool TestState(FAutomationTestBase& test, const FKamoLogStore& store, const FString& id, const FString& expected, const FString& expected_root = FString())
+    {
+        FString state, root_id;
+        return KamoTest::TestState(test, store, id, expected)
+            && store.Get(id, state, &root_id)
+            && test.TestEqual(*(id + TEXT(" root")), root_id, expected_root);
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoLogStoreFormat, "Kamo.LogStore.Format", KamoTest::Flags)
+
+bool FTestKamoLogStoreFormat::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory store_directory(TEXT("KamoLogStore"), TEXT("Format"));
+
+    {
+        FKamoLogStore store;
+        TestTrue(TEXT("Open empty store"), store.Open(store_directory.directory, 1024 * 1024));
+        TestTrue(TEXT("Append"), store.Append({
+            { TEXT("region.1"), FString(), FString(TEXT("{\"name\": \"main\"}")) },
+            { TEXT("player.1"), TEXT("region.1"), FString(TEXT("{\"name\": \"t\u00e4v\u00e5\"}")) },
+            { TEXT("player.2"), TEXT("region.1"), FString(TEXT("")) },
+            { TEXT("item.1"), TEXT("region.1"), FString(TEXT("{}")) },
+        }, true));
+        TestTrue(TEXT("Overwrite, move and delete"), store.Append({
+            { TEXT("player.2"), TEXT("region.2"), FString(TEXT("{\"x\": 2}")) },
+            { TEXT("item.1"), FString(), TOptional<FString>() },
+        }, true));
+
+        TestTrue(TEXT("Sequence bumped"), store.GetSequence(TEXT("player.2")) > store.GetSequence(TEXT("player.1")));
+        TestTrue(TEXT("No sequence after delete"), store.GetSequence(TEXT("item.1")) == 0);
+    }
+
+    // Everything is decoded the same from disk
+    FKamoLogStore store;
+    TestTrue(TEXT("Reopen"), store.Open(store_directory.directory, 1024 * 1024));
+    TestState(*this, store, TEXT("region.1"), TEXT("{\"name\": \"main\"}"));
+    TestState(*this, store, TEXT("player.1"), TEXT("{\"name\": \"t\u00e4v\u00e5\"}"), TEXT("region.1"));
+    TestState(*this, store, TEXT("player.2"), TEXT("{\"x\": 2}"), TEXT("region.2"));
+    TestFalse(TEXT("Deleted object"), store.Contains(TEXT("item.1")));
+    TestTrue(TEXT("Root"), store.IsRoot(TEXT("region.1")));
+
+    TArray<FString> ids;
+    store.GetChildren(TEXT("region.1"), ids);
+    TestTrue(TEXT("Children after move"), ids == TArray<FString>({ TEXT("player.1") }));
+    ids.Reset();
+    store.GetChildrenOfClass(TEXT("item"), ids);
+    TestEqual(TEXT("Class of deleted object"), ids.Num(), 0);
+
+    // A child that turns into a root leaves the child indexes
+    TestTrue(TEXT("Child to root"), store.Append({ { TEXT("player.1"), FString(), FString(TEXT("{}")) } }, false));
+    TestTrue(TEXT("Now a root"), store.IsRoot(TEXT("player.1")));
+    ids.Reset();
+    store.GetChildren(TEXT("region.1"), ids);
+    TestEqual(TEXT("Children of old root"), ids.Num(), 0);
+    ids.Reset();
+    store.GetChildrenOfClass(TEXT("player"), ids);
+    TestTrue(TEXT("Children of class"), ids == TArray<FString>({ TEXT("player.2") }));
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoLogStoreTruncated, "Kamo.LogStore.Truncated", KamoTest::Flags)
+
+bool FTestKamoLogStoreTruncated::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory store_directory(TEXT("KamoLogStore"), TEXT("Truncated"));
+
+    {
+        FKamoLogStore store;
+        store.Open(store_directory.directory, 1024 * 1024);
+        TestTrue(TEXT("Append"), store.Append({
+            { TEXT("player.1"), TEXT("region.1"), FString(TEXT("{\"a\": 1}")) },
+            { TEXT("player.2"), TEXT("region.1"), FString(TEXT("{\"b\": 2}")) },
+        }, true));
+        TestTrue(TEXT("Overwrite"), store.Append({ { TEXT("player.1"), TEXT("region.1"), FString(TEXT("{\"a\": 3}")) } }, true));
+    }
+
+    // Cut the last record short, as a crash in the middle of a write would
+    TArray<FString> paths = SegmentPaths(store_directory);
+    TestEqual(TEXT("One segment"), paths.Num(), 1);
+    if (paths.Num() != 1)
+    {
+        return false;
+    }
+
+    TArray<uint8> data;
+    TestTrue(TEXT("Read segment"), FFileHelper::LoadFileToArray(data, *paths[0]));
+    data.SetNum(data.Num() - 3);
+    TestTrue(TEXT("Truncate segment"), FFileHelper::SaveArrayToFile(data, *paths[0]));
+
+    // The records before it are recovered, the torn overwrite is not
+    {
+        FKamoLogStore store;
+        TestTrue(TEXT("Open truncated"), store.Open(store_directory.directory, 1024 * 1024));
+        TestState(*this, store, TEXT("player.1"), TEXT("{\"a\": 1}"), TEXT("region.1"));
+        TestState(*this, store, TEXT("player.2"), TEXT("{\"b\": 2}"), TEXT("region.1"));
+
+        // Writing carries on in a new segment
+        TestTrue(TEXT("Append after recovery"), store.Append({ { TEXT("player.3"), TEXT("region.1"), FString(TEXT("{\"c\": 3}")) } }, true));
+    }
+
+    TestEqual(TEXT("New segment"), SegmentPaths(store_directory).Num(), 2);
+
+    FKamoLogStore store;
+    TestTrue(TEXT("Reopen"), store.Open(store_directory.directory, 1024 * 1024));
+    TestState(*this, store, TEXT("player.1"), TEXT("{\"a\": 1}"), TEXT("region.1"));
+    TestState(*this, store, TEXT("player.3"), TEXT("{\"c\": 3}"), TEXT("region.1"));
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoLogStoreCompaction, "Kamo.LogStore.Compaction", KamoTest::Flags)
+
+bool FTestKamoLogStoreCompaction::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory store_directory(TEXT("KamoLogStore"), TEXT("Compaction"));
+
+    // Overwrite the same objects until most of the sealed segments are dead
+    const int64 segment_bytes = 64 * 1024;
+    const int32 num_objects = 8;
+    const int32 num_rounds = 32;
+    const int32 state_bytes = 4 * 1024;
+    {
+        FKamoLogStore store;
+        store.Open(store_directory.directory, segment_bytes);
+        for (int32 round = 0; round < num_rounds; round++)
+        {
+            TArray<FKamoLogStore::FWrite> writes;
+            for (int32 i = 0; i < num_objects; i++)
+            {
+                FString state = FString::Printf(TEXT("{\"round\": %i, \"pad\": \"%s\"}"), round, *FString::ChrN(state_bytes, TEXT('x')));
+                writes.Add({ FString::Printf(TEXT("object.%i"), i), TEXT("region.1"), state });
+            }
+            TestTrue(TEXT("Append round"), store.Append(writes, false));
+        }
+        store.Append({ { TEXT("object.0"), FString(), TOptional<FString>() } }, false);
+    }
+
+    // Segments sealed while a compaction ran are compacted on the next open, closing waits for it
+    {
+        FKamoLogStore store;
+        TestTrue(TEXT("Open for compaction"), store.Open(store_directory.directory, segment_bytes));
+    }
+
+    int64 written_bytes = (int64)num_objects * num_rounds * state_bytes;
+    TestTrue(TEXT("Compacted"), TotalBytes(store_directory) < written_bytes / 2);
+    TestEqual(TEXT("No temp files left"), store_directory.FindFiles(TEXT("*.tmp")).Num(), 0);
+
+    // Reopened, the compacted segments and the ones after them make up the latest state
+    FKamoLogStore store;
+    TestTrue(TEXT("Reopen compacted"), store.Open(store_directory.directory, segment_bytes));
+    TestFalse(TEXT("Deleted object"), store.Contains(TEXT("object.0")));
+
+    TArray<FString> ids;
+    store.GetChildren(TEXT("region.1"), ids);
+    TestEqual(TEXT("Objects after compaction"), ids.Num(), num_objects - 1);
+    for (int32 i = 1; i < num_objects; i++)
+    {
+        FString state;
+        FString id = FString::Printf(TEXT("object.%i"), i);
+        TestTrue(*id, store.Get(id, state) && state.StartsWith(FString::Printf(TEXT("{\"round\": %i,"), num_rounds - 1)));
+    }
+
+    return true;
+}
+
+#endif
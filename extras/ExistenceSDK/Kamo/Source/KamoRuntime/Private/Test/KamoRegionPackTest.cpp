@@ -0,0 +1,155 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoRegionPack.h"
+#include "KamoTestHelpers.h"
+
+#include "HAL/FileManager.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace
+{
+    int64 PackSize(const KamoTest::FTestDirectory& region)
+    {
+        return IFileManager::Get().FileSize(*FKamoRegionPack::PackFilename(region.directory));
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoRegionPackFormat, "Kamo.RegionPack.Format", KamoTest::Flags)
+
+bool FTestKamoRegionPackFormat::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory region(TEXT("KamoRegionPack"), TEXT("Format"));
+
+    {
+        FKamoRegionPack pack(region.directory);
+        TestTrue(TEXT("Refresh empty region"), pack.Refresh());
+        TestEqual(TEXT("Empty region"), pack.Num(), 0);
+
+        TestTrue(TEXT("Append"), pack.Append({
+            { TEXT("player.1"), FString(TEXT("{\"name\": \"one\"}")) },
+            { TEXT("player.2"), FString(TEXT("{\"name\": \"t\u00e4v\u00e5\"}")) },
+            { TEXT("player.3"), FString(TEXT("{}")) },
+        }));
+        TestTrue(TEXT("Overwrite and delete"), pack.Append({
+            { TEXT("player.1"), FString(TEXT("{\"name\": \"uno\"}")) },
+            { TEXT("player.3"), TOptional<FString>() },
+        }));
+
+        TestEqual(TEXT("Objects after writes"), pack.Num(), 2);
+        KamoTest::TestState(*this, pack, TEXT("player.1"), TEXT("{\"name\": \"uno\"}"));
+    }
+
+    // A fresh reader sees the same objects
+    FKamoRegionPack pack(region.directory);
+    TestTrue(TEXT("Refresh"), pack.Refresh());
+    TestEqual(TEXT("Objects after reopen"), pack.Num(), 2);
+    KamoTest::TestState(*this, pack, TEXT("player.1"), TEXT("{\"name\": \"uno\"}"));
+    KamoTest::TestState(*this, pack, TEXT("player.2"), TEXT("{\"name\": \"t\u00e4v\u00e5\"}"));
+    TestFalse(TEXT("Deleted object"), pack.Contains(TEXT("player.3")));
+
+    // Writes of another writer are picked up by a refresh
+    FKamoRegionPack other(region.directory);
+    TestTrue(TEXT("Other writer"), other.Refresh() && other.Append({ { TEXT("player.4"), FString(TEXT("{\"x\": 4}")) } }));
+    uint64 change_count = pack.GetChangeCount();
+    TestTrue(TEXT("Refresh after other writer"), pack.Refresh());
+    TestTrue(TEXT("Change count bumped"), pack.GetChangeCount() > change_count);
+    KamoTest::TestState(*this, pack, TEXT("player.4"), TEXT("{\"x\": 4}"));
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoRegionPackTornTail, "Kamo.RegionPack.TornTail", KamoTest::Flags)
+
+bool FTestKamoRegionPackTornTail::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory region(TEXT("KamoRegionPack"), TEXT("TornTail"));
+
+    {
+        FKamoRegionPack pack(region.directory);
+        pack.Refresh();
+        TestTrue(TEXT("Append"), pack.Append({
+            { TEXT("item.1"), FString(TEXT("{\"a\": 1}")) },
+            { TEXT("item.2"), FString(TEXT("{\"b\": 2}")) },
+        }));
+    }
+
+    // A record cut short by a crash, the header promises more payload than there is
+    int64 intact_size = PackSize(region);
+    TArray<uint8> torn = { 200, 0, 0, 0, 0x12, 0x34, 0x56, 0x78, 0, 5, 0, 'i', 't' };
+    TestTrue(TEXT("Write torn record"), FFileHelper::SaveArrayToFile(torn, *FKamoRegionPack::PackFilename(region.directory), &IFileManager::Get(), FILEWRITE_Append));
+    TestEqual(TEXT("Pack grew"), PackSize(region), intact_size + torn.Num());
+
+    // Readers ignore the torn tail
+    FKamoRegionPack pack(region.directory);
+    TestTrue(TEXT("Refresh with torn tail"), pack.Refresh());
+    TestEqual(TEXT("Objects before the tail"), pack.Num(), 2);
+    KamoTest::TestState(*this, pack, TEXT("item.1"), TEXT("{\"a\": 1}"));
+    KamoTest::TestState(*this, pack, TEXT("item.2"), TEXT("{\"b\": 2}"));
+
+    // The next writer drops it, otherwise its own records would never be read
+    TestTrue(TEXT("Append after torn tail"), pack.Append({ { TEXT("item.3"), FString(TEXT("{\"c\": 3}")) } }));
+
+    FKamoRegionPack reopened(region.directory);
+    TestTrue(TEXT("Refresh after repair"), reopened.Refresh());
+    TestEqual(TEXT("Objects after repair"), reopened.Num(), 3);
+    KamoTest::TestState(*this, reopened, TEXT("item.1"), TEXT("{\"a\": 1}"));
+    KamoTest::TestState(*this, reopened, TEXT("item.3"), TEXT("{\"c\": 3}"));
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoRegionPackCompaction, "Kamo.RegionPack.Compaction", KamoTest::Flags)
+
+bool FTestKamoRegionPackCompaction::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory region(TEXT("KamoRegionPack"), TEXT("Compaction"));
+
+    // Overwrite the same objects until most of the file is dead, compaction kicks in from 1 MB
+    const int32 num_objects = 8;
+    const int32 num_rounds = 16;
+    const int32 state_bytes = 32 * 1024;
+    int64 max_size = 0;
+    {
+        FKamoRegionPack pack(region.directory);
+        pack.Refresh();
+        for (int32 round = 0; round < num_rounds; round++)
+        {
+            TArray<FKamoRegionPack::FWrite> writes;
+            for (int32 i = 0; i < num_objects; i++)
+            {
+                FString state = FString::Printf(TEXT("{\"round\": %i, \"pad\": \"%s\"}"), round, *FString::ChrN(state_bytes, TEXT('x')));
+                writes.Add({ FString::Printf(TEXT("object.%i"), i), state });
+            }
+            TestTrue(TEXT("Append round"), pack.Append(writes));
+            max_size = FMath::Max(max_size, PackSize(region));
+        }
+        pack.Append({ { TEXT("object.0"), TOptional<FString>() } });
+    }
+
+    int64 written_bytes = (int64)num_objects * num_rounds * state_bytes;
+    TestTrue(TEXT("Compacted"), PackSize(region) < written_bytes / 2);
+    TestTrue(TEXT("Never grew without bound"), max_size < written_bytes / 2);
+    TestFalse(TEXT("No temp file left"), IFileManager::Get().FileExists(*(FKamoRegionPack::PackFilename(region.directory) + TEXT(".tmp"))));
+
+    // Reopened, the compacted index and the records after it make up the latest state
+    FKamoRegionPack pack(region.directory);
+    TestTrue(TEXT("Refresh compacted"), pack.Refresh());
+    TestEqual(TEXT("Objects after compaction"), pack.Num(), num_objects - 1);
+    TestFalse(TEXT("Deleted object"), pack.Contains(TEXT("object.0")));
+    for (int32 i = 1; i < num_objects; i++)
+    {
+        FString state;
+        FString id = FString::Printf(TEXT("object.%i"), i);
+        TestTrue(*id, pack.Get(id, state) && state.StartsWith(FString::Printf(TEXT("{\"round\": %i,"), num_rounds - 1)));
+    }
+
+    return true;
+}
+
+#endif
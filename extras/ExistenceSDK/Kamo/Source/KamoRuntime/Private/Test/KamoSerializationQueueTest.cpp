@@ -0,0 +1,166 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoSerializationQueue.h"
+#include "KamoTestHelpers.h"
+
+#include "Misc/AutomationTest.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace
+{
+    // Priorities only, so the order doesn't depend on timing
+    KamoSerializationPolicy MakeTestPolicy()
+    {
+        KamoSerializationPolicy policy;
+        policy.class_priority.Add(TEXT("player"), 100);
+        policy.class_priority.Add(TEXT("item"), 10);
+        policy.aging_rate = 0.0f;
+        policy.deadline = 0.0f;
+        return policy;
+    }
+
+    TArray<FString> PopAll(FKamoSerializationQueue& queue)
+    {
+        TArray<FString> ids;
+        FKamoSerializationQueue::Record record;
+        while (queue.Pop(record))
+        {
+            ids.Add(record.id());
+            queue.Complete(record);
+        }
+        return ids;
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoSerializationQueueOrder, "Kamo.SerializationQueue.Order", KamoTest::Flags)
+
+bool FTestKamoSerializationQueueOrder::RunTest(const FString& Parameters)
+{
+    FKamoSerializationQueue queue;
+    queue.SetPolicy(MakeTestPolicy());
+
+    queue.Push(KamoID(TEXT("item.1")), KamoID(TEXT("region.1")), TEXT("{}"));
+    queue.Push(KamoID(TEXT("player.1")), KamoID(TEXT("region.1")), TEXT("{}"));
+    queue.Push(KamoID(TEXT("box.1")), KamoID(TEXT("region.1")), TEXT("{}"));
+    queue.Push(KamoID(TEXT("item.2")), KamoID(TEXT("region.1")), TEXT("{}"));
+    queue.Push(KamoID(TEXT("box.2")), KamoID(TEXT("region.1")), TEXT("{}"));
+    TestEqual(TEXT("Queued"), queue.Num(), 5);
+    TestEqual(TEXT("Peek"), queue.Peek() ? queue.Peek()->id() : FString(), FString(TEXT("player.1")));
+
+    // A bumped object goes before everything else, a removed one is gone
+    TestTrue(TEXT("Bump"), queue.Bump(TEXT("box.2")));
+    TestFalse(TEXT("Bump unknown"), queue.Bump(TEXT("box.3")));
+    TestTrue(TEXT("Remove"), queue.Remove(TEXT("item.1")));
+    TestFalse(TEXT("Removed"), queue.Contains(TEXT("item.1")));
+
+    // A re-queued object gains a little
+    queue.Push(KamoID(TEXT("box.1")), KamoID(TEXT("region.1")), TEXT("{\"v\": 2}"));
+    TestEqual(TEXT("Re-queue doesn't add"), queue.Num(), 4);
+
+    TArray<FString> expected = { TEXT("box.2"), TEXT("player.1"), TEXT("item.2"), TEXT("box.1") };
+    TArray<FString> order = PopAll(queue);
+    TestTrue(FString::Printf(TEXT("Pop order %s"), *FString::Join(order, TEXT(", "))), order == expected);
+    TestTrue(TEXT("Empty"), queue.IsEmpty());
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoSerializationQueueHeap, "Kamo.SerializationQueue.Heap", KamoTest::Flags)
+
+bool FTestKamoSerializationQueueHeap::RunTest(const FString& Parameters)
+{
+    // Every object gets its own priority through bumps, the heap must hand them out highest first
+    // whatever was removed or bumped in between
+    KamoSerializationPolicy policy = MakeTestPolicy();
+    policy.pending_priority = 1;
+    FKamoSerializationQueue queue;
+    queue.SetPolicy(policy);
+
+    const int32 num_objects = 200;
+    TMap<FString, int32> priorities;
+    FRandomStream random(1234);
+    for (int32 i = 0; i < num_objects; i++)
+    {
+        FString id = FString::Printf(TEXT("box.%i"), i);
+        queue.Push(KamoID(id), KamoID(TEXT("region.1")), TEXT("{}"));
+        priorities.Add(id, 0);
+    }
+
+    for (int32 n = 0; n < num_objects * 10; n++)
+    {
+        FString id = FString::Printf(TEXT("box.%i"), random.RandRange(0, num_objects - 1));
+        if (random.RandRange(0, 19) == 0)
+        {
+            TestTrue(*(TEXT("Remove ") + id), queue.Remove(id) == (priorities.Remove(id) > 0));
+        }
+        else if (priorities.Contains(id))
+        {
+            TestTrue(*(TEXT("Bump ") + id), queue.Bump(id));
+            priorities[id]++;
+        }
+    }
+
+    TestEqual(TEXT("Queued after removes"), queue.Num(), priorities.Num());
+
+    int32 last_priority = MAX_int32;
+    FKamoSerializationQueue::Record record;
+    while (queue.Pop(record))
+    {
+        const int32* expected = priorities.Find(record.id());
+        if (!expected)
+        {
+            AddError(FString::Printf(TEXT("Popped removed object %s"), *record.id()));
+            continue;
+        }
+        TestEqual(*record.id(), record.priority, *expected);
+        TestTrue(*(TEXT("In order ") + record.id()), record.priority <= last_priority);
+        last_priority = record.priority;
+
+        TestTrue(TEXT("Pending while in flight"), queue.Contains(record.id()));
+        queue.Complete(record);
+        priorities.Remove(record.id());
+    }
+
+    TestEqual(TEXT("All popped"), priorities.Num(), 0);
+    TestTrue(TEXT("Empty"), queue.IsEmpty());
+
+    return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoSerializationQueuePopBatch, "Kamo.SerializationQueue.PopBatch", KamoTest::Flags)
+
+bool FTestKamoSerializationQueuePopBatch::RunTest(const FString& Parameters)
+{
+    FKamoSerializationQueue queue;
+    queue.SetPolicy(MakeTestPolicy());
+
+    // 10 characters, 15 bytes as UTF-8
+    FString state = TEXT("\u00e4\u00e4\u00e4\u00e4\u00e4xxxxx");
+    for (int32 i = 0; i < 5; i++)
+    {
+        queue.Push(KamoID(FString::Printf(TEXT("box.%i"), i)), KamoID(TEXT("region.1")), state);
+    }
+
+    TArray<FKamoSerializationQueue::Record> batch;
+    TestEqual(TEXT("Count limit"), queue.PopBatch(2, 1000, batch), 2);
+    TestEqual(TEXT("Byte limit counts UTF-8"), queue.PopBatch(10, 44, batch), 2);
+    TestEqual(TEXT("Appended to the batch"), batch.Num(), 4);
+    TestEqual(TEXT("At least one over the byte limit"), queue.PopBatch(10, 1, batch), 1);
+    TestEqual(TEXT("Empty queue"), queue.PopBatch(10, 1000, batch), 0);
+    TestEqual(TEXT("Queued"), queue.Num(), 0);
+    TestFalse(TEXT("In flight until completed"), queue.IsEmpty());
+
+    for (const auto& record : batch)
+    {
+        queue.Complete(record);
+    }
+    TestTrue(TEXT("Empty"), queue.IsEmpty());
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,65 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/Paths.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace KamoTest
+{
+    static const int Flags = EAutomationTestFlags::EditorContext
+                           | EAutomationTestFlags::ClientContext
+                           | EAutomationTestFlags::EngineFilter;
+
+    // An empty directory for the files of a test, deleted when the test is done
+    struct FTestDirectory
+    {
+        FString directory;
+
+        FTestDirectory(const TCHAR* area, const TCHAR* name)
+        {
+            directory = FPaths::Combine(FPaths::AutomationTransientDir(), area, name);
+            IPlatformFile& pf = FPlatformFileManager::Get().GetPlatformFile();
+            pf.DeleteDirectoryRecursively(*directory);
+            pf.CreateDirectoryTree(*directory);
+        }
+
+        ~FTestDirectory()
+        {
+            FPlatformFileManager::Get().GetPlatformFile().DeleteDirectoryRecursively(*directory);
+        }
+
+        // Full paths of the files matching 'wildcard', sorted by name
+        TArray<FString> FindFiles(const TCHAR* wildcard) const
+        {
+            TArray<FString> names;
+            IFileManager::Get().FindFiles(names, *(directory / wildcard), true, false);
+            names.Sort();
+            for (FString& name : names)
+            {
+                name = directory / name;
+            }
+            return names;
+        }
+    };
+
+    // Check the state of 'id' in anything with a 'bool Get(const FString& id, FString& state) const'
+    template<typename StoreType>
+    bool TestState(FAutomationTestBase& test, const StoreType& store, const FString& id, const FString& expected)
+    {
+        FString state;
+        if (!store.Get(id, state))
+        {
+            test.AddError(FString::Printf(TEXT("%s not found"), *id));
+            return false;
+        }
+        return test.TestEqual(*id, state, expected);
+    }
+}
+
+#endif
@@ -0,0 +1,83 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#include "KamoWriteJournal.h"
+#include "KamoTestHelpers.h"
+
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+
+#if WITH_AUTOMATION_TESTS
+
+namespace
+{
+    bool TestRecovered(FAutomationTestBase& test, const FString& what, const KamoTest::FTestDirectory& journal_directory, const FString& expected_state)
+    {
+        TArray<FKamoWriteJournal::Entry> entries;
+        if (!test.TestTrue(*(what + TEXT(" recover")), FKamoWriteJournal::Recover(journal_directory.directory, TEXT("test"), entries))
+            || !test.TestEqual(*(what + TEXT(" uncommitted")), entries.Num(), 1))
+        {
+            return false;
+        }
+        return test.TestEqual(*(what + TEXT(" id")), entries[0].id(), FString(TEXT("player.1")))
+            && test.TestEqual(*(what + TEXT(" root")), entries[0].root_id(), FString(TEXT("region.1")))
+            && test.TestEqual(*(what + TEXT(" state")), entries[0].state, expected_state);
+    }
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTestKamoWriteJournalRecover, "Kamo.WriteJournal.Recover", KamoTest::Flags)
+
+bool FTestKamoWriteJournalRecover::RunTest(const FString& Parameters)
+{
+    KamoTest::FTestDirectory journal_directory(TEXT("KamoWriteJournal"), TEXT("Recover"));
+
+    {
+        FKamoWriteJournal journal;
+        TestTrue(TEXT("Open"), journal.Open(journal_directory.directory, TEXT("test"), 1));
+        journal.Append(KamoID(TEXT("player.1")), KamoID(TEXT("region.1")), TEXT("{\"a\": 1}"));
+        uint64 sequence = journal.Append(KamoID(TEXT("player.2")), KamoID(TEXT("region.1")), TEXT("{\"b\": 2}"));
+        journal.Commit(KamoID(TEXT("player.2")), sequence);
+        journal.Append(KamoID(TEXT("player.1")), KamoID(TEXT("region.1")), TEXT("{\"a\": 3}"));
+
+        // Closing writes out what's left, the uncommitted write stays in the journal
+        journal.Close();
+    }
+
+    TestRecovered(*this, TEXT("Intact"), journal_directory, TEXT("{\"a\": 3}"));
+
+    TArray<FString> paths = journal_directory.FindFiles(TEXT("*.journal"));
+    TestEqual(TEXT("One segment"), paths.Num(), 1);
+    if (paths.Num() != 1)
+    {
+        return false;
+    }
+
+    TArray<uint8> intact;
+    TestTrue(TEXT("Read segment"), FFileHelper::LoadFileToArray(intact, *paths[0]));
+
+    // A crash in the middle of a write leaves a torn record, the writes before it are recovered
+    TArray<uint8> torn = intact;
+    torn.SetNum(torn.Num() - 3);
+    TestTrue(TEXT("Write torn segment"), FFileHelper::SaveArrayToFile(torn, *paths[0]));
+    TestRecovered(*this, TEXT("Torn"), journal_directory, TEXT("{\"a\": 1}"));
+
+    // ...or a tail of zeros where the file size was updated but the data never made it. A zero size
+    // record has a valid CRC and must not be read as a record.
+    for (int32 zero_bytes : { 4, 8, 13, 100 })
+    {
+        TArray<uint8> zero_filled = intact;
+        zero_filled.AddZeroed(zero_bytes);
+        TestTrue(TEXT("Write zero filled segment"), FFileHelper::SaveArrayToFile(zero_filled, *paths[0]));
+        TestRecovered(*this, FString::Printf(TEXT("%i zero bytes"), zero_bytes), journal_directory, TEXT("{\"a\": 3}"));
+    }
+
+    // Recovery is done once the writes are in the DB
+    TestTrue(TEXT("Reset"), FKamoWriteJournal::Reset(journal_directory.directory, TEXT("test")));
+    TArray<FKamoWriteJournal::Entry> entries;
+    TestTrue(TEXT("Recover after reset"), FKamoWriteJournal::Recover(journal_directory.directory, TEXT("test"), entries));
+    TestEqual(TEXT("Nothing after reset"), entries.Num(), 0);
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,30 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "KamoStructs.h"
+
+
+/**
+ * Encoding of command message payloads.
+ *
+ * The binary envelope is versioned and starts with the bytes 'K' 'C' <version>, followed by the number
+ * of commands and then each command: flags, an interned command id (or the command name if it's not in
+ * the table of that version), packed Kamo IDs and a typed parameter blob. Lengths and counts are varints
+ * and strings are UTF-8. Message queues carry text so the envelope is sent base64 encoded.
+ *
+ * The JSON encoding, {"commands": [{"command": ..., "kamo_id": ..., "region_id": ..., "parameters": {...}}]},
+ * is still understood and can be sent for debugging. Decode() tells the two apart by the leading '{'.
+ */
+struct KAMORUNTIME_API FKamoCommandCodec
+{
+    static FString Encode(const TArray<KamoCommand>& commands, bool json = false);
+    static bool Decode(const FString& payload, TArray<KamoCommand>& commands);
+
+    static FString EncodeJson(const TArray<KamoCommand>& commands);
+    static bool DecodeJson(const FString& payload, TArray<KamoCommand>& commands);
+
+    static void EncodeBinary(const TArray<KamoCommand>& commands, TArray<uint8>& data);
+    static bool DecodeBinary(const TArray<uint8>& data, TArray<KamoCommand>& commands);
+};
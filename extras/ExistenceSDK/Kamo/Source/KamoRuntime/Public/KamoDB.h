@@ -30,6 +30,9 @@ public:
     // Check if object is pending serialization to DB and bump priority if needed
     virtual bool IsSerializationPending(const KamoID& id, bool bump_priority = true) = 0;
     virtual bool CancelIfPending(const KamoID& id) = 0;
+
+    // Ordering of the serialization queue, for drivers that queue writes.
+    virtual void SetSerializationPolicy(const KamoSerializationPolicy& policy) {}
     
     // Root object API
     virtual bool AddRootObject(const KamoID& id, const FString& state, bool ignore_if_exists=false) = 0;
@@ -48,7 +51,63 @@ public:
     virtual KamoChildObject GetObject(const KamoID& id, bool fail_silently = false) const = 0;
     // Specify either 'root_id', 'class_name'
     virtual TArray<KamoChildObject> FindObjects(const KamoID& root_id, const FString& class_name) const = 0;
+
+    // Streaming FindObjects. 'callback' gets the objects in chunks of about 'chunk_size' as they arrive
+    // and returns false to stop early. Drivers that support it fetch the next chunk while the callback
+    // runs and never hold more than a couple of chunks. Returns false on error.
+    virtual bool FindObjectsStreamed(const KamoID& root_id, const FString& class_name, TFunctionRef<bool(TArray<KamoChildObject>&)> callback, int32 chunk_size = 500) const
+    {
+        chunk_size = FMath::Max(chunk_size, 1);
+        TArray<KamoChildObject> objects = FindObjects(root_id, class_name);
+        for (int32 i = 0; i < objects.Num(); i += chunk_size)
+        {
+            TArray<KamoChildObject> chunk(objects.GetData() + i, FMath::Min(chunk_size, objects.Num() - i));
+            if (!callback(chunk))
+            {
+                break;
+            }
+        }
+        return true;
+    }
+
     virtual bool MoveObject(const KamoID& id, const KamoID& root_id) = 0;
+
+    // Move a set of child objects, typically an object and its subobjects, to 'root_id'. Drivers that
+    // support it do this atomically so the set is never split between regions.
+    virtual bool MoveObjects(const TArray<KamoID>& ids, const KamoID& root_id)
+    {
+        for (const auto& id : ids)
+        {
+            if (!MoveObject(id, root_id))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Fetch specific child objects of 'root_id'. Objects not found are left out.
+    virtual TArray<KamoChildObject> GetObjects(const KamoID& root_id, const TArray<KamoID>& ids) const
+    {
+        TArray<KamoChildObject> objects;
+        for (const auto& id : ids)
+        {
+            auto object = GetObject(id, true);
+            if (!object.IsEmpty() && object.root_id == root_id)
+            {
+                objects.Add(object);
+            }
+        }
+        return objects;
+    }
+
+    // Version stamps. Drivers that support it keep a counter per child object which is bumped on
+    // every write. All objects in 'root_id' are returned, objects with unknown version get 0.
+    // Returns false if the driver doesn't keep version stamps.
+    virtual bool GetObjectVersions(const KamoID& root_id, TMap<FString, int64>& versions) const { return false; }
+    
+    // Driver specific stats for the server heartbeat
+    virtual void GatherStats(const TSharedPtr<FJsonObject>& stats) const {}
     
     // Handler API
     virtual bool AddHandlerObject(const KamoHandlerObject& handler) = 0;
@@ -27,6 +27,26 @@ struct KamoURLParts
     FString GetURL() const;
 };
 
+// Driver tuning, applied when the session is created. Zero means driver default. Driver specific
+// command line switches override these.
+struct KamoDriverConfig
+{
+    int32 connection_pool_size = 0;
+    int32 num_writers = 0;  // Serializer threads of DB drivers
+    int32 write_batch_size = 0;  // Max objects per serializer batch
+    int32 write_batch_bytes = 0;  // Max bytes per serializer batch
+    int32 read_cache_mb = 0;  // Client side read cache of DB drivers, 0 is off
+    float region_lock_refresh_interval = 0.0f;  // Seconds between region lock refreshes
+    int32 region_lock_timeout = 0;  // Seconds until a region lock expires if not refreshed
+    FString journal_directory;  // Local write journal of DB drivers, empty is off
+    FString instance_name;  // Tells apart processes of the same tenant, e.g. in local file names. Empty is the process id
+    int32 journal_sync_interval_ms = 0;  // Max milliseconds a journaled write waits to be flushed to disk
+    bool loose_objects = false;  // File DB stores one file per object instead of packed regions
+    bool io_uring = false;  // File drivers batch their I/O through io_uring where available
+    int32 message_batch_size = 0;  // Max messages per read of MQ drivers
+    int32 message_stream_max_length = 0;  // Approximate max length of MQ inbox streams
+};
+
 class KAMORUNTIME_API IKamoDriver 
 {
  
@@ -35,6 +55,7 @@ protected:
     FString tenant_name;
     FString session_info;  // Optional driver agnostic session info.
     bool initialized;
+    KamoDriverConfig config;
 
 public:
     IKamoDriver();
@@ -45,6 +66,9 @@ public:
     virtual FString GetScheme() const = 0;    
     FString GetSessionURL() const;
 
+    // Call before CreateSession
+    void SetConfig(const KamoDriverConfig& _config) { config = _config; }
+
     // Session handling
     bool CreateSession(const FString& _tenant_name, const FString& _session_info=FString());
     virtual void CloseSession();
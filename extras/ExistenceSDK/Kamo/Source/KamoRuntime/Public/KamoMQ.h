@@ -22,5 +22,24 @@ public:
     virtual bool CreateMessageQueue() = 0;
     virtual bool DeleteMessageQueue() = 0;    
     virtual bool ReceiveMessage(KamoMessage& message) = 0;
+
+    // Append up to 'max_messages' received messages to 'messages' in the order they arrived, returns the
+    // number appended.
+    virtual int32 ReceiveMessages(TArray<KamoMessage>& messages, int32 max_messages)
+    {
+        int32 num_received = 0;
+        KamoMessage message;
+        while (num_received < max_messages && ReceiveMessage(message))
+        {
+            messages.Add(MoveTemp(message));
+            num_received++;
+        }
+        return num_received;
+    }
+
+    // Call when a received message has been processed. Drivers with at-least-once delivery redeliver
+    // messages that were received but never acknowledged.
+    virtual void AcknowledgeMessage(const KamoMessage& message) { }
+
     virtual bool SendMessage(const FString& inbox_address, const FString& message_type, const FString& payload) = 0;
 };
@@ -115,6 +115,27 @@ struct KamoMessage
     KamoID sender;
     FString message_type;
     FString payload;
+    FString message_id;  // Driver specific, see IKamoMQ::AcknowledgeMessage
+};
+
+// A command in a "command" message, see FKamoCommandCodec
+struct KamoCommand
+{
+    FString command;
+    KamoID kamo_id;  // Optional
+    KamoID region_id;  // Optional
+    FString parameters;  // JSON object, empty if none
+};
+
+// How DB drivers order their serialization queue. Priorities are in arbitrary points, higher goes first.
+struct KamoSerializationPolicy
+{
+    TMap<FString, int32> class_priority;  // Base priority by class name, default is 0
+    int32 requeue_priority = 1;  // Bump when an object is written again while still queued
+    int32 pending_priority = 1000;  // Bump when the runtime is waiting on the object, see IKamoDB::IsSerializationPending
+    int32 max_priority = 1000000000;
+    float aging_rate = 100.0f;  // Points gained per second in the queue
+    float deadline = 30.0f;  // Objects waiting longer than this many seconds are written first. 0 to disable.
 };
 
 struct UE4ServerHandler : KamoHandlerObject
@@ -0,0 +1,85 @@
+// Copyright 2019-2021 Directive Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "KamoStructs.h"
+
+#include <atomic>
+
+
+/**
+ * Kamo trace channel.
+ *
+ * Records a timeline of hot path operations (object id, class, byte size and duration) from the
+ * runtime, the DB serializer workers and the MQ threads. Recording is off by default and costs a
+ * single flag check per scope when off. Each thread records into its own buffer.
+ *
+ * Console commands:
+ *   kamo.trace.start          - Start recording.
+ *   kamo.trace.stop [file]    - Stop recording and export to Chrome trace JSON (chrome://tracing, Perfetto).
+ *                               Default file is <Saved>/Profiling/kamo-trace-<time>.json
+ *
+ * Pass -kamotrace on the command line to start recording at boot.
+ */
+class KAMORUNTIME_API FKamoTrace
+{
+public:
+    static bool IsEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    static void Start();
+    static void Stop();
+    static bool Export(const FString& path);
+
+    static void AddEvent(const TCHAR* name, const KamoID& id, int64 bytes, uint64 start_cycles, uint64 end_cycles);
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+
+class KAMORUNTIME_API FKamoTraceScope
+{
+public:
+    FKamoTraceScope(const TCHAR* name) :
+        active(FKamoTrace::IsEnabled())
+    {
+        if (active)
+        {
+            event_name = name;
+            start_cycles = FPlatformTime::Cycles64();
+        }
+    }
+
+    ~FKamoTraceScope()
+    {
+        if (active)
+        {
+            FKamoTrace::AddEvent(event_name, event_id, event_bytes, start_cycles, FPlatformTime::Cycles64());
+        }
+    }
+
+    bool IsActive() const { return active; }
+
+    // Only call when active, building the id can cost more than the traced operation.
+    void SetArgs(const KamoID& id = KamoID(), int64 bytes = 0)
+    {
+        event_id = id;
+        event_bytes = bytes;
+    }
+
+    void SetBytes(int64 bytes) { event_bytes = bytes; }
+
+private:
+    bool active;
+    const TCHAR* event_name = nullptr;
+    KamoID event_id;
+    int64 event_bytes = 0;
+    uint64 start_cycles = 0;
+};
+
+
+// The optional id and byte size arguments are only evaluated when recording.
+#define KAMO_TRACE_SCOPE(name, ...) \
+    FKamoTraceScope PREPROCESSOR_JOIN(kamo_trace_scope_, __LINE__)(TEXT(name)); \
+    if (PREPROCESSOR_JOIN(kamo_trace_scope_, __LINE__).IsActive()) PREPROCESSOR_JOIN(kamo_trace_scope_, __LINE__).SetArgs(__VA_ARGS__)